@@ -0,0 +1,506 @@
+#include "allreduce.h"
+#include "grpc_client.h"
+#include "quantize.h"
+#include <arpa/inet.h>
+#include <algorithm>
+#include <climits>
+#include <cmath>
+#include <cstring>
+#include "get_clock.h"
+
+namespace flashreduce {
+
+const int kPollBatch = 32;
+
+static QueuePairConfig session_qp_config(const AllReduceConfig &config) {
+    QueuePairConfig qpConfig;
+    qpConfig.type = IBV_QPT_UC;
+    // 未退休的 WQE 不超过在途的 window 个槽加上最多 signalInterval 个等待信号的 WR
+    qpConfig.maxSendWr = config.window + config.signalInterval;
+    // 除了每个槽一个结果，还要承接聚合器对重传的重发，UC 没有接收请求时会静默丢弃
+    qpConfig.maxRecvWr = 2 * config.window;
+    return qpConfig;
+}
+
+RetransmitTimer::RetransmitTimer(double initialUs, double minUs, double maxUs, int samplesPerRtt)
+    : minUs_(minUs), maxUs_(maxUs), srttUs_(0), rttvarUs_(0), srttGain_(0.125 / samplesPerRtt),
+      rttvarGain_(0.25 / samplesPerRtt), rtoUs_(std::clamp(initialUs, minUs, maxUs)), backoff_(0) {}
+
+/**
+ * @brief 加入一个 RTT 样本并更新超时，增益为 RFC 6298 的 1/8 与 1/4 除以每个 RTT 的样本数，并清除退避。
+ *
+ * @param rttUs 从发出一个槽到收到其结果的时间，包含在聚合器上等待其它 worker 的时间。
+ */
+void RetransmitTimer::sample(double rttUs) {
+    if (srttUs_ == 0) {
+        srttUs_ = rttUs;
+        rttvarUs_ = rttUs / 2;
+    } else {
+        rttvarUs_ += rttvarGain_ * (std::fabs(srttUs_ - rttUs) - rttvarUs_);
+        srttUs_ += srttGain_ * (rttUs - srttUs_);
+    }
+    rtoUs_ = std::clamp(srttUs_ + 4 * rttvarUs_, minUs_, maxUs_);
+    backoff_ = 0;
+}
+
+/**
+ * @brief 创建槽状态机，所有槽的序号从 UINT32_MAX 开始，第一次装入时变为 0。
+ *
+ * @param window 槽数。
+ * @param timer 重传计时器的初始状态，通常按每个 RTT window 个样本构造。
+ * @param ticksPerUs 调用者时钟每微秒的刻度数。
+ * @param maxRetransmits 同一槽重传超过该次数仍无结果即认为聚合器失联。
+ */
+SlotWindow::SlotWindow(int window, const RetransmitTimer &timer, double ticksPerUs, int maxRetransmits)
+    : window_(window), timer_(timer), ticksPerUs_(ticksPerUs), maxRetransmits_(maxRetransmits),
+      chunks_(0), completed_(0), delivered_(0), nextCheck_(UINT64_MAX), retransmits_(0),
+      staleResults_(0) {
+    CHECK(window > 0 && window <= ALLREDUCE_MAX_SLOTS)
+        << "Window must be in [1, " << ALLREDUCE_MAX_SLOTS << "], got " << window;
+    CHECK(maxRetransmits > 0) << "Slots must be retransmitted at least once";
+    slotSeq_.assign(window, UINT32_MAX);
+}
+
+/**
+ * @brief 开始一次 chunks 块的归约，槽 s 先承载第 s 块，调用者随后对前 min(window, chunks) 个槽调用 fill。
+ */
+void SlotWindow::begin(uint32_t chunks) {
+    chunks_ = chunks;
+    completed_ = 0;
+    slotChunk_.resize(window_);
+    for (int slot = 0; slot < window_; slot++)
+        slotChunk_[slot] = slot;
+    pending_.assign(window_, 0);
+    queued_.assign(window_, 0);
+    sentAt_.assign(window_, 0);
+    retries_.assign(window_, 0);
+    delivered_ = 0;
+    nextCheck_ = UINT64_MAX;
+}
+
+/**
+ * @brief 槽开始新的一轮：序号加一并等待调用者把 chunk(slot) 块打包发送。
+ *
+ * @return 该槽是否需要加入调用者的发送队列；待重发时结果先到了，队列中已有该槽。
+ */
+bool SlotWindow::fill(int slot) {
+    slotSeq_[slot]++;
+    pending_[slot] = 1;
+    retries_[slot] = 0;
+    if (queued_[slot])
+        return false;
+    queued_[slot] = 1;
+    return true;
+}
+
+/**
+ * @brief 调用者从发送队列取出槽时调用，记录发送时刻。
+ *
+ * @return 该槽是否仍需发送；排队重发期间结果已经到达时返回 false。
+ */
+bool SlotWindow::sent(int slot, uint64_t now) {
+    queued_[slot] = 0;
+    if (!pending_[slot])
+        return false;
+    sentAt_[slot] = now;
+    nextCheck_ = std::min(nextCheck_, deadline(slot));
+    return true;
+}
+
+/**
+ * @brief 记录一个结果，只用未重传过的槽采样 RTT。
+ *
+ * @param imm 结果的立即数。
+ * @param now 收到结果的时刻。
+ * @return 结果所属的槽，调用者据此解包后调用 advance；重传引起的重复结果或上一次归约
+ *         遗留的结果返回 -1。
+ */
+int SlotWindow::receive(uint32_t imm, uint64_t now) {
+    int slot = slot_imm_slot(imm);
+    if (slot >= window_ || !pending_[slot] || slot_imm_seq(imm) != (slotSeq_[slot] & 0xFFFF)) {
+        staleResults_++;
+        return -1;
+    }
+    if (retries_[slot] == 0)
+        timer_.sample((now - sentAt_[slot]) / ticksPerUs_);
+    if (sentAt_[slot] > delivered_) {
+        delivered_ = sentAt_[slot];
+        nextCheck_ = std::min(nextCheck_, delivered_ + (uint64_t)(timer_.lossDelayUs() * ticksPerUs_));
+    }
+    return slot;
+}
+
+/**
+ * @brief 结果已解包，槽空出。
+ *
+ * 槽 s 只承载 s、s + window、s + 2 * window ... 块，与结果到达的先后无关，
+ * 多个 worker 收到结果的顺序不同时也能在同一槽中放入同一块。
+ *
+ * @return 该槽是否装入了下一块，为真时调用者随即调用 fill 并打包。
+ */
+bool SlotWindow::advance(int slot) {
+    pending_[slot] = 0;
+    completed_++;
+    if (slotChunk_[slot] + window_ >= chunks_)
+        return false;
+    slotChunk_[slot] += window_;
+    return true;
+}
+
+/* 更晚发出的槽已有结果时按 lossDelayUs 判定丢失（同 RACK），否则按退避后的超时 */
+uint64_t SlotWindow::deadline(int slot) const {
+    double us = delivered_ > sentAt_[slot] ? timer_.lossDelayUs() : timer_.backoffUs(retries_[slot]);
+    return sentAt_[slot] + (uint64_t)(us * ticksPerUs_);
+}
+
+/**
+ * @brief 扫描在途槽，找出判定丢失的槽，并算出下一次需要扫描的时刻。
+ *
+ * 超时的槽之后没有任何更晚发出的槽有结果时，可能只是别的 worker 还没跟上，
+ * 这时只重发其中最早发出的一个作探测（RFC 6298 5.4 节），计时器退避，
+ * 其余的等探测有了结果或退避后的超时再说，停顿期间不会把整个窗口都重发一遍。
+ * 应在收完已到达的结果之后调用，停顿后成批到达的结果不会被当成乱序。
+ *
+ * @return 需要原样重发的槽，调用者把它们加入发送队列，发送时照常调用 sent。
+ */
+const std::vector<int> &SlotWindow::retransmitExpired(uint64_t now) {
+    expired_.clear();
+    nextCheck_ = UINT64_MAX;
+    int probe = -1;
+    for (int slot = 0; slot < window_; slot++) {
+        if (!pending_[slot] || queued_[slot])
+            continue;
+        uint64_t due = deadline(slot);
+        if (due > now) {
+            nextCheck_ = std::min(nextCheck_, due);
+        } else if (delivered_ > sentAt_[slot]) {
+            retransmit(slot);
+        } else if (probe < 0 || sentAt_[slot] < sentAt_[probe]) {
+            probe = slot;
+        }
+    }
+    if (probe >= 0) {
+        retransmit(probe);
+        timer_.expire();
+        nextCheck_ = std::min(nextCheck_, now + (uint64_t)(timer_.timeoutUs() * ticksPerUs_));
+    }
+    return expired_;
+}
+
+void SlotWindow::retransmit(int slot) {
+    CHECK(++retries_[slot] <= maxRetransmits_)
+        << "No result for slot " << slot << " after " << maxRetransmits_
+        << " retransmits, the aggregator is unreachable";
+    queued_[slot] = 1;
+    expired_.push_back(slot);
+    retransmits_++;
+}
+
+/**
+ * @brief 创建聚合会话：注册暂存区，创建 UC QP 并启动代理线程，之后须调用 connect。
+ *
+ * @param context 设备上下文。
+ * @param config 窗口、槽大小、定点放大倍数等参数，两端须一致。
+ */
+AllReduceSession::AllReduceSession(RdmaContext &context, const AllReduceConfig &config)
+    : config_(config), slotBytes_(config.slotElems * sizeof(int32_t)),
+      sendDepth_(config.window + config.signalInterval),
+      stagingBuffer_(2 * (size_t)config.window * config.slotElems),
+      staging_(context, stagingBuffer_.data(), stagingBuffer_.size() * sizeof(int32_t)),
+      cq_(context, 3 * config.window + config.signalInterval),
+      qp_(context, session_qp_config(config), cq_), connected_(false), cyclesPerUs_(get_cpu_mhz(0)),
+      window_(config.window,
+              RetransmitTimer(config.retransmitTimeoutUs, config.minRetransmitTimeoutUs,
+                              config.maxRetransmitTimeoutUs, config.window),
+              cyclesPerUs_, config.maxRetransmits),
+      smoothedRttUs_(0), retransmitTimeoutUs_(window_.timer().timeoutUs()), handler_(),
+      abortFlag_(0), proxyTail_(nullptr), slotsSent_(0), saturatedSlots_(0) {
+    CHECK(config.slotElems > 0) << "Slot must hold at least one element";
+    CHECK(config.scaleBlockElems >= 0 && config.scaleBlockElems % config.slotElems == 0)
+        << "Scale block of " << config.scaleBlockElems << " elements must be a multiple of the slot";
+    CHECK(config.numWorkers > 0) << "Number of workers must be positive";
+    CHECK(config.signalInterval > 0 && config.signalInterval <= PROXY_MAX_SEND_BATCH)
+        << "Signal interval must be in [1, " << PROXY_MAX_SEND_BATCH << "]";
+    CHECK(config.minRetransmitTimeoutUs > 0 && config.minRetransmitTimeoutUs <= config.maxRetransmitTimeoutUs)
+        << "Retransmit timeout range [" << config.minRetransmitTimeoutUs << ", "
+        << config.maxRetransmitTimeoutUs << "] is empty";
+    CHECK(cyclesPerUs_ > 0) << "Failed to measure the CPU clock for retransmit timers";
+    std::memset(&aggregator_, 0, sizeof(aggregator_));
+    handler_.abortFlag = &abortFlag_;
+    ProxyThreadConfig proxyConfig = {};
+    proxyConfig.numaNode = config.numaNode >= 0 ? config.numaNode : context.numaNode();
+    proxyConfig.name = "flashreduce";
+    ProxyCreate(&handler_, &proxyConfig);
+}
+
+AllReduceSession::~AllReduceSession() {
+    ProxyDestroy(&handler_);
+}
+
+/**
+ * @brief 连接到聚合器，并为每个槽的两份副本各预投递一个接收请求承接写回的结果。
+ *
+ * @param aggregator 聚合器的 QP 信息，raddr/rkey 为 worker 写入的槽区域。
+ * @param mtu 路径 MTU，须不小于一个槽的载荷。
+ */
+void AllReduceSession::connect(const QpInfo &aggregator, ibv_mtu mtu) {
+    CHECK(!connected_) << "Session is already connected";
+    qp_.toInit();
+    struct ibv_recv_wr recv_wr, *bad_recv_wr = nullptr;
+    std::memset(&recv_wr, 0, sizeof(recv_wr));
+    for (int i = 0; i < 2 * config_.window; i++)
+        CHECK(ibv_post_recv(qp_.qp(), &recv_wr, &bad_recv_wr) == 0) << "Failed to post receive WR";
+    qp_.connect(aggregator, mtu);
+    CHECK(slotBytes_ <= (size_t)(128 << qp_.pathMtu()))
+        << "Slot of " << slotBytes_ << " bytes does not fit the path MTU " << (128 << qp_.pathMtu());
+    aggregator_ = aggregator;
+    connected_ = true;
+}
+
+/**
+ * @brief 经由控制器的 RdmaSession 交换 QP 信息并连接到聚合器。
+ *
+ * 本端以非 root 身份注册，控制器返回 root（聚合器）的 QP 信息。GID 为 IPv4 映射地址时
+ * 同时上报主机字节序的 IPv4 地址，供交换机改写包头。
+ */
+void AllReduceSession::connect(gRPCClient &client, uint32_t sessionId, uint32_t rank,
+                               uint32_t numWorkers) {
+    std::vector<QpInfo> local = {localInfo()}, remote;
+    const ibv_gid &gid = local[0].gid;
+    uint32_t ipv4 = 0;
+    if (gid.raw[10] == 0xff && gid.raw[11] == 0xff) {
+        std::memcpy(&ipv4, gid.raw + 12, sizeof(ipv4));
+        ipv4 = ntohl(ipv4);
+    }
+    client.RdmaSession(sessionId, rank, numWorkers, 0, 0, ipv4, local, remote);
+    CHECK(remote.size() == 1) << "Controller returned " << remote.size() << " aggregators";
+    config_.numWorkers = numWorkers;
+    connect(remote[0]);
+}
+
+/**
+ * @brief 按块协商缩放因子：各 worker 的块指数经聚合器取最大值，所有 worker 得到同一组因子。
+ *
+ * 块指数本身作为 int32 张量在同一会话上做一次 Max 归约，不经过控制器。
+ */
+void AllReduceSession::agreeBlockScales(Operation *op) {
+    size_t block = config_.scaleBlockElems;
+    size_t blocks = (op->count + block - 1) / block;
+    std::vector<int32_t> exponents(blocks);
+    for (size_t b = 0; b < blocks; b++) {
+        const char *data = op->data + b * block * dtype_size(op->dtype);
+        size_t n = std::min(block, op->count - b * block);
+        float maxAbs = op->dtype == Float16    ? max_abs_f16((const uint16_t *)data, n)
+                       : op->dtype == BFloat16 ? max_abs_bf16((const uint16_t *)data, n)
+                                               : max_abs((const float *)data, n);
+        exponents[b] = block_exponent(maxAbs);
+    }
+    allReduce(exponents.data(), blocks, Int32, Max);
+    op->blockScales.resize(blocks);
+    for (size_t b = 0; b < blocks; b++)
+        op->blockScales[b] = block_scale(exponents[b], config_.numWorkers);
+}
+
+float AllReduceSession::slotScale(const Operation *op, int slot) const {
+    if (op->blockScales.empty())
+        return config_.scale;
+    return op->blockScales[(size_t)window_.chunk(slot) * config_.slotElems / config_.scaleBlockElems];
+}
+
+/* 槽当前这一轮所用的副本 */
+int32_t *AllReduceSession::slotData(int slot) {
+    return stagingBuffer_.data() + shadow_index(slot, window_.seq(slot) & 1) * config_.slotElems;
+}
+
+/* 槽开始新的一轮：序号加一，把 chunk(slot) 块打包进对应副本并排队发送 */
+void AllReduceSession::fill(Operation *op, int slot) {
+    bool enqueue = window_.fill(slot);
+    pack(op, slot);
+    if (enqueue)
+        op->ready.push_back(slot);
+}
+
+/* 把第 chunk(slot) 块转换成 int32 放进暂存区的槽中，不足一槽的部分用单位元补齐 */
+void AllReduceSession::pack(Operation *op, int slot) {
+    int32_t *dst = slotData(slot);
+    size_t first = (size_t)window_.chunk(slot) * config_.slotElems;
+    size_t n = std::min<size_t>(config_.slotElems, op->count - first);
+    const char *src = op->data + first * dtype_size(op->dtype);
+    if (op->dtype == Int32) {
+        std::memcpy(dst, src, n * sizeof(int32_t));
+    } else {
+        float scale = slotScale(op, slot);
+        float maxAbs = op->dtype == Float16    ? quantize_f16((const uint16_t *)src, dst, n, scale)
+                       : op->dtype == BFloat16 ? quantize_bf16((const uint16_t *)src, dst, n, scale)
+                                               : quantize((const float *)src, dst, n, scale);
+        if (maxAbs * scale > QUANTIZE_SATURATION)
+            saturatedSlots_++;
+    }
+    std::fill(dst + n, dst + config_.slotElems, op->op == Max ? INT32_MIN : 0);
+}
+
+void AllReduceSession::unpack(Operation *op, int slot) {
+    const int32_t *src = slotData(slot);
+    size_t first = (size_t)window_.chunk(slot) * config_.slotElems;
+    size_t n = std::min<size_t>(config_.slotElems, op->count - first);
+    char *dst = op->data + first * dtype_size(op->dtype);
+    switch (op->dtype) {
+    case Int32:
+        std::memcpy(dst, src, n * sizeof(int32_t));
+        break;
+    case Float32:
+        dequantize(src, (float *)dst, n, 1.0f / slotScale(op, slot));
+        break;
+    case Float16:
+        dequantize_f16(src, (uint16_t *)dst, n, 1.0f / slotScale(op, slot));
+        break;
+    case BFloat16:
+        dequantize_bf16(src, (uint16_t *)dst, n, 1.0f / slotScale(op, slot));
+        break;
+    }
+}
+
+/* 把已打包的槽按额度串成批提交，最后一批带信号，保证所有 WQE 都能退休 */
+void AllReduceSession::postReady(ProxyArgs *args, Operation *op) {
+    struct ibv_send_wr wrs[PROXY_MAX_SEND_BATCH];
+    struct ibv_sge sges[PROXY_MAX_SEND_BATCH];
+    uint64_t now = get_cycles();
+    while (!op->ready.empty() && args->endpoint.available_wqes > 0) {
+        int limit = std::min(args->endpoint.available_wqes, PROXY_MAX_SEND_BATCH);
+        int n = 0;
+        while (n < limit && !op->ready.empty()) {
+            int slot = op->ready.front();
+            op->ready.pop_front();
+            // 排队重发期间结果已经到达
+            if (!window_.sent(slot, now))
+                continue;
+            uint32_t seq = window_.seq(slot);
+            sges[n].addr = (uintptr_t)slotData(slot);
+            sges[n].length = slotBytes_;
+            sges[n].lkey = staging_.lkey();
+            std::memset(&wrs[n], 0, sizeof(wrs[n]));
+            wrs[n].sg_list = &sges[n];
+            wrs[n].num_sge = 1;
+            wrs[n].opcode = IBV_WR_RDMA_WRITE_WITH_IMM;
+            wrs[n].imm_data = htonl(slot_imm(op->op, slot, seq));
+            wrs[n].wr.rdma.remote_addr = (uint64_t)aggregator_.raddr + shadow_index(slot, seq & 1) * slotBytes_;
+            wrs[n].wr.rdma.rkey = aggregator_.rkey;
+            if (window_.retries(slot) == 0)
+                op->posted++;
+            n++;
+        }
+        if (n == 0)
+            break;
+        // 首发全部提交之后的批次（包括之后的重发）都带信号
+        CHECK(ProxyPostSendBatch(args, wrs, n, op->posted == op->chunks) == 0)
+            << "Failed to post " << n << " slots";
+        slotsSent_ += n;
+    }
+}
+
+/* 把计时器的状态发布给其它线程，计时器本身只在代理线程上读写 */
+void AllReduceSession::publishTimer() {
+    smoothedRttUs_.store(window_.timer().smoothedRttUs(), std::memory_order_relaxed);
+    retransmitTimeoutUs_.store(window_.timer().timeoutUs(), std::memory_order_relaxed);
+}
+
+/* 代理线程上的进度函数：收回写回的结果，腾出的槽立即装入下一块，超时的槽重发 */
+void AllReduceSession::progress(ProxyArgs *args) {
+    Operation *op = (Operation *)args->opaque;
+    AllReduceSession *session = op->session;
+    SlotWindow &window = session->window_;
+    if (args->state == ProxyOpReady) {
+        args->state = ProxyOpProgress;
+        window.begin(op->chunks);
+        for (int slot = 0; slot < window.window() && (uint32_t)slot < op->chunks; slot++)
+            session->fill(op, slot);
+    }
+    args->idle = 1;
+    struct ibv_wc wcs[kPollBatch];
+    int n = ProxyPollCq(args, kPollBatch, wcs);
+    uint64_t now = get_cycles();
+    for (int k = 0; k < n; k++) {
+        CHECK_EQ(wcs[k].status, IBV_WC_SUCCESS)
+            << "AllReduce slot failed: " << ibv_wc_status_str(wcs[k].status);
+        args->idle = 0;
+        if (wcs[k].opcode != IBV_WC_RECV_RDMA_WITH_IMM) {
+            ProxySendCompleted(args, &wcs[k]);
+            continue;
+        }
+        CHECK(ProxyPostRecv(args, &args->endpoint.recv_wr) == 0) << "Failed to post receive WR";
+        // 重传引起的重复结果，或者上一次 allReduce 遗留的结果
+        int slot = window.receive(ntohl(wcs[k].imm_data), now);
+        if (slot < 0)
+            continue;
+        session->publishTimer();
+        session->unpack(op, slot);
+        if (window.advance(slot))
+            session->fill(op, slot);
+    }
+    // 先收完已到达的结果再判定丢失，停顿后成批到达的结果不会被当成乱序
+    if (n < kPollBatch && window.due(now)) {
+        for (int slot : window.retransmitExpired(now))
+            op->ready.push_back(slot);
+        session->publishTimer();
+    }
+    session->postReady(args, op);
+    if (window.done() && args->endpoint.available_wqes == session->sendDepth_)
+        args->state = ProxyOpNone;
+}
+
+/**
+ * @brief 对 ptr 指向的张量做全局归约，结果原地写回。
+ *
+ * @param ptr 张量首地址，不要求注册。
+ * @param count 元素个数。
+ * @param dtype 元素类型，浮点类型经定点转换，精度为 1 / scale 或所在块的 1 / 因子，
+ *              float16/bfloat16 再受自身尾数位数限制。
+ * @param op 归约操作。
+ */
+void AllReduceSession::allReduce(void *ptr, size_t count, DataType dtype, ReduceOp op) {
+    CHECK(connected_) << "AllReduce session is not connected";
+    if (count == 0)
+        return;
+    Operation operation;
+    operation.session = this;
+    operation.data = (char *)ptr;
+    operation.count = count;
+    operation.dtype = dtype;
+    operation.op = op;
+    operation.chunks = (uint32_t)((count + config_.slotElems - 1) / config_.slotElems);
+    operation.posted = 0;
+    if (dtype != Int32 && config_.scaleBlockElems > 0)
+        agreeBlockScales(&operation);
+
+    ProxyArgs *args = allocateArgs(&handler_);
+    args->state = ProxyOpReady;
+    args->proxyTail = &proxyTail_;
+    args->progress = progress;
+    args->opaque = &operation;
+    args->endpoint.cq = cq_.cq();
+    args->endpoint.qp = qp_.qp();
+    args->endpoint.max_inline = qp_.maxInlineData();
+    args->endpoint.available_wqes = sendDepth_;
+    args->endpoint.signal_interval = config_.signalInterval;
+    std::memset(&args->endpoint.recv_wr, 0, sizeof(args->endpoint.recv_wr));
+    ProxyRequest request;
+    ProxyRequestInit(&request);
+    ProxyArgsAppend(&handler_, args, &request);
+    ProxyStart(&handler_);
+    ProxyRequestWait(&request);
+}
+
+/**
+ * @brief 在聚合会话上做 AllReduce，结果原地写回 ptr。
+ *
+ * @param ptr 张量首地址。
+ * @param count 元素个数。
+ * @param dtype 元素类型。
+ * @param op 归约操作。
+ * @param session 已连接的聚合会话。
+ */
+void AllReduce(void *ptr, size_t count, DataType dtype, ReduceOp op, AllReduceSession &session) {
+    session.allReduce(ptr, count, dtype, op);
+}
+
+} // namespace flashreduce
@@ -0,0 +1,272 @@
+#pragma once
+#include "proxy.h"
+#include "rdma_context.h"
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <vector>
+
+class gRPCClient;
+
+/* 每个聚合槽的 int32 元素数，载荷 1KB，不超过 1024 的路径 MTU，一个槽正好一个包 */
+#define ALLREDUCE_SLOT_ELEMS 256
+/* 每个 worker 在聚合器上占用的槽数，即在途槽的滑动窗口 */
+#define ALLREDUCE_DEFAULT_WINDOW 128
+/* float32 转为定点 int32 的放大倍数，交换机只做整数运算 */
+#define ALLREDUCE_DEFAULT_SCALE 65536.0f
+/* 立即数：高 2 位为归约操作，中间 14 位为槽号，低 16 位为该槽的使用序号 */
+#define ALLREDUCE_MAX_SLOTS (1 << 14)
+/* 重传超时的初值和上下限（微秒），实际超时随测得的 RTT 调整，见 RetransmitTimer */
+#define ALLREDUCE_DEFAULT_RTO_US 1000.0
+#define ALLREDUCE_MIN_RTO_US 100.0
+#define ALLREDUCE_MAX_RTO_US 100000.0
+
+namespace flashreduce {
+
+enum DataType
+{
+    Float32,
+    Int32,
+    /* IEEE binary16 与 bfloat16，按位以 uint16_t 存放，与 float32 一样经定点转换后归约 */
+    Float16,
+    BFloat16,
+};
+
+enum ReduceOp
+{
+    Sum,
+    Max,
+};
+
+static inline size_t dtype_size(DataType dtype)
+{
+    return dtype == Float16 || dtype == BFloat16 ? sizeof(uint16_t) : sizeof(int32_t);
+}
+
+/* 序号在每次往槽中装入新的一块时加一，跨 allReduce 连续递增；其最低位即影子槽的版本，
+ * 相邻两轮落在同一槽的两份副本上，重传的旧一轮不会覆盖新一轮 */
+static inline uint32_t slot_imm(ReduceOp op, uint32_t slot, uint32_t seq)
+{
+    return (uint32_t)op << 30 | (slot & (ALLREDUCE_MAX_SLOTS - 1)) << 16 | (seq & 0xFFFF);
+}
+
+static inline ReduceOp slot_imm_op(uint32_t imm) { return (ReduceOp)(imm >> 30); }
+static inline uint32_t slot_imm_slot(uint32_t imm) { return (imm >> 16) & (ALLREDUCE_MAX_SLOTS - 1); }
+static inline uint32_t slot_imm_seq(uint32_t imm) { return imm & 0xFFFF; }
+static inline uint32_t slot_imm_version(uint32_t imm) { return imm & 1; }
+
+/* 槽 slot 的版本 version 在暂存区（以及聚合器的接收区、结果区）中的下标 */
+static inline size_t shadow_index(uint32_t slot, uint32_t version) { return 2 * (size_t)slot + version; }
+
+/* 重传超时估计，同 TCP（RFC 6298）：超时为平滑 RTT 加四倍平均偏差，限制在 [minUs, maxUs]。
+ * 只用未重传过的槽采样（Karn 算法），否则无法区分结果回应的是哪一次发送。
+ * 一个 RTT 内窗口中的每个槽各给一个样本，增益按 samplesPerRtt 缩小（RFC 7323 附录 G），
+ * 否则相邻样本过于接近，平均偏差很快趋于 0，超时贴着平滑 RTT，稍慢的槽都会被误判超时。
+ * 发生超时后整个计时器的超时加倍（5.5 节），之后首发的槽也按退避后的值计时，
+ * 直到下一个有效样本才恢复按 RTT 计算的值。 */
+class RetransmitTimer
+{
+public:
+    RetransmitTimer(double initialUs = ALLREDUCE_DEFAULT_RTO_US, double minUs = ALLREDUCE_MIN_RTO_US,
+                    double maxUs = ALLREDUCE_MAX_RTO_US, int samplesPerRtt = 1);
+
+    void sample(double rttUs);
+    /* 计时器超时并发出了探测，退避一倍 */
+    void expire() { backoff_ = std::min(backoff_ + 1, 20u); }
+    double timeoutUs() const { return backoffUs(0); }
+    /* 已重传 retries 次的槽的超时：取该槽与计时器退避次数的较大者，两者不叠加，直到上限 */
+    double backoffUs(uint32_t retries) const
+    {
+        return std::min(rtoUs_ * (1u << std::min(std::max(retries, backoff_), 20u)), maxUs_);
+    }
+    /* 更晚发出的槽已有结果时，再等多久仍无结果即判定丢失：平滑 RTT 加四分之一的乱序余量，不退避 */
+    double lossDelayUs() const { return srttUs_ > 0 ? 1.25 * srttUs_ : rtoUs_; }
+    double smoothedRttUs() const { return srttUs_; }
+
+private:
+    double minUs_;
+    double maxUs_;
+    double srttUs_;
+    double rttvarUs_;
+    /* 增益 1/8 与 1/4 再除以每个 RTT 内的样本数 */
+    double srttGain_;
+    double rttvarGain_;
+    /* 按 RTT 计算、未退避的超时 */
+    double rtoUs_;
+    uint32_t backoff_;
+};
+
+/* 与传输无关的槽状态机，AllReduceSession 与交换机模拟器的 UDP/共享内存 worker 共用：
+ * 第 c 块放在槽 c % window，槽每装入一块序号加一，结果回来后装入第 c + window 块；
+ * 按 RetransmitTimer 和已收到结果中最晚的发送时刻判定丢失（同 RACK），序号不符的结果丢弃。
+ * 只记录状态并给出决定，打包、发送和解包由调用者完成。时间单位为调用者的时钟刻度，
+ * 构造时给出每微秒的刻度数。序号和计时器跨多次归约保留，与聚合器上的槽状态对应。 */
+class SlotWindow
+{
+public:
+    SlotWindow(int window, const RetransmitTimer &timer, double ticksPerUs, int maxRetransmits);
+
+    void begin(uint32_t chunks);
+    bool fill(int slot);
+    bool sent(int slot, uint64_t now);
+    int receive(uint32_t imm, uint64_t now);
+    bool advance(int slot);
+    /* 到了可能有槽超时的时刻，此时才需要调用 retransmitExpired */
+    bool due(uint64_t now) const { return now >= nextCheck_; }
+    const std::vector<int> &retransmitExpired(uint64_t now);
+
+    int window() const { return window_; }
+    uint32_t seq(int slot) const { return slotSeq_[slot]; }
+    uint32_t chunk(int slot) const { return slotChunk_[slot]; }
+    uint32_t retries(int slot) const { return retries_[slot]; }
+    bool pending(int slot) const { return pending_[slot]; }
+    bool done() const { return completed_ == chunks_; }
+    const RetransmitTimer &timer() const { return timer_; }
+    uint64_t retransmits() const { return retransmits_; }
+    uint64_t staleResults() const { return staleResults_; }
+
+private:
+    uint64_t deadline(int slot) const;
+    void retransmit(int slot);
+
+    int window_;
+    RetransmitTimer timer_;
+    double ticksPerUs_;
+    uint32_t maxRetransmits_;
+    /* 每个槽已使用的轮数，跨归约保留 */
+    std::vector<uint32_t> slotSeq_;
+    uint32_t chunks_;
+    uint32_t completed_;
+    /* 每个槽当前承载的分块序号 */
+    std::vector<uint32_t> slotChunk_;
+    /* 每个槽是否在等结果、是否在等调用者发送、最近一次发送的时刻和已重传次数 */
+    std::vector<uint8_t> pending_;
+    std::vector<uint8_t> queued_;
+    std::vector<uint64_t> sentAt_;
+    std::vector<uint32_t> retries_;
+    /* 已收到结果的槽中最晚的一次发送时刻，早于它发出的槽迟迟没有结果即认为丢失 */
+    uint64_t delivered_;
+    /* 最早可能超时的时刻，之前不必扫描在途槽 */
+    uint64_t nextCheck_;
+    std::vector<int> expired_;
+    uint64_t retransmits_;
+    uint64_t staleResults_;
+};
+
+struct AllReduceConfig
+{
+    int window = ALLREDUCE_DEFAULT_WINDOW;
+    int slotElems = ALLREDUCE_SLOT_ELEMS;
+    float scale = ALLREDUCE_DEFAULT_SCALE;
+    /* 大于 0 时浮点张量每 scaleBlockElems 个元素共用一个 2 的幂缩放因子，取代 scale：
+     * 各 worker 先求块内最大绝对值，经聚合器取最大值后换算成因子，须为 slotElems 的整数倍 */
+    int scaleBlockElems = 0;
+    /* 参与归约的 worker 数，按块缩放时据此为求和预留进位；经控制器 connect 时自动填入 */
+    int numWorkers = 1;
+    /* 发送每 signalInterval 个槽置一次信号，见 ProxyPostSendBatch */
+    int signalInterval = 16;
+    /* 重传超时的初值和上下限（微秒）；同一槽连续超时时按 2 的幂退避，不超过上限 */
+    double retransmitTimeoutUs = ALLREDUCE_DEFAULT_RTO_US;
+    double minRetransmitTimeoutUs = ALLREDUCE_MIN_RTO_US;
+    double maxRetransmitTimeoutUs = ALLREDUCE_MAX_RTO_US;
+    /* 同一槽重传超过该次数仍无结果即认为聚合器失联 */
+    int maxRetransmits = 64;
+    /* 代理线程所在的 NUMA 节点，-1 表示取网卡所在节点 */
+    int numaNode = -1;
+};
+
+/* 交换机聚合会话：worker 通过一个 UC QP 连到聚合器（可编程交换机或其模拟器）。
+ *
+ * 线上协议（SwitchML 式）：worker 本地有 window 个槽的暂存区，每个槽有两份影子副本，
+ * 张量按 slotElems 个元素切块，第 c 块放在槽 c % window 中。槽每装入一块序号加一，
+ * 数据放在序号最低位所指的副本里，用 RDMA WRITE_WITH_IMM 写到聚合器 raddr 上同一副本
+ * 的位置，立即数见 slot_imm。聚合器收齐所有 worker 对某个槽这一轮的写入后，把归约结果
+ * 以同样的立即数写回每个 worker 暂存区的同一副本。worker 收到结果即把它拷回张量，并在
+ * 该槽中放入下一块（c + window），因此在途槽数由窗口自然限制，不需要额外的流控。
+ *
+ * UC 不重传，写入或结果丢失时该槽的结果永远不会到达。代理线程为每个在途槽计时，
+ * 更晚发出的槽已有结果而它仍没有、或者超过按 RTT 估计的超时，就原样重发同一副本（见 SlotWindow）；
+ * 聚合器对已计入的重复写入不再累加，若这一轮已完成则只把结果重发给该 worker。序号不符的结果是迟到的重复，直接丢弃。
+ * 两份副本保证重传的上一轮和正在进行的这一轮互不覆盖。
+ * 浮点类型在打包时按 scale（或按块协商的因子）转为定点 int32，转换由 quantize.h 中按指令集
+ * 分派的核完成，越界的值饱和；float16/bfloat16 的展开和收窄融合在同一个核里，直接在张量与
+ * 暂存槽之间转换，不产生整张量大小的 float32 副本。最后一块不足 slotElems 时用归约的单位元补齐。
+ *
+ * 所有发送和接收都在会话自带的代理线程上推进；allReduce 阻塞到结果全部写回为止，
+ * 同一会话一次只能进行一个 allReduce。 */
+class AllReduceSession
+{
+public:
+    AllReduceSession(RdmaContext &context, const AllReduceConfig &config = AllReduceConfig());
+    ~AllReduceSession();
+    AllReduceSession(const AllReduceSession &) = delete;
+    AllReduceSession &operator=(const AllReduceSession &) = delete;
+
+    QpInfo localInfo() const { return qp_.localInfo(&staging_); }
+    void connect(const QpInfo &aggregator, ibv_mtu mtu = RDMA_MTU_AUTO);
+    void connect(gRPCClient &client, uint32_t sessionId, uint32_t rank, uint32_t numWorkers);
+    void allReduce(void *ptr, size_t count, DataType dtype, ReduceOp op);
+
+    const AllReduceConfig &config() const { return config_; }
+    uint64_t slotsSent() const { return slotsSent_; }
+    /* 超时重发的槽数和丢弃的过期结果数 */
+    uint64_t retransmits() const { return window_.retransmits(); }
+    uint64_t staleResults() const { return window_.staleResults(); }
+    /* 重传计时器的平滑 RTT 和当前超时（微秒），由代理线程发布，任意线程可读 */
+    double smoothedRttUs() const { return smoothedRttUs_.load(std::memory_order_relaxed); }
+    double retransmitTimeoutUs() const { return retransmitTimeoutUs_.load(std::memory_order_relaxed); }
+    /* 量化时有元素超出 int32 范围而被截断的槽数 */
+    uint64_t saturatedSlots() const { return saturatedSlots_; }
+
+private:
+    struct Operation
+    {
+        AllReduceSession *session;
+        char *data;
+        size_t count;
+        DataType dtype;
+        ReduceOp op;
+        /* 按块缩放时每块的因子，为空表示统一使用 config.scale */
+        std::vector<float> blockScales;
+        uint32_t chunks;
+        uint32_t posted;
+        /* 已打包或待重发、等待发送额度的槽 */
+        std::deque<int> ready;
+    };
+
+    static void progress(ProxyArgs *args);
+    void agreeBlockScales(Operation *op);
+    float slotScale(const Operation *op, int slot) const;
+    int32_t *slotData(int slot);
+    void fill(Operation *op, int slot);
+    void pack(Operation *op, int slot);
+    void unpack(Operation *op, int slot);
+    void postReady(ProxyArgs *args, Operation *op);
+    void publishTimer();
+
+    AllReduceConfig config_;
+    size_t slotBytes_;
+    int sendDepth_;
+    std::vector<int32_t> stagingBuffer_;
+    MemoryRegion staging_;
+    CompletionQueue cq_;
+    QueuePair qp_;
+    QpInfo aggregator_;
+    bool connected_;
+    double cyclesPerUs_;
+    /* 槽序号和计时器跨 allReduce 保留，与聚合器上的影子槽状态对应；只在代理线程上访问 */
+    SlotWindow window_;
+    std::atomic<double> smoothedRttUs_;
+    std::atomic<double> retransmitTimeoutUs_;
+    ProxyHandler handler_;
+    uint32_t abortFlag_;
+    ProxyArgs *proxyTail_;
+    uint64_t slotsSent_;
+    uint64_t saturatedSlots_;
+};
+
+void AllReduce(void *ptr, size_t count, DataType dtype, ReduceOp op, AllReduceSession &session);
+
+} // namespace flashreduce
@@ -37,7 +37,8 @@ void gRPCClient::RdmaSession(uint32_t session_id,
     Status status = session_stub_->RdmaSession(&context, request, &response);
     CHECK(status.ok()) << "RdmaSession failed: " << status.error_code()
                        << ": " << status.error_message();
-    struct QpInfo remote_qp_info;
+    // 控制器的应答里没有 mtu，保持为 0，negotiate_mtu 只按本端的 active_mtu
+    struct QpInfo remote_qp_info = {};
     remote_qp_info.rkey = response.rkey();
     remote_qp_info.raddr = reinterpret_cast<void *>(response.raddr());
     remote_qp_info.qp_num = response.qpn();
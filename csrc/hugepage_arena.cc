@@ -0,0 +1,157 @@
+#include "hugepage_arena.h"
+#include <algorithm>
+#include <linux/mman.h>
+#include <sys/mman.h>
+
+#ifndef MAP_HUGE_2MB
+#define MAP_HUGE_2MB (21 << MAP_HUGE_SHIFT)
+#endif
+#ifndef MAP_HUGE_1GB
+#define MAP_HUGE_1GB (30 << MAP_HUGE_SHIFT)
+#endif
+
+static size_t round_up(size_t value, size_t alignment) {
+    return (value + alignment - 1) / alignment * alignment;
+}
+
+/* 从 hugetlbfs 预留池申请，池中页数不足时 mmap 直接失败而不是在缺页时 SIGBUS */
+static void *map_hugetlb(size_t length, int sizeFlag) {
+    void *addr = mmap(nullptr, length, PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB | sizeFlag, -1, 0);
+    return addr == MAP_FAILED ? nullptr : addr;
+}
+
+/* 多映射 2MB 再裁掉首尾，使起始地址按 2MB 对齐，透明大页才能整页映射 */
+static void *map_transparent(size_t length) {
+    size_t span = length + HUGEPAGE_SIZE_2MB;
+    char *raw = (char *)mmap(nullptr, span, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS,
+                             -1, 0);
+    CHECK(raw != MAP_FAILED) << "Failed to map " << span << " bytes";
+    char *aligned = (char *)round_up((uintptr_t)raw, HUGEPAGE_SIZE_2MB);
+    if (aligned > raw)
+        munmap(raw, aligned - raw);
+    char *tail = aligned + length;
+    if (raw + span > tail)
+        munmap(tail, raw + span - tail);
+    LOG_IF(WARNING, madvise(aligned, length, MADV_HUGEPAGE) != 0)
+        << "madvise(MADV_HUGEPAGE) failed, chunk falls back to 4K pages";
+    return aligned;
+}
+
+/**
+ * @brief 创建大页内存池，块在第一次分配时才申请。
+ *
+ * @param context 设备上下文，块注册在它的 PD 上。
+ * @param chunkSize 每块大小，向上取整到 2MB；为 1GB 整数倍时优先使用 1GB 页。
+ * @param access MR 访问权限。
+ */
+HugepageArena::HugepageArena(RdmaContext &context, size_t chunkSize, int access)
+    : context_(&context), chunkSize_(round_up(chunkSize, HUGEPAGE_SIZE_2MB)), access_(access),
+      reservedBytes_(0), usedBytes_(0) {}
+
+HugepageArena::~HugepageArena() {
+    LOG_IF(WARNING, usedBytes_ > 0) << usedBytes_ << " bytes are still allocated from the arena";
+    for (auto &chunk : chunks_) {
+        // 先注销再解除映射，网卡不能再访问已归还的页
+        chunk->mr.reset();
+        munmap(chunk->base, chunk->length);
+    }
+}
+
+HugepageArena::Chunk *HugepageArena::addChunk(size_t length) {
+    auto chunk = std::make_unique<Chunk>();
+    void *addr = nullptr;
+    if (length % HUGEPAGE_SIZE_1GB == 0 && (addr = map_hugetlb(length, MAP_HUGE_1GB)) != nullptr) {
+        chunk->kind = ArenaHugetlb1G;
+    } else if ((addr = map_hugetlb(length, MAP_HUGE_2MB)) != nullptr) {
+        chunk->kind = ArenaHugetlb2M;
+    } else {
+        addr = map_transparent(length);
+        chunk->kind = ArenaTransparent;
+    }
+    chunk->base = (char *)addr;
+    chunk->length = length;
+    chunk->mr = std::make_unique<MemoryRegion>(*context_, addr, length, access_);
+    chunk->free[0] = length;
+    LOG(INFO) << "Arena chunk " << chunks_.size() << ": " << length << " bytes at " << addr
+              << (chunk->kind == ArenaHugetlb1G   ? " on 1GB pages"
+                  : chunk->kind == ArenaHugetlb2M ? " on 2MB pages"
+                                                  : " on transparent hugepages");
+    reservedBytes_ += length;
+    byBase_[(uintptr_t)addr] = chunk.get();
+    chunks_.push_back(std::move(chunk));
+    return chunks_.back().get();
+}
+
+/* 首次适配：对齐后剩余的头尾仍留在空闲表中 */
+bool HugepageArena::carve(Chunk *chunk, size_t length, size_t alignment, RegisteredBuffer *buffer) {
+    for (auto it = chunk->free.begin(); it != chunk->free.end(); ++it) {
+        size_t start = it->first, size = it->second;
+        size_t offset = round_up((uintptr_t)chunk->base + start, alignment) - (uintptr_t)chunk->base;
+        if (offset + length > start + size)
+            continue;
+        chunk->free.erase(it);
+        if (offset > start)
+            chunk->free[start] = offset - start;
+        if (offset + length < start + size)
+            chunk->free[offset + length] = start + size - offset - length;
+        buffer->addr = chunk->base + offset;
+        buffer->length = length;
+        buffer->lkey = chunk->mr->lkey();
+        buffer->rkey = chunk->mr->rkey();
+        return true;
+    }
+    return false;
+}
+
+/**
+ * @brief 分配一段已注册的内存。
+ *
+ * @param length 字节数，向上取整到 64 字节。
+ * @param alignment 起始地址对齐，须为 2 的幂且不超过 2MB。
+ * @return 子缓冲区，lkey/rkey 可直接填入 SGE 和 WR。
+ */
+RegisteredBuffer HugepageArena::allocate(size_t length, size_t alignment) {
+    CHECK(alignment > 0 && (alignment & (alignment - 1)) == 0 && alignment <= HUGEPAGE_SIZE_2MB)
+        << "Invalid arena alignment " << alignment;
+    length = round_up(std::max<size_t>(length, 1), ARENA_DEFAULT_ALIGNMENT);
+    std::lock_guard<std::mutex> lock(mutex_);
+    RegisteredBuffer buffer;
+    for (auto &chunk : chunks_) {
+        if (carve(chunk.get(), length, alignment, &buffer)) {
+            usedBytes_ += length;
+            return buffer;
+        }
+    }
+    Chunk *chunk = addChunk(std::max(chunkSize_, round_up(length, HUGEPAGE_SIZE_2MB)));
+    CHECK(carve(chunk, length, alignment, &buffer)) << "Fresh arena chunk cannot fit " << length;
+    usedBytes_ += length;
+    return buffer;
+}
+
+void HugepageArena::free(const RegisteredBuffer &buffer) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto owner = byBase_.upper_bound((uintptr_t)buffer.addr);
+    CHECK(owner != byBase_.begin()) << "Buffer " << buffer.addr << " does not belong to the arena";
+    Chunk *chunk = std::prev(owner)->second;
+    size_t start = (char *)buffer.addr - chunk->base;
+    size_t end = start + buffer.length;
+    CHECK(end <= chunk->length) << "Buffer " << buffer.addr << " does not belong to the arena";
+    auto next = chunk->free.lower_bound(start);
+    CHECK(next == chunk->free.end() || next->first >= end) << "Double free of " << buffer.addr;
+    if (next != chunk->free.end() && next->first == end) {
+        end += next->second;
+        next = chunk->free.erase(next);
+    }
+    if (next != chunk->free.begin()) {
+        auto prev = std::prev(next);
+        CHECK(prev->first + prev->second <= start) << "Double free of " << buffer.addr;
+        if (prev->first + prev->second == start) {
+            prev->second = end - prev->first;
+            usedBytes_ -= buffer.length;
+            return;
+        }
+    }
+    chunk->free[start] = end - start;
+    usedBytes_ -= buffer.length;
+}
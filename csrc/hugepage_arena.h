@@ -0,0 +1,79 @@
+#pragma once
+#include "rdma_context.h"
+#include <cstddef>
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+#define HUGEPAGE_SIZE_2MB (2UL << 20)
+#define HUGEPAGE_SIZE_1GB (1UL << 30)
+#define ARENA_DEFAULT_CHUNK_SIZE (256UL << 20)
+#define ARENA_DEFAULT_ALIGNMENT 64
+
+/* 块的页来源，依次尝试，前一种不可用时退到下一种 */
+enum ArenaPageKind
+{
+    ArenaHugetlb1G,
+    ArenaHugetlb2M,
+    ArenaTransparent,
+};
+
+/* 从已注册块中切出的子缓冲区，lkey/rkey 即所在块的 MR */
+struct RegisteredBuffer
+{
+    void *addr;
+    size_t length;
+    uint32_t lkey;
+    uint32_t rkey;
+};
+
+/* 大页内存池：按块向系统申请大页并整块注册一次，之后的分配都在块内切分，
+ * 不再调用 ibv_reg_mr。大页使网卡 MTT 中的一项覆盖 2MB 或 1GB，
+ * 大缓冲区的地址翻译不再频繁缺失。
+ *
+ * 每块依次尝试 1GB hugetlbfs 页（块大小为 1GB 整数倍时）、2MB hugetlbfs 页，
+ * 都没有预留时退回按 2MB 对齐的匿名映射并 madvise(MADV_HUGEPAGE)，由透明大页兜底。
+ * 块内按首次适配分配，释放时与相邻空闲区合并；超过块大小的请求单独成块。 */
+class HugepageArena
+{
+public:
+    HugepageArena(RdmaContext &context, size_t chunkSize = ARENA_DEFAULT_CHUNK_SIZE,
+                  int access = RDMA_DEFAULT_ACCESS);
+    ~HugepageArena();
+    HugepageArena(const HugepageArena &) = delete;
+    HugepageArena &operator=(const HugepageArena &) = delete;
+
+    RegisteredBuffer allocate(size_t length, size_t alignment = ARENA_DEFAULT_ALIGNMENT);
+    void free(const RegisteredBuffer &buffer);
+
+    size_t chunks() const { return chunks_.size(); }
+    ArenaPageKind pageKind(size_t chunk) const { return chunks_[chunk]->kind; }
+    size_t reservedBytes() const { return reservedBytes_; }
+    size_t usedBytes() const { return usedBytes_; }
+
+private:
+    struct Chunk
+    {
+        char *base;
+        size_t length;
+        ArenaPageKind kind;
+        std::unique_ptr<MemoryRegion> mr;
+        /* 空闲区，起始偏移到长度 */
+        std::map<size_t, size_t> free;
+    };
+
+    Chunk *addChunk(size_t length);
+    bool carve(Chunk *chunk, size_t length, size_t alignment, RegisteredBuffer *buffer);
+
+    RdmaContext *context_;
+    size_t chunkSize_;
+    int access_;
+    std::mutex mutex_;
+    std::vector<std::unique_ptr<Chunk>> chunks_;
+    /* 块起始地址到块，用于 free 时定位 */
+    std::map<uintptr_t, Chunk *> byBase_;
+    size_t reservedBytes_;
+    size_t usedBytes_;
+};
@@ -0,0 +1,317 @@
+#include "mr_cache.h"
+#include <algorithm>
+#include <atomic>
+#include <cstdarg>
+#include <cstdlib>
+#include <dlfcn.h>
+#include <malloc.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include <vector>
+
+/* 所有存活的缓存，munmap/mremap/mmap 拦截时逐个通知。liveCaches 为 0 时拦截只多一次原子读 */
+static std::mutex cachesMutex;
+static std::vector<MrCache *> caches;
+static std::atomic<int> liveCaches(0);
+/* 开启 leave_pinned 的缓存数，由 cachesMutex 保护 */
+static int leavePinnedCaches = 0;
+/* 缓存自身持锁调用 verbs 时，驱动内部的 munmap 不涉及用户缓冲区，跳过通知以免重入死锁 */
+static thread_local bool insideCache = false;
+
+struct CacheScope {
+    CacheScope() { insideCache = true; }
+    ~CacheScope() { insideCache = false; }
+};
+
+static void invalidate_all(const void *addr, size_t length) {
+    if (liveCaches.load(std::memory_order_acquire) == 0 || insideCache)
+        return;
+    std::lock_guard<std::mutex> lock(cachesMutex);
+    for (MrCache *cache : caches)
+        cache->invalidate(addr, length);
+}
+
+/* 拦截 munmap/mremap：先让覆盖该区间的 MR 失效，再交给 libc 解除映射。
+ * 注销 MR 必须在解除映射之前，否则网卡可能仍按旧的页表访问已归还的物理页。 */
+extern "C" int munmap(void *addr, size_t length) {
+    static int (*realMunmap)(void *, size_t) =
+        (int (*)(void *, size_t))dlsym(RTLD_NEXT, "munmap");
+    invalidate_all(addr, length);
+    return realMunmap(addr, length);
+}
+
+extern "C" void *mremap(void *oldAddr, size_t oldSize, size_t newSize, int flags, ...) {
+    static void *(*realMremap)(void *, size_t, size_t, int, ...) =
+        (void *(*)(void *, size_t, size_t, int, ...))dlsym(RTLD_NEXT, "mremap");
+    invalidate_all(oldAddr, oldSize);
+    if (flags & MREMAP_FIXED) {
+        va_list ap;
+        va_start(ap, flags);
+        void *newAddr = va_arg(ap, void *);
+        va_end(ap);
+        return realMremap(oldAddr, oldSize, newSize, flags, newAddr);
+    }
+    return realMremap(oldAddr, oldSize, newSize, flags);
+}
+
+/* 带 MAP_FIXED 的 mmap 会原地替换区间内已有的映射，旧的物理页同样被归还，
+ * 与 munmap 一样须先让覆盖该区间的 MR 失效。开启大文件支持编译的程序调用的是 mmap64。 */
+extern "C" void *mmap(void *addr, size_t length, int prot, int flags, int fd, off_t offset) {
+    static void *(*realMmap)(void *, size_t, int, int, int, off_t) =
+        (void *(*)(void *, size_t, int, int, int, off_t))dlsym(RTLD_NEXT, "mmap");
+    if (flags & MAP_FIXED)
+        invalidate_all(addr, length);
+    return realMmap(addr, length, prot, flags, fd, offset);
+}
+
+extern "C" void *mmap64(void *addr, size_t length, int prot, int flags, int fd, off64_t offset) {
+    static void *(*realMmap64)(void *, size_t, int, int, int, off64_t) =
+        (void *(*)(void *, size_t, int, int, int, off64_t))dlsym(RTLD_NEXT, "mmap64");
+    if (flags & MAP_FIXED)
+        invalidate_all(addr, length);
+    return realMmap64(addr, length, prot, flags, fd, offset);
+}
+
+/* glibc 的 DEFAULT_MMAP_MAX 与 DEFAULT_TRIM_THRESHOLD，环境变量设置的值优先 */
+static int default_malloc_param(const char *env, int fallback) {
+    const char *value = getenv(env);
+    return value != nullptr && *value != '\0' ? atoi(value) : fallback;
+}
+
+/**
+ * @brief 创建 MR 缓存。
+ *
+ * 第一个 leavePinned 缓存创建时通过 mallopt 关闭 glibc 的 mmap 分配和堆收缩，
+ * 使 free 之后内存仍然映射，缓存的 MR 始终指向有效的页；该设置作用于整个进程，
+ * 最后一个 leavePinned 缓存销毁时恢复。
+ *
+ * @param context 设备上下文，MR 注册在它的 PD 上。
+ * @param budgetBytes 钉住内存的预算，超出时按 LRU 注销未在使用的 MR。
+ * @param access MR 访问权限。
+ * @param leavePinned 为真时让 free 不再把内存归还系统。
+ */
+MrCache::MrCache(RdmaContext &context, size_t budgetBytes, int access, bool leavePinned)
+    : context_(&context), budget_(budgetBytes), access_(access), leavePinned_(leavePinned),
+      root_(nullptr), nextSeq_(0), seed_(0x9E3779B9u), hits_(0), misses_(0), evictions_(0),
+      invalidations_(0), pinnedBytes_(0), entries_(0) {
+    std::lock_guard<std::mutex> lock(cachesMutex);
+    if (leavePinned_ && leavePinnedCaches++ == 0) {
+        mallopt(M_MMAP_MAX, 0);
+        mallopt(M_TRIM_THRESHOLD, -1);
+    }
+    caches.push_back(this);
+    liveCaches.fetch_add(1, std::memory_order_release);
+}
+
+MrCache::~MrCache() {
+    {
+        std::lock_guard<std::mutex> lock(cachesMutex);
+        caches.erase(std::find(caches.begin(), caches.end(), this));
+        liveCaches.fetch_sub(1, std::memory_order_release);
+        if (leavePinned_ && --leavePinnedCaches == 0) {
+            mallopt(M_MMAP_MAX, default_malloc_param("MALLOC_MMAP_MAX_", 65536));
+            mallopt(M_TRIM_THRESHOLD, default_malloc_param("MALLOC_TRIM_THRESHOLD_", 128 * 1024));
+        }
+    }
+    CacheScope scope;
+    for (auto &item : byMr_) {
+        LOG_IF(WARNING, item.second->refs > 0)
+            << "MR of " << item.second->end - item.second->start << " bytes is still in use";
+        ibv_dereg_mr(item.first);
+        delete item.second;
+    }
+}
+
+void MrCache::pull(Entry *node) {
+    node->maxEnd = node->end;
+    if (node->left)
+        node->maxEnd = std::max(node->maxEnd, node->left->maxEnd);
+    if (node->right)
+        node->maxEnd = std::max(node->maxEnd, node->right->maxEnd);
+}
+
+/* 按 (start, seq) 拆分：left 中的键都小于给定键，right 中的键都不小于给定键 */
+void MrCache::split(Entry *node, uintptr_t start, uint64_t seq, Entry **left, Entry **right) {
+    if (node == nullptr) {
+        *left = *right = nullptr;
+        return;
+    }
+    if (node->start < start || (node->start == start && node->seq < seq)) {
+        split(node->right, start, seq, &node->right, right);
+        *left = node;
+    } else {
+        split(node->left, start, seq, left, &node->left);
+        *right = node;
+    }
+    pull(node);
+}
+
+MrCache::Entry *MrCache::merge(Entry *left, Entry *right) {
+    if (left == nullptr)
+        return right;
+    if (right == nullptr)
+        return left;
+    if (left->priority > right->priority) {
+        left->right = merge(left->right, right);
+        pull(left);
+        return left;
+    }
+    right->left = merge(left, right->left);
+    pull(right);
+    return right;
+}
+
+void MrCache::treeInsert(Entry *entry) {
+    seed_ = seed_ * 1664525u + 1013904223u;
+    entry->priority = seed_;
+    entry->left = entry->right = nullptr;
+    pull(entry);
+    Entry *left, *right;
+    split(root_, entry->start, entry->seq, &left, &right);
+    root_ = merge(merge(left, entry), right);
+}
+
+void MrCache::treeErase(Entry *entry) {
+    Entry *left, *middle, *right;
+    split(root_, entry->start, entry->seq, &left, &middle);
+    split(middle, entry->start, entry->seq + 1, &middle, &right);
+    CHECK(middle == entry) << "MR cache interval tree is corrupted";
+    root_ = merge(left, right);
+}
+
+/* 找一个完整覆盖 [start, end) 的区间：只有起始地址不大于 start 的节点可能覆盖 */
+MrCache::Entry *MrCache::findCovering(Entry *node, uintptr_t start, uintptr_t end) const {
+    while (node != nullptr && node->maxEnd >= end) {
+        if (node->left && node->left->maxEnd >= end) {
+            Entry *found = findCovering(node->left, start, end);
+            if (found)
+                return found;
+        }
+        if (node->start > start)
+            return nullptr;
+        if (node->end >= end)
+            return node;
+        node = node->right;
+    }
+    return nullptr;
+}
+
+void MrCache::collectOverlapping(Entry *node, uintptr_t start, uintptr_t end,
+                                 std::list<Entry *> &out) const {
+    if (node == nullptr || node->maxEnd <= start)
+        return;
+    collectOverlapping(node->left, start, end, out);
+    if (node->start < end && node->end > start)
+        out.push_back(node);
+    if (node->start < end)
+        collectOverlapping(node->right, start, end, out);
+}
+
+/* 从区间树和 LRU 中移除，仍在使用的 MR 延迟到最后一次 release 时注销 */
+void MrCache::remove(Entry *entry) {
+    treeErase(entry);
+    lru_.erase(entry->lru);
+    entries_--;
+    if (entry->refs > 0) {
+        entry->stale = true;
+        return;
+    }
+    pinnedBytes_ -= entry->end - entry->start;
+    byMr_.erase(entry->mr);
+    ibv_dereg_mr(entry->mr);
+    delete entry;
+}
+
+void MrCache::evict() {
+    auto it = lru_.end();
+    while (pinnedBytes_ > budget_ && it != lru_.begin()) {
+        Entry *entry = *--it;
+        if (entry->refs > 0)
+            continue;
+        it = std::next(it);
+        remove(entry);
+        evictions_++;
+    }
+}
+
+/**
+ * @brief 取得覆盖 [addr, addr + length) 的 MR，未命中时按页对齐注册并缓存。
+ *
+ * 返回的 MR 在 release 之前不会被淘汰；区间被 munmap 时仍会从缓存移除，
+ * 但注销推迟到 release，调用者须保证使用期间不解除映射。
+ *
+ * @param addr 缓冲区起始地址。
+ * @param length 缓冲区长度。
+ * @return 覆盖该缓冲区的 MR，lkey/rkey 可直接用于 WR。
+ */
+ibv_mr *MrCache::acquire(void *addr, size_t length) {
+    CacheScope scope;
+    uintptr_t start = (uintptr_t)addr;
+    uintptr_t end = start + std::max<size_t>(length, 1);
+    std::lock_guard<std::mutex> lock(mutex_);
+    Entry *entry = findCovering(root_, start, end);
+    if (entry != nullptr) {
+        hits_++;
+        lru_.splice(lru_.begin(), lru_, entry->lru);
+        entry->refs++;
+        return entry->mr;
+    }
+    misses_++;
+    uintptr_t page = sysconf(_SC_PAGESIZE);
+    uintptr_t alignedStart = start & ~(page - 1);
+    uintptr_t alignedEnd = (end + page - 1) & ~(page - 1);
+    ibv_mr *mr = ibv_reg_mr(context_->pd(), (void *)alignedStart, alignedEnd - alignedStart,
+                            access_);
+    CHECK(mr) << "Failed to register " << alignedEnd - alignedStart << " bytes at "
+              << (void *)alignedStart;
+    entry = new Entry();
+    entry->start = alignedStart;
+    entry->end = alignedEnd;
+    entry->seq = nextSeq_++;
+    entry->mr = mr;
+    entry->refs = 1;
+    entry->stale = false;
+    treeInsert(entry);
+    lru_.push_front(entry);
+    entry->lru = lru_.begin();
+    byMr_[mr] = entry;
+    entries_++;
+    pinnedBytes_ += alignedEnd - alignedStart;
+    evict();
+    return mr;
+}
+
+void MrCache::release(ibv_mr *mr) {
+    CacheScope scope;
+    std::lock_guard<std::mutex> lock(mutex_);
+    Entry *entry = byMr_.at(mr);
+    CHECK(entry->refs > 0) << "MR released more times than acquired";
+    if (--entry->refs > 0)
+        return;
+    if (entry->stale) {
+        pinnedBytes_ -= entry->end - entry->start;
+        byMr_.erase(mr);
+        ibv_dereg_mr(mr);
+        delete entry;
+        return;
+    }
+    evict();
+}
+
+/**
+ * @brief 使与 [addr, addr + length) 重叠的缓存 MR 失效。
+ *
+ * @param addr 区间起始地址。
+ * @param length 区间长度。
+ */
+void MrCache::invalidate(const void *addr, size_t length) {
+    uintptr_t start = (uintptr_t)addr;
+    CacheScope scope;
+    std::lock_guard<std::mutex> lock(mutex_);
+    std::list<Entry *> overlapping;
+    collectOverlapping(root_, start, start + length, overlapping);
+    for (Entry *entry : overlapping) {
+        remove(entry);
+        invalidations_++;
+    }
+}
@@ -0,0 +1,91 @@
+#pragma once
+#include "rdma_context.h"
+#include <cstddef>
+#include <cstdint>
+#include <list>
+#include <mutex>
+#include <unordered_map>
+
+/* 已注册内存缓存：按地址区间缓存 MR，用户每次传入的缓冲区只要落在某个已缓存的 MR 内
+ * 就直接复用，不再调用 ibv_reg_mr。区间存放在按起始地址排序、以子树最大结束地址
+ * 增强的区间树（treap）中，按子树最大结束地址剪枝，查询只访问可能重叠的节点。
+ *
+ * 钉住的内存超过预算时按 LRU 注销未被使用的 MR。munmap/mremap 以及带 MAP_FIXED 的
+ * mmap 经由库内的符号拦截通知所有缓存，使覆盖被解除或替换映射区间的 MR 失效。
+ * 这些拦截函数由库导出，对整个进程生效：链接本库后进程内所有经由符号表的映射调用
+ * 都先经过它们，没有存活的缓存时只多一次原子读。
+ *
+ * glibc free 内部的 munmap 不经过符号表。默认情况下调用者须保证缓冲区在缓存期间
+ * 不被归还系统，或在 free 之前调用 invalidate；其它自行 munmap 的分配器同样如此。
+ * 构造时传入 leavePinned 则与 MPI 的 leave_pinned 做法相同，通过 mallopt 关闭
+ * glibc 的 mmap 分配和堆收缩，使 free 之后内存仍然映射。该设置作用于整个进程：
+ * 大块分配改走 brk，RSS 不再回落，宿主程序自己的分配器也受影响。最后一个
+ * leavePinned 缓存销毁时恢复这两个参数；glibc 没有读取参数的接口，恢复的是
+ * glibc 默认值或 MALLOC_MMAP_MAX_/MALLOC_TRIM_THRESHOLD_ 环境变量给出的值，
+ * 且 mmap 阈值不再随 free 动态调整。 */
+class MrCache
+{
+public:
+    MrCache(RdmaContext &context, size_t budgetBytes, int access = RDMA_DEFAULT_ACCESS,
+            bool leavePinned = false);
+    ~MrCache();
+    MrCache(const MrCache &) = delete;
+    MrCache &operator=(const MrCache &) = delete;
+
+    ibv_mr *acquire(void *addr, size_t length);
+    void release(ibv_mr *mr);
+    void invalidate(const void *addr, size_t length);
+
+    uint64_t hits() const { return hits_; }
+    uint64_t misses() const { return misses_; }
+    uint64_t evictions() const { return evictions_; }
+    uint64_t invalidations() const { return invalidations_; }
+    size_t pinnedBytes() const { return pinnedBytes_; }
+    size_t entries() const { return entries_; }
+
+private:
+    struct Entry
+    {
+        uintptr_t start;
+        uintptr_t end;
+        /* 子树中最大的 end，用于剪枝 */
+        uintptr_t maxEnd;
+        uint64_t seq;
+        uint32_t priority;
+        Entry *left;
+        Entry *right;
+        ibv_mr *mr;
+        int refs;
+        /* 已从区间树中移除但仍被使用，最后一次 release 时注销 */
+        bool stale;
+        std::list<Entry *>::iterator lru;
+    };
+
+    static void pull(Entry *node);
+    static void split(Entry *node, uintptr_t start, uint64_t seq, Entry **left, Entry **right);
+    static Entry *merge(Entry *left, Entry *right);
+    void treeInsert(Entry *entry);
+    void treeErase(Entry *entry);
+    Entry *findCovering(Entry *node, uintptr_t start, uintptr_t end) const;
+    void collectOverlapping(Entry *node, uintptr_t start, uintptr_t end, std::list<Entry *> &out) const;
+    void remove(Entry *entry);
+    void evict();
+
+    RdmaContext *context_;
+    size_t budget_;
+    int access_;
+    bool leavePinned_;
+    std::mutex mutex_;
+    Entry *root_;
+    /* 队首为最近使用 */
+    std::list<Entry *> lru_;
+    std::unordered_map<ibv_mr *, Entry *> byMr_;
+    uint64_t nextSeq_;
+    uint32_t seed_;
+    uint64_t hits_;
+    uint64_t misses_;
+    uint64_t evictions_;
+    uint64_t invalidations_;
+    size_t pinnedBytes_;
+    size_t entries_;
+};
@@ -1,25 +1,621 @@
 #include "proxy.h"
 #include "common.h"
-#define PROXYARGS_ALLOCATE_SIZE 32
+#include "proxy_pool.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <linux/futex.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/syscall.h>
+#define PROXY_STEAL_INTERVAL_NS 1000000L
+#define PROXY_DEFAULT_SPIN_ROUNDS 1000
+#define PROXY_DEFAULT_YIELD_ROUNDS 100
+#define PROXY_DEFAULT_BLOCK_TIMEOUT_MS 100
+#define PROXY_REQUEST_DONE 1u
+#define PROXY_REQUEST_WAITING 2u
+#define PROXY_REQUEST_SPIN 128
+#define PROXY_CQ_POLL_BATCH 64
+
+/* WaitAny 使用的全局完成序号及其等待者数量，ProxyRequest 可能来自不同的 handler */
+static std::atomic<uint32_t> anyCompletionSeq(0);
+static std::atomic<int> anyWaiters(0);
+
+static inline void futexWait(void* addr, uint32_t value) {
+    syscall(SYS_futex, addr, FUTEX_WAIT_PRIVATE, value, NULL, NULL, 0);
+}
+
+static inline void futexWakeAll(void* addr) {
+    syscall(SYS_futex, addr, FUTEX_WAKE_PRIVATE, INT_MAX, NULL, NULL, 0);
+}
+
+/**
+ * @brief 将任务压入 handler 的无锁提交队列。
+ * @ingroup ProxyModule
+ *
+ * @param handler 指向 ProxyHandler 结构体的指针。
+ * @param args 指向 ProxyArgs 结构体的指针。
+ */
+static void submitPush(ProxyHandler* handler, ProxyArgs* args) {
+    ProxyArgs* head = handler->submitHead.load(std::memory_order_relaxed);
+    do {
+        args->submitNext = head;
+    } while (!handler->submitHead.compare_exchange_weak(head, args));
+}
+
+/**
+ * @brief 若代理线程正在休眠或阻塞在 CQ 上，则唤醒它。
+ * @ingroup ProxyModule
+ *
+ * @param handler 指向 ProxyHandler 结构体的指针。
+ */
+static void proxyWake(ProxyHandler* handler) {
+    if (handler->blocking.load()) {
+        eventfd_write(handler->wakeFd, 1);
+        return;
+    }
+    if (!handler->sleeping.load())
+        return;
+    pthread_mutex_lock(&handler->mutex);
+    if (handler->submitHead.load() != NULL) {
+        handler->stop = false;
+        pthread_cond_signal(&handler->cond);
+    }
+    pthread_mutex_unlock(&handler->mutex);
+}
+
+/**
+ * @brief 记录一次窃取完成，统计迁移延迟。
+ * @ingroup ProxyModule
+ *
+ * @param handler 指向窃取方 ProxyHandler 结构体的指针。
+ */
+static void recordSteal(ProxyHandler* handler) {
+    uint64_t cycles = get_cycles() - handler->stealRequestTick;
+    handler->steals.store(handler->steals.load(std::memory_order_relaxed) + 1,
+                          std::memory_order_relaxed);
+    handler->migrationCycles.store(
+        handler->migrationCycles.load(std::memory_order_relaxed) + cycles,
+        std::memory_order_relaxed);
+    if (cycles > handler->maxMigrationCycles.load(std::memory_order_relaxed))
+        handler->maxMigrationCycles.store(cycles, std::memory_order_relaxed);
+    handler->stealTarget = -1;
+}
+
+/**
+ * @brief 登记任务使用的 CQ，供自适应等待时阻塞在其完成通道上。
+ * @ingroup ProxyModule
+ *
+ * 仅由代理线程调用。CQ 与完成通道按引用计数登记，完成通道的 fd 会被设为
+ * 非阻塞并加入 epoll。没有完成通道的任务会使代理线程无法阻塞。
+ *
+ * @param handler 指向 ProxyHandler 结构体的指针。
+ * @param args 指向 ProxyArgs 结构体的指针。
+ */
+static void proxyWatchCq(ProxyHandler* handler, ProxyArgs* args) {
+    if (handler->waitMode != ProxyWaitAdaptive)
+        return;
+    handler->armed = false;
+    struct ibv_cq* cq = args->endpoint.cq;
+    if (cq == NULL || cq->channel == NULL) {
+        handler->nUnblockable++;
+        return;
+    }
+    for (ProxyCqRef& ref : *handler->cqs) {
+        if (ref.cq == cq) {
+            ref.refs++;
+            return;
+        }
+    }
+    handler->cqs->push_back({cq, 1});
+    for (ProxyChannelRef& ref : *handler->channels) {
+        if (ref.channel == cq->channel) {
+            ref.refs++;
+            return;
+        }
+    }
+    int flags = fcntl(cq->channel->fd, F_GETFL);
+    fcntl(cq->channel->fd, F_SETFL, flags | O_NONBLOCK);
+    struct epoll_event event;
+    event.events = EPOLLIN;
+    event.data.ptr = cq->channel;
+    CHECK(epoll_ctl(handler->epollFd, EPOLL_CTL_ADD, cq->channel->fd, &event) == 0)
+        << "Failed to add completion channel to epoll";
+    handler->channels->push_back({cq->channel, 1});
+}
+
+/**
+ * @brief 撤销 proxyWatchCq 的登记。
+ * @ingroup ProxyModule
+ *
+ * @param handler 指向 ProxyHandler 结构体的指针。
+ * @param args 指向 ProxyArgs 结构体的指针。
+ */
+static void proxyUnwatchCq(ProxyHandler* handler, ProxyArgs* args) {
+    if (handler->waitMode != ProxyWaitAdaptive)
+        return;
+    struct ibv_cq* cq = args->endpoint.cq;
+    if (cq == NULL || cq->channel == NULL) {
+        handler->nUnblockable--;
+        return;
+    }
+    std::vector<ProxyCqRef>& cqs = *handler->cqs;
+    for (size_t i = 0; i < cqs.size(); i++) {
+        if (cqs[i].cq == cq) {
+            if (--cqs[i].refs > 0)
+                return;
+            cqs[i] = cqs.back();
+            cqs.pop_back();
+            break;
+        }
+    }
+    std::vector<ProxyChannelRef>& channels = *handler->channels;
+    for (size_t i = 0; i < channels.size(); i++) {
+        if (channels[i].channel == cq->channel) {
+            if (--channels[i].refs > 0)
+                return;
+            epoll_ctl(handler->epollFd, EPOLL_CTL_DEL, cq->channel->fd, NULL);
+            channels[i] = channels.back();
+            channels.pop_back();
+            return;
+        }
+    }
+}
+
+/**
+ * @brief 登记任务的 CQ 参与集中轮询。
+ * @ingroup ProxyModule
+ *
+ * @param handler 指向 ProxyHandler 结构体的指针。
+ * @param args 指向 ProxyArgs 结构体的指针。
+ */
+static void proxySweepAdd(ProxyHandler* handler, ProxyArgs* args) {
+    if (args->complete == NULL)
+        return;
+    CHECK(args->endpoint.cq != NULL) << "CQ-centric op needs endpoint.cq";
+    for (ProxyCqRef& ref : *handler->sweepCqs) {
+        if (ref.cq == args->endpoint.cq) {
+            ref.refs++;
+            return;
+        }
+    }
+    handler->sweepCqs->push_back({args->endpoint.cq, 1});
+}
+
+/**
+ * @brief 撤销 proxySweepAdd 的登记，最后一个引用撤销后不再轮询该 CQ。
+ * @ingroup ProxyModule
+ *
+ * @param handler 指向 ProxyHandler 结构体的指针。
+ * @param args 指向 ProxyArgs 结构体的指针。
+ */
+static void proxySweepRemove(ProxyHandler* handler, ProxyArgs* args) {
+    if (args->complete == NULL)
+        return;
+    std::vector<ProxyCqRef>& cqs = *handler->sweepCqs;
+    for (size_t i = 0; i < cqs.size(); i++) {
+        if (cqs[i].cq == args->endpoint.cq) {
+            if (--cqs[i].refs == 0) {
+                cqs[i] = cqs.back();
+                cqs.pop_back();
+            }
+            return;
+        }
+    }
+}
+
+/**
+ * @brief 对集中轮询的 CQ 各批量轮询一次，并按 wr_id 分发完成事件。
+ * @ingroup ProxyModule
+ *
+ * 多个 channel 共享一个 CQ 时，一次 ibv_poll_cq 即可取回所有任务的完成事件，
+ * 而不是每个任务各轮询一次。
+ *
+ * @param handler 指向 ProxyHandler 结构体的指针。
+ * @return 本次分发的完成事件数。
+ */
+static int proxySweepCqs(ProxyHandler* handler) {
+    struct ibv_wc wcs[PROXY_CQ_POLL_BATCH];
+    int total = 0;
+    std::vector<ProxyCqRef>& cqs = *handler->sweepCqs;
+    for (size_t i = 0; i < cqs.size(); i++) {
+        int n = ibv_poll_cq(cqs[i].cq, PROXY_CQ_POLL_BATCH, wcs);
+        CHECK(n >= 0) << "Failed to poll CQ";
+        if (n > 0)
+            PROXY_TRACE(ProxyTracePollCq, cqs[i].cq, n);
+        for (int k = 0; k < n; k++) {
+            ProxyArgs* owner = ProxyWrIdArgs(wcs[k].wr_id);
+            CHECK(owner != NULL) << "Completion on a swept CQ without ProxyWrId";
+            owner->complete(owner, &wcs[k]);
+        }
+        total += n;
+    }
+    handler->sweepPolls += cqs.size();
+    handler->sweepCompletions += total;
+    return total;
+}
+
+/**
+ * @brief 将任务挂入代理线程私有的环形任务链表。
+ * @ingroup ProxyModule
+ *
+ * 仅由代理线程调用。若该 channel 没有正在执行的任务，则作为新的 channel
+ * 插入环形链表；否则通过 nextPeer 追加到该 channel 的尾部。
+ * 被窃取来的 channel 链直接作为新的 channel 插入；属于已让出 channel 的
+ * 任务会转发给该 channel 当前所属的 shard。
+ *
+ * @param handler 指向 ProxyHandler 结构体的指针。
+ * @param args 指向要挂入的 ProxyArgs 结构体的指针。
+ */
+static void linkArgs(ProxyHandler* handler, ProxyArgs* args) {
+    if (args->migrated) {
+        /* 只有 channel 的归属 shard 会让出它，窃取方不是归属 shard，没有它的转发记录 */
+        args->migrated = false;
+        if (handler->ops == NULL) {
+            args->next = args;
+            handler->ops = args;
+        } else {
+            args->next = handler->ops->next;
+            handler->ops->next = args;
+        }
+        handler->nChannels.store(handler->nChannels.load(std::memory_order_relaxed) + 1,
+                                 std::memory_order_relaxed);
+        for (ProxyArgs* peer = args; peer != NULL; peer = peer->nextPeer)
+            proxyWatchCq(handler, peer);
+        recordSteal(handler);
+        PROXY_TRACE(ProxyTraceSteal, args, handler->shardId);
+        return;
+    }
+    if (handler->forward != NULL && !handler->forward->empty()) {
+        auto it = handler->forward->find(args->proxyTail);
+        if (it != handler->forward->end()) {
+            ProxyHandler* owner = &handler->engine->shards[it->second];
+            submitPush(owner, args);
+            proxyWake(owner);
+            return;
+        }
+    }
+    proxyWatchCq(handler, args);
+    proxySweepAdd(handler, args);
+    if (*args->proxyTail == NULL) {
+        if (handler->ops == NULL) {
+            args->next = args;
+            handler->ops = args;
+        } else {
+            args->next = handler->ops->next;
+            handler->ops->next = args;
+        }
+        *args->proxyTail = args;
+        handler->nChannels.store(handler->nChannels.load(std::memory_order_relaxed) + 1,
+                                 std::memory_order_relaxed);
+    } else {
+        (*args->proxyTail)->nextPeer = args;
+        *args->proxyTail = args;
+    }
+}
+
+/**
+ * @brief 摘取提交队列中的全部任务并挂入私有任务链表。
+ * @ingroup ProxyModule
+ *
+ * 提交队列是一个无锁栈，一次 exchange 即可整体取走；逆序后按提交顺序挂入，
+ * 从而保证同一 channel 内任务的先后顺序。
+ *
+ * @param handler 指向 ProxyHandler 结构体的指针。
+ */
+static void drainSubmitQueue(ProxyHandler* handler) {
+    if (handler->submitHead.load(std::memory_order_relaxed) == NULL)
+        return;
+    ProxyArgs* list =
+        handler->submitHead.exchange(NULL, std::memory_order_acquire);
+    ProxyArgs* fifo = NULL;
+    while (list != NULL) {
+        ProxyArgs* next = list->submitNext;
+        list->submitNext = fifo;
+        fifo = list;
+        list = next;
+    }
+    while (fifo != NULL) {
+        ProxyArgs* next = fifo->submitNext;
+        fifo->submitNext = NULL;
+        linkArgs(handler, fifo);
+        fifo = next;
+    }
+}
+
+/**
+ * @brief 回收已完成的任务。
+ * @ingroup ProxyModule
+ *
+ * 仅由代理线程调用，将任务归还到分配它的对象池中本线程的 magazine，
+ * 并将任务的完成句柄置为完成、唤醒等待者。
+ *
+ * @param handler 指向 ProxyHandler 结构体的指针。
+ * @param args 指向已完成的 ProxyArgs 结构体的指针。
+ */
+static void freeArgs(ProxyHandler* handler, ProxyArgs* args) {
+    proxyUnwatchCq(handler, args);
+    proxySweepRemove(handler, args);
+    PROXY_TRACE(ProxyTraceComplete, args, handler->shardId);
+    ProxyRequest* request = args->request;
+    ProxyPoolFree(args->pool, args);
+    if (request != NULL) {
+        /* exchange 之后调用者可能已释放 request，只能再把地址交给 futex */
+        if (request->state.exchange(PROXY_REQUEST_DONE) & PROXY_REQUEST_WAITING)
+            futexWakeAll(&request->state);
+        if (anyWaiters.load() != 0) {
+            anyCompletionSeq.fetch_add(1);
+            futexWakeAll(&anyCompletionSeq);
+        }
+    }
+    ProxyCounter* active = handler->activeOps;
+    if (active->value.fetch_sub(1) == 1 && active->waiters.load() != 0)
+        futexWakeAll(&active->value);
+}
+
+/**
+ * @brief 阻塞等待计数器归零。
+ * @ingroup ProxyModule
+ *
+ * @param counter 指向 ProxyCounter 结构体的指针。
+ */
+static void counterWaitZero(ProxyCounter* counter) {
+    int value = counter->value.load(std::memory_order_acquire);
+    if (value == 0)
+        return;
+    counter->waiters.fetch_add(1);
+    while ((value = counter->value.load()) != 0)
+        futexWait(&counter->value, (uint32_t)value);
+    counter->waiters.fetch_sub(1, std::memory_order_relaxed);
+}
+
+/**
+ * @brief 判断一条 channel 链能否让给其它 shard。
+ * @ingroup ProxyModule
+ *
+ * 任务总是提交到 channel 的归属 shard，由它按转发记录送往当前所在的 shard。
+ * 只有归属 shard 让出 channel 时，转发只有一跳，经同一个提交队列先后到达，
+ * 顺序不变；若已迁出的 channel 再次迁移（包括迁回归属 shard），之前转发的任务
+ * 可能还在途中，会落到之后提交的任务后面。因此迁出后的 channel 不再迁移。
+ *
+ * @param handler 指向 ProxyHandler 结构体的指针。
+ * @param chain channel 链的头部。
+ * @return 可以让出时返回 true。
+ */
+static bool proxyDonatable(ProxyHandler* handler, ProxyArgs* chain) {
+    if (ProxyEngineShard(handler->engine, chain->proxyTail) != handler->shardId)
+        return false;
+    /* 集中轮询的任务由本线程分发完成事件，SRQ 只能由一个线程补充，都不能让出 */
+    for (ProxyArgs* peer = chain; peer != NULL; peer = peer->nextPeer) {
+        if (peer->complete != NULL || peer->endpoint.srq != NULL)
+            return false;
+    }
+    return true;
+}
+
+/**
+ * @brief 响应其它 shard 的窃取请求。
+ * @ingroup ProxyModule
+ *
+ * 仅在一轮开始时由代理线程调用，此时 handler->ops 为当前位置。若本 shard
+ * 至少有两个 channel，则从 handler->ops 之后找到第一条可让出的 channel 链，
+ * 摘下交给窃取方，并记录转发关系，之后提交到本 shard 的该 channel 任务都会被转发。
+ * 没有可让出的链时请求留待之后或由窃取方撤回。
+ *
+ * @param handler 指向 ProxyHandler 结构体的指针。
+ */
+static void serveStealRequest(ProxyHandler* handler) {
+    int thief = handler->stealRequest.load(std::memory_order_relaxed);
+    if (thief < 0 || handler->nChannels.load(std::memory_order_relaxed) < 2)
+        return;
+    ProxyArgs* prev = handler->ops;
+    ProxyArgs* chain = prev->next;
+    while (!proxyDonatable(handler, chain)) {
+        prev = chain;
+        chain = chain->next;
+        if (chain == handler->ops)
+            return;
+    }
+    if (!handler->stealRequest.compare_exchange_strong(thief, -1))
+        return;
+    prev->next = chain->next;
+    handler->nChannels.store(handler->nChannels.load(std::memory_order_relaxed) - 1,
+                             std::memory_order_relaxed);
+    if (handler->forward == NULL)
+        handler->forward = new std::unordered_map<ProxyArgs**, int>();
+    (*handler->forward)[chain->proxyTail] = thief;
+    for (ProxyArgs* peer = chain; peer != NULL; peer = peer->nextPeer)
+        proxyUnwatchCq(handler, peer);
+    chain->next = NULL;
+    chain->migrated = true;
+    handler->donations.store(handler->donations.load(std::memory_order_relaxed) + 1,
+                             std::memory_order_relaxed);
+    ProxyHandler* target = &handler->engine->shards[thief];
+    submitPush(target, chain);
+    proxyWake(target);
+}
+
+/**
+ * @brief 取消本 shard 尚未被响应的窃取请求。
+ * @ingroup ProxyModule
+ *
+ * @param handler 指向 ProxyHandler 结构体的指针。
+ * @return 没有在途的 channel 链时返回 true；若被窃取者已接受请求，
+ *         channel 链即将到达，返回 false。
+ */
+static bool cancelSteal(ProxyHandler* handler) {
+    if (handler->stealTarget < 0)
+        return true;
+    int expected = handler->shardId;
+    if (handler->engine->shards[handler->stealTarget].stealRequest.compare_exchange_strong(
+            expected, -1)) {
+        handler->stealTarget = -1;
+        return true;
+    }
+    return false;
+}
+
+/**
+ * @brief 空闲时向最繁忙的 shard 发起窃取请求。
+ * @ingroup ProxyModule
+ *
+ * 每个 shard 同时最多有一个未完成的请求；若已有请求仍未被响应而出现了
+ * 更繁忙的 shard，则改投该 shard。
+ *
+ * @param handler 指向 ProxyHandler 结构体的指针。
+ */
+static void requestSteal(ProxyHandler* handler) {
+    ProxyEngine* engine = handler->engine;
+    if (engine == NULL || !engine->workStealing || engine->nThreads < 2)
+        return;
+    int victim = -1;
+    int most = 0;
+    for (int i = 0; i < engine->nThreads; i++) {
+        if (i == handler->shardId)
+            continue;
+        int n = engine->shards[i].nChannels.load(std::memory_order_relaxed);
+        if (n > most) {
+            most = n;
+            victim = i;
+        }
+    }
+    if (victim < 0 || victim == handler->stealTarget)
+        return;
+    if (!cancelSteal(handler))
+        return;
+    int expected = -1;
+    if (engine->shards[victim].stealRequest.compare_exchange_strong(expected,
+                                                                     handler->shardId)) {
+        handler->stealTarget = victim;
+        handler->stealRequestTick = get_cycles();
+    }
+}
+
+/**
+ * @brief 代理线程在没有任务时休眠。
+ * @ingroup ProxyModule
+ *
+ * 先置位 sleeping 再检查提交队列，与 ProxyStart 中先提交再检查 sleeping
+ * 的顺序相配合，保证不会丢失唤醒。开启工作窃取时使用定时等待。
+ *
+ * @param handler 指向 ProxyHandler 结构体的指针。
+ * @return 收到停止请求且没有待处理任务时返回 true。
+ */
+static bool proxySleep(ProxyHandler* handler) {
+    bool stop;
+    pthread_mutex_lock(&handler->mutex);
+    handler->sleeping.store(true);
+    if (handler->submitHead.load() == NULL && !handler->stop) {
+        PROXY_TRACE(ProxyTraceSleep, NULL, handler->shardId);
+        if (handler->engine != NULL && handler->engine->workStealing) {
+            /* 窃取模式下定期醒来重新挑选被窃取者 */
+            struct timespec deadline;
+            clock_gettime(CLOCK_REALTIME, &deadline);
+            deadline.tv_nsec += PROXY_STEAL_INTERVAL_NS;
+            if (deadline.tv_nsec >= 1000000000L) {
+                deadline.tv_sec += 1;
+                deadline.tv_nsec -= 1000000000L;
+            }
+            pthread_cond_timedwait(&handler->cond, &handler->mutex, &deadline);
+        } else {
+            pthread_cond_wait(&handler->cond, &handler->mutex);
+        }
+    }
+    handler->sleeping.store(false, std::memory_order_relaxed);
+    stop = handler->stop && handler->submitHead.load() == NULL;
+    pthread_mutex_unlock(&handler->mutex);
+    return stop;
+}
+
+/**
+ * @brief 对所有登记的 CQ 请求完成通知。
+ * @ingroup ProxyModule
+ *
+ * 请求通知之前已到达的完成不会产生事件，因此请求后还要再执行一整轮推进，
+ * 该轮仍然空闲才能阻塞，此时之前的完成已被消费，之后的完成都会产生事件。
+ *
+ * @param handler 指向 ProxyHandler 结构体的指针。
+ */
+static void proxyArm(ProxyHandler* handler) {
+    for (ProxyCqRef& ref : *handler->cqs)
+        ibv_req_notify_cq(ref.cq, 0);
+    handler->armed = true;
+}
 
 /**
- * @struct ProxyPool
+ * @brief 阻塞在所有完成通道和唤醒 eventfd 上，直到有完成、新任务或超时。
  * @ingroup ProxyModule
- * @brief 用于管理 ProxyArgs 对象池的结构体。
+ *
+ * @param handler 指向 ProxyHandler 结构体的指针。
  */
-struct ProxyPool {
-    /** 指向下一个 ProxyPool 的指针 */
-    struct ProxyPool* next;
-    /** 存储 ProxyArgs 对象的数组 */
-    struct ProxyArgs elems[PROXYARGS_ALLOCATE_SIZE];
-};
+static void proxyBlock(ProxyHandler* handler) {
+    struct epoll_event events[16];
+    handler->armed = false;
+    handler->blocking.store(true);
+    if (handler->submitHead.load() != NULL || *handler->abortFlag) {
+        handler->blocking.store(false, std::memory_order_relaxed);
+        return;
+    }
+    PROXY_TRACE(ProxyTraceBlock, NULL, handler->shardId);
+    int n = epoll_wait(handler->epollFd, events, 16, handler->blockTimeoutMs);
+    handler->blocking.store(false, std::memory_order_relaxed);
+    handler->blocks++;
+    for (int i = 0; i < n; i++) {
+        if (events[i].data.ptr == NULL) {
+            eventfd_t value;
+            eventfd_read(handler->wakeFd, &value);
+            continue;
+        }
+        struct ibv_comp_channel* channel = (struct ibv_comp_channel*)events[i].data.ptr;
+        struct ibv_cq* cq;
+        void* cqContext;
+        while (ibv_get_cq_event(channel, &cq, &cqContext) == 0)
+            ibv_ack_cq_events(cq, 1);
+    }
+}
+
+/**
+ * @brief 一整轮推进都空闲时的处理。
+ * @ingroup ProxyModule
+ *
+ * ProxyWaitYield 模式下每 10 轮让出一次 CPU。ProxyWaitAdaptive 模式下先自旋
+ * spinRounds 轮，再 sched_yield yieldRounds 轮，然后请求 CQ 通知并在下一个
+ * 空闲轮阻塞；若有任务的 CQ 没有完成通道，则一直停留在 sched_yield 阶段。
+ *
+ * @param handler 指向 ProxyHandler 结构体的指针。
+ * @param idleSpin 连续空闲轮数。
+ */
+static void proxyIdle(ProxyHandler* handler, int* idleSpin) {
+    if (handler->waitMode != ProxyWaitAdaptive) {
+        if (++(*idleSpin) == 10) {
+            sched_yield();
+            *idleSpin = 0;
+        }
+        return;
+    }
+    if (handler->armed) {
+        proxyBlock(handler);
+        *idleSpin = 0;
+        return;
+    }
+    ++(*idleSpin);
+    if (*idleSpin >= handler->spinRounds + handler->yieldRounds &&
+        handler->nUnblockable == 0 && !handler->cqs->empty()) {
+        proxyArm(handler);
+    } else if (*idleSpin >= handler->spinRounds) {
+        sched_yield();
+    }
+}
 
 /**
  * @brief 代理执行线程的主函数。
  * @ingroup ProxyModule
  *
- * 该函数会不断轮询任务队列，执行队列中的任务。当队列为空时，线程会休眠，直到被唤醒。
- * 若所有任务都处于等待状态且超过一定轮询次数，线程会主动放弃 CPU 使用权。
+ * 该函数会不断轮询任务队列，执行队列中的任务。每一轮开始时摘取新提交的任务，
+ * 推进过程本身不持有任何锁。当队列为空时，线程会先尝试从其它 shard 窃取
+ * channel，然后休眠，直到被唤醒。
+ * 若所有任务都处于等待状态，按 waitMode 让出 CPU 或阻塞在 CQ 完成通道上。
  *
  * @param handler_ 指向 ProxyHandler 结构体的指针。
  * @return 始终返回 NULL。
@@ -30,28 +626,31 @@ static void* persistentThread(void* handler_) {
     int idleSpin = 0;
     ProxyArgs* op = NULL;
     while (1) {
-        do {
-            if (*handler->abortFlag)
-                return NULL;
-            if (op == NULL) {
-                pthread_mutex_lock(&handler->mutex);
-                op = handler->ops;
-                if (op == NULL) {
-                    if (handler->stop) {
-                        pthread_mutex_unlock(&handler->mutex);
-                        return NULL;
-                    }
-                    pthread_cond_wait(&handler->cond, &handler->mutex);
-                }
-                pthread_mutex_unlock(&handler->mutex);
+        if (*handler->abortFlag)
+            return NULL;
+        if (op == NULL || op == handler->ops) {
+            drainSubmitQueue(handler);
+            if (handler->ops == NULL) {
+                requestSteal(handler);
+                if (proxySleep(handler) && cancelSteal(handler))
+                    return NULL;
+                continue;
             }
-        } while (op == NULL);
+            /* 有任务可做时撤回尚未被响应的窃取请求 */
+            cancelSteal(handler);
+            if (handler->engine != NULL)
+                serveStealRequest(handler);
+            if (!handler->sweepCqs->empty() && proxySweepCqs(handler) > 0)
+                idle = 0;
+            op = handler->ops;
+        }
         op->idle = 0;
         if (op->state != ProxyOpNone) {
+            if (op->state == ProxyOpReady)
+                PROXY_TRACE(ProxyTraceStart, op, handler->shardId);
             op->progress(op);
         }
         idle &= op->idle;
-        pthread_mutex_lock(&handler->mutex);
         if (!idle)
             idleSpin = 0;
         ProxyArgs* next = op->next;
@@ -67,6 +666,8 @@ static void* persistentThread(void* handler_) {
                 }
             } else {
                 *(next->proxyTail) = NULL;
+                handler->nChannels.store(handler->nChannels.load(std::memory_order_relaxed) - 1,
+                                         std::memory_order_relaxed);
                 if (op != freeOp) {
                     next = next->next;
                     op->next = next;
@@ -76,21 +677,113 @@ static void* persistentThread(void* handler_) {
             }
             if (freeOp == handler->ops)
                 handler->ops = next;
-            freeOp->next = handler->pool;
-            handler->pool = freeOp;
+            freeArgs(handler, freeOp);
         }
         op = next;
         if (op == handler->ops) {
-            if (idle == 1) {
-                if (++idleSpin == 10) {
-                    sched_yield();
-                    idleSpin = 0;
+            if (idle == 1)
+                proxyIdle(handler, &idleSpin);
+            else
+                handler->armed = false;
+            idle = 1;
+        }
+    }
+}
+
+/**
+ * @brief 读取 NUMA 节点上的 CPU 集合。
+ * @ingroup ProxyModule
+ *
+ * 解析 /sys/devices/system/node/node<N>/cpulist，格式如 "0-15,32-47"。
+ *
+ * @param numaNode NUMA 节点编号。
+ * @param cpus 输出的 CPU 集合。
+ * @return CPU 数量，读取失败时返回 -1。
+ */
+int ProxyNumaCpus(int numaNode, cpu_set_t* cpus) {
+    char path[128];
+    snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist", numaNode);
+    FILE* file = fopen(path, "r");
+    if (file == NULL)
+        return -1;
+    CPU_ZERO(cpus);
+    int first, last, n = 0;
+    char sep;
+    while (fscanf(file, "%d", &first) == 1) {
+        last = first;
+        sep = (char)fgetc(file);
+        if (sep == '-') {
+            if (fscanf(file, "%d", &last) != 1)
+                break;
+            sep = (char)fgetc(file);
+        }
+        for (int cpu = first; cpu <= last && cpu < CPU_SETSIZE; cpu++) {
+            CPU_SET(cpu, cpus);
+            n++;
+        }
+        if (sep != ',')
+            break;
+    }
+    fclose(file);
+    return n;
+}
+
+/**
+ * @brief 按配置创建代理线程。
+ * @ingroup ProxyModule
+ *
+ * CPU 亲和性与调度策略通过线程属性在创建时生效，避免线程先在任意核心上运行。
+ * 若因权限不足无法使用 SCHED_FIFO，则退回默认调度策略重新创建。
+ *
+ * @param handler 指向 ProxyHandler 结构体的指针。
+ * @param config 线程配置，可为 NULL。
+ */
+static void proxyCreateThread(ProxyHandler* handler, const ProxyThreadConfig* config) {
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    if (config != NULL) {
+        cpu_set_t cpus;
+        int nCpus = 0;
+        CPU_ZERO(&cpus);
+        if (config->nCores > 0) {
+            for (int i = 0; i < config->nCores; i++) {
+                // CPU_SET 不检查越界，超出 cpu_set_t 的编号会写坏栈
+                if (config->cores[i] < 0 || config->cores[i] >= CPU_SETSIZE) {
+                    LOG(WARNING) << "Ignoring CPU " << config->cores[i] << " outside [0, " << CPU_SETSIZE << ")";
+                    continue;
                 }
+                CPU_SET(config->cores[i], &cpus);
+                nCpus++;
             }
-            idle = 1;
+        } else if (config->numaNode >= 0) {
+            nCpus = ProxyNumaCpus(config->numaNode, &cpus);
+            if (nCpus <= 0)
+                LOG(WARNING) << "Cannot read CPUs of NUMA node " << config->numaNode
+                             << ", proxy thread is not pinned";
+        }
+        if (nCpus > 0)
+            pthread_attr_setaffinity_np(&attr, sizeof(cpus), &cpus);
+        if (config->fifoPriority > 0) {
+            struct sched_param param;
+            param.sched_priority = config->fifoPriority;
+            pthread_attr_setinheritsched(&attr, PTHREAD_EXPLICIT_SCHED);
+            pthread_attr_setschedpolicy(&attr, SCHED_FIFO);
+            pthread_attr_setschedparam(&attr, &param);
         }
-        pthread_mutex_unlock(&handler->mutex);
     }
+    int ret = pthread_create(&handler->proxyThread, &attr, persistentThread, handler);
+    if (ret == EPERM && config != NULL && config->fifoPriority > 0) {
+        LOG(WARNING) << "No permission for SCHED_FIFO priority " << config->fifoPriority
+                     << ", proxy thread falls back to default scheduling";
+        pthread_attr_setinheritsched(&attr, PTHREAD_INHERIT_SCHED);
+        ret = pthread_create(&handler->proxyThread, &attr, persistentThread, handler);
+    }
+    CHECK(ret == 0) << "Failed to create proxy thread, ret = " << ret;
+    pthread_attr_destroy(&attr);
+    const char* name = config != NULL && config->name != NULL ? config->name : "flashreduce-px";
+    char shortName[16];
+    snprintf(shortName, sizeof(shortName), "%s", name);
+    pthread_setname_np(handler->proxyThread, shortName);
 }
 
 /**
@@ -98,17 +791,70 @@ static void* persistentThread(void* handler_) {
  * @ingroup ProxyModule
  *
  * 该函数用于初始化 ProxyHandler 结构体，并创建一个新的线程来执行
- * persistentThread 函数。
+ * persistentThread 函数。config 可指定绑定的 CPU 或 NUMA 节点、
+ * SCHED_FIFO 优先级、线程名以及空闲时的等待方式。
  *
  * @param handler 指向 ProxyHandler 结构体的指针。
+ * @param config 线程配置，NULL 表示使用默认属性。
  */
-void ProxyCreate(ProxyHandler* handler) {
+void ProxyCreate(ProxyHandler* handler, const ProxyThreadConfig* config) {
     if (!handler->proxyThread) {
         handler->stop = false;
         handler->ops = NULL;
         handler->mutex = PTHREAD_MUTEX_INITIALIZER;
         handler->cond = PTHREAD_COND_INITIALIZER;
-        pthread_create(&handler->proxyThread, NULL, persistentThread, handler);
+        handler->submitHead.store(NULL, std::memory_order_relaxed);
+        handler->sleeping.store(false, std::memory_order_relaxed);
+        handler->nActive.value.store(0, std::memory_order_relaxed);
+        handler->nActive.waiters.store(0, std::memory_order_relaxed);
+        if (handler->activeOps == NULL)
+            handler->activeOps = &handler->nActive;
+        handler->nChannels.store(0, std::memory_order_relaxed);
+        handler->stealRequest.store(-1, std::memory_order_relaxed);
+        handler->stealTarget = -1;
+        handler->forward = NULL;
+        handler->steals.store(0, std::memory_order_relaxed);
+        handler->donations.store(0, std::memory_order_relaxed);
+        handler->migrationCycles.store(0, std::memory_order_relaxed);
+        handler->maxMigrationCycles.store(0, std::memory_order_relaxed);
+        handler->argsPool = ProxyPoolCreate(config != NULL && config->hugePages);
+        if (config != NULL && config->prewarmArgs > 0)
+            ProxyPoolReserve(handler->argsPool, config->prewarmArgs);
+        handler->waitMode = config != NULL ? config->waitMode : ProxyWaitYield;
+        handler->spinRounds = config != NULL && config->spinRounds > 0
+                                  ? config->spinRounds
+                                  : PROXY_DEFAULT_SPIN_ROUNDS;
+        handler->yieldRounds = config != NULL && config->yieldRounds > 0
+                                   ? config->yieldRounds
+                                   : PROXY_DEFAULT_YIELD_ROUNDS;
+        handler->blockTimeoutMs = config != NULL && config->blockTimeoutMs > 0
+                                      ? config->blockTimeoutMs
+                                      : PROXY_DEFAULT_BLOCK_TIMEOUT_MS;
+        handler->epollFd = -1;
+        handler->wakeFd = -1;
+        handler->blocking.store(false, std::memory_order_relaxed);
+        handler->armed = false;
+        handler->nUnblockable = 0;
+        handler->cqs = NULL;
+        handler->channels = NULL;
+        handler->blocks = 0;
+        handler->sweepCqs = new std::vector<ProxyCqRef>();
+        handler->sweepPolls = 0;
+        handler->sweepCompletions = 0;
+        if (handler->waitMode == ProxyWaitAdaptive) {
+            handler->epollFd = epoll_create1(EPOLL_CLOEXEC);
+            CHECK(handler->epollFd >= 0) << "Failed to create epoll fd";
+            handler->wakeFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+            CHECK(handler->wakeFd >= 0) << "Failed to create eventfd";
+            struct epoll_event event;
+            event.events = EPOLLIN;
+            event.data.ptr = NULL;
+            CHECK(epoll_ctl(handler->epollFd, EPOLL_CTL_ADD, handler->wakeFd, &event) == 0)
+                << "Failed to add eventfd to epoll";
+            handler->cqs = new std::vector<ProxyCqRef>();
+            handler->channels = new std::vector<ProxyChannelRef>();
+        }
+        proxyCreateThread(handler, config);
     }
     LOG(INFO) << "Proxy thread created.";
 }
@@ -117,58 +863,47 @@ void ProxyCreate(ProxyHandler* handler) {
  * @brief 将任务添加到任务队列。
  * @ingroup ProxyModule
  *
- * 该函数将一个 ProxyArgs 结构体表示的任务添加到任务队列中。
+ * 该函数将一个 ProxyArgs 结构体表示的任务压入无锁提交队列，不持有任何锁。
+ * 任务由代理线程在下一轮开始时挂入任务链表。若代理线程正阻塞在 CQ 完成
+ * 通道上，则通过 eventfd 唤醒它。
  *
  * @param handler 指向 ProxyHandler 结构体的指针。
  * @param args 指向 ProxyArgs 结构体的指针，表示要添加的任务。
+ * @param request 任务完成句柄，可为 NULL；任务完成并回收后被置为完成。
  */
-void ProxyArgsAppend(ProxyHandler* handler, ProxyArgs* args) {
-    pthread_mutex_lock(&handler->mutex);
-    if (*args->proxyTail == NULL) {
-        if (handler->ops == NULL) {
-            args->next = args;
-            handler->ops = args;
-        } else {
-            args->next = handler->ops->next;
-            handler->ops->next = args;
-        }
-        *args->proxyTail = args;
-    } else {
-        (*args->proxyTail)->nextPeer = args;
-        *args->proxyTail = args;
-    }
-    pthread_mutex_unlock(&handler->mutex);
+void ProxyArgsAppend(ProxyHandler* handler, ProxyArgs* args, ProxyRequest* request) {
+    PROXY_TRACE(ProxyTraceAppend, args, 0);
+    handler->activeOps->value.fetch_add(1, std::memory_order_relaxed);
+    args->migrated = false;
+    args->request = request;
+    if (request != NULL)
+        request->state.store(0, std::memory_order_relaxed);
+    submitPush(handler, args);
+    if (handler->blocking.load())
+        eventfd_write(handler->wakeFd, 1);
 }
 
 /**
  * @brief 分配一个 ProxyArgs 结构体。
  * @ingroup ProxyModule
  *
- * 该函数从对象池中分配一个 ProxyArgs
- * 结构体，如果对象池为空，则创建一个新的对象池。
+ * 该函数从对象池中分配一个 ProxyArgs 结构体。通常只访问当前线程的
+ * magazine，不加锁；magazine 用尽时经由无锁 depot 换取，池中没有空闲对象时
+ * 才加锁新建 slab。
  *
  * @param handler 指向 ProxyHandler 结构体的指针。
  * @return 指向分配的 ProxyArgs 结构体的指针。
  */
 ProxyArgs* allocateArgs(ProxyHandler* handler) {
-    ProxyArgs* elem;
-    pthread_mutex_lock(&handler->mutex);
-    if (handler->pool == NULL) {
-        struct ProxyPool* newPool;
-        CALLOC(newPool, ProxyPool, 1);
-        ProxyArgs* newElems = newPool->elems;
-        for (int i = 0; i < PROXYARGS_ALLOCATE_SIZE; i++) {
-            if (i + 1 < PROXYARGS_ALLOCATE_SIZE)
-                newElems[i].next = newElems + i + 1;
-        }
-        handler->pool = newElems;
-        newPool->next = handler->pools;
-        handler->pools = newPool;
-    }
-    elem = handler->pool;
-    handler->pool = handler->pool->next;
-    pthread_mutex_unlock(&handler->mutex);
-    elem->next = elem->nextPeer = NULL;
+    ProxyArgs* elem = ProxyPoolAlloc(handler->argsPool);
+    elem->pool = handler->argsPool;
+    elem->next = elem->nextPeer = elem->submitNext = NULL;
+    elem->complete = NULL;
+    elem->endpoint.srq = NULL;
+    elem->endpoint.signal_interval = 0;
+    elem->endpoint.unsignaled = 0;
+    elem->endpoint.max_inline = 0;
+    elem->opaque = NULL;
     return elem;
 }
 
@@ -177,45 +912,330 @@ ProxyArgs* allocateArgs(ProxyHandler* handler) {
  * @ingroup ProxyModule
  *
  * 该函数用于唤醒处于休眠状态的代理执行线程，使其开始处理任务队列中的任务。
+ * 代理线程未休眠时不获取任何锁。
  *
  * @param handler 指向 ProxyHandler 结构体的指针。
  */
 void ProxyStart(ProxyHandler* handler) {
-    pthread_mutex_lock(&handler->mutex);
-    if (handler->ops != NULL) {
-        handler->stop = false;
-        pthread_cond_signal(&handler->cond);
-    }
-    pthread_mutex_unlock(&handler->mutex);
+    proxyWake(handler);
 }
 
 /**
- * @brief 销毁代理执行线程。
+ * @brief 通知代理线程退出并等待其结束。
  * @ingroup ProxyModule
  *
- * 该函数用于停止代理执行线程，并释放相关资源。
- *
  * @param handler 指向 ProxyHandler 结构体的指针。
  */
-void ProxyDestroy(ProxyHandler* handler) {
+static void proxyJoin(ProxyHandler* handler) {
     pthread_mutex_lock(&handler->mutex);
     handler->stop = true;
     pthread_cond_signal(&handler->cond);
     pthread_mutex_unlock(&handler->mutex);
     if (handler->proxyThread)
         pthread_join(handler->proxyThread, NULL);
-    pthread_mutex_lock(&handler->mutex);
-    while (handler->pools != NULL) {
-        struct ProxyPool* next = handler->pools->next;
-        free(handler->pools);
-        handler->pools = next;
+    if (handler->waitMode == ProxyWaitAdaptive) {
+        LOG(INFO) << "Proxy thread blocked on completion channels " << handler->blocks
+                  << " times.";
+        close(handler->epollFd);
+        close(handler->wakeFd);
+        delete handler->cqs;
+        delete handler->channels;
+        handler->cqs = NULL;
+        handler->channels = NULL;
     }
-    pthread_mutex_unlock(&handler->mutex);
+    if (handler->sweepPolls > 0)
+        LOG(INFO) << "Proxy thread swept CQs " << handler->sweepPolls << " times, "
+                  << handler->sweepCompletions << " completions.";
+    delete handler->sweepCqs;
+    handler->sweepCqs = NULL;
+}
+
+/**
+ * @brief 释放 handler 的对象池。必须在所有可能回收到该池的线程结束后调用。
+ * @ingroup ProxyModule
+ *
+ * @param handler 指向 ProxyHandler 结构体的指针。
+ */
+static void proxyFreePools(ProxyHandler* handler) {
+    delete handler->forward;
+    handler->forward = NULL;
+    ProxyPoolDestroy(handler->argsPool);
+    handler->argsPool = NULL;
+}
+
+/**
+ * @brief 销毁代理执行线程。
+ * @ingroup ProxyModule
+ *
+ * 该函数用于停止代理执行线程，并释放相关资源。
+ *
+ * @param handler 指向 ProxyHandler 结构体的指针。
+ */
+void ProxyDestroy(ProxyHandler* handler) {
+    proxyJoin(handler);
+    proxyFreePools(handler);
     LOG(INFO) << "Proxy thread destroyed.";
 }
 
+/**
+ * @brief 等待所有已提交的任务完成。
+ * @ingroup ProxyModule
+ *
+ * 在 futex 上阻塞，不占用 CPU。
+ *
+ * @param handler 指向 ProxyHandler 结构体的指针。
+ */
 void ProxyWaitAllOpFinished(ProxyHandler* handler) {
-    while (handler->ops != NULL) {
+    counterWaitZero(handler->activeOps);
+}
+
+/**
+ * @brief 创建多线程代理引擎。
+ * @ingroup ProxyModule
+ *
+ * 创建 nThreads 个代理线程，每个线程对应一个 shard。若 configs 非空，
+ * 则第 i 个线程按 configs[i] 放置和调度。调用前需设置 engine->abortFlag，
+ * 并按需设置 engine->workStealing。
+ *
+ * @param engine 指向 ProxyEngine 结构体的指针。
+ * @param nThreads 代理线程数量。
+ * @param configs 长度为 nThreads 的线程配置数组，可为 NULL。
+ */
+void ProxyEngineCreate(ProxyEngine* engine, int nThreads, const ProxyThreadConfig* configs) {
+    CHECK_GT(nThreads, 0) << "Proxy engine needs at least one thread";
+    engine->nThreads = nThreads;
+    engine->nActive.value.store(0, std::memory_order_relaxed);
+    engine->nActive.waiters.store(0, std::memory_order_relaxed);
+    engine->shards = new ProxyHandler[nThreads]();
+    for (int i = 0; i < nThreads; i++) {
+        ProxyHandler* shard = &engine->shards[i];
+        shard->abortFlag = engine->abortFlag;
+        shard->engine = engine;
+        shard->shardId = i;
+        shard->activeOps = &engine->nActive;
+        char name[16];
+        ProxyThreadConfig config = {};
+        if (configs != NULL)
+            config = configs[i];
+        if (config.name == NULL) {
+            snprintf(name, sizeof(name), "flashreduce-px%d", i);
+            config.name = name;
+        }
+        ProxyCreate(shard, &config);
+    }
+    LOG(INFO) << "Proxy engine created with " << nThreads << " threads.";
+}
+
+/**
+ * @brief 计算 channel 所属的 shard。
+ * @ingroup ProxyModule
+ *
+ * channel 以其 proxyTail 地址标识，同一 channel 的任务总是落在同一个 shard，
+ * 从而保持 channel 内的执行顺序。
+ *
+ * @param engine 指向 ProxyEngine 结构体的指针。
+ * @param proxyTail channel 的 proxyTail 指针。
+ * @return shard 下标。
+ */
+int ProxyEngineShard(ProxyEngine* engine, ProxyArgs** proxyTail) {
+    uint64_t h = (uint64_t)(uintptr_t)proxyTail;
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    return (int)(h % (uint64_t)engine->nThreads);
+}
+
+/**
+ * @brief 从 channel 所属 shard 的对象池中分配 ProxyArgs。
+ * @ingroup ProxyModule
+ *
+ * @param engine 指向 ProxyEngine 结构体的指针。
+ * @param proxyTail channel 的 proxyTail 指针，会写入返回的 ProxyArgs。
+ * @return 指向分配的 ProxyArgs 结构体的指针。
+ */
+ProxyArgs* ProxyEngineAllocateArgs(ProxyEngine* engine, ProxyArgs** proxyTail) {
+    ProxyArgs* args =
+        allocateArgs(&engine->shards[ProxyEngineShard(engine, proxyTail)]);
+    args->proxyTail = proxyTail;
+    return args;
+}
+
+/**
+ * @brief 将任务提交到其 channel 所属的 shard。
+ * @ingroup ProxyModule
+ *
+ * @param engine 指向 ProxyEngine 结构体的指针。
+ * @param args 指向 ProxyArgs 结构体的指针，proxyTail 必须已设置。
+ * @param request 任务完成句柄，可为 NULL。
+ */
+void ProxyEngineArgsAppend(ProxyEngine* engine, ProxyArgs* args, ProxyRequest* request) {
+    ProxyArgsAppend(&engine->shards[ProxyEngineShard(engine, args->proxyTail)], args,
+                    request);
+}
+
+/**
+ * @brief 唤醒所有有待处理任务的代理线程。
+ * @ingroup ProxyModule
+ *
+ * @param engine 指向 ProxyEngine 结构体的指针。
+ */
+void ProxyEngineStart(ProxyEngine* engine) {
+    for (int i = 0; i < engine->nThreads; i++)
+        ProxyStart(&engine->shards[i]);
+}
+
+/**
+ * @brief 等待所有 shard 上已提交的任务完成。
+ * @ingroup ProxyModule
+ *
+ * @param engine 指向 ProxyEngine 结构体的指针。
+ */
+void ProxyEngineWaitAllOpFinished(ProxyEngine* engine) {
+    counterWaitZero(&engine->nActive);
+}
+
+/**
+ * @brief 销毁多线程代理引擎。
+ * @ingroup ProxyModule
+ *
+ * 任务可能在 shard 之间迁移，由其它 shard 的线程归还到分配它的对象池，
+ * 因此先停止所有代理线程，再统一释放对象池。
+ *
+ * @param engine 指向 ProxyEngine 结构体的指针。
+ */
+void ProxyEngineDestroy(ProxyEngine* engine) {
+    for (int i = 0; i < engine->nThreads; i++)
+        proxyJoin(&engine->shards[i]);
+    for (int i = 0; i < engine->nThreads; i++) {
+        if (engine->workStealing) {
+            ProxyStealStats stats;
+            ProxyEngineGetStealStats(engine, i, &stats);
+            LOG(INFO) << "Proxy shard " << i << ": steals=" << stats.steals
+                      << ", donations=" << stats.donations
+                      << ", avg migration=" << stats.avgMigrationUs << " us"
+                      << ", max migration=" << stats.maxMigrationUs << " us";
+        }
+        proxyFreePools(&engine->shards[i]);
+    }
+    delete[] engine->shards;
+    engine->shards = NULL;
+    engine->nThreads = 0;
+    LOG(INFO) << "Proxy engine destroyed.";
+}
+
+/**
+ * @brief 获取某个 shard 的工作窃取统计。
+ * @ingroup ProxyModule
+ *
+ * steals 为该 shard 窃取到的 channel 链数，donations 为被其它 shard 窃取走的数量，
+ * 迁移延迟为从发出窃取请求到 channel 链挂入本 shard 的时间。
+ *
+ * @param engine 指向 ProxyEngine 结构体的指针。
+ * @param shard shard 下标。
+ * @param stats 输出统计结果。
+ */
+void ProxyEngineGetStealStats(ProxyEngine* engine, int shard, ProxyStealStats* stats) {
+    ProxyHandler* handler = &engine->shards[shard];
+    double mhz = get_cpu_mhz(0);
+    stats->steals = handler->steals.load(std::memory_order_relaxed);
+    stats->donations = handler->donations.load(std::memory_order_relaxed);
+    uint64_t cycles = handler->migrationCycles.load(std::memory_order_relaxed);
+    stats->avgMigrationUs = stats->steals ? cycles / mhz / stats->steals : 0;
+    stats->maxMigrationUs =
+        handler->maxMigrationCycles.load(std::memory_order_relaxed) / mhz;
+}
+
+/**
+ * @brief 初始化任务完成句柄。
+ * @ingroup ProxyModule
+ *
+ * 句柄在 ProxyArgsAppend 时会被重新置为未完成，因此同一个句柄可以
+ * 在上一个任务完成后重复使用。
+ *
+ * @param request 指向 ProxyRequest 结构体的指针。
+ */
+void ProxyRequestInit(ProxyRequest* request) {
+    request->state.store(0, std::memory_order_relaxed);
+}
+
+/**
+ * @brief 检查任务是否完成，不阻塞。
+ * @ingroup ProxyModule
+ *
+ * @param request 指向 ProxyRequest 结构体的指针。
+ * @return 任务已完成时返回 true。
+ */
+bool ProxyRequestTest(ProxyRequest* request) {
+    return request->state.load(std::memory_order_acquire) & PROXY_REQUEST_DONE;
+}
+
+/**
+ * @brief 等待任务完成。
+ * @ingroup ProxyModule
+ *
+ * 先短暂轮询，然后置位等待标志并在 futex 上阻塞，由代理线程回收任务时唤醒。
+ *
+ * @param request 指向 ProxyRequest 结构体的指针。
+ */
+void ProxyRequestWait(ProxyRequest* request) {
+    for (int i = 0; i < PROXY_REQUEST_SPIN; i++) {
+        if (ProxyRequestTest(request))
+            return;
+        sched_yield();
+    }
+    uint32_t state = request->state.load(std::memory_order_acquire);
+    while (!(state & PROXY_REQUEST_DONE)) {
+        if (!(state & PROXY_REQUEST_WAITING) &&
+            !request->state.compare_exchange_weak(state, state | PROXY_REQUEST_WAITING))
+            continue;
+        futexWait(&request->state, state | PROXY_REQUEST_WAITING);
+        state = request->state.load(std::memory_order_acquire);
+    }
+}
+
+/**
+ * @brief 等待一组任务中任意一个完成。
+ * @ingroup ProxyModule
+ *
+ * 多个句柄无法在同一个 futex 上等待，因此阻塞在全局完成序号上；
+ * 只有存在 WaitAny 等待者时，代理线程才会递增序号并唤醒。
+ *
+ * @param requests ProxyRequest 数组。
+ * @param n 数组长度。
+ * @return 已完成任务的下标。
+ */
+int ProxyRequestWaitAny(ProxyRequest* requests, int n) {
+    CHECK_GT(n, 0) << "ProxyRequestWaitAny needs at least one request";
+    for (int spin = 0; spin < PROXY_REQUEST_SPIN; spin++) {
+        for (int i = 0; i < n; i++) {
+            if (ProxyRequestTest(&requests[i]))
+                return i;
+        }
         sched_yield();
     }
-}
\ No newline at end of file
+    int index = -1;
+    anyWaiters.fetch_add(1);
+    while (index < 0) {
+        uint32_t seq = anyCompletionSeq.load();
+        for (int i = 0; i < n && index < 0; i++) {
+            if (ProxyRequestTest(&requests[i]))
+                index = i;
+        }
+        if (index < 0)
+            futexWait(&anyCompletionSeq, seq);
+    }
+    anyWaiters.fetch_sub(1, std::memory_order_relaxed);
+    return index;
+}
+
+/**
+ * @brief 等待一组任务全部完成。
+ * @ingroup ProxyModule
+ *
+ * @param requests ProxyRequest 数组。
+ * @param n 数组长度。
+ */
+void ProxyRequestWaitAll(ProxyRequest* requests, int n) {
+    for (int i = 0; i < n; i++)
+        ProxyRequestWait(&requests[i]);
+}
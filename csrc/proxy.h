@@ -1,8 +1,17 @@
 #pragma once
 #include "get_clock.h"
+#include "proxy_trace.h"
 #include <pthread.h>
+#include <sched.h>
+#include <atomic>
 #include <cstdint>
+#include <unordered_map>
+#include <vector>
 #include <infiniband/verbs.h>
+#define PROXY_CACHE_LINE_SIZE 64
+/* ProxyPostSendBatch 一次最多串联的 WR 数 */
+#define PROXY_MAX_SEND_BATCH 64
+class SharedReceiveQueue;
 struct RDMAEndpoint {
     struct ibv_cq* cq;
     int available_wqes;
@@ -10,6 +19,14 @@ struct RDMAEndpoint {
     struct ibv_recv_wr recv_wr;
     struct ibv_sge sge;
     struct ibv_send_wr send_wr;
+    /* 非空时接收请求由 SRQ 提供，进度函数负责补充 */
+    SharedReceiveQueue* srq;
+    /* ProxyPostSendBatch 每 signal_interval 个 WR 置一次 IBV_SEND_SIGNALED，0 或 1 表示
+     * 每个都置；unsignaled 为最近一个带信号 WR 之后已提交的不带信号 WR 数 */
+    int signal_interval;
+    int unsignaled;
+    /* QP 的内联上限（QueuePair::maxInlineData），负载不超过它的发送自动内联，0 表示不内联 */
+    uint32_t max_inline;
 };
 
 enum ProxyOpState {
@@ -17,36 +34,306 @@ enum ProxyOpState {
     ProxyOpReady,
     ProxyOpProgress,
 };
+/* 代理线程空闲时的等待方式 */
+enum ProxyWaitMode {
+    /* 每空转 10 轮调用一次 sched_yield，从不阻塞 */
+    ProxyWaitYield,
+    /* 先自旋，再 sched_yield，超过预算后在 CQ 完成通道上阻塞 */
+    ProxyWaitAdaptive,
+};
+
+struct ProxyCqRef {
+    struct ibv_cq* cq;
+    int refs;
+};
+
+struct ProxyChannelRef {
+    struct ibv_comp_channel* channel;
+    int refs;
+};
+
+/* 可被 futex 等待的计数器：waiters 非零时，计数归零会唤醒等待者 */
+struct ProxyCounter {
+    std::atomic<int> value;
+    std::atomic<int> waiters;
+};
+
+/* 任务完成句柄，由调用者持有并随 ProxyArgsAppend 提交。
+ * state 同时作为 futex 字：bit0 表示已完成，bit1 表示有线程在等待。 */
+struct ProxyRequest {
+    std::atomic<uint32_t> state;
+};
+
 struct ProxyArgs;
+struct ProxyArgsPool;
 typedef void (*proxyProgressFunc_t)(struct ProxyArgs*);
-struct ProxyArgs {
+typedef void (*proxyCompletionFunc_t)(struct ProxyArgs*, struct ibv_wc*);
+struct ProxyTask;
+typedef struct ProxyTask (*proxyCoroFunc_t)(struct ProxyArgs*);
+/* 按缓存行对齐，相邻任务的热字段不会落在同一缓存行上 */
+struct alignas(PROXY_CACHE_LINE_SIZE) ProxyArgs {
     bool idle;
     enum ProxyOpState state;
     proxyProgressFunc_t progress;
     ProxyArgs** proxyTail;
     struct ProxyArgs* next;
     struct ProxyArgs* nextPeer;
+    /* 提交队列链接，仅在 ProxyArgsAppend 与代理线程摘取之间使用 */
+    struct ProxyArgs* submitNext;
+    /* 为真表示这是被其它 shard 让出的整条 channel 链的头部 */
+    bool migrated;
+    /* 任务回收时置为完成的句柄，可为 NULL */
+    struct ProxyRequest* request;
+    /* 分配该任务的对象池。任务被窃取后由其它 shard 完成时也归还到这里 */
+    struct ProxyArgsPool* pool;
+    /* 非 NULL 时启用 CQ 集中轮询：代理线程每轮对 endpoint.cq 批量轮询一次，
+     * 按 wr_id 把完成事件分发给所属任务，progress 中不再调用 ibv_poll_cq。
+     * 该 CQ 上所有 WR 的 wr_id 都必须由 ProxyWrId 生成，且任务结束前须收齐自己的完成事件；
+     * 在 ProxyEngine 中，共享同一 CQ 的任务须属于同一个 shard。 */
+    proxyCompletionFunc_t complete;
+    /* 协程任务：coroutine 在代理线程首次推进时创建协程帧，coroFrame 为协程句柄地址，
+     * 见 proxy_coro.h */
+    proxyCoroFunc_t coroutine;
+    void* coroFrame;
     struct RDMAEndpoint endpoint;
     int iterations;
     cycles_t startTick;
     cycles_t endTick;
     int first_completion;
     int count;
+    /* 进度函数私有的任务状态，由提交者设置，代理线程不解释 */
+    void* opaque;
 };
 struct ProxyHandler {
     pthread_t proxyThread;
+    /* cond/mutex 仅用于代理线程休眠与唤醒，不在提交和推进路径上使用 */
     pthread_cond_t cond;
     pthread_mutex_t mutex;
+    /* 代理线程私有的环形任务链表，其它线程不得访问 */
     ProxyArgs* ops;
     bool stop;
     uint32_t* abortFlag;
-    struct ProxyArgs* pool;
-    struct ProxyPool* pools;
+    /* 多生产者/单消费者提交队列（无锁栈，代理线程整体摘取后逆序为 FIFO），
+     * 独占缓存行，生产者的写入不会干扰代理线程私有的字段 */
+    alignas(PROXY_CACHE_LINE_SIZE) std::atomic<ProxyArgs*> submitHead;
+    /* 代理线程是否在 cond 上休眠，生产者据此决定是否需要加锁唤醒 */
+    std::atomic<bool> sleeping;
+    /* 已提交但尚未回收的任务数；activeOps 指向实际计数，引擎内各 shard 共享一个计数 */
+    struct ProxyCounter nActive;
+    struct ProxyCounter* activeOps;
+    /* ProxyArgs 对象池，生产者分配、代理线程回收，均走各自线程的 magazine */
+    struct ProxyArgsPool* argsPool;
+    /* 以下字段仅在 ProxyEngine 中使用 */
+    struct ProxyEngine* engine;
+    int shardId;
+    /* 当前 ops 链表中的 channel 数，由本线程写，其它线程读取以挑选被窃取者 */
+    std::atomic<int> nChannels;
+    /* 向本 shard 发起窃取请求的 shard 编号，-1 表示无请求 */
+    std::atomic<int> stealRequest;
+    /* 本 shard 发出且尚未完成的窃取请求目标，-1 表示无 */
+    int stealTarget;
+    cycles_t stealRequestTick;
+    /* 已让出的 channel 及其新的所属 shard，之后提交到本 shard 的任务会被转发 */
+    std::unordered_map<ProxyArgs**, int>* forward;
+    std::atomic<uint64_t> steals;
+    std::atomic<uint64_t> donations;
+    std::atomic<uint64_t> migrationCycles;
+    std::atomic<uint64_t> maxMigrationCycles;
+    /* 自适应等待：以下字段除 blocking 外均为代理线程私有 */
+    enum ProxyWaitMode waitMode;
+    int spinRounds;
+    int yieldRounds;
+    int blockTimeoutMs;
+    int epollFd;
+    int wakeFd;
+    /* 代理线程是否阻塞在 epoll 上，生产者据此决定是否写 wakeFd */
+    std::atomic<bool> blocking;
+    /* 已对所有 CQ 调用 ibv_req_notify_cq，下一轮仍空闲即可阻塞 */
+    bool armed;
+    /* 没有完成通道、无法阻塞等待的任务数 */
+    int nUnblockable;
+    std::vector<ProxyCqRef>* cqs;
+    std::vector<ProxyChannelRef>* channels;
+    uint64_t blocks;
+    /* CQ 集中轮询的 CQ 及引用它的任务数，代理线程私有 */
+    std::vector<ProxyCqRef>* sweepCqs;
+    uint64_t sweepPolls;
+    uint64_t sweepCompletions;
+};
+
+/* 代理线程的放置与调度配置，未设置的字段保持系统默认 */
+struct ProxyThreadConfig {
+    /* 绑定的 CPU 列表，nCores 为 0 时不按 CPU 列表绑定 */
+    const int* cores;
+    int nCores;
+    /* cores 为空时绑定到该 NUMA 节点的全部 CPU，-1 表示不限制；
+     * 默认为 -1，值初始化的配置不会被绑到节点 0 */
+    int numaNode = -1;
+    /* SCHED_FIFO 优先级，0 表示使用默认调度策略 */
+    int fifoPriority;
+    /* 线程名，最长 15 个字符，NULL 使用默认名 */
+    const char* name;
+    /* 空闲等待方式，以及自适应模式下的自旋轮数、yield 轮数和单次阻塞超时，0 表示默认值 */
+    enum ProxyWaitMode waitMode;
+    int spinRounds;
+    int yieldRounds;
+    int blockTimeoutMs;
+    /* 启动时预分配的 ProxyArgs 数，以及对象池是否使用 2MB 大页 */
+    int prewarmArgs;
+    bool hugePages;
+};
+
+struct ProxyStealStats {
+    uint64_t steals;
+    uint64_t donations;
+    double avgMigrationUs;
+    double maxMigrationUs;
 };
 
-void ProxyCreate(struct ProxyHandler* handler);
+/* 多线程代理引擎：每个 shard 是一个独立的 ProxyHandler，channel 按 proxyTail 固定到某个 shard。
+ * 开启 workStealing 后，空闲的 shard 会从繁忙的 shard 窃取整条 channel 链；
+ * channel 只会从归属 shard 迁出一次，迁出后不再迁移，以保持 channel 内任务的顺序。 */
+struct ProxyEngine {
+    int nThreads;
+    struct ProxyHandler* shards;
+    uint32_t* abortFlag;
+    bool workStealing;
+    struct ProxyCounter nActive;
+};
+
+/* CQ 集中轮询模式下的 wr_id 编码：低 48 位为所属 ProxyArgs 地址，高 16 位为调用者自定义标签 */
+static inline uint64_t ProxyWrId(struct ProxyArgs* args, uint16_t tag) {
+    return ((uint64_t)tag << 48) | ((uintptr_t)args & ((1ull << 48) - 1));
+}
+
+static inline struct ProxyArgs* ProxyWrIdArgs(uint64_t wrId) {
+    return (struct ProxyArgs*)(uintptr_t)(wrId & ((1ull << 48) - 1));
+}
+
+static inline uint16_t ProxyWrIdTag(uint64_t wrId) {
+    return (uint16_t)(wrId >> 48);
+}
+
+/* 负载不超过 max_inline 的写和发送置 IBV_SEND_INLINE，由 CPU 把数据写进 WQE，
+ * 省去网卡一次 DMA 读；其余清除该标志，以便 WR 从模板复制而来时不残留 */
+static inline void ProxyInlineIfFits(struct RDMAEndpoint* endpoint, struct ibv_send_wr* wr) {
+    if (endpoint->max_inline == 0)
+        return;
+    uint32_t length = 0;
+    for (int i = 0; i < wr->num_sge; i++)
+        length += wr->sg_list[i].length;
+    bool inlinable = wr->opcode == IBV_WR_RDMA_WRITE || wr->opcode == IBV_WR_RDMA_WRITE_WITH_IMM ||
+                     wr->opcode == IBV_WR_SEND || wr->opcode == IBV_WR_SEND_WITH_IMM;
+    if (inlinable && length <= endpoint->max_inline)
+        wr->send_flags |= IBV_SEND_INLINE;
+    else
+        wr->send_flags &= ~IBV_SEND_INLINE;
+}
+
+/* 进度函数使用的 RDMA 提交与轮询，开启 FLASHREDUCE_TRACE 时记录跟踪事件 */
+static inline int ProxyPostSend(struct ProxyArgs* args, struct ibv_send_wr* wr) {
+    struct ibv_send_wr* badWr = NULL;
+    ProxyInlineIfFits(&args->endpoint, wr);
+    PROXY_TRACE(ProxyTracePostSend, args, wr->wr_id);
+    return ibv_post_send(args->endpoint.qp, wr, &badWr);
+}
+
+static inline int ProxyPostRecv(struct ProxyArgs* args, struct ibv_recv_wr* wr) {
+    struct ibv_recv_wr* badWr = NULL;
+    PROXY_TRACE(ProxyTracePostRecv, args, wr->wr_id);
+    return ibv_post_recv(args->endpoint.qp, wr, &badWr);
+}
+
+/**
+ * @brief 把 n 个 WR 用 next 串成一条链，只敲一次门铃提交。
+ * @ingroup ProxyModule
+ *
+ * 按 endpoint.signal_interval 选择性地置 IBV_SEND_SIGNALED。不带信号的 WR 没有
+ * 完成事件，它占用的 WQE 由之后第一个带信号 WR 的完成一并归还：带信号 WR 的
+ * wr_id 由 ProxyWrId 生成，标签为它归还的 WQE 数，完成时调用 ProxySendCompleted
+ * 加回 endpoint.available_wqes。wrs 中其余字段由调用者填写，wr_id 与 next 会被覆盖。
+ * signal_interval 不能超过发送队列深度，否则发送队列可能被不带信号的 WR 占满。
+ * 负载不超过 endpoint.max_inline 的 WR 自动内联。
+ *
+ * @param args 指向 ProxyArgs 结构体的指针。
+ * @param wrs 待提交的 WR 数组。
+ * @param n WR 个数，不超过 PROXY_MAX_SEND_BATCH 和 available_wqes。
+ * @param flush 非零时最后一个 WR 必定带信号，用于数据流的末尾，保证所有 WR 都能确认完成。
+ * @return ibv_post_send 的返回值。失败时 badWr 之前的 WR 已经提交，其余的未提交，
+ *         可以修正后重新提交。
+ */
+static inline int ProxyPostSendBatch(struct ProxyArgs* args, struct ibv_send_wr* wrs, int n,
+                                     int flush) {
+    struct RDMAEndpoint* endpoint = &args->endpoint;
+    int interval = endpoint->signal_interval > 1 ? endpoint->signal_interval : 1;
+    int unsignaled = endpoint->unsignaled;
+    for (int i = 0; i < n; i++) {
+        wrs[i].next = i + 1 < n ? &wrs[i + 1] : NULL;
+        ProxyInlineIfFits(endpoint, &wrs[i]);
+        unsignaled++;
+        if (unsignaled >= interval || (flush && i == n - 1)) {
+            wrs[i].send_flags |= IBV_SEND_SIGNALED;
+            wrs[i].wr_id = ProxyWrId(args, (uint16_t)unsignaled);
+            unsignaled = 0;
+        } else {
+            wrs[i].send_flags &= ~IBV_SEND_SIGNALED;
+            wrs[i].wr_id = ProxyWrId(args, 0);
+        }
+    }
+    struct ibv_send_wr* badWr = NULL;
+    PROXY_TRACE(ProxyTracePostSend, args, n);
+    int ret = ibv_post_send(endpoint->qp, wrs, &badWr);
+    if (ret == 0) {
+        endpoint->available_wqes -= n;
+        endpoint->unsignaled = unsignaled;
+        return 0;
+    }
+    /* 只有 badWr 之前的 WR 进入了发送队列，额度和不带信号的计数只按这部分更新 */
+    int posted = badWr != NULL ? (int)(badWr - wrs) : 0;
+    int last = posted - 1;
+    while (last >= 0 && !(wrs[last].send_flags & IBV_SEND_SIGNALED))
+        last--;
+    endpoint->available_wqes -= posted;
+    endpoint->unsignaled = last >= 0 ? posted - 1 - last : endpoint->unsignaled + posted;
+    return ret;
+}
+
+/* 归还一个带信号 WR 及其之前不带信号的 WR 占用的 WQE，返回归还的个数 */
+static inline int ProxySendCompleted(struct ProxyArgs* args, const struct ibv_wc* wc) {
+    int retired = ProxyWrIdTag(wc->wr_id);
+    args->endpoint.available_wqes += retired;
+    return retired;
+}
+
+static inline int ProxyPollCq(struct ProxyArgs* args, int n, struct ibv_wc* wcs) {
+    int got = ibv_poll_cq(args->endpoint.cq, n, wcs);
+    if (got > 0)
+        PROXY_TRACE(ProxyTracePollCq, args, got);
+    return got;
+}
+
+void ProxyCreate(struct ProxyHandler* handler, const struct ProxyThreadConfig* config = NULL);
 struct ProxyArgs* allocateArgs(struct ProxyHandler* handler);
-void ProxyArgsAppend(struct ProxyHandler* handler, struct ProxyArgs* args);
+void ProxyArgsAppend(struct ProxyHandler* handler, struct ProxyArgs* args,
+                     struct ProxyRequest* request = NULL);
 void ProxyStart(struct ProxyHandler* handler);
 void ProxyDestroy(struct ProxyHandler* handler);
 void ProxyWaitAllOpFinished(ProxyHandler* handler);
+int ProxyNumaCpus(int numaNode, cpu_set_t* cpus);
+
+void ProxyEngineCreate(struct ProxyEngine* engine, int nThreads,
+                       const struct ProxyThreadConfig* configs = NULL);
+int ProxyEngineShard(struct ProxyEngine* engine, ProxyArgs** proxyTail);
+struct ProxyArgs* ProxyEngineAllocateArgs(struct ProxyEngine* engine, ProxyArgs** proxyTail);
+void ProxyEngineArgsAppend(struct ProxyEngine* engine, struct ProxyArgs* args,
+                           struct ProxyRequest* request = NULL);
+void ProxyEngineStart(struct ProxyEngine* engine);
+void ProxyEngineWaitAllOpFinished(struct ProxyEngine* engine);
+void ProxyEngineDestroy(struct ProxyEngine* engine);
+void ProxyEngineGetStealStats(struct ProxyEngine* engine, int shard, struct ProxyStealStats* stats);
+
+void ProxyRequestInit(struct ProxyRequest* request);
+bool ProxyRequestTest(struct ProxyRequest* request);
+void ProxyRequestWait(struct ProxyRequest* request);
+int ProxyRequestWaitAny(struct ProxyRequest* requests, int n);
+void ProxyRequestWaitAll(struct ProxyRequest* requests, int n);
@@ -0,0 +1,121 @@
+#include "proxy_coro.h"
+#include "common.h"
+#define PROXY_FRAME_CHUNK_SIZE (64 * 1024)
+#define PROXY_FRAME_CLASSES (PROXY_FRAME_MAX_SIZE / PROXY_FRAME_CLASS_SIZE)
+
+struct ProxyFrame {
+    struct ProxyFrame* next;
+};
+
+/* 线程私有的协程帧空闲链表。帧可能在另一个线程上释放（channel 被窃取），
+ * 此时归入释放线程的链表；内存块在进程退出前不归还，每块的第一个分级
+ * 用作 frameChunks 链表节点。 */
+struct ProxyFramePool {
+    struct ProxyFrame* free[PROXY_FRAME_CLASSES];
+    char* chunk;
+    size_t chunkLeft;
+};
+
+static thread_local ProxyFramePool framePool;
+/* 所有线程申请过的内存块，只增不减 */
+static std::atomic<ProxyFrame*> frameChunks(NULL);
+
+/**
+ * @brief 为协程帧分配内存。
+ * @ingroup ProxyModule
+ *
+ * 优先从当前线程的空闲链表取，链表为空时从当前内存块切分，
+ * 只有内存块用尽时才向堆申请新的块。
+ *
+ * @param size 协程帧大小。
+ * @return 指向协程帧内存的指针。
+ */
+void* ProxyFrameAlloc(size_t size) {
+    if (unlikely(size > PROXY_FRAME_MAX_SIZE))
+        return ::operator new(size);
+    size_t cls = (size - 1) / PROXY_FRAME_CLASS_SIZE;
+    ProxyFrame* frame = framePool.free[cls];
+    if (likely(frame != NULL)) {
+        framePool.free[cls] = frame->next;
+        return frame;
+    }
+    size_t bytes = (cls + 1) * PROXY_FRAME_CLASS_SIZE;
+    if (framePool.chunkLeft < bytes) {
+        ALLOC_ALIGNED(framePool.chunk, char, PROXY_FRAME_CHUNK_SIZE, PROXY_FRAME_CLASS_SIZE);
+        ProxyFrame* chunk = (ProxyFrame*)framePool.chunk;
+        chunk->next = frameChunks.load(std::memory_order_relaxed);
+        while (!frameChunks.compare_exchange_weak(chunk->next, chunk, std::memory_order_relaxed))
+            ;
+        framePool.chunk += PROXY_FRAME_CLASS_SIZE;
+        framePool.chunkLeft = PROXY_FRAME_CHUNK_SIZE - PROXY_FRAME_CLASS_SIZE;
+    }
+    void* mem = framePool.chunk;
+    framePool.chunk += bytes;
+    framePool.chunkLeft -= bytes;
+    return mem;
+}
+
+/**
+ * @brief 归还协程帧内存。
+ * @ingroup ProxyModule
+ *
+ * @param frame 协程帧内存。
+ * @param size 协程帧大小，与分配时相同。
+ */
+void ProxyFrameFree(void* frame, size_t size) {
+    if (unlikely(size > PROXY_FRAME_MAX_SIZE)) {
+        ::operator delete(frame);
+        return;
+    }
+    size_t cls = (size - 1) / PROXY_FRAME_CLASS_SIZE;
+    ProxyFrame* node = (ProxyFrame*)frame;
+    node->next = framePool.free[cls];
+    framePool.free[cls] = node;
+}
+
+/**
+ * @brief 协程任务的进度函数。
+ * @ingroup ProxyModule
+ *
+ * 任务首次推进时在代理线程上调用 args->coroutine 创建协程帧，之后每轮
+ * 轮询协程正在等待的对象，条件满足才恢复执行；没有恢复时报告空闲。
+ * 协程返回后销毁协程帧并结束任务。
+ *
+ * @param args 指向 ProxyArgs 结构体的指针。
+ */
+void ProxyCoroProgress(ProxyArgs* args) {
+    if (args->state == ProxyOpReady) {
+        args->coroFrame = args->coroutine(args).handle.address();
+        args->state = ProxyOpProgress;
+    }
+    auto handle = std::coroutine_handle<ProxyTask::promise_type>::from_address(args->coroFrame);
+    ProxyTask::promise_type& promise = handle.promise();
+    if (promise.poll != nullptr) {
+        if (!promise.poll(promise.awaiter)) {
+            args->idle = 1;
+            return;
+        }
+        promise.poll = nullptr;
+    }
+    handle.resume();
+    if (handle.done()) {
+        handle.destroy();
+        args->coroFrame = NULL;
+        args->state = ProxyOpNone;
+    }
+}
+
+/**
+ * @brief 将协程绑定为任务的执行体。
+ * @ingroup ProxyModule
+ *
+ * 协程帧延迟到代理线程首次推进时才创建，提交任务的线程不分配协程帧。
+ *
+ * @param args 指向 ProxyArgs 结构体的指针。
+ * @param coroutine 返回 ProxyTask 的协程函数。
+ */
+void ProxyCoroBind(ProxyArgs* args, proxyCoroFunc_t coroutine) {
+    args->coroutine = coroutine;
+    args->coroFrame = NULL;
+    args->progress = ProxyCoroProgress;
+}
@@ -0,0 +1,87 @@
+#pragma once
+#include "proxy.h"
+#include <coroutine>
+#include <cstddef>
+#include <glog/logging.h>
+
+/* 协程帧按 64 字节分级缓存在线程私有的空闲链表中，超过上限的帧直接使用堆内存 */
+#define PROXY_FRAME_CLASS_SIZE 64
+#define PROXY_FRAME_MAX_SIZE 4096
+
+void* ProxyFrameAlloc(size_t size);
+void ProxyFrameFree(void* frame, size_t size);
+
+/* 代理任务协程的返回类型。协程由代理线程通过 ProxyCoroProgress 恢复执行，
+ * 挂起时记录当前等待对象的轮询函数，代理线程每轮轮询一次，满足条件才恢复。 */
+struct ProxyTask {
+    struct promise_type {
+        bool (*poll)(void*) = nullptr;
+        void* awaiter = nullptr;
+
+        ProxyTask get_return_object() {
+            return ProxyTask{std::coroutine_handle<promise_type>::from_promise(*this)};
+        }
+        std::suspend_always initial_suspend() noexcept { return {}; }
+        std::suspend_always final_suspend() noexcept { return {}; }
+        void return_void() {}
+        void unhandled_exception() { LOG(FATAL) << "Unhandled exception in proxy coroutine"; }
+        static void* operator new(size_t size) { return ProxyFrameAlloc(size); }
+        static void operator delete(void* frame, size_t size) { ProxyFrameFree(frame, size); }
+    };
+
+    std::coroutine_handle<promise_type> handle;
+};
+
+/* 等待对象基类：Derived 提供 bool poll()，条件满足时返回 true */
+template <typename Derived>
+struct ProxyAwaitable {
+    bool await_ready() { return static_cast<Derived*>(this)->poll(); }
+    void await_suspend(std::coroutine_handle<ProxyTask::promise_type> handle) {
+        handle.promise().poll = [](void* self) { return static_cast<Derived*>(self)->poll(); };
+        handle.promise().awaiter = static_cast<Derived*>(this);
+    }
+};
+
+/* 等待 CQ 上至少一个完成事件，一次最多取回 max 个，co_await 返回取回的个数 */
+struct ProxyCqCompletion : ProxyAwaitable<ProxyCqCompletion> {
+    struct ibv_cq* cq;
+    struct ibv_wc* wcs;
+    int max;
+    int n;
+
+    ProxyCqCompletion(struct ibv_cq* cq, struct ibv_wc* wcs, int max)
+        : cq(cq), wcs(wcs), max(max), n(0) {}
+    bool poll() {
+        n = ibv_poll_cq(cq, max, wcs);
+        CHECK(n >= 0) << "Failed to poll CQ";
+        if (n > 0)
+            PROXY_TRACE(ProxyTracePollCq, cq, n);
+        return n > 0;
+    }
+    int await_resume() { return n; }
+};
+
+/* 等待 credits 不少于 need，恢复时扣除 need。credits 只能由代理线程修改 */
+struct ProxyCredits : ProxyAwaitable<ProxyCredits> {
+    int* credits;
+    int need;
+
+    ProxyCredits(int* credits, int need) : credits(credits), need(need) {}
+    bool poll() { return *credits >= need; }
+    void await_resume() { *credits -= need; }
+};
+
+/* 让出到下一轮 */
+struct ProxyYield : ProxyAwaitable<ProxyYield> {
+    bool yielded = false;
+
+    bool poll() {
+        bool ready = yielded;
+        yielded = true;
+        return ready;
+    }
+    void await_resume() {}
+};
+
+void ProxyCoroProgress(struct ProxyArgs* args);
+void ProxyCoroBind(struct ProxyArgs* args, proxyCoroFunc_t coroutine);
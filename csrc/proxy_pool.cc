@@ -0,0 +1,428 @@
+#include "proxy_pool.h"
+#include "common.h"
+#include <string.h>
+#include <sys/mman.h>
+#include <new>
+#define PROXY_SLAB_BYTES (64 * 1024)
+#define PROXY_HUGE_SLAB_BYTES (2 * 1024 * 1024)
+
+/* 线程编号位图，线程退出时归还编号，新线程继承该编号在各对象池中的槽位 */
+static std::atomic<uint64_t> threadIndexBits[PROXY_POOL_MAX_THREADS / 64];
+
+struct ProxyThreadIndex {
+    int index;
+    ProxyThreadIndex() : index(-1) {
+        for (int word = 0; word < PROXY_POOL_MAX_THREADS / 64 && index < 0; word++) {
+            uint64_t bits = threadIndexBits[word].load(std::memory_order_relaxed);
+            while (~bits != 0) {
+                int bit = __builtin_ctzll(~bits);
+                if (threadIndexBits[word].compare_exchange_weak(bits, bits | (1ull << bit),
+                                                                std::memory_order_acquire)) {
+                    index = word * 64 + bit;
+                    break;
+                }
+            }
+        }
+    }
+    ~ProxyThreadIndex() {
+        if (index >= 0)
+            threadIndexBits[index / 64].fetch_and(~(1ull << (index % 64)),
+                                                  std::memory_order_release);
+    }
+};
+
+/**
+ * @brief 获取当前线程的槽位编号。
+ * @ingroup ProxyModule
+ *
+ * @return 槽位编号，超过 PROXY_POOL_MAX_THREADS 个线程时返回 -1。
+ */
+static inline int proxyThreadIndex() {
+    static thread_local ProxyThreadIndex self;
+    return self.index;
+}
+
+static void depotInit(ProxyDepot* depot) {
+    ALLOC_ALIGNED(depot->cells, ProxyDepotCell, PROXY_DEPOT_SIZE, PROXY_CACHE_LINE_SIZE);
+    for (size_t i = 0; i < PROXY_DEPOT_SIZE; i++) {
+        new (&depot->cells[i].seq) std::atomic<size_t>(i);
+        depot->cells[i].magazine = NULL;
+    }
+    depot->head.store(0, std::memory_order_relaxed);
+    depot->tail.store(0, std::memory_order_relaxed);
+}
+
+/**
+ * @brief 将 magazine 放入 depot。
+ * @ingroup ProxyModule
+ *
+ * magazine 总数不超过 PROXY_DEPOT_SIZE，而每个 magazine 同一时刻最多位于一个
+ * depot 中，因此 depot 不会满。
+ *
+ * @param depot 指向 ProxyDepot 结构体的指针。
+ * @param magazine 要放入的 magazine。
+ */
+static void depotPush(ProxyDepot* depot, ProxyMagazine* magazine) {
+    size_t pos = depot->tail.load(std::memory_order_relaxed);
+    for (;;) {
+        ProxyDepotCell* cell = &depot->cells[pos & (PROXY_DEPOT_SIZE - 1)];
+        size_t seq = cell->seq.load(std::memory_order_acquire);
+        intptr_t diff = (intptr_t)seq - (intptr_t)pos;
+        if (diff == 0) {
+            if (depot->tail.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+                cell->magazine = magazine;
+                cell->seq.store(pos + 1, std::memory_order_release);
+                return;
+            }
+        } else {
+            CHECK(diff > 0) << "Proxy magazine depot overflow";
+            pos = depot->tail.load(std::memory_order_relaxed);
+        }
+    }
+}
+
+/**
+ * @brief 从 depot 取出一个 magazine。
+ * @ingroup ProxyModule
+ *
+ * @param depot 指向 ProxyDepot 结构体的指针。
+ * @return magazine，depot 为空时返回 NULL。
+ */
+static ProxyMagazine* depotPop(ProxyDepot* depot) {
+    size_t pos = depot->head.load(std::memory_order_relaxed);
+    for (;;) {
+        ProxyDepotCell* cell = &depot->cells[pos & (PROXY_DEPOT_SIZE - 1)];
+        size_t seq = cell->seq.load(std::memory_order_acquire);
+        intptr_t diff = (intptr_t)seq - (intptr_t)(pos + 1);
+        if (diff == 0) {
+            if (depot->head.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+                ProxyMagazine* magazine = cell->magazine;
+                cell->seq.store(pos + PROXY_DEPOT_SIZE, std::memory_order_release);
+                return magazine;
+            }
+        } else if (diff < 0) {
+            return NULL;
+        } else {
+            pos = depot->head.load(std::memory_order_relaxed);
+        }
+    }
+}
+
+/**
+ * @brief 新建一个空 magazine，调用者须持有 pool->mutex。
+ * @ingroup ProxyModule
+ *
+ * @return magazine，总数已达 PROXY_DEPOT_SIZE 时返回 NULL，调用者改用 spill 链表。
+ */
+static ProxyMagazine* newMagazine(ProxyArgsPool* pool) {
+    if (pool->nMagazines >= PROXY_DEPOT_SIZE) {
+        LOG_FIRST_N(WARNING, 1) << "Proxy args pool reached " << PROXY_DEPOT_SIZE
+                                << " magazines, further ops use the shared free list";
+        return NULL;
+    }
+    ProxyMagazine* magazine;
+    CALLOC(magazine, ProxyMagazine, 1);
+    magazine->allNext = pool->magazines;
+    pool->magazines = magazine;
+    pool->nMagazines++;
+    return magazine;
+}
+
+/**
+ * @brief 分配一块 slab 内存。
+ * @ingroup ProxyModule
+ *
+ * 开启 hugePages 时先尝试 2MB 大页，失败则退回普通页并建议内核使用透明大页。
+ * mmap 返回的内存已清零且按页对齐。
+ */
+static void* mapSlab(ProxyArgsPool* pool, size_t* bytes) {
+    void* base = MAP_FAILED;
+    if (pool->hugePages) {
+        *bytes = PROXY_HUGE_SLAB_BYTES;
+        base = mmap(NULL, *bytes, PROT_READ | PROT_WRITE,
+                    MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+        if (base == MAP_FAILED) {
+            LOG_FIRST_N(WARNING, 1) << "No hugetlb pages available for proxy args pool, "
+                                       "falling back to transparent huge pages";
+            base = mmap(NULL, *bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS,
+                        -1, 0);
+            if (base != MAP_FAILED)
+                madvise(base, *bytes, MADV_HUGEPAGE);
+        }
+    } else {
+        *bytes = PROXY_SLAB_BYTES;
+        base = mmap(NULL, *bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    }
+    CHECK(base != MAP_FAILED) << "Cannot map " << *bytes << "B for proxy args pool";
+    return base;
+}
+
+/**
+ * @brief 新建一个 slab 并切分为满的 magazine。
+ * @ingroup ProxyModule
+ *
+ * slab 末尾不足一个 magazine 的对象留在 pool->partial 中，由下一个 slab 补满，
+ * depot 中因此只有满 magazine。magazine 数达到上限后剩余对象放入 spill 链表；
+ * 此时若 spill 中还有对象则不必新建 slab，直接返回 NULL 让调用者从 spill 分配。
+ *
+ * @param pool 指向 ProxyArgsPool 结构体的指针。
+ * @param keep 为真时保留一个 magazine 返回给调用者，其余放入 depot。
+ * @return keep 为真时返回保留的非空 magazine，magazine 数已达上限时可能为 NULL。
+ */
+static ProxyMagazine* proxyPoolGrow(ProxyArgsPool* pool, bool keep) {
+    pthread_mutex_lock(&pool->mutex);
+    if (keep && pool->nMagazines >= PROXY_DEPOT_SIZE && pool->partial == NULL &&
+        pool->spill != NULL) {
+        pthread_mutex_unlock(&pool->mutex);
+        return NULL;
+    }
+    ProxySlab* slab;
+    CALLOC(slab, ProxySlab, 1);
+    slab->base = mapSlab(pool, &slab->bytes);
+    slab->next = pool->slabs;
+    pool->slabs = slab;
+    ProxyArgs* elems = (ProxyArgs*)slab->base;
+    size_t n = slab->bytes / sizeof(ProxyArgs);
+    pool->nArgs += n;
+    ProxyMagazine* kept = NULL;
+    ProxyMagazine* magazine = pool->partial;
+    size_t i = 0;
+    for (; i < n; i++) {
+        if (magazine == NULL && (magazine = newMagazine(pool)) == NULL)
+            break;
+        magazine->rounds[magazine->count++] = &elems[i];
+        if (magazine->count == PROXY_MAGAZINE_SIZE) {
+            if (keep && kept == NULL)
+                kept = magazine;
+            else
+                depotPush(&pool->full, magazine);
+            magazine = NULL;
+        }
+    }
+    for (; i < n; i++) {
+        elems[i].next = pool->spill;
+        pool->spill = &elems[i];
+    }
+    if (keep && kept == NULL && magazine != NULL) {
+        kept = magazine;
+        magazine = NULL;
+    }
+    pool->partial = magazine;
+    pthread_mutex_unlock(&pool->mutex);
+    return kept;
+}
+
+/**
+ * @brief 取一个空 magazine，depot 中没有时新建。
+ * @ingroup ProxyModule
+ *
+ * @return magazine，magazine 数已达上限时返回 NULL。
+ */
+static ProxyMagazine* emptyMagazine(ProxyArgsPool* pool) {
+    ProxyMagazine* magazine = depotPop(&pool->empty);
+    if (magazine == NULL) {
+        pthread_mutex_lock(&pool->mutex);
+        magazine = newMagazine(pool);
+        pthread_mutex_unlock(&pool->mutex);
+    }
+    return magazine;
+}
+
+/**
+ * @brief 创建 ProxyArgs 对象池。
+ * @ingroup ProxyModule
+ *
+ * @param hugePages 为真时 slab 使用 2MB 大页。
+ * @return 指向新建 ProxyArgsPool 结构体的指针。
+ */
+ProxyArgsPool* ProxyPoolCreate(bool hugePages) {
+    ProxyArgsPool* pool;
+    ALLOC_ALIGNED(pool, ProxyArgsPool, 1, PROXY_CACHE_LINE_SIZE);
+    memset((void*)pool, 0, sizeof(ProxyArgsPool));
+    depotInit(&pool->full);
+    depotInit(&pool->empty);
+    pool->mutex = PTHREAD_MUTEX_INITIALIZER;
+    pool->hugePages = hugePages;
+    return pool;
+}
+
+/**
+ * @brief 预先分配对象，使池中至少有 nArgs 个 ProxyArgs。
+ * @ingroup ProxyModule
+ *
+ * 在启动阶段调用，避免首批任务在提交路径上触发缺页和 slab 分配。
+ *
+ * @param pool 指向 ProxyArgsPool 结构体的指针。
+ * @param nArgs 期望的对象数。
+ */
+void ProxyPoolReserve(ProxyArgsPool* pool, size_t nArgs) {
+    for (;;) {
+        pthread_mutex_lock(&pool->mutex);
+        size_t have = pool->nArgs;
+        pthread_mutex_unlock(&pool->mutex);
+        if (have >= nArgs)
+            break;
+        proxyPoolGrow(pool, false);
+    }
+}
+
+/**
+ * @brief 从共享空闲链表分配，供没有槽位的线程以及 magazine 数达到上限时使用。
+ * @ingroup ProxyModule
+ */
+static ProxyArgs* proxyPoolAllocShared(ProxyArgsPool* pool) {
+    pthread_mutex_lock(&pool->mutex);
+    while (pool->spill == NULL) {
+        ProxyMagazine* magazine = depotPop(&pool->full);
+        pthread_mutex_unlock(&pool->mutex);
+        if (magazine == NULL)
+            magazine = proxyPoolGrow(pool, true);
+        pthread_mutex_lock(&pool->mutex);
+        /* 为 NULL 时新 slab 的对象已全部放入 spill */
+        if (magazine == NULL)
+            continue;
+        while (magazine->count > 0) {
+            ProxyArgs* elem = magazine->rounds[--magazine->count];
+            elem->next = pool->spill;
+            pool->spill = elem;
+        }
+        depotPush(&pool->empty, magazine);
+    }
+    ProxyArgs* elem = pool->spill;
+    pool->spill = elem->next;
+    pthread_mutex_unlock(&pool->mutex);
+    return elem;
+}
+
+/**
+ * @brief 把对象放回共享空闲链表。
+ * @ingroup ProxyModule
+ */
+static void proxyPoolFreeShared(ProxyArgsPool* pool, ProxyArgs* args) {
+    pthread_mutex_lock(&pool->mutex);
+    args->next = pool->spill;
+    pool->spill = args;
+    pthread_mutex_unlock(&pool->mutex);
+}
+
+/**
+ * @brief 当前 magazine 已空时的分配慢路径。
+ * @ingroup ProxyModule
+ *
+ * 先换用 previous；仍为空则用一个满 magazine 替换，空的那个归还 depot。
+ * magazine 数已达上限且 depot 中没有满 magazine 时改从 spill 链表分配。
+ */
+static ProxyArgs* proxyPoolAllocSlow(ProxyArgsPool* pool, ProxyMagazineSlot* slot) {
+    ProxyMagazine* previous = slot->previous;
+    if (previous != NULL && previous->count > 0) {
+        slot->previous = slot->loaded;
+        slot->loaded = previous;
+        return previous->rounds[--previous->count];
+    }
+    ProxyMagazine* full = depotPop(&pool->full);
+    if (full == NULL)
+        full = proxyPoolGrow(pool, true);
+    if (unlikely(full == NULL))
+        return proxyPoolAllocShared(pool);
+    if (previous != NULL)
+        depotPush(&pool->empty, previous);
+    slot->previous = slot->loaded;
+    slot->loaded = full;
+    return full->rounds[--full->count];
+}
+
+/**
+ * @brief 分配一个 ProxyArgs。
+ * @ingroup ProxyModule
+ *
+ * 快路径只访问当前线程的槽位，不加锁也不使用原子操作。
+ * 对象内容为上次使用后的残留值，由调用者初始化。
+ *
+ * @param pool 指向 ProxyArgsPool 结构体的指针。
+ * @return 指向 64 字节对齐的 ProxyArgs 结构体的指针。
+ */
+ProxyArgs* ProxyPoolAlloc(ProxyArgsPool* pool) {
+    int index = proxyThreadIndex();
+    if (unlikely(index < 0))
+        return proxyPoolAllocShared(pool);
+    ProxyMagazineSlot* slot = &pool->slots[index];
+    ProxyMagazine* loaded = slot->loaded;
+    if (likely(loaded != NULL && loaded->count > 0))
+        return loaded->rounds[--loaded->count];
+    return proxyPoolAllocSlow(pool, slot);
+}
+
+/**
+ * @brief 当前 magazine 已满时的回收慢路径。
+ * @ingroup ProxyModule
+ *
+ * 先换用 previous；仍已满则把它交给 depot，换上一个空 magazine。
+ * magazine 数已达上限时改为放回 spill 链表。
+ */
+static void proxyPoolFreeSlow(ProxyArgsPool* pool, ProxyMagazineSlot* slot, ProxyArgs* args) {
+    ProxyMagazine* previous = slot->previous;
+    if (previous != NULL && previous->count < PROXY_MAGAZINE_SIZE) {
+        slot->previous = slot->loaded;
+        slot->loaded = previous;
+        previous->rounds[previous->count++] = args;
+        return;
+    }
+    ProxyMagazine* empty = emptyMagazine(pool);
+    if (unlikely(empty == NULL)) {
+        proxyPoolFreeShared(pool, args);
+        return;
+    }
+    if (previous != NULL)
+        depotPush(&pool->full, previous);
+    slot->previous = slot->loaded;
+    slot->loaded = empty;
+    empty->rounds[empty->count++] = args;
+}
+
+/**
+ * @brief 归还一个 ProxyArgs。
+ * @ingroup ProxyModule
+ *
+ * 可由任意线程调用，args 必须由 pool 分配。其它线程归还的对象先进入该线程
+ * 在 pool 中的 magazine，装满后经 depot 回到分配方，pool 因此不会无限增长。
+ *
+ * @param pool 指向 ProxyArgsPool 结构体的指针。
+ * @param args 要归还的 ProxyArgs。
+ */
+void ProxyPoolFree(ProxyArgsPool* pool, ProxyArgs* args) {
+    int index = proxyThreadIndex();
+    if (unlikely(index < 0)) {
+        proxyPoolFreeShared(pool, args);
+        return;
+    }
+    ProxyMagazineSlot* slot = &pool->slots[index];
+    ProxyMagazine* loaded = slot->loaded;
+    if (likely(loaded != NULL && loaded->count < PROXY_MAGAZINE_SIZE)) {
+        loaded->rounds[loaded->count++] = args;
+        return;
+    }
+    proxyPoolFreeSlow(pool, slot, args);
+}
+
+/**
+ * @brief 销毁对象池并释放所有 slab。必须在所有使用该池的线程停止访问后调用。
+ * @ingroup ProxyModule
+ *
+ * @param pool 指向 ProxyArgsPool 结构体的指针。
+ */
+void ProxyPoolDestroy(ProxyArgsPool* pool) {
+    while (pool->slabs != NULL) {
+        ProxySlab* next = pool->slabs->next;
+        munmap(pool->slabs->base, pool->slabs->bytes);
+        free(pool->slabs);
+        pool->slabs = next;
+    }
+    while (pool->magazines != NULL) {
+        ProxyMagazine* next = pool->magazines->allNext;
+        free(pool->magazines);
+        pool->magazines = next;
+    }
+    _mm_free(pool->full.cells);
+    _mm_free(pool->empty.cells);
+    _mm_free(pool);
+}
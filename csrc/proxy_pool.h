@@ -0,0 +1,70 @@
+#pragma once
+#include "proxy.h"
+#include <pthread.h>
+#include <atomic>
+#include <cstddef>
+
+/* 每个线程的 magazine 槽位数，超出的线程退回到 mutex 保护的共享链表 */
+#define PROXY_POOL_MAX_THREADS 128
+/* 每个 magazine 缓存的 ProxyArgs 数 */
+#define PROXY_MAGAZINE_SIZE 32
+/* 每个 depot 可容纳的 magazine 数。magazine 总数达到该值后新建的 slab 与无处
+ * 可放的对象改经 mutex 保护的共享链表分配与回收，池仍可继续增长，只是变慢 */
+#define PROXY_DEPOT_SIZE 4096
+
+/* 固定容量的 ProxyArgs 指针栈，在线程槽位与 depot 之间整体交换 */
+struct ProxyMagazine {
+    int count;
+    /* 对象池创建的所有 magazine 链表，仅用于销毁 */
+    struct ProxyMagazine* allNext;
+    struct ProxyArgs* rounds[PROXY_MAGAZINE_SIZE];
+};
+
+/* 线程私有槽位：loaded 用于当前分配与回收，previous 作为满/空的后备 */
+struct alignas(PROXY_CACHE_LINE_SIZE) ProxyMagazineSlot {
+    struct ProxyMagazine* loaded;
+    struct ProxyMagazine* previous;
+};
+
+struct ProxyDepotCell {
+    std::atomic<size_t> seq;
+    struct ProxyMagazine* magazine;
+};
+
+/* 有界多生产者/多消费者 magazine 队列 */
+struct ProxyDepot {
+    alignas(PROXY_CACHE_LINE_SIZE) std::atomic<size_t> head;
+    alignas(PROXY_CACHE_LINE_SIZE) std::atomic<size_t> tail;
+    struct ProxyDepotCell* cells;
+};
+
+struct ProxySlab {
+    struct ProxySlab* next;
+    void* base;
+    size_t bytes;
+};
+
+/* ProxyArgs 的 slab 分配器：对象按缓存行对齐，分配与回收走线程私有的 magazine，
+ * 只有 magazine 用尽或装满时才经由无锁 depot 与其它线程交换，新建 slab 时才加锁。 */
+struct ProxyArgsPool {
+    struct ProxyMagazineSlot slots[PROXY_POOL_MAX_THREADS];
+    struct ProxyDepot full;
+    struct ProxyDepot empty;
+    /* 以下字段由 mutex 保护，只在慢路径上使用 */
+    pthread_mutex_t mutex;
+    struct ProxySlab* slabs;
+    struct ProxyMagazine* magazines;
+    /* slab 切分后不足一个 magazine 的对象，留待下一个 slab 补满 */
+    struct ProxyMagazine* partial;
+    int nMagazines;
+    size_t nArgs;
+    bool hugePages;
+    /* 没有槽位的线程以及 magazine 数达到上限后共享的空闲链表 */
+    struct ProxyArgs* spill;
+};
+
+struct ProxyArgsPool* ProxyPoolCreate(bool hugePages);
+void ProxyPoolReserve(struct ProxyArgsPool* pool, size_t nArgs);
+struct ProxyArgs* ProxyPoolAlloc(struct ProxyArgsPool* pool);
+void ProxyPoolFree(struct ProxyArgsPool* pool, struct ProxyArgs* args);
+void ProxyPoolDestroy(struct ProxyArgsPool* pool);
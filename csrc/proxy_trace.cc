@@ -0,0 +1,120 @@
+#include "proxy_trace.h"
+#include "common.h"
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/syscall.h>
+#include <vector>
+
+#ifdef FLASHREDUCE_TRACE
+thread_local ProxyTraceRing* proxyTraceRing = NULL;
+#endif
+
+/* 所有线程的环形缓冲区，只增不减，线程退出后仍可导出 */
+static std::atomic<ProxyTraceRing*> traceRings(NULL);
+
+static const char* traceEventNames[ProxyTraceEventCount] = {
+    "append", "start", "post_send", "post_recv", "poll_cq",
+    "complete", "sleep", "block", "steal",
+};
+
+/**
+ * @brief 为当前线程创建并登记环形缓冲区。
+ * @ingroup ProxyModule
+ *
+ * 在线程第一次记录事件时调用，之后的记录只访问线程私有的缓冲区。
+ *
+ * @return 当前线程的环形缓冲区。
+ */
+ProxyTraceRing* ProxyTraceRegister() {
+    // 含原子成员，不能用 calloc 分配；值初始化同样把记录清零
+    ProxyTraceRing* ring = new ProxyTraceRing();
+    ring->tid = (int)syscall(SYS_gettid);
+    pthread_getname_np(pthread_self(), ring->name, sizeof(ring->name));
+    ring->next = traceRings.load(std::memory_order_relaxed);
+    while (!traceRings.compare_exchange_weak(ring->next, ring, std::memory_order_release,
+                                             std::memory_order_relaxed))
+        ;
+#ifdef FLASHREDUCE_TRACE
+    proxyTraceRing = ring;
+#endif
+    return ring;
+}
+
+/* 按 JSON 字符串的规则转义后写出，线程名可由用户任意设置 */
+static void trace_write_string(FILE* file, const char* str) {
+    fputc('"', file);
+    for (const char* p = str; *p != '\0'; p++) {
+        unsigned char c = (unsigned char)*p;
+        if (c == '"' || c == '\\')
+            fprintf(file, "\\%c", c);
+        else if (c < 0x20)
+            fprintf(file, "\\u%04x", c);
+        else
+            fputc(c, file);
+    }
+    fputc('"', file);
+}
+
+/**
+ * @brief 将所有线程的跟踪记录导出为 Chrome/Perfetto 可读取的 JSON。
+ * @ingroup ProxyModule
+ *
+ * 时间戳由 get_cycles 的周期数按 get_cpu_mhz 换算为微秒。每个任务从 append
+ * 到 complete 导出为一段异步区间，其余事件导出为瞬时事件。
+ * 应在代理线程空闲或销毁后调用，否则可能读到正在被覆盖的记录。
+ *
+ * @param path 输出文件路径。
+ */
+void ProxyTraceDump(const char* path) {
+#ifndef FLASHREDUCE_TRACE
+    LOG(WARNING) << "Proxy trace is compiled out, rebuild with -DFLASHREDUCE_TRACE=ON";
+#endif
+    FILE* file = fopen(path, "w");
+    CHECK(file != NULL) << "Cannot open trace file " << path;
+    std::vector<ProxyTraceRing*> rings;
+    cycles_t base = 0;
+    for (ProxyTraceRing* ring = traceRings.load(std::memory_order_acquire); ring != NULL;
+         ring = ring->next) {
+        rings.push_back(ring);
+        uint64_t head = ring->head.load(std::memory_order_acquire);
+        uint64_t first = head > PROXY_TRACE_RING_SIZE ? head - PROXY_TRACE_RING_SIZE : 0;
+        if (head > first) {
+            cycles_t tick = ring->records[first & (PROXY_TRACE_RING_SIZE - 1)].tick;
+            if (base == 0 || tick < base)
+                base = tick;
+        }
+    }
+    double mhz = get_cpu_mhz(0);
+    fprintf(file, "{\"traceEvents\":[\n");
+    bool firstEvent = true;
+    for (ProxyTraceRing* ring : rings) {
+        fprintf(file, "%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":0,\"tid\":%d,"
+                      "\"args\":{\"name\":",
+                firstEvent ? "" : ",\n", ring->tid);
+        trace_write_string(file, ring->name);
+        fprintf(file, "}}");
+        firstEvent = false;
+        uint64_t head = ring->head.load(std::memory_order_acquire);
+        uint64_t first = head > PROXY_TRACE_RING_SIZE ? head - PROXY_TRACE_RING_SIZE : 0;
+        for (uint64_t i = first; i < head; i++) {
+            const ProxyTraceRecord* record = &ring->records[i & (PROXY_TRACE_RING_SIZE - 1)];
+            double ts = (record->tick - base) / mhz;
+            const char* name = record->event < ProxyTraceEventCount
+                                   ? traceEventNames[record->event]
+                                   : "unknown";
+            if (record->event == ProxyTraceAppend || record->event == ProxyTraceComplete) {
+                fprintf(file, ",\n{\"name\":\"op\",\"cat\":\"op\",\"ph\":\"%s\",\"id\":\"%p\","
+                              "\"ts\":%.3f,\"pid\":0,\"tid\":%d}",
+                        record->event == ProxyTraceAppend ? "b" : "e", record->op, ts,
+                        ring->tid);
+            }
+            fprintf(file, ",\n{\"name\":\"%s\",\"ph\":\"i\",\"s\":\"t\",\"ts\":%.3f,\"pid\":0,"
+                          "\"tid\":%d,\"args\":{\"op\":\"%p\",\"arg\":%u}}",
+                    name, ts, ring->tid, record->op, record->arg);
+        }
+    }
+    fprintf(file, "\n]}\n");
+    fclose(file);
+    LOG(INFO) << "Proxy trace written to " << path;
+}
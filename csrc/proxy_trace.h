@@ -0,0 +1,66 @@
+#pragma once
+#include "get_clock.h"
+#include <atomic>
+#include <cstdint>
+
+/* 代理热路径跟踪。只在定义 FLASHREDUCE_TRACE 时编译进来（cmake -DFLASHREDUCE_TRACE=ON），
+ * 否则 PROXY_TRACE 展开为空语句，没有任何开销。 */
+
+/* 每个线程的环形缓冲区容量，必须是 2 的幂，写满后覆盖最旧的记录 */
+#define PROXY_TRACE_RING_SIZE (1 << 16)
+
+enum ProxyTraceEvent {
+    ProxyTraceAppend,
+    ProxyTraceStart,
+    ProxyTracePostSend,
+    ProxyTracePostRecv,
+    ProxyTracePollCq,
+    ProxyTraceComplete,
+    ProxyTraceSleep,
+    ProxyTraceBlock,
+    ProxyTraceSteal,
+    ProxyTraceEventCount
+};
+
+struct ProxyTraceRecord {
+    cycles_t tick;
+    const void* op;
+    uint32_t event;
+    uint32_t arg;
+};
+
+/* 单写者环形缓冲区，只由所属线程写入 */
+struct ProxyTraceRing {
+    struct ProxyTraceRecord records[PROXY_TRACE_RING_SIZE];
+    std::atomic<uint64_t> head;
+    int tid;
+    char name[16];
+    struct ProxyTraceRing* next;
+};
+
+struct ProxyTraceRing* ProxyTraceRegister();
+void ProxyTraceDump(const char* path);
+
+#ifdef FLASHREDUCE_TRACE
+extern thread_local struct ProxyTraceRing* proxyTraceRing;
+
+static inline void ProxyTraceRecordEvent(enum ProxyTraceEvent event, const void* op,
+                                         uint32_t arg) {
+    struct ProxyTraceRing* ring = proxyTraceRing;
+    if (__builtin_expect(ring == NULL, 0))
+        ring = ProxyTraceRegister();
+    uint64_t head = ring->head.load(std::memory_order_relaxed);
+    struct ProxyTraceRecord* record = &ring->records[head & (PROXY_TRACE_RING_SIZE - 1)];
+    record->tick = get_cycles();
+    record->op = op;
+    record->event = event;
+    record->arg = arg;
+    ring->head.store(head + 1, std::memory_order_release);
+}
+
+#define PROXY_TRACE(event, op, arg) ProxyTraceRecordEvent((event), (op), (uint32_t)(arg))
+#else
+#define PROXY_TRACE(event, op, arg) \
+    do {                            \
+    } while (0)
+#endif
@@ -0,0 +1,691 @@
+#include "quantize.h"
+#include <glog/logging.h>
+#include <immintrin.h>
+#include <algorithm>
+#include <atomic>
+#include <climits>
+#include <cstdint>
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+
+namespace flashreduce {
+
+/* 输出超过该大小时用非临时存储绕过缓存，省去写分配时对目标行的读取；
+ * 打包单个槽这类小块仍走缓存，紧接着就会被网卡读走 */
+const size_t kStreamBytes = 4 << 20;
+
+/* 比较的写法与 SIMD 的 min/max 一致：任一操作数为 NaN 时取第二个操作数 */
+static inline float min_like_simd(float a, float b) { return a < b ? a : b; }
+static inline float max_like_simd(float a, float b) { return a > b ? a : b; }
+
+static float quantize_scalar(const float *src, int32_t *dst, size_t n, float scale) {
+    float maxAbs = 0.0f;
+    for (size_t i = 0; i < n; i++) {
+        maxAbs = max_like_simd(std::fabs(src[i]), maxAbs);
+        float y = min_like_simd(src[i] * scale, QUANTIZE_SATURATION);
+        dst[i] = (int32_t)lrintf(max_like_simd(y, -QUANTIZE_SATURATION));
+    }
+    return maxAbs;
+}
+
+static void dequantize_scalar(const int32_t *src, float *dst, size_t n, float inverseScale) {
+    for (size_t i = 0; i < n; i++)
+        dst[i] = (float)src[i] * inverseScale;
+}
+
+static float max_abs_scalar(const float *src, size_t n) {
+    float maxAbs = 0.0f;
+    for (size_t i = 0; i < n; i++)
+        maxAbs = max_like_simd(std::fabs(src[i]), maxAbs);
+    return maxAbs;
+}
+
+static inline float bits_to_float(uint32_t bits) {
+    float f;
+    std::memcpy(&f, &bits, sizeof(f));
+    return f;
+}
+
+static inline uint32_t float_to_bits(float f) {
+    uint32_t bits;
+    std::memcpy(&bits, &f, sizeof(bits));
+    return bits;
+}
+
+/* 与 vcvtph2ps 一致：非规格化数精确展开，NaN 保留载荷并置静默位 */
+float half_to_float(uint16_t h) {
+    uint32_t sign = (uint32_t)(h & 0x8000) << 16;
+    uint32_t exponent = (h >> 10) & 0x1f;
+    uint32_t mantissa = h & 0x3ff;
+    if (exponent == 0x1f)
+        return bits_to_float(sign | 0x7f800000 | (mantissa ? 0x400000 : 0) | mantissa << 13);
+    if (exponent == 0) {
+        if (mantissa == 0)
+            return bits_to_float(sign);
+        exponent = 113;
+        while (!(mantissa & 0x400)) {
+            mantissa <<= 1;
+            exponent--;
+        }
+        return bits_to_float(sign | exponent << 23 | (mantissa & 0x3ff) << 13);
+    }
+    return bits_to_float(sign | (exponent + 112) << 23 | mantissa << 13);
+}
+
+/* 与 vcvtps2ph 在就近偶数舍入下一致：溢出为无穷，下溢到非规格化数或零，NaN 截断载荷并置静默位 */
+uint16_t float_to_half(float f) {
+    uint32_t bits = float_to_bits(f);
+    uint16_t sign = (bits >> 16) & 0x8000;
+    uint32_t absBits = bits & 0x7fffffff;
+    if (absBits > 0x7f800000)
+        return sign | 0x7e00 | ((absBits >> 13) & 0x3ff);
+    // 不小于 65520 的值舍入后超出半精度最大值 65504
+    if (absBits >= 0x477ff000)
+        return sign | 0x7c00;
+    if (absBits < 0x38800000) {
+        // 2^-25 恰在 0 与最小非规格化数之间，偶数舍入到 0
+        if (absBits <= 0x33000000)
+            return sign;
+        uint32_t mantissa = (absBits & 0x7fffff) | 0x800000;
+        int shift = 126 - (int)(absBits >> 23);
+        uint32_t result = mantissa >> shift;
+        uint32_t rest = mantissa & ((1u << shift) - 1), halfway = 1u << (shift - 1);
+        if (rest > halfway || (rest == halfway && (result & 1)))
+            result++;
+        return sign | result;
+    }
+    absBits -= 0x38000000;
+    return sign | ((absBits + 0xfff + ((absBits >> 13) & 1)) >> 13);
+}
+
+float bfloat16_to_float(uint16_t b) {
+    return bits_to_float((uint32_t)b << 16);
+}
+
+/* 与 vcvtneps2bf16 一致：就近偶数舍入，非规格化数冲为带符号的零，NaN 置静默位 */
+uint16_t float_to_bfloat16(float f) {
+    uint32_t bits = float_to_bits(f);
+    uint32_t absBits = bits & 0x7fffffff;
+    if (absBits > 0x7f800000)
+        return (bits >> 16) | 0x40;
+    if (absBits < 0x00800000)
+        return (bits >> 16) & 0x8000;
+    return (bits + 0x7fff + ((bits >> 16) & 1)) >> 16;
+}
+
+/* 半精度各核先在寄存器中展开为 float32，再走与 float32 相同的乘法、截断和舍入，
+ * 因此量化结果与先转成 float32 再调用 quantize 逐位一致 */
+template <float (*Widen)(uint16_t)>
+static float quantize_half_scalar(const uint16_t *src, int32_t *dst, size_t n, float scale) {
+    float maxAbs = 0.0f;
+    for (size_t i = 0; i < n; i++) {
+        float x = Widen(src[i]);
+        maxAbs = max_like_simd(std::fabs(x), maxAbs);
+        float y = min_like_simd(x * scale, QUANTIZE_SATURATION);
+        dst[i] = (int32_t)lrintf(max_like_simd(y, -QUANTIZE_SATURATION));
+    }
+    return maxAbs;
+}
+
+template <uint16_t (*Narrow)(float)>
+static void dequantize_half_scalar(const int32_t *src, uint16_t *dst, size_t n, float inverseScale) {
+    for (size_t i = 0; i < n; i++)
+        dst[i] = Narrow((float)src[i] * inverseScale);
+}
+
+template <float (*Widen)(uint16_t)>
+static float max_abs_half_scalar(const uint16_t *src, size_t n) {
+    float maxAbs = 0.0f;
+    for (size_t i = 0; i < n; i++)
+        maxAbs = max_like_simd(std::fabs(Widen(src[i])), maxAbs);
+    return maxAbs;
+}
+
+__attribute__((target("avx2"))) static float reduce_max_avx2(__m256 v) {
+    __m128 m = _mm_max_ps(_mm256_castps256_ps128(v), _mm256_extractf128_ps(v, 1));
+    m = _mm_max_ps(m, _mm_movehl_ps(m, m));
+    m = _mm_max_ss(m, _mm_shuffle_ps(m, m, 1));
+    return _mm_cvtss_f32(m);
+}
+
+/* 非临时存储要求目标按向量宽度对齐，返回需要先用标量处理的元素数 */
+static size_t stream_head(const void *dst, size_t n, size_t vectorBytes) {
+    if (n * sizeof(int32_t) < kStreamBytes)
+        return SIZE_MAX;
+    size_t misalign = (uintptr_t)dst & (vectorBytes - 1);
+    return misalign == 0 ? 0 : std::min(n, (vectorBytes - misalign) / sizeof(int32_t));
+}
+
+__attribute__((target("avx2"))) static inline void store_avx2(void *dst, __m256i v, bool stream) {
+    if (stream)
+        _mm256_stream_si256((__m256i *)dst, v);
+    else
+        _mm256_storeu_si256((__m256i *)dst, v);
+}
+
+/* 每轮两个向量，让乘法、截断、转换和存储的延迟互相重叠，单核即可跑满内存带宽 */
+__attribute__((target("avx2"))) static float quantize_avx2(const float *src, int32_t *dst, size_t n,
+                                                         float scale) {
+    const __m256 vscale = _mm256_set1_ps(scale);
+    const __m256 hi = _mm256_set1_ps(QUANTIZE_SATURATION);
+    const __m256 lo = _mm256_set1_ps(-QUANTIZE_SATURATION);
+    const __m256 absMask = _mm256_castsi256_ps(_mm256_set1_epi32(0x7fffffff));
+    __m256 m0 = _mm256_setzero_ps(), m1 = _mm256_setzero_ps();
+    size_t i = stream_head(dst, n, sizeof(__m256i));
+    bool stream = i != SIZE_MAX;
+    i = stream ? i : 0;
+    float maxAbs = quantize_scalar(src, dst, i, scale);
+    for (; i + 16 <= n; i += 16) {
+        __m256 x0 = _mm256_loadu_ps(src + i);
+        __m256 x1 = _mm256_loadu_ps(src + i + 8);
+        m0 = _mm256_max_ps(_mm256_and_ps(x0, absMask), m0);
+        m1 = _mm256_max_ps(_mm256_and_ps(x1, absMask), m1);
+        __m256 y0 = _mm256_max_ps(_mm256_min_ps(_mm256_mul_ps(x0, vscale), hi), lo);
+        __m256 y1 = _mm256_max_ps(_mm256_min_ps(_mm256_mul_ps(x1, vscale), hi), lo);
+        store_avx2(dst + i, _mm256_cvtps_epi32(y0), stream);
+        store_avx2(dst + i + 8, _mm256_cvtps_epi32(y1), stream);
+    }
+    for (; i + 8 <= n; i += 8) {
+        __m256 x0 = _mm256_loadu_ps(src + i);
+        m0 = _mm256_max_ps(_mm256_and_ps(x0, absMask), m0);
+        __m256 y0 = _mm256_max_ps(_mm256_min_ps(_mm256_mul_ps(x0, vscale), hi), lo);
+        store_avx2(dst + i, _mm256_cvtps_epi32(y0), stream);
+    }
+    if (stream)
+        _mm_sfence();
+    maxAbs = max_like_simd(reduce_max_avx2(_mm256_max_ps(m0, m1)), maxAbs);
+    return max_like_simd(quantize_scalar(src + i, dst + i, n - i, scale), maxAbs);
+}
+
+__attribute__((target("avx2"))) static void dequantize_avx2(const int32_t *src, float *dst, size_t n,
+                                                          float inverseScale) {
+    const __m256 vscale = _mm256_set1_ps(inverseScale);
+    size_t i = stream_head(dst, n, sizeof(__m256));
+    bool stream = i != SIZE_MAX;
+    i = stream ? i : 0;
+    dequantize_scalar(src, dst, i, inverseScale);
+    for (; i + 16 <= n; i += 16) {
+        __m256i x0 = _mm256_loadu_si256((const __m256i *)(src + i));
+        __m256i x1 = _mm256_loadu_si256((const __m256i *)(src + i + 8));
+        store_avx2(dst + i, _mm256_castps_si256(_mm256_mul_ps(_mm256_cvtepi32_ps(x0), vscale)), stream);
+        store_avx2(dst + i + 8, _mm256_castps_si256(_mm256_mul_ps(_mm256_cvtepi32_ps(x1), vscale)), stream);
+    }
+    if (stream)
+        _mm_sfence();
+    dequantize_scalar(src + i, dst + i, n - i, inverseScale);
+}
+
+__attribute__((target("avx2"))) static float max_abs_avx2(const float *src, size_t n) {
+    const __m256 absMask = _mm256_castsi256_ps(_mm256_set1_epi32(0x7fffffff));
+    // 只读不写，多用两个累加器以掩盖取最大值的依赖链
+    __m256 m0 = _mm256_setzero_ps(), m1 = m0, m2 = m0, m3 = m0;
+    size_t i = 0;
+    for (; i + 32 <= n; i += 32) {
+        m0 = _mm256_max_ps(_mm256_and_ps(_mm256_loadu_ps(src + i), absMask), m0);
+        m1 = _mm256_max_ps(_mm256_and_ps(_mm256_loadu_ps(src + i + 8), absMask), m1);
+        m2 = _mm256_max_ps(_mm256_and_ps(_mm256_loadu_ps(src + i + 16), absMask), m2);
+        m3 = _mm256_max_ps(_mm256_and_ps(_mm256_loadu_ps(src + i + 24), absMask), m3);
+    }
+    float maxAbs = reduce_max_avx2(_mm256_max_ps(_mm256_max_ps(m0, m1), _mm256_max_ps(m2, m3)));
+    return max_like_simd(max_abs_scalar(src + i, n - i), maxAbs);
+}
+
+__attribute__((target("avx2,f16c"))) static inline __m256 load_f16_avx2(const uint16_t *src) {
+    return _mm256_cvtph_ps(_mm_loadu_si128((const __m128i *)src));
+}
+
+/* bfloat16 即 float32 的高 16 位，展开只需零扩展后左移 */
+__attribute__((target("avx2"))) static inline __m256 load_bf16_avx2(const uint16_t *src) {
+    __m256i x = _mm256_cvtepu16_epi32(_mm_loadu_si128((const __m128i *)src));
+    return _mm256_castsi256_ps(_mm256_slli_epi32(x, 16));
+}
+
+__attribute__((target("avx2,f16c"))) static inline void store_f16_avx2(uint16_t *dst, __m256 y) {
+    _mm_storeu_si128((__m128i *)dst, _mm256_cvtps_ph(y, _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC));
+}
+
+/* 没有 AVX512_BF16 时用整数运算模拟 vcvtneps2bf16，规则同 float_to_bfloat16 */
+__attribute__((target("avx2"))) static inline void store_bf16_avx2(uint16_t *dst, __m256 y) {
+    __m256i x = _mm256_castps_si256(y);
+    __m256i absX = _mm256_and_si256(x, _mm256_set1_epi32(0x7fffffff));
+    __m256i high = _mm256_srli_epi32(x, 16);
+    __m256i lsb = _mm256_and_si256(high, _mm256_set1_epi32(1));
+    __m256i rounded = _mm256_srli_epi32(_mm256_add_epi32(_mm256_add_epi32(x, _mm256_set1_epi32(0x7fff)), lsb), 16);
+    __m256i nan = _mm256_or_si256(high, _mm256_set1_epi32(0x40));
+    __m256i zero = _mm256_and_si256(high, _mm256_set1_epi32(0x8000));
+    __m256i r = _mm256_blendv_epi8(rounded, nan, _mm256_cmpgt_epi32(absX, _mm256_set1_epi32(0x7f800000)));
+    r = _mm256_blendv_epi8(r, zero, _mm256_cmpgt_epi32(_mm256_set1_epi32(0x00800000), absX));
+    // packus 在每个 128 位半区内交错两个源，再按 64 位重排回顺序
+    __m256i packed = _mm256_permute4x64_epi64(_mm256_packus_epi32(r, r), 0xD8);
+    _mm_storeu_si128((__m128i *)dst, _mm256_castsi256_si128(packed));
+}
+
+/* 半精度的输出只有 float32 的一半大小，且主要用于逐槽打包，不走非临时存储 */
+template <__m256 (*Load)(const uint16_t *), float (*Widen)(uint16_t)>
+__attribute__((target("avx2,f16c"))) static float quantize_half_avx2(const uint16_t *src, int32_t *dst,
+                                                                   size_t n, float scale) {
+    const __m256 vscale = _mm256_set1_ps(scale);
+    const __m256 hi = _mm256_set1_ps(QUANTIZE_SATURATION);
+    const __m256 lo = _mm256_set1_ps(-QUANTIZE_SATURATION);
+    const __m256 absMask = _mm256_castsi256_ps(_mm256_set1_epi32(0x7fffffff));
+    __m256 m0 = _mm256_setzero_ps(), m1 = _mm256_setzero_ps();
+    size_t i = 0;
+    for (; i + 16 <= n; i += 16) {
+        __m256 x0 = Load(src + i);
+        __m256 x1 = Load(src + i + 8);
+        m0 = _mm256_max_ps(_mm256_and_ps(x0, absMask), m0);
+        m1 = _mm256_max_ps(_mm256_and_ps(x1, absMask), m1);
+        __m256 y0 = _mm256_max_ps(_mm256_min_ps(_mm256_mul_ps(x0, vscale), hi), lo);
+        __m256 y1 = _mm256_max_ps(_mm256_min_ps(_mm256_mul_ps(x1, vscale), hi), lo);
+        _mm256_storeu_si256((__m256i *)(dst + i), _mm256_cvtps_epi32(y0));
+        _mm256_storeu_si256((__m256i *)(dst + i + 8), _mm256_cvtps_epi32(y1));
+    }
+    float maxAbs = reduce_max_avx2(_mm256_max_ps(m0, m1));
+    return max_like_simd(quantize_half_scalar<Widen>(src + i, dst + i, n - i, scale), maxAbs);
+}
+
+template <void (*Store)(uint16_t *, __m256), uint16_t (*Narrow)(float)>
+__attribute__((target("avx2,f16c"))) static void dequantize_half_avx2(const int32_t *src, uint16_t *dst,
+                                                                    size_t n, float inverseScale) {
+    const __m256 vscale = _mm256_set1_ps(inverseScale);
+    size_t i = 0;
+    for (; i + 16 <= n; i += 16) {
+        __m256i x0 = _mm256_loadu_si256((const __m256i *)(src + i));
+        __m256i x1 = _mm256_loadu_si256((const __m256i *)(src + i + 8));
+        Store(dst + i, _mm256_mul_ps(_mm256_cvtepi32_ps(x0), vscale));
+        Store(dst + i + 8, _mm256_mul_ps(_mm256_cvtepi32_ps(x1), vscale));
+    }
+    dequantize_half_scalar<Narrow>(src + i, dst + i, n - i, inverseScale);
+}
+
+template <__m256 (*Load)(const uint16_t *), float (*Widen)(uint16_t)>
+__attribute__((target("avx2,f16c"))) static float max_abs_half_avx2(const uint16_t *src, size_t n) {
+    const __m256 absMask = _mm256_castsi256_ps(_mm256_set1_epi32(0x7fffffff));
+    __m256 m0 = _mm256_setzero_ps(), m1 = m0, m2 = m0, m3 = m0;
+    size_t i = 0;
+    for (; i + 32 <= n; i += 32) {
+        m0 = _mm256_max_ps(_mm256_and_ps(Load(src + i), absMask), m0);
+        m1 = _mm256_max_ps(_mm256_and_ps(Load(src + i + 8), absMask), m1);
+        m2 = _mm256_max_ps(_mm256_and_ps(Load(src + i + 16), absMask), m2);
+        m3 = _mm256_max_ps(_mm256_and_ps(Load(src + i + 24), absMask), m3);
+    }
+    float maxAbs = reduce_max_avx2(_mm256_max_ps(_mm256_max_ps(m0, m1), _mm256_max_ps(m2, m3)));
+    return max_like_simd(max_abs_half_scalar<Widen>(src + i, n - i), maxAbs);
+}
+
+__attribute__((target("avx512f"))) static inline void store_avx512(void *dst, __m512i v, bool stream) {
+    if (stream)
+        _mm512_stream_si512((__m512i *)dst, v);
+    else
+        _mm512_storeu_si512(dst, v);
+}
+
+/* AVX-512 用掩码处理尾部，不再落回标量循环 */
+__attribute__((target("avx512f"))) static float quantize_avx512(const float *src, int32_t *dst,
+                                                              size_t n, float scale) {
+    const __m512 vscale = _mm512_set1_ps(scale);
+    const __m512 hi = _mm512_set1_ps(QUANTIZE_SATURATION);
+    const __m512 lo = _mm512_set1_ps(-QUANTIZE_SATURATION);
+    __m512 m0 = _mm512_setzero_ps(), m1 = _mm512_setzero_ps();
+    size_t i = stream_head(dst, n, sizeof(__m512i));
+    bool stream = i != SIZE_MAX;
+    i = stream ? i : 0;
+    float maxAbs = quantize_scalar(src, dst, i, scale);
+    for (; i + 32 <= n; i += 32) {
+        __m512 x0 = _mm512_loadu_ps(src + i);
+        __m512 x1 = _mm512_loadu_ps(src + i + 16);
+        m0 = _mm512_max_ps(_mm512_abs_ps(x0), m0);
+        m1 = _mm512_max_ps(_mm512_abs_ps(x1), m1);
+        __m512 y0 = _mm512_max_ps(_mm512_min_ps(_mm512_mul_ps(x0, vscale), hi), lo);
+        __m512 y1 = _mm512_max_ps(_mm512_min_ps(_mm512_mul_ps(x1, vscale), hi), lo);
+        store_avx512(dst + i, _mm512_cvtps_epi32(y0), stream);
+        store_avx512(dst + i + 16, _mm512_cvtps_epi32(y1), stream);
+    }
+    if (stream)
+        _mm_sfence();
+    for (; i < n; i += 16) {
+        __mmask16 mask = n - i >= 16 ? (__mmask16)0xFFFF : (__mmask16)((1u << (n - i)) - 1);
+        __m512 x0 = _mm512_maskz_loadu_ps(mask, src + i);
+        m0 = _mm512_max_ps(_mm512_abs_ps(x0), m0);
+        __m512 y0 = _mm512_max_ps(_mm512_min_ps(_mm512_mul_ps(x0, vscale), hi), lo);
+        _mm512_mask_storeu_epi32(dst + i, mask, _mm512_cvtps_epi32(y0));
+    }
+    return max_like_simd(_mm512_reduce_max_ps(_mm512_max_ps(m0, m1)), maxAbs);
+}
+
+__attribute__((target("avx512f"))) static void dequantize_avx512(const int32_t *src, float *dst,
+                                                               size_t n, float inverseScale) {
+    const __m512 vscale = _mm512_set1_ps(inverseScale);
+    size_t i = stream_head(dst, n, sizeof(__m512));
+    bool stream = i != SIZE_MAX;
+    i = stream ? i : 0;
+    dequantize_scalar(src, dst, i, inverseScale);
+    for (; i + 32 <= n; i += 32) {
+        __m512i x0 = _mm512_loadu_si512(src + i);
+        __m512i x1 = _mm512_loadu_si512(src + i + 16);
+        store_avx512(dst + i, _mm512_castps_si512(_mm512_mul_ps(_mm512_cvtepi32_ps(x0), vscale)), stream);
+        store_avx512(dst + i + 16, _mm512_castps_si512(_mm512_mul_ps(_mm512_cvtepi32_ps(x1), vscale)), stream);
+    }
+    if (stream)
+        _mm_sfence();
+    for (; i < n; i += 16) {
+        __mmask16 mask = n - i >= 16 ? (__mmask16)0xFFFF : (__mmask16)((1u << (n - i)) - 1);
+        __m512i x0 = _mm512_maskz_loadu_epi32(mask, src + i);
+        _mm512_mask_storeu_ps(dst + i, mask, _mm512_mul_ps(_mm512_cvtepi32_ps(x0), vscale));
+    }
+}
+
+__attribute__((target("avx512f"))) static float max_abs_avx512(const float *src, size_t n) {
+    __m512 m0 = _mm512_setzero_ps(), m1 = m0, m2 = m0, m3 = m0;
+    size_t i = 0;
+    for (; i + 64 <= n; i += 64) {
+        m0 = _mm512_max_ps(_mm512_abs_ps(_mm512_loadu_ps(src + i)), m0);
+        m1 = _mm512_max_ps(_mm512_abs_ps(_mm512_loadu_ps(src + i + 16)), m1);
+        m2 = _mm512_max_ps(_mm512_abs_ps(_mm512_loadu_ps(src + i + 32)), m2);
+        m3 = _mm512_max_ps(_mm512_abs_ps(_mm512_loadu_ps(src + i + 48)), m3);
+    }
+    for (; i < n; i += 16) {
+        __mmask16 mask = n - i >= 16 ? (__mmask16)0xFFFF : (__mmask16)((1u << (n - i)) - 1);
+        m0 = _mm512_max_ps(_mm512_abs_ps(_mm512_maskz_loadu_ps(mask, src + i)), m0);
+    }
+    return _mm512_reduce_max_ps(_mm512_max_ps(_mm512_max_ps(m0, m1), _mm512_max_ps(m2, m3)));
+}
+
+__attribute__((target("avx512f"))) static inline __m512 load_f16_avx512(const uint16_t *src) {
+    return _mm512_cvtph_ps(_mm256_loadu_si256((const __m256i *)src));
+}
+
+__attribute__((target("avx512f"))) static inline __m512 load_bf16_avx512(const uint16_t *src) {
+    __m512i x = _mm512_cvtepu16_epi32(_mm256_loadu_si256((const __m256i *)src));
+    return _mm512_castsi512_ps(_mm512_slli_epi32(x, 16));
+}
+
+__attribute__((target("avx512f"))) static inline void store_f16_avx512(uint16_t *dst, __m512 y) {
+    _mm256_storeu_si256((__m256i *)dst, _mm512_cvtps_ph(y, _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC));
+}
+
+__attribute__((target("avx512f"))) static inline void store_bf16_emulated_avx512(uint16_t *dst, __m512 y) {
+    __m512i x = _mm512_castps_si512(y);
+    __m512i absX = _mm512_and_si512(x, _mm512_set1_epi32(0x7fffffff));
+    __m512i high = _mm512_srli_epi32(x, 16);
+    __m512i lsb = _mm512_and_si512(high, _mm512_set1_epi32(1));
+    __m512i r = _mm512_srli_epi32(_mm512_add_epi32(_mm512_add_epi32(x, _mm512_set1_epi32(0x7fff)), lsb), 16);
+    r = _mm512_mask_or_epi32(r, _mm512_cmpgt_epi32_mask(absX, _mm512_set1_epi32(0x7f800000)), high,
+                             _mm512_set1_epi32(0x40));
+    r = _mm512_mask_and_epi32(r, _mm512_cmplt_epi32_mask(absX, _mm512_set1_epi32(0x00800000)), high,
+                              _mm512_set1_epi32(0x8000));
+    _mm256_storeu_si256((__m256i *)dst, _mm512_cvtepi32_epi16(r));
+}
+
+template <__m512 (*Load)(const uint16_t *), float (*Widen)(uint16_t)>
+__attribute__((target("avx512f"))) static float quantize_half_avx512(const uint16_t *src, int32_t *dst,
+                                                                   size_t n, float scale) {
+    const __m512 vscale = _mm512_set1_ps(scale);
+    const __m512 hi = _mm512_set1_ps(QUANTIZE_SATURATION);
+    const __m512 lo = _mm512_set1_ps(-QUANTIZE_SATURATION);
+    __m512 m0 = _mm512_setzero_ps(), m1 = _mm512_setzero_ps();
+    size_t i = 0;
+    for (; i + 32 <= n; i += 32) {
+        __m512 x0 = Load(src + i);
+        __m512 x1 = Load(src + i + 16);
+        m0 = _mm512_max_ps(_mm512_abs_ps(x0), m0);
+        m1 = _mm512_max_ps(_mm512_abs_ps(x1), m1);
+        __m512 y0 = _mm512_max_ps(_mm512_min_ps(_mm512_mul_ps(x0, vscale), hi), lo);
+        __m512 y1 = _mm512_max_ps(_mm512_min_ps(_mm512_mul_ps(x1, vscale), hi), lo);
+        _mm512_storeu_si512(dst + i, _mm512_cvtps_epi32(y0));
+        _mm512_storeu_si512(dst + i + 16, _mm512_cvtps_epi32(y1));
+    }
+    for (; i + 16 <= n; i += 16) {
+        __m512 x0 = Load(src + i);
+        m0 = _mm512_max_ps(_mm512_abs_ps(x0), m0);
+        __m512 y0 = _mm512_max_ps(_mm512_min_ps(_mm512_mul_ps(x0, vscale), hi), lo);
+        _mm512_storeu_si512(dst + i, _mm512_cvtps_epi32(y0));
+    }
+    float maxAbs = _mm512_reduce_max_ps(_mm512_max_ps(m0, m1));
+    return max_like_simd(quantize_half_scalar<Widen>(src + i, dst + i, n - i, scale), maxAbs);
+}
+
+template <void (*Store)(uint16_t *, __m512), uint16_t (*Narrow)(float)>
+__attribute__((target("avx512f"))) static void dequantize_half_avx512(const int32_t *src, uint16_t *dst,
+                                                                    size_t n, float inverseScale) {
+    const __m512 vscale = _mm512_set1_ps(inverseScale);
+    size_t i = 0;
+    for (; i + 32 <= n; i += 32) {
+        __m512i x0 = _mm512_loadu_si512(src + i);
+        __m512i x1 = _mm512_loadu_si512(src + i + 16);
+        Store(dst + i, _mm512_mul_ps(_mm512_cvtepi32_ps(x0), vscale));
+        Store(dst + i + 16, _mm512_mul_ps(_mm512_cvtepi32_ps(x1), vscale));
+    }
+    for (; i + 16 <= n; i += 16)
+        Store(dst + i, _mm512_mul_ps(_mm512_cvtepi32_ps(_mm512_loadu_si512(src + i)), vscale));
+    dequantize_half_scalar<Narrow>(src + i, dst + i, n - i, inverseScale);
+}
+
+template <__m512 (*Load)(const uint16_t *), float (*Widen)(uint16_t)>
+__attribute__((target("avx512f"))) static float max_abs_half_avx512(const uint16_t *src, size_t n) {
+    __m512 m0 = _mm512_setzero_ps(), m1 = m0, m2 = m0, m3 = m0;
+    size_t i = 0;
+    for (; i + 64 <= n; i += 64) {
+        m0 = _mm512_max_ps(_mm512_abs_ps(Load(src + i)), m0);
+        m1 = _mm512_max_ps(_mm512_abs_ps(Load(src + i + 16)), m1);
+        m2 = _mm512_max_ps(_mm512_abs_ps(Load(src + i + 32)), m2);
+        m3 = _mm512_max_ps(_mm512_abs_ps(Load(src + i + 48)), m3);
+    }
+    for (; i + 16 <= n; i += 16)
+        m0 = _mm512_max_ps(_mm512_abs_ps(Load(src + i)), m0);
+    float maxAbs = _mm512_reduce_max_ps(_mm512_max_ps(_mm512_max_ps(m0, m1), _mm512_max_ps(m2, m3)));
+    return max_like_simd(max_abs_half_scalar<Widen>(src + i, n - i), maxAbs);
+}
+
+/* vcvtneps2bf16 属于 AVX512_BF16，部分支持 AVX-512 的 CPU 没有，此时用整数模拟 */
+static bool has_avx512_bf16() {
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("avx512bf16");
+}
+
+__attribute__((target("avx512f,avx512bf16"))) static void dequantize_bf16_native_avx512(const int32_t *src,
+                                                                                      uint16_t *dst, size_t n,
+                                                                                      float inverseScale) {
+    const __m512 vscale = _mm512_set1_ps(inverseScale);
+    size_t i = 0;
+    for (; i + 32 <= n; i += 32) {
+        __m512 y0 = _mm512_mul_ps(_mm512_cvtepi32_ps(_mm512_loadu_si512(src + i)), vscale);
+        __m512 y1 = _mm512_mul_ps(_mm512_cvtepi32_ps(_mm512_loadu_si512(src + i + 16)), vscale);
+        _mm512_storeu_si512(dst + i, (__m512i)_mm512_cvtne2ps_pbh(y1, y0));
+    }
+    for (; i + 16 <= n; i += 16) {
+        __m512 y0 = _mm512_mul_ps(_mm512_cvtepi32_ps(_mm512_loadu_si512(src + i)), vscale);
+        _mm256_storeu_si256((__m256i *)(dst + i), (__m256i)_mm512_cvtneps_pbh(y0));
+    }
+    dequantize_half_scalar<float_to_bfloat16>(src + i, dst + i, n - i, inverseScale);
+}
+
+static void dequantize_bf16_avx512(const int32_t *src, uint16_t *dst, size_t n, float inverseScale) {
+    static const bool native = has_avx512_bf16();
+    if (native)
+        dequantize_bf16_native_avx512(src, dst, n, inverseScale);
+    else
+        dequantize_half_avx512<store_bf16_emulated_avx512, float_to_bfloat16>(src, dst, n, inverseScale);
+}
+
+struct QuantizeKernels
+{
+    float (*quantize)(const float *, int32_t *, size_t, float);
+    void (*dequantize)(const int32_t *, float *, size_t, float);
+    float (*maxAbs)(const float *, size_t);
+    float (*quantizeF16)(const uint16_t *, int32_t *, size_t, float);
+    void (*dequantizeF16)(const int32_t *, uint16_t *, size_t, float);
+    float (*maxAbsF16)(const uint16_t *, size_t);
+    float (*quantizeBf16)(const uint16_t *, int32_t *, size_t, float);
+    void (*dequantizeBf16)(const int32_t *, uint16_t *, size_t, float);
+    float (*maxAbsBf16)(const uint16_t *, size_t);
+};
+
+static const QuantizeKernels kKernels[] = {
+    {quantize_scalar, dequantize_scalar, max_abs_scalar,
+     quantize_half_scalar<half_to_float>, dequantize_half_scalar<float_to_half>,
+     max_abs_half_scalar<half_to_float>,
+     quantize_half_scalar<bfloat16_to_float>, dequantize_half_scalar<float_to_bfloat16>,
+     max_abs_half_scalar<bfloat16_to_float>},
+    {quantize_avx2, dequantize_avx2, max_abs_avx2,
+     quantize_half_avx2<load_f16_avx2, half_to_float>, dequantize_half_avx2<store_f16_avx2, float_to_half>,
+     max_abs_half_avx2<load_f16_avx2, half_to_float>,
+     quantize_half_avx2<load_bf16_avx2, bfloat16_to_float>,
+     dequantize_half_avx2<store_bf16_avx2, float_to_bfloat16>,
+     max_abs_half_avx2<load_bf16_avx2, bfloat16_to_float>},
+    {quantize_avx512, dequantize_avx512, max_abs_avx512,
+     quantize_half_avx512<load_f16_avx512, half_to_float>,
+     dequantize_half_avx512<store_f16_avx512, float_to_half>,
+     max_abs_half_avx512<load_f16_avx512, half_to_float>,
+     quantize_half_avx512<load_bf16_avx512, bfloat16_to_float>, dequantize_bf16_avx512,
+     max_abs_half_avx512<load_bf16_avx512, bfloat16_to_float>},
+};
+
+static QuantizeIsa detect_isa() {
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512f"))
+        return QuantizeAvx512;
+    // AVX2 一档的半精度转换用 F16C，实际支持 AVX2 的 CPU 都带有
+    if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("f16c"))
+        return QuantizeAvx2;
+    return QuantizeScalar;
+}
+
+static QuantizeIsa initial_isa() {
+    QuantizeIsa isa = detect_isa();
+    const char *env = getenv(QUANTIZE_ISA_ENV);
+    if (env) {
+        QuantizeIsa requested = strcmp(env, "scalar") == 0 ? QuantizeScalar
+                                : strcmp(env, "avx2") == 0 ? QuantizeAvx2
+                                                           : QuantizeAvx512;
+        LOG_IF(WARNING, requested > isa)
+            << QUANTIZE_ISA_ENV << "=" << env << " is not supported, using " << quantize_isa_name(isa);
+        isa = std::min(requested, isa);
+    }
+    LOG(INFO) << "Quantization kernels: " << quantize_isa_name(isa);
+    return isa;
+}
+
+static std::atomic<int> currentIsa(-1);
+
+static const QuantizeKernels &kernels() {
+    int isa = currentIsa.load(std::memory_order_relaxed);
+    if (isa < 0) {
+        static const QuantizeIsa initial = initial_isa();
+        int expected = -1;
+        currentIsa.compare_exchange_strong(expected, initial);
+        isa = currentIsa.load(std::memory_order_relaxed);
+    }
+    return kKernels[isa];
+}
+
+/**
+ * @brief float32 量化为定点 int32：dst[i] = 饱和(就近偶数舍入(src[i] * scale))。
+ *
+ * @param src 输入，不要求对齐。
+ * @param dst 输出，不能与 src 重叠。
+ * @param n 元素个数。
+ * @param scale 放大倍数。
+ * @return src 的最大绝对值，与转换在同一遍中得到。
+ */
+float quantize(const float *src, int32_t *dst, size_t n, float scale) {
+    return kernels().quantize(src, dst, n, scale);
+}
+
+void dequantize(const int32_t *src, float *dst, size_t n, float inverseScale) {
+    kernels().dequantize(src, dst, n, inverseScale);
+}
+
+float max_abs(const float *src, size_t n) {
+    return kernels().maxAbs(src, n);
+}
+
+/**
+ * @brief IEEE float16 量化为定点 int32，展开在寄存器中完成，不经过 float32 的中间缓冲。
+ *
+ * @param src 输入，按位存放的 float16。
+ * @param dst 输出，不能与 src 重叠。
+ * @param n 元素个数。
+ * @param scale 放大倍数。
+ * @return src 的最大绝对值。
+ */
+float quantize_f16(const uint16_t *src, int32_t *dst, size_t n, float scale) {
+    return kernels().quantizeF16(src, dst, n, scale);
+}
+
+void dequantize_f16(const int32_t *src, uint16_t *dst, size_t n, float inverseScale) {
+    kernels().dequantizeF16(src, dst, n, inverseScale);
+}
+
+float max_abs_f16(const uint16_t *src, size_t n) {
+    return kernels().maxAbsF16(src, n);
+}
+
+float quantize_bf16(const uint16_t *src, int32_t *dst, size_t n, float scale) {
+    return kernels().quantizeBf16(src, dst, n, scale);
+}
+
+void dequantize_bf16(const int32_t *src, uint16_t *dst, size_t n, float inverseScale) {
+    kernels().dequantizeBf16(src, dst, n, inverseScale);
+}
+
+float max_abs_bf16(const uint16_t *src, size_t n) {
+    return kernels().maxAbsBf16(src, n);
+}
+
+QuantizeIsa quantize_isa() {
+    kernels();
+    return (QuantizeIsa)currentIsa.load(std::memory_order_relaxed);
+}
+
+const char *quantize_isa_name(QuantizeIsa isa) {
+    switch (isa) {
+    case QuantizeScalar:
+        return "scalar";
+    case QuantizeAvx2:
+        return "avx2";
+    case QuantizeAvx512:
+        return "avx512";
+    }
+    return "unknown";
+}
+
+QuantizeIsa set_quantize_isa(QuantizeIsa isa) {
+    static const QuantizeIsa supported = detect_isa();
+    isa = std::min(isa, supported);
+    currentIsa.store(isa, std::memory_order_relaxed);
+    return isa;
+}
+
+int32_t block_exponent(float maxAbs) {
+    if (!(maxAbs > 0.0f))
+        return INT32_MIN;
+    if (std::isinf(maxAbs))
+        return 129;
+    int exponent;
+    std::frexp(maxAbs, &exponent);
+    return exponent;
+}
+
+/**
+ * @brief 由全局块指数得到缩放因子。
+ *
+ * 每个量化值小于 2^(31 - ceil(log2(numWorkers)))，numWorkers 个相加仍小于 2^31；
+ * 因子是 2 的幂，乘法和反量化时的倒数都是精确的。
+ *
+ * @param exponent 各 worker 的 block_exponent 取最大值。
+ * @param numWorkers 参与求和的 worker 数。
+ * @return 缩放因子，全零块返回 1。
+ */
+float block_scale(int32_t exponent, int numWorkers) {
+    if (exponent == INT32_MIN)
+        return 1.0f;
+    int headroom = 0;
+    while ((1 << headroom) < numWorkers)
+        headroom++;
+    int64_t shift = 31 - (int64_t)exponent - headroom;
+    return std::ldexp(1.0f, (int)std::clamp<int64_t>(shift, -126, 127));
+}
+
+} // namespace flashreduce
@@ -0,0 +1,55 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+
+/* 设为 scalar、avx2 或 avx512 时强制使用对应实现，不支持的指令集退回运行时探测的结果 */
+#define QUANTIZE_ISA_ENV "FLASHREDUCE_QUANTIZE_ISA"
+/* 小于 2^31 的最大 float，量化结果饱和到 [-QUANTIZE_SATURATION, QUANTIZE_SATURATION] */
+#define QUANTIZE_SATURATION 2147483520.0f
+
+namespace flashreduce {
+
+enum QuantizeIsa
+{
+    QuantizeScalar,
+    QuantizeAvx2,
+    QuantizeAvx512,
+};
+
+/* float32 与定点 int32 之间的转换核，按 CPU 支持的指令集在首次调用时选定。
+ *
+ * quantize 在一遍扫描中完成 x * scale、就近偶数舍入、饱和，并顺带返回 src 的最大绝对值，
+ * 调用者可据此判断是否发生了饱和或为下一次选择缩放因子；NaN 不计入最大绝对值，
+ * 量化为 QUANTIZE_SATURATION。dequantize 计算 src * inverseScale。
+ * 各实现的结果逐位一致。 */
+float quantize(const float *src, int32_t *dst, size_t n, float scale);
+void dequantize(const int32_t *src, float *dst, size_t n, float inverseScale);
+float max_abs(const float *src, size_t n);
+
+/* 半精度张量按位以 uint16_t 存放。量化时在寄存器中展开为 float32 后与 quantize 走同样的步骤，
+ * 结果与先展开再调用 quantize 逐位一致；反量化得到的 float32 以就近偶数舍入收窄，
+ * float16 超出范围时为无穷，bfloat16 的非规格化数冲为零，与 vcvtneps2bf16 一致。 */
+float quantize_f16(const uint16_t *src, int32_t *dst, size_t n, float scale);
+void dequantize_f16(const int32_t *src, uint16_t *dst, size_t n, float inverseScale);
+float max_abs_f16(const uint16_t *src, size_t n);
+float quantize_bf16(const uint16_t *src, int32_t *dst, size_t n, float scale);
+void dequantize_bf16(const int32_t *src, uint16_t *dst, size_t n, float inverseScale);
+float max_abs_bf16(const uint16_t *src, size_t n);
+
+/* 单个元素的转换，与上面的核使用同样的舍入规则 */
+float half_to_float(uint16_t h);
+uint16_t float_to_half(float f);
+float bfloat16_to_float(uint16_t b);
+uint16_t float_to_bfloat16(float f);
+
+QuantizeIsa quantize_isa();
+const char *quantize_isa_name(QuantizeIsa isa);
+/* 基准测试用：在当前 CPU 支持的前提下切换实现，返回实际生效的指令集 */
+QuantizeIsa set_quantize_isa(QuantizeIsa isa);
+
+/* 块内最大绝对值 m 满足 m < 2^exponent；m 为 0 时返回 INT32_MIN，即取最大值归约的单位元 */
+int32_t block_exponent(float maxAbs);
+/* 各 worker 块指数取最大值后得到的缩放因子，2 的幂，保证 numWorkers 个量化值相加不溢出 */
+float block_scale(int32_t exponent, int numWorkers);
+
+} // namespace flashreduce
@@ -0,0 +1,542 @@
+#include "rdma_context.h"
+#include <algorithm>
+#include <atomic>
+#include <cstring>
+#include <thread>
+
+const int kMinRnrTimer = 0x12;
+const int kTimeout = 14;
+const int kRetryCount = 7;
+const int kRnrRetry = 7;
+const int kMaxRdAtomic = 1;
+/* 并行迁移时每个线程一次领取的 QP 数，也是启用一个线程所需的最少 QP 数 */
+const int kQpsPerChunk = 16;
+
+/**
+ * @brief 打开 RDMA 设备并缓存其属性。
+ *
+ * 设备列表在上下文的整个生命周期内保留，保证 device() 返回的指针始终有效。
+ * 端口号或 GID 索引为自动时使用 resolve_gid 按设备缓存的选择，两者须同时自动或同时指定。
+ *
+ * @param deviceName 设备名，例如 mlx5_0。
+ * @param port 端口号，IB_PORT_AUTO 表示自动选择。
+ * @param gidIndex GID 索引，GID_INDEX_AUTO 表示自动选择。
+ */
+RdmaContext::RdmaContext(const std::string &deviceName, int port, int gidIndex)
+    : device_(nullptr), port_(port), gidIndex_(gidIndex), inlineLimits_{0, 0, 0} {
+    int numDevices = 0;
+    devices_ = ibv_get_device_list(&numDevices);
+    CHECK(devices_) << "No RDMA devices found";
+    for (int i = 0; i < numDevices; ++i) {
+        if (deviceName == ibv_get_device_name(devices_[i])) {
+            device_ = devices_[i];
+            break;
+        }
+    }
+    CHECK(device_) << "RDMA device " << deviceName << " not found";
+    context_ = ibv_open_device(device_);
+    CHECK(context_) << "Failed to open RDMA device " << deviceName;
+    pd_ = ibv_alloc_pd(context_);
+    CHECK(pd_) << "Failed to allocate protection domain";
+    std::memset(&deviceAttr_, 0, sizeof(deviceAttr_));
+    CHECK(ibv_query_device(context_, &deviceAttr_) == 0) << "Failed to query device attributes";
+    if (port_ == IB_PORT_AUTO || gidIndex_ == GID_INDEX_AUTO) {
+        CHECK(port_ == IB_PORT_AUTO && gidIndex_ == GID_INDEX_AUTO)
+            << "Port and GID index must be both automatic or both explicit";
+        const GidSelection &selection = resolve_gid(context_);
+        port_ = selection.port;
+        gidIndex_ = selection.gid_index;
+        gid_ = selection.gid;
+        roceVersion_ = selection.roce_version;
+    } else {
+        // 显式指定的索引指向空表项时连接只会静默重传，在这里直接报错
+        struct ibv_gid_entry entry;
+        CHECK(ibv_query_gid_ex(context_, port_, gidIndex_, &entry, 0) == 0)
+            << "GID index " << gidIndex_ << " on port " << port_ << " of " << deviceName
+            << " is empty";
+        gid_ = entry.gid;
+        roceVersion_ = entry.gid_type == IBV_GID_TYPE_ROCE_V2   ? 2
+                       : entry.gid_type == IBV_GID_TYPE_ROCE_V1 ? 1
+                                                                : 0;
+    }
+    std::memset(&portAttr_, 0, sizeof(portAttr_));
+    CHECK(ibv_query_port(context_, port_, &portAttr_) == 0) << "Failed to query port attributes";
+    LOG_IF(WARNING, portAttr_.state != IBV_PORT_ACTIVE)
+        << "Port " << port_ << " of " << deviceName << " is not active";
+    numaNode_ = get_device_numa_node(device_);
+}
+
+RdmaContext::~RdmaContext() {
+    ibv_dealloc_pd(pd_);
+    ibv_close_device(context_);
+    ibv_free_device_list(devices_);
+}
+
+/**
+ * @brief 为 UD 发送创建指向远端的地址句柄。
+ *
+ * 返回的句柄由调用者使用 ibv_destroy_ah 释放，且必须先于上下文释放。
+ *
+ * @param remote 远端 QP 信息，只使用 gid 和 lid。
+ * @return 地址句柄。
+ */
+ibv_ah *RdmaContext::createAh(const QpInfo &remote) const {
+    struct ibv_ah_attr attr;
+    std::memset(&attr, 0, sizeof(attr));
+    attr.is_global = 1;
+    attr.dlid = remote.lid;
+    attr.port_num = port_;
+    attr.grh.dgid = remote.gid;
+    attr.grh.sgid_index = gidIndex_;
+    attr.grh.hop_limit = 0xFF;
+    ibv_ah *ah = ibv_create_ah(pd_, &attr);
+    CHECK(ah) << "Failed to create address handle";
+    return ah;
+}
+
+static int inline_slot(ibv_qp_type type) {
+    switch (type) {
+    case IBV_QPT_RC:
+        return 0;
+    case IBV_QPT_UC:
+        return 1;
+    case IBV_QPT_UD:
+        return 2;
+    default:
+        return -1;
+    }
+}
+
+uint32_t RdmaContext::inlineLimit(ibv_qp_type type) const {
+    int slot = inline_slot(type);
+    return slot < 0 ? 0 : inlineLimits_[slot];
+}
+
+void RdmaContext::setInlineLimit(ibv_qp_type type, uint32_t limit) {
+    int slot = inline_slot(type);
+    if (slot >= 0)
+        inlineLimits_[slot] = limit;
+}
+
+CompletionQueue::CompletionQueue(RdmaContext &context, int depth, bool withChannel)
+    : channel_(nullptr) {
+    if (withChannel) {
+        channel_ = ibv_create_comp_channel(context.context());
+        CHECK(channel_) << "Failed to create completion channel";
+    }
+    cq_ = ibv_create_cq(context.context(), depth, nullptr, channel_, 0);
+    CHECK(cq_) << "Failed to create completion queue with depth " << depth;
+}
+
+CompletionQueue::~CompletionQueue() {
+    if (cq_)
+        ibv_destroy_cq(cq_);
+    if (channel_)
+        ibv_destroy_comp_channel(channel_);
+}
+
+CompletionQueue::CompletionQueue(CompletionQueue &&other) noexcept
+    : cq_(other.cq_), channel_(other.channel_) {
+    other.cq_ = nullptr;
+    other.channel_ = nullptr;
+}
+
+MemoryRegion::MemoryRegion(RdmaContext &context, void *addr, size_t length, int access) {
+    mr_ = ibv_reg_mr(context.pd(), addr, length, access);
+    CHECK(mr_) << "Failed to register memory region of size " << length;
+}
+
+MemoryRegion::~MemoryRegion() {
+    if (mr_)
+        ibv_dereg_mr(mr_);
+}
+
+MemoryRegion::MemoryRegion(MemoryRegion &&other) noexcept : mr_(other.mr_) {
+    other.mr_ = nullptr;
+}
+
+/**
+ * @brief 创建共享接收队列。创建后（以及可选的 attachBuffers 之后）调用一次 refill
+ * 投递满 maxWr 个接收请求。
+ *
+ * @param context 设备上下文。
+ * @param maxWr SRQ 深度，即所有挂接 QP 共用的接收请求总数。
+ * @param lowWatermark 已投递数不高于该值时 refill 才补充。
+ * @param batch 每次 ibv_post_srq_recv 串联的接收请求数。
+ */
+SharedReceiveQueue::SharedReceiveQueue(RdmaContext &context, uint32_t maxWr,
+                                       uint32_t lowWatermark, uint32_t batch)
+    : maxWr_(maxWr), lowWatermark_(lowWatermark), batch_(batch), posted_(0),
+      bufferAddr_(nullptr), slotSize_(0), lkey_(0) {
+    CHECK(batch_ > 0 && lowWatermark_ < maxWr_) << "Invalid SRQ watermark " << lowWatermark_
+                                                 << " or batch " << batch_;
+    struct ibv_srq_init_attr initAttr;
+    std::memset(&initAttr, 0, sizeof(initAttr));
+    initAttr.attr.max_wr = maxWr_;
+    initAttr.attr.max_sge = 1;
+    srq_ = ibv_create_srq(context.pd(), &initAttr);
+    CHECK(srq_) << "Failed to create shared receive queue with depth " << maxWr_;
+    wrs_.resize(batch_);
+    sges_.resize(batch_);
+    freeSlots_.resize(maxWr_, 0);
+}
+
+SharedReceiveQueue::~SharedReceiveQueue() {
+    ibv_destroy_srq(srq_);
+}
+
+/**
+ * @brief 为每个接收请求绑定 slotSize 字节的接收缓冲区，必须在首次 refill 之前调用。
+ *
+ * @param mr 至少 capacity() * slotSize 字节的内存区域。
+ * @param slotSize 每个接收缓冲区的大小。
+ */
+void SharedReceiveQueue::attachBuffers(const MemoryRegion &mr, size_t slotSize) {
+    CHECK(posted_ == 0) << "SRQ buffers must be attached before the first refill";
+    CHECK(mr.length() >= maxWr_ * slotSize) << "SRQ buffer region is too small";
+    bufferAddr_ = mr.addr();
+    slotSize_ = slotSize;
+    lkey_ = mr.lkey();
+    freeSlots_.clear();
+    for (uint64_t slot = maxWr_; slot > 0; slot--)
+        freeSlots_.push_back(slot - 1);
+}
+
+/**
+ * @brief 记录一个接收完成。未绑定缓冲区时接收请求立即可以重新投递；
+ * 绑定缓冲区时需在处理完数据后调用 release 归还。
+ *
+ * 出错或被冲刷（QP 出错、销毁）的接收完成同样消耗了 SRQ 中的请求，也须传入，
+ * 否则 posted_ 只增不减，refill 会越投越少；绑定缓冲区时其缓冲区也要照常 release。
+ * verbs 规定出错完成的 opcode 无定义，因此只在成功时检查其为接收完成；
+ * wr_id 是 refill 时填入的缓冲区序号，对所有完成都据此拦截误传的完成。
+ *
+ * @param wc 来自挂接 QP 的接收完成，可以是出错完成。
+ */
+void SharedReceiveQueue::consumed(const ibv_wc &wc) {
+    CHECK(wc.status != IBV_WC_SUCCESS || (wc.opcode & IBV_WC_RECV))
+        << "Completion of opcode " << wc.opcode << " on QP " << wc.qp_num
+        << " did not consume a receive WR";
+    CHECK(wc.wr_id < maxWr_ && posted_ > 0)
+        << "Receive completion with wr_id " << wc.wr_id << " on QP " << wc.qp_num
+        << " does not belong to this SRQ";
+    posted_--;
+    if (slotSize_ == 0)
+        freeSlots_.push_back(wc.wr_id);
+}
+
+void SharedReceiveQueue::release(uint64_t wrId) {
+    freeSlots_.push_back(wrId);
+}
+
+/**
+ * @brief 已投递数不高于低水位时，把空闲接收请求按批串联投递回 SRQ。
+ *
+ * 未到低水位时只有一次比较，可以在代理线程每轮调用。
+ *
+ * @return 本次投递的接收请求数。
+ */
+int SharedReceiveQueue::refill() {
+    if (posted_ > lowWatermark_ || freeSlots_.empty())
+        return 0;
+    int total = 0;
+    while (!freeSlots_.empty()) {
+        uint32_t n = std::min<size_t>(batch_, freeSlots_.size());
+        for (uint32_t i = 0; i < n; i++) {
+            uint64_t slot = freeSlots_.back();
+            freeSlots_.pop_back();
+            std::memset(&wrs_[i], 0, sizeof(wrs_[i]));
+            wrs_[i].wr_id = slot;
+            wrs_[i].next = i + 1 < n ? &wrs_[i + 1] : nullptr;
+            if (slotSize_ > 0) {
+                sges_[i].addr = (uintptr_t)buffer(slot);
+                sges_[i].length = (uint32_t)slotSize_;
+                sges_[i].lkey = lkey_;
+                wrs_[i].sg_list = &sges_[i];
+                wrs_[i].num_sge = 1;
+            }
+        }
+        struct ibv_recv_wr *bad_wr = nullptr;
+        int ret = ibv_post_srq_recv(srq_, wrs_.data(), &bad_wr);
+        CHECK(ret == 0) << "Failed to post " << n << " receive WRs to SRQ, ret = " << ret;
+        posted_ += n;
+        total += n;
+    }
+    return total;
+}
+
+QueuePair::QueuePair(RdmaContext &context, const QueuePairConfig &config, CompletionQueue &cq)
+    : context_(&context) {
+    create(config, cq.cq(), cq.cq());
+}
+
+QueuePair::QueuePair(RdmaContext &context, const QueuePairConfig &config,
+                     CompletionQueue &sendCq, CompletionQueue &recvCq)
+    : context_(&context) {
+    create(config, sendCq.cq(), recvCq.cq());
+}
+
+/**
+ * @brief 创建 QP 并协商内联上限。
+ *
+ * 设备不支持请求的内联大小时 ibv_create_qp 失败，此时减半重试直到成功。
+ * maxInlineData 为 RDMA_INLINE_AUTO 时从上下文缓存的结果（首次为 RDMA_INLINE_PROBE）
+ * 开始协商，并把驱动实际给出的上限记回上下文，之后同类型的 QP 一次创建成功。
+ */
+void QueuePair::create(const QueuePairConfig &config, ibv_cq *sendCq, ibv_cq *recvCq) {
+    struct ibv_qp_init_attr initAttr;
+    bool autoInline = config.maxInlineData == RDMA_INLINE_AUTO;
+    uint32_t inlineData = config.maxInlineData;
+    if (autoInline) {
+        inlineData = context_->inlineLimit(config.type);
+        if (inlineData == 0)
+            inlineData = RDMA_INLINE_PROBE;
+    }
+    for (;;) {
+        std::memset(&initAttr, 0, sizeof(initAttr));
+        initAttr.send_cq = sendCq;
+        initAttr.recv_cq = recvCq;
+        initAttr.srq = config.srq;
+        initAttr.qp_type = config.type;
+        initAttr.sq_sig_all = config.sqSigAll;
+        initAttr.cap.max_send_wr = config.maxSendWr;
+        initAttr.cap.max_recv_wr = config.maxRecvWr;
+        initAttr.cap.max_send_sge = config.maxSendSge;
+        initAttr.cap.max_recv_sge = config.maxRecvSge;
+        initAttr.cap.max_inline_data = inlineData;
+        qp_ = ibv_create_qp(context_->pd(), &initAttr);
+        if (qp_ || inlineData == 0)
+            break;
+        inlineData /= 2;
+    }
+    CHECK(qp_) << "Failed to create queue pair of type " << config.type;
+    if (!autoInline && initAttr.cap.max_inline_data < config.maxInlineData)
+        LOG(WARNING) << "Device only allows " << initAttr.cap.max_inline_data
+                     << " bytes of inline data, requested " << config.maxInlineData;
+    if (autoInline)
+        context_->setInlineLimit(config.type, initAttr.cap.max_inline_data);
+    maxInline_ = initAttr.cap.max_inline_data;
+    type_ = config.type;
+    state_ = IBV_QPS_RESET;
+    psn_ = config.psn & 0xFFFFFF;
+    access_ = config.access;
+    pathMtu_ = RDMA_MTU_AUTO;
+}
+
+QueuePair::~QueuePair() {
+    if (qp_)
+        ibv_destroy_qp(qp_);
+}
+
+QueuePair::QueuePair(QueuePair &&other) noexcept
+    : context_(other.context_), qp_(other.qp_), type_(other.type_), state_(other.state_),
+      psn_(other.psn_), access_(other.access_), maxInline_(other.maxInline_),
+      pathMtu_(other.pathMtu_) {
+    other.qp_ = nullptr;
+}
+
+/**
+ * @brief 生成交换给对端的本地 QP 信息。
+ *
+ * @param mr 对端写入的目标内存区域，为空时 rkey/raddr 置零（例如 UD 或纯 SEND）。
+ * @return 本地 QpInfo。
+ */
+QpInfo QueuePair::localInfo(const MemoryRegion *mr) const {
+    QpInfo info;
+    std::memset(&info, 0, sizeof(info));
+    if (mr) {
+        info.rkey = mr->rkey();
+        info.raddr = mr->addr();
+    }
+    info.qp_num = qp_->qp_num;
+    info.psn = psn_;
+    info.gid = context_->gid();
+    info.lid = context_->lid();
+    info.mtu = context_->activeMtu();
+    return info;
+}
+
+void QueuePair::toInit() {
+    struct ibv_qp_attr attr;
+    std::memset(&attr, 0, sizeof(attr));
+    attr.qp_state = IBV_QPS_INIT;
+    attr.port_num = context_->port();
+    attr.pkey_index = 0;
+    int mask = IBV_QP_STATE | IBV_QP_PORT | IBV_QP_PKEY_INDEX;
+    if (type_ == IBV_QPT_UD) {
+        attr.qkey = RDMA_UD_QKEY;
+        mask |= IBV_QP_QKEY;
+    } else {
+        attr.qp_access_flags = access_;
+        mask |= IBV_QP_ACCESS_FLAGS;
+    }
+    int ret = ibv_modify_qp(qp_, &attr, mask);
+    CHECK(ret == 0) << "Failed to modify QP " << qp_->qp_num << " to INIT, ret = " << ret;
+    state_ = IBV_QPS_INIT;
+}
+
+/**
+ * @brief 迁移到 RTR。UD 不需要对端信息，remote 与 mtu 被忽略。
+ *
+ * @param remote 对端 QP 信息。
+ * @param mtu 路径 MTU，RDMA_MTU_AUTO 表示取两端 active_mtu 的较小值，见 negotiate_mtu。
+ */
+void QueuePair::toRtr(const QpInfo &remote, ibv_mtu mtu) {
+    struct ibv_qp_attr attr;
+    std::memset(&attr, 0, sizeof(attr));
+    attr.qp_state = IBV_QPS_RTR;
+    int mask = IBV_QP_STATE;
+    // UD 没有路径 MTU，单个消息不能超过本端的 active_mtu
+    pathMtu_ = context_->activeMtu();
+    if (type_ != IBV_QPT_UD) {
+        pathMtu_ = negotiate_mtu(context_->activeMtu(), remote, mtu);
+        attr.path_mtu = pathMtu_;
+        attr.dest_qp_num = remote.qp_num;
+        attr.rq_psn = remote.psn;
+        attr.ah_attr.is_global = 1;
+        attr.ah_attr.dlid = remote.lid;
+        attr.ah_attr.port_num = context_->port();
+        attr.ah_attr.grh.dgid = remote.gid;
+        attr.ah_attr.grh.sgid_index = context_->gidIndex();
+        attr.ah_attr.grh.hop_limit = 0xFF;
+        mask |= IBV_QP_AV | IBV_QP_PATH_MTU | IBV_QP_DEST_QPN | IBV_QP_RQ_PSN;
+    }
+    if (type_ == IBV_QPT_RC) {
+        attr.max_dest_rd_atomic = 1;
+        attr.min_rnr_timer = kMinRnrTimer;
+        mask |= IBV_QP_MAX_DEST_RD_ATOMIC | IBV_QP_MIN_RNR_TIMER;
+    }
+    int ret = ibv_modify_qp(qp_, &attr, mask);
+    CHECK(ret == 0) << "Failed to modify QP " << qp_->qp_num << " to RTR, ret = " << ret;
+    state_ = IBV_QPS_RTR;
+}
+
+void QueuePair::toRts() {
+    struct ibv_qp_attr attr;
+    std::memset(&attr, 0, sizeof(attr));
+    attr.qp_state = IBV_QPS_RTS;
+    attr.sq_psn = psn_;
+    int mask = IBV_QP_STATE | IBV_QP_SQ_PSN;
+    if (type_ == IBV_QPT_RC) {
+        attr.timeout = kTimeout;
+        attr.retry_cnt = kRetryCount;
+        attr.rnr_retry = kRnrRetry;
+        attr.max_rd_atomic = kMaxRdAtomic;
+        mask |= IBV_QP_TIMEOUT | IBV_QP_RETRY_CNT | IBV_QP_RNR_RETRY | IBV_QP_MAX_QP_RD_ATOMIC;
+    }
+    int ret = ibv_modify_qp(qp_, &attr, mask);
+    CHECK(ret == 0) << "Failed to modify QP " << qp_->qp_num << " to RTS, ret = " << ret;
+    state_ = IBV_QPS_RTS;
+}
+
+/**
+ * @brief 完成从当前状态到 RTS 的全部迁移。
+ *
+ * 已经处于 INIT 的 QP（例如交换信息前提前迁移以便预投递接收）跳过 INIT。
+ *
+ * @param remote 对端 QP 信息。
+ * @param mtu 路径 MTU，RDMA_MTU_AUTO 表示自动协商。
+ */
+void QueuePair::connect(const QpInfo &remote, ibv_mtu mtu) {
+    if (state_ == IBV_QPS_RESET)
+        toInit();
+    toRtr(remote, mtu);
+    toRts();
+}
+
+/**
+ * @brief 批量创建 QP，第 i 个 QP 的发送和接收都使用 cqs[i % cqs.size()]。
+ *
+ * @param context 设备上下文。
+ * @param config 所有 QP 共用的配置。
+ * @param cqs 轮流分配给 QP 的 CQ，不能为空。
+ * @param count QP 个数。
+ * @return 处于 RESET 状态的 QP。
+ */
+std::vector<QueuePair> create_queue_pairs(RdmaContext &context, const QueuePairConfig &config,
+                                          std::vector<CompletionQueue> &cqs, int count) {
+    CHECK(!cqs.empty()) << "At least one completion queue is required";
+    std::vector<QueuePair> qps;
+    qps.reserve(count);
+    for (int i = 0; i < count; i++)
+        qps.emplace_back(context, config, cqs[i % cqs.size()]);
+    return qps;
+}
+
+/**
+ * @brief 在一次往返内交换全部 QpInfo。
+ *
+ * 两端的 QP 个数必须相同，对端第 i 个 QpInfo 对应本端第 i 个 QP。
+ *
+ * @param sock 已建立的带外连接。
+ * @param local 本端所有 QP 的信息。
+ * @return 对端所有 QP 的信息。
+ */
+std::vector<QpInfo> exchange_qp_infos(SocketEndpoint &sock, const std::vector<QpInfo> &local) {
+    std::vector<QpInfo> remote(local.size());
+    int ret = sock.syncData(local.size() * sizeof(QpInfo), local.data(), remote.data());
+    CHECK(ret == 0) << "Failed to exchange " << local.size() << " QP infos, ret = " << ret;
+    return remote;
+}
+
+/* 将 [0, count) 按 kQpsPerChunk 分块，由至多 numThreads 个线程动态领取执行 */
+template <typename Fn>
+static void parallel_chunks(size_t count, int numThreads, Fn fn) {
+    if (numThreads <= 0)
+        numThreads = std::max(1u, std::thread::hardware_concurrency());
+    size_t chunks = (count + kQpsPerChunk - 1) / kQpsPerChunk;
+    numThreads = (int)std::min<size_t>(numThreads, chunks);
+    if (numThreads <= 1) {
+        for (size_t i = 0; i < count; i++)
+            fn(i);
+        return;
+    }
+    std::atomic<size_t> next(0);
+    auto worker = [&]() {
+        size_t begin;
+        while ((begin = next.fetch_add(kQpsPerChunk, std::memory_order_relaxed)) < count) {
+            size_t end = std::min(begin + kQpsPerChunk, count);
+            for (size_t i = begin; i < end; i++)
+                fn(i);
+        }
+    };
+    std::vector<std::thread> threads;
+    threads.reserve(numThreads - 1);
+    for (int t = 1; t < numThreads; t++)
+        threads.emplace_back(worker);
+    worker();
+    for (auto &thread : threads)
+        thread.join();
+}
+
+/**
+ * @brief 并行地将 QP 迁移到 INIT。
+ *
+ * 交换 QpInfo 之前调用，以便在对端开始发送前预投递接收请求。
+ *
+ * @param qps 待迁移的 QP。
+ * @param numThreads 线程数，0 表示取 CPU 核数。
+ */
+void init_queue_pairs(std::vector<QueuePair> &qps, int numThreads) {
+    parallel_chunks(qps.size(), numThreads, [&](size_t i) {
+        if (qps[i].state() == IBV_QPS_RESET)
+            qps[i].toInit();
+    });
+}
+
+/**
+ * @brief 并行地将 QP 迁移到 RTS。
+ *
+ * 每个 QP 的迁移互相独立，verbs 对不同 QP 的 modify 可以并发调用，
+ * 启动耗时主要花在驱动的 modify_qp 命令上，因此按线程数近似线性缩短。
+ *
+ * @param qps 待连接的 QP。
+ * @param remote 与 qps 一一对应的对端 QP 信息。
+ * @param mtu 路径 MTU，RDMA_MTU_AUTO 表示每个 QP 与对端自动协商。
+ * @param numThreads 线程数，0 表示取 CPU 核数。
+ */
+void connect_queue_pairs(std::vector<QueuePair> &qps, const std::vector<QpInfo> &remote,
+                         ibv_mtu mtu, int numThreads) {
+    CHECK_EQ(qps.size(), remote.size()) << "QP count mismatch with remote side";
+    parallel_chunks(qps.size(), numThreads, [&](size_t i) { qps[i].connect(remote[i], mtu); });
+}
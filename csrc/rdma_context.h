@@ -0,0 +1,210 @@
+#pragma once
+#include "rdma_utils.h"
+#include "socket_endpoint.h"
+#include <infiniband/verbs.h>
+#include <glog/logging.h>
+#include <cstddef>
+#include <string>
+#include <vector>
+
+/* UD QP 使用的 Q_Key，收发两端必须一致 */
+#define RDMA_UD_QKEY 0x11111111
+
+#define RDMA_DEFAULT_ACCESS (IBV_ACCESS_LOCAL_WRITE | IBV_ACCESS_REMOTE_WRITE)
+
+/* QueuePairConfig::maxInlineData 取该值时向设备协商尽可能大的内联上限 */
+#define RDMA_INLINE_AUTO UINT32_MAX
+/* 协商内联上限时的起始探测值 */
+#define RDMA_INLINE_PROBE 1024
+
+/* 设备上下文：打开设备、分配 PD，并在构造时一次性缓存设备属性、端口属性和 GID，
+ * 之后创建 CQ/QP/MR 不再查询设备，批量创建数百个 QP 时只剩下 verbs 本身的开销。
+ * 不可拷贝；依赖它的 CompletionQueue/QueuePair/MemoryRegion 必须先于它析构。 */
+class RdmaContext
+{
+public:
+    RdmaContext(const std::string &deviceName, int port = IB_PORT_AUTO, int gidIndex = GID_INDEX_AUTO);
+    ~RdmaContext();
+    RdmaContext(const RdmaContext &) = delete;
+    RdmaContext &operator=(const RdmaContext &) = delete;
+
+    ibv_device *device() const { return device_; }
+    ibv_context *context() const { return context_; }
+    ibv_pd *pd() const { return pd_; }
+    int port() const { return port_; }
+    int gidIndex() const { return gidIndex_; }
+    const ibv_gid &gid() const { return gid_; }
+    /* 0 为 InfiniBand，1 为 RoCEv1，2 为 RoCEv2 */
+    int roceVersion() const { return roceVersion_; }
+    uint16_t lid() const { return portAttr_.lid; }
+    ibv_mtu activeMtu() const { return portAttr_.active_mtu; }
+    const ibv_port_attr &portAttr() const { return portAttr_; }
+    const ibv_device_attr &deviceAttr() const { return deviceAttr_; }
+    int numaNode() const { return numaNode_; }
+
+    ibv_ah *createAh(const QpInfo &remote) const;
+
+    /* 各 QP 类型协商出的内联上限，0 表示尚未协商 */
+    uint32_t inlineLimit(ibv_qp_type type) const;
+    void setInlineLimit(ibv_qp_type type, uint32_t limit);
+
+private:
+    ibv_device **devices_;
+    ibv_device *device_;
+    ibv_context *context_;
+    ibv_pd *pd_;
+    int port_;
+    int gidIndex_;
+    ibv_gid gid_;
+    int roceVersion_;
+    ibv_port_attr portAttr_;
+    ibv_device_attr deviceAttr_;
+    int numaNode_;
+    uint32_t inlineLimits_[3];
+};
+
+/* 完成队列，可选绑定完成通道以便代理线程阻塞等待。可移动，不可拷贝 */
+class CompletionQueue
+{
+public:
+    CompletionQueue(RdmaContext &context, int depth, bool withChannel = false);
+    ~CompletionQueue();
+    CompletionQueue(CompletionQueue &&other) noexcept;
+    CompletionQueue(const CompletionQueue &) = delete;
+    CompletionQueue &operator=(const CompletionQueue &) = delete;
+
+    ibv_cq *cq() const { return cq_; }
+    ibv_comp_channel *channel() const { return channel_; }
+
+private:
+    ibv_cq *cq_;
+    ibv_comp_channel *channel_;
+};
+
+/* 注册内存区域，不拥有 addr 指向的内存。可移动，不可拷贝 */
+class MemoryRegion
+{
+public:
+    MemoryRegion(RdmaContext &context, void *addr, size_t length, int access = RDMA_DEFAULT_ACCESS);
+    ~MemoryRegion();
+    MemoryRegion(MemoryRegion &&other) noexcept;
+    MemoryRegion(const MemoryRegion &) = delete;
+    MemoryRegion &operator=(const MemoryRegion &) = delete;
+
+    ibv_mr *mr() const { return mr_; }
+    void *addr() const { return mr_->addr; }
+    size_t length() const { return mr_->length; }
+    uint32_t lkey() const { return mr_->lkey; }
+    uint32_t rkey() const { return mr_->rkey; }
+
+private:
+    ibv_mr *mr_;
+};
+
+/* 共享接收队列：设备上所有挂接的 QP 共用一份接收请求，低于低水位时按批补充，
+ * 每批用 next 串成一条链，一次 ibv_post_srq_recv 提交。可选地为每个接收请求
+ * 绑定固定大小的接收缓冲区，wr_id 为缓冲区序号。
+ * 不是线程安全的，consumed/refill 应只由一个代理线程调用。 */
+class SharedReceiveQueue
+{
+public:
+    SharedReceiveQueue(RdmaContext &context, uint32_t maxWr, uint32_t lowWatermark,
+                       uint32_t batch);
+    ~SharedReceiveQueue();
+    SharedReceiveQueue(const SharedReceiveQueue &) = delete;
+    SharedReceiveQueue &operator=(const SharedReceiveQueue &) = delete;
+
+    ibv_srq *srq() const { return srq_; }
+    uint32_t posted() const { return posted_; }
+    uint32_t capacity() const { return maxWr_; }
+
+    void attachBuffers(const MemoryRegion &mr, size_t slotSize);
+    void *buffer(uint64_t wrId) const { return (char *)bufferAddr_ + wrId * slotSize_; }
+    void consumed(const ibv_wc &wc);
+    void release(uint64_t wrId);
+    int refill();
+
+private:
+    ibv_srq *srq_;
+    uint32_t maxWr_;
+    uint32_t lowWatermark_;
+    uint32_t batch_;
+    uint32_t posted_;
+    void *bufferAddr_;
+    size_t slotSize_;
+    uint32_t lkey_;
+    /* 可投递的缓冲区序号；未绑定缓冲区时只用其长度计数 */
+    std::vector<uint64_t> freeSlots_;
+    std::vector<ibv_recv_wr> wrs_;
+    std::vector<ibv_sge> sges_;
+};
+
+struct QueuePairConfig
+{
+    ibv_qp_type type = IBV_QPT_RC;
+    uint32_t maxSendWr = 256;
+    uint32_t maxRecvWr = 256;
+    uint32_t maxSendSge = 1;
+    uint32_t maxRecvSge = 1;
+    uint32_t maxInlineData = RDMA_INLINE_AUTO;
+    int sqSigAll = 0;
+    uint32_t psn = 0;
+    int access = RDMA_DEFAULT_ACCESS;
+    ibv_srq *srq = nullptr;
+};
+
+/* RC/UC/UD 队列对。发送和接收 CQ 可以是同一个，也可以由多个 QP 共享；
+ * CQ 必须比 QP 活得久。状态迁移失败直接 CHECK 退出，与 rdma_utils 一致。
+ * 可移动，不可拷贝，便于放进 std::vector 批量管理。 */
+class QueuePair
+{
+public:
+    QueuePair(RdmaContext &context, const QueuePairConfig &config, CompletionQueue &cq);
+    QueuePair(RdmaContext &context, const QueuePairConfig &config, CompletionQueue &sendCq,
+              CompletionQueue &recvCq);
+    ~QueuePair();
+    QueuePair(QueuePair &&other) noexcept;
+    QueuePair(const QueuePair &) = delete;
+    QueuePair &operator=(const QueuePair &) = delete;
+
+    ibv_qp *qp() const { return qp_; }
+    uint32_t qpNum() const { return qp_->qp_num; }
+    ibv_qp_type type() const { return type_; }
+    ibv_qp_state state() const { return state_; }
+    ibv_cq *sendCq() const { return qp_->send_cq; }
+    ibv_cq *recvCq() const { return qp_->recv_cq; }
+    uint32_t maxInlineData() const { return maxInline_; }
+    /* 迁移到 RTR 时确定的路径 MTU，之前为 0 */
+    ibv_mtu pathMtu() const { return pathMtu_; }
+
+    QpInfo localInfo(const MemoryRegion *mr = nullptr) const;
+    void toInit();
+    void toRtr(const QpInfo &remote, ibv_mtu mtu = RDMA_MTU_AUTO);
+    void toRts();
+    void connect(const QpInfo &remote, ibv_mtu mtu = RDMA_MTU_AUTO);
+
+private:
+    void create(const QueuePairConfig &config, ibv_cq *sendCq, ibv_cq *recvCq);
+
+    RdmaContext *context_;
+    ibv_qp *qp_;
+    ibv_qp_type type_;
+    ibv_qp_state state_;
+    uint32_t psn_;
+    int access_;
+    uint32_t maxInline_;
+    ibv_mtu pathMtu_;
+};
+
+/* 批量建链：先用 create_queue_pairs 一次创建全部 QP，exchange_qp_infos 在一次往返内
+ * 交换所有 QpInfo，再由 connect_queue_pairs 在多个线程上并行完成 INIT→RTR→RTS。
+ * numThreads 为 0 时取 CPU 核数，QP 较少时自动减少线程数。 */
+std::vector<QueuePair> create_queue_pairs(RdmaContext &context, const QueuePairConfig &config,
+                                          std::vector<CompletionQueue> &cqs, int count);
+
+std::vector<QpInfo> exchange_qp_infos(SocketEndpoint &sock, const std::vector<QpInfo> &local);
+
+void init_queue_pairs(std::vector<QueuePair> &qps, int numThreads = 0);
+
+void connect_queue_pairs(std::vector<QueuePair> &qps, const std::vector<QpInfo> &remote,
+                         ibv_mtu mtu = RDMA_MTU_AUTO, int numThreads = 0);
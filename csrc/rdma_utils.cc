@@ -1,5 +1,14 @@
 #include "rdma_utils.h"
+#include <arpa/inet.h>
+#include <net/if.h>
+#include <cstdio>
+#include <cstdlib>
 #include <cstring>
+#include <map>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <vector>
 
 const int kMinRnrTimer = 0x12;
 const int kTimeout = 14;
@@ -27,6 +36,154 @@ void init_ibv_device(struct ibv_device **device, struct ibv_context **context, c
     ibv_free_device_list(devices);
 }
 
+int get_device_numa_node(struct ibv_device *device)
+{
+    std::string path = std::string(device->ibdev_path) + "/device/numa_node";
+    FILE *file = fopen(path.c_str(), "r");
+    if (!file)
+    {
+        LOG(WARNING) << "Cannot open " << path;
+        return -1;
+    }
+    int numa_node = -1;
+    if (fscanf(file, "%d", &numa_node) != 1)
+        numa_node = -1;
+    fclose(file);
+    return numa_node;
+}
+
+static bool is_ipv4_mapped(const ibv_gid &gid)
+{
+    static const uint8_t prefix[12] = {0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0xff, 0xff};
+    return std::memcmp(gid.raw, prefix, sizeof(prefix)) == 0;
+}
+
+/* 过滤条件为网卡名时比较 GID 绑定的网卡，为 a.b.c.d/len 时比较 IPv4 映射地址 */
+static bool gid_matches(const ibv_gid_entry &entry, const char *filter)
+{
+    if (filter == nullptr || *filter == '\0')
+        return true;
+    const char *slash = strchr(filter, '/');
+    if (slash == nullptr)
+        return entry.ndev_ifindex != 0 && entry.ndev_ifindex == if_nametoindex(filter);
+    std::string network(filter, slash - filter);
+    int prefix_len = atoi(slash + 1);
+    struct in_addr subnet;
+    if (inet_pton(AF_INET, network.c_str(), &subnet) != 1 || prefix_len < 0 || prefix_len > 32)
+    {
+        LOG(FATAL) << "Invalid GID filter " << filter << ", expected an interface name or a.b.c.d/len";
+    }
+    if (!is_ipv4_mapped(entry.gid))
+        return false;
+    uint32_t mask = prefix_len == 0 ? 0 : htonl(~0u << (32 - prefix_len));
+    uint32_t addr;
+    std::memcpy(&addr, entry.gid.raw + 12, sizeof(addr));
+    return (addr & mask) == (subnet.s_addr & mask);
+}
+
+/* RoCEv2 的 IPv4 映射地址可跨子网路由，优先级最高；链路本地 IPv6 只能在二层内使用 */
+static int gid_score(const ibv_gid_entry &entry)
+{
+    if (entry.gid_type != IBV_GID_TYPE_ROCE_V2)
+        return 1;
+    if (is_ipv4_mapped(entry.gid))
+        return 4;
+    bool link_local = entry.gid.raw[0] == 0xfe && (entry.gid.raw[1] & 0xc0) == 0x80;
+    return link_local ? 2 : 3;
+}
+
+static std::string gid_to_string(const ibv_gid &gid)
+{
+    char text[INET6_ADDRSTRLEN];
+    inet_ntop(AF_INET6, gid.raw, text, sizeof(text));
+    return text;
+}
+
+/**
+ * @brief 扫描设备所有活动端口的 GID 表，选出最合适的一项。
+ *
+ * 依次偏好 RoCEv2 的 IPv4 映射地址、RoCEv2 全局 IPv6 地址、RoCEv2 链路本地地址，
+ * 最后是 RoCEv1 或 InfiniBand 的 GID；同等条件下取端口号和索引最小的一项。
+ * 设置了过滤条件却没有任何匹配项时直接报错，而不是选一个错误的 GID 让连接静默重传。
+ *
+ * @param context 设备上下文。
+ * @param filter 网卡名或 IPv4 子网，nullptr 或空串表示不过滤。
+ * @return 选中的端口、GID 索引、RoCE 版本和 GID。
+ */
+GidSelection select_gid(struct ibv_context *context, const char *filter)
+{
+    struct ibv_device_attr device_attr;
+    CHECK(ibv_query_device(context, &device_attr) == 0) << "Failed to query device attributes";
+    int max_entries = 0;
+    std::vector<ibv_port_attr> ports(device_attr.phys_port_cnt + 1);
+    for (int port = 1; port <= device_attr.phys_port_cnt; ++port)
+    {
+        CHECK(ibv_query_port(context, port, &ports[port]) == 0) << "Failed to query port " << port;
+        max_entries += ports[port].gid_tbl_len;
+    }
+    std::vector<ibv_gid_entry> entries(max_entries);
+    ssize_t num_entries = ibv_query_gid_table(context, entries.data(), entries.size(), 0);
+    CHECK(num_entries >= 0) << "Failed to query GID table of " << ibv_get_device_name(context->device);
+
+    GidSelection selection = {};
+    int best_score = 0;
+    for (ssize_t i = 0; i < num_entries; ++i)
+    {
+        const ibv_gid_entry &entry = entries[i];
+        if (ports[entry.port_num].state != IBV_PORT_ACTIVE || !gid_matches(entry, filter))
+            continue;
+        int score = gid_score(entry);
+        if (score <= best_score)
+            continue;
+        best_score = score;
+        selection.port = entry.port_num;
+        selection.gid_index = entry.gid_index;
+        selection.gid = entry.gid;
+        if (ports[entry.port_num].link_layer != IBV_LINK_LAYER_ETHERNET)
+            selection.roce_version = 0;
+        else
+            selection.roce_version = entry.gid_type == IBV_GID_TYPE_ROCE_V2 ? 2 : 1;
+    }
+    if (best_score == 0)
+    {
+        std::ostringstream oss;
+        for (ssize_t i = 0; i < num_entries; ++i)
+            oss << "\n  port " << entries[i].port_num << " index " << entries[i].gid_index << " type "
+                << entries[i].gid_type << " ifindex " << entries[i].ndev_ifindex << " "
+                << gid_to_string(entries[i].gid);
+        LOG(FATAL) << "No usable GID on " << ibv_get_device_name(context->device)
+                   << (filter && *filter ? std::string(" matching ") + filter : std::string())
+                   << ", GID table:" << oss.str();
+    }
+    return selection;
+}
+
+/**
+ * @brief 按设备缓存的 GID 选择，过滤条件取自环境变量 FLASHREDUCE_GID_FILTER。
+ *
+ * 同一设备只扫描一次 GID 表，之后创建和迁移 QP 都直接使用缓存结果。
+ *
+ * @param context 设备上下文。
+ * @return 选中的 GID，引用在进程生命周期内有效。
+ */
+const GidSelection &resolve_gid(struct ibv_context *context)
+{
+    static std::mutex mutex;
+    static std::map<std::string, GidSelection> cache;
+    std::lock_guard<std::mutex> lock(mutex);
+    std::string name = ibv_get_device_name(context->device);
+    auto it = cache.find(name);
+    if (it != cache.end())
+        return it->second;
+    GidSelection selection = select_gid(context, getenv(RDMA_GID_FILTER_ENV));
+    LOG(INFO) << name << ": using port " << selection.port << " GID index " << selection.gid_index
+              << (selection.roce_version == 2   ? " (RoCEv2) "
+                  : selection.roce_version == 1 ? " (RoCEv1) "
+                                                : " (InfiniBand) ")
+              << gid_to_string(selection.gid);
+    return cache.emplace(name, selection).first->second;
+}
+
 const char *port_state_to_string(enum ibv_port_state state)
 {
     switch (state)
@@ -67,6 +224,30 @@ const char *mtu_to_string(enum ibv_mtu mtu)
     }
 }
 
+/**
+ * @brief 确定连接使用的路径 MTU。
+ *
+ * 自动模式取本端和对端 active_mtu 的较小值；对端未携带 MTU（例如经 gRPC 会话交换）时
+ * 只按本端。显式指定时（例如交换机聚合要求固定的包长）使用指定值，但不能超过协商结果，
+ * 否则超长的包会在路径上被丢弃。
+ *
+ * @param local 本端端口的 active_mtu。
+ * @param remote 对端 QP 信息。
+ * @param requested 指定的 MTU，RDMA_MTU_AUTO 表示自动。
+ * @return 路径 MTU。
+ */
+ibv_mtu negotiate_mtu(ibv_mtu local, const QpInfo &remote, ibv_mtu requested)
+{
+    ibv_mtu agreed = local;
+    if (remote.mtu != 0 && remote.mtu < agreed)
+        agreed = (ibv_mtu)remote.mtu;
+    if (requested == RDMA_MTU_AUTO)
+        return agreed;
+    CHECK(requested <= agreed) << "Requested MTU " << mtu_to_string(requested)
+                               << " exceeds the negotiated MTU " << mtu_to_string(agreed);
+    return requested;
+}
+
 void print_port_attributes(const struct ibv_port_attr *attr)
 {
     if (!attr)
@@ -109,7 +290,7 @@ int modify_qp_to_init(struct ibv_qp *qp)
     struct ibv_qp_attr attributes;
     std::memset(&attributes, 0, sizeof(attributes));
     attributes.qp_state = IBV_QPS_INIT;
-    attributes.port_num = IB_PORT;
+    attributes.port_num = resolve_gid(qp->context).port;
     attributes.pkey_index = 0;
     attributes.qp_access_flags = (IBV_ACCESS_LOCAL_WRITE | IBV_ACCESS_REMOTE_WRITE);
     int ret = ibv_modify_qp(qp, &attributes,
@@ -132,9 +313,9 @@ static int modify_qp_to_rtr_uc(struct ibv_qp *qp, const QpInfo &neighbor_qp_info
     attributes.ah_attr.dlid = neighbor_qp_info.lid; // not really necessary since using RoCE, not IB, and is_global is set
     attributes.ah_attr.sl = 0;
     attributes.ah_attr.src_path_bits = 0;
-    attributes.ah_attr.port_num = IB_PORT;
+    attributes.ah_attr.port_num = resolve_gid(qp->context).port;
     attributes.ah_attr.grh.dgid = neighbor_qp_info.gid;
-    attributes.ah_attr.grh.sgid_index = GID_INDEX;
+    attributes.ah_attr.grh.sgid_index = resolve_gid(qp->context).gid_index;
     attributes.ah_attr.grh.flow_label = 0;
     attributes.ah_attr.grh.hop_limit = 0xFF;
     attributes.ah_attr.grh.traffic_class = 0;
@@ -166,6 +347,7 @@ static int modify_qp_to_rts_rc(
 {
     uint32_t target_qp_num = neighbor_qp_info.qp_num;
     uint16_t target_lid = neighbor_qp_info.lid;
+    const GidSelection &local_gid = resolve_gid(qp->context);
     int ret = 0;
     /* Change QP state to RTR */
     {
@@ -174,7 +356,7 @@ static int modify_qp_to_rts_rc(
             .sl = 0,
             .src_path_bits = 0,
             .is_global = 1,
-            .port_num = IB_PORT,
+            .port_num = (uint8_t)local_gid.port,
         };
         struct ibv_qp_attr qp_attr = {
             .qp_state = IBV_QPS_RTR,
@@ -186,7 +368,7 @@ static int modify_qp_to_rts_rc(
             .min_rnr_timer = 0x12,
         };
 
-        qp_attr.ah_attr.grh.sgid_index = GID_INDEX;
+        qp_attr.ah_attr.grh.sgid_index = local_gid.gid_index;
         memcpy(&qp_attr.ah_attr.grh.dgid, &neighbor_qp_info.gid, sizeof(ibv_gid));
         qp_attr.ah_attr.grh.hop_limit = 0xFF;
         qp_attr.ah_attr.grh.flow_label = 0;
@@ -224,6 +406,10 @@ int modify_qp_to_rts(
     struct ibv_qp *qp,
     const QpInfo &neighbor_qp_info, ibv_mtu mtu, int reliable)
 {
+    struct ibv_port_attr port_attr;
+    CHECK(ibv_query_port(qp->context, resolve_gid(qp->context).port, &port_attr) == 0)
+        << "Failed to query port attributes";
+    mtu = negotiate_mtu(port_attr.active_mtu, neighbor_qp_info, mtu);
     if (reliable)
     {
         return modify_qp_to_rts_rc(qp, neighbor_qp_info, mtu);
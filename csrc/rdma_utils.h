@@ -1,8 +1,13 @@
 #pragma once
 #include <infiniband/verbs.h>
 #include <glog/logging.h>
-#define IB_PORT 1
-#define GID_INDEX 3 // RoCEv2 GID index
+/* 端口号和 GID 索引取以下值时，由 resolve_gid 扫描 GID 表自动选择 */
+#define IB_PORT_AUTO 0
+#define GID_INDEX_AUTO -1
+/* 自动选择 GID 时的过滤条件：网卡名（如 eth0）或 IPv4 子网（如 10.0.0.0/8），未设置时不过滤 */
+#define RDMA_GID_FILTER_ENV "FLASHREDUCE_GID_FILTER"
+/* 路径 MTU 取该值时使用两端 active_mtu 的较小值 */
+#define RDMA_MTU_AUTO ((ibv_mtu)0)
 
 struct QpInfo
 {
@@ -12,10 +17,28 @@ struct QpInfo
     uint32_t psn;
     ibv_gid gid;
     uint16_t lid;
+    uint8_t mtu; // 端口的 active_mtu，0 表示对端未提供
+};
+
+/* GID 表中选出的一项 */
+struct GidSelection
+{
+    int port;
+    int gid_index;
+    int roce_version; // 0 为 InfiniBand，1 为 RoCEv1，2 为 RoCEv2
+    ibv_gid gid;
 };
 
 void init_ibv_device(struct ibv_device **device, struct ibv_context **context, const char *device_name);
 
+int get_device_numa_node(struct ibv_device *device);
+
+GidSelection select_gid(struct ibv_context *context, const char *filter);
+
+const GidSelection &resolve_gid(struct ibv_context *context);
+
+ibv_mtu negotiate_mtu(ibv_mtu local, const QpInfo &remote, ibv_mtu requested);
+
 int modify_qp_to_init(struct ibv_qp *qp);
 
 int modify_qp_to_rts(
@@ -1,4 +1,5 @@
 #include "socket_endpoint.h"
+#include <errno.h>
 
 void SocketEndpoint::logError(const std::string& message) {
     return; // Placeholder for error logging
@@ -121,17 +122,42 @@ connect:
     sockfd_ = sockfd;
 }
 
+int SocketEndpoint::sendAll(const void* buf, size_t size) {
+    const char* p = (const char*)buf;
+    while (size > 0) {
+        ssize_t rc = send(sockfd_, p, size, 0);
+        if (rc < 0 && errno == EINTR) continue;
+        if (rc <= 0) return rc;
+        p += rc;
+        size -= rc;
+    }
+    return 1;
+}
+
+int SocketEndpoint::recvAll(void* buf, size_t size) {
+    char* p = (char*)buf;
+    while (size > 0) {
+        ssize_t rc = recv(sockfd_, p, size, 0);
+        if (rc < 0 && errno == EINTR) continue;
+        if (rc <= 0) return rc;
+        p += rc;
+        size -= rc;
+    }
+    return 1;
+}
+
+// 大块数据（例如上千个 QpInfo）一次 send/recv 可能只传输一部分，循环直到收发完整
 int SocketEndpoint::syncData(size_t size, const void* outBuf, void* inBuf) {
     int rc;
     if (isDaemon_) {
-        rc = send(sockfd_, outBuf, size, 0);
+        rc = sendAll(outBuf, size);
         if (rc <= 0) return rc;
-        rc = recv(sockfd_, inBuf, size, 0);
+        rc = recvAll(inBuf, size);
         if (rc <= 0) return rc;
     } else {
-        rc = recv(sockfd_, inBuf, size, 0);
+        rc = recvAll(inBuf, size);
         if (rc <= 0) return rc;
-        rc = send(sockfd_, outBuf, size, 0);
+        rc = sendAll(outBuf, size);
         if (rc <= 0) return rc;
     }
     return 0;
@@ -23,6 +23,8 @@ public:
 
 private:
   int startListening(int port);
+  int sendAll(const void *buf, size_t size);
+  int recvAll(void *buf, size_t size);
   void logError(const std::string &message);
   void logDebug(const std::string &message);
   int sockfd_;
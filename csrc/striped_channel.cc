@@ -0,0 +1,191 @@
+#include "striped_channel.h"
+#include <algorithm>
+#include <arpa/inet.h>
+#include <cstring>
+
+const int kPollBatch = 64;
+const size_t kDefaultChunkSize = 64 * 1024;
+
+/**
+ * @brief 在一组已创建的 QP 上构造条带化通道。
+ *
+ * 默认使用全部 QP，分块大小为 64KB。所有 QP 的发送和接收 CQ 去重后统一轮询，
+ * 因此多个 QP 既可以共享一个 CQ，也可以各自使用独立的 CQ。
+ *
+ * @param qps 参与条带化的 RC QP，必须比通道活得久。
+ * @param sendQueueDepth 每个 QP 的发送队列深度，用作发送额度。
+ */
+StripedChannel::StripedChannel(std::vector<QueuePair> &qps, int sendQueueDepth)
+    : stripes_((int)qps.size()), chunkSize_(kDefaultChunkSize), nextQp_(0), posting_(0),
+      sent_(0), arrived_(STRIPED_ID_SPACE), expected_(STRIPED_ID_SPACE), received_(0) {
+    CHECK(!qps.empty()) << "Striped channel needs at least one queue pair";
+    for (size_t i = 0; i < qps.size(); i++) {
+        CHECK(qps[i].type() == IBV_QPT_RC)
+            << "Striped channel needs RC queue pairs, QP " << qps[i].qpNum() << " is not RC";
+        qps_.push_back(&qps[i]);
+        qpIndex_[qps[i].qpNum()] = (int)i;
+        for (ibv_cq *cq : {qps[i].sendCq(), qps[i].recvCq()})
+            if (std::find(cqs_.begin(), cqs_.end(), cq) == cqs_.end())
+                cqs_.push_back(cq);
+    }
+    credits_.assign(qps.size(), sendQueueDepth);
+}
+
+void StripedChannel::setStripes(int stripes) {
+    CHECK(stripes >= 1 && stripes <= (int)qps_.size())
+        << "Stripes must be in [1, " << qps_.size() << "], got " << stripes;
+    stripes_ = stripes;
+}
+
+void StripedChannel::setChunkSize(size_t chunkSize) {
+    CHECK(chunkSize > 0) << "Chunk size must be positive";
+    chunkSize_ = chunkSize;
+}
+
+void StripedChannel::postReceive(int qp) {
+    struct ibv_recv_wr recv_wr, *bad_recv_wr = nullptr;
+    std::memset(&recv_wr, 0, sizeof(recv_wr));
+    int ret = ibv_post_recv(qps_[qp]->qp(), &recv_wr, &bad_recv_wr);
+    CHECK(ret == 0) << "Failed to post receive WR on QP " << qps_[qp]->qpNum() << ", ret = " << ret;
+}
+
+/**
+ * @brief 在每个 QP 上预投递接收请求，接收端在 QP 迁移到 INIT 之后调用。
+ *
+ * 每个分块消耗一个接收请求，收到后在同一 QP 上立即补回。
+ *
+ * @param depth 每个 QP 预投递的接收请求数，不超过 QP 的接收队列深度。
+ */
+void StripedChannel::postReceives(int depth) {
+    for (size_t qp = 0; qp < qps_.size(); qp++)
+        for (int i = 0; i < depth; i++)
+            postReceive((int)qp);
+}
+
+/**
+ * @brief 提交一条消息，由后续的 progress 切块投递。
+ *
+ * 两端按相同顺序收发消息，消息序号从 0 开始递增。分块大小在提交时确定，
+ * 之后修改分块大小不影响已提交的消息。
+ *
+ * @param local 本地内存区域。
+ * @param offset 消息在 local 中的偏移。
+ * @param length 消息长度。
+ * @param remoteAddr 对端写入地址。
+ * @param rkey 对端内存区域的 rkey。
+ * @return 消息序号，可用 done 查询是否发送完成。
+ */
+uint64_t StripedChannel::send(const MemoryRegion &local, size_t offset, size_t length,
+                              uint64_t remoteAddr, uint32_t rkey) {
+    CHECK(messages_.size() < STRIPED_MAX_INFLIGHT) << "Too many in-flight striped messages";
+    Message message;
+    message.localAddr = (uint64_t)local.addr() + offset;
+    message.remoteAddr = remoteAddr;
+    message.lkey = local.lkey();
+    message.rkey = rkey;
+    message.length = length;
+    message.chunkSize = chunkSize_;
+    message.chunks = (uint32_t)std::max<size_t>(1, (length + chunkSize_ - 1) / chunkSize_);
+    CHECK(message.chunks <= STRIPED_MAX_CHUNKS)
+        << "Message of " << length << " bytes needs " << message.chunks
+        << " chunks, increase the chunk size";
+    message.posted = 0;
+    message.completed = 0;
+    messages_.push_back(message);
+    return sent_ + messages_.size() - 1;
+}
+
+/* 按轮转顺序把未投递的分块放到前 stripes_ 个 QP 上，所有条带都没有额度时停止 */
+void StripedChannel::postChunks() {
+    while (posting_ < messages_.size()) {
+        Message &message = messages_[posting_];
+        int qp = -1;
+        for (int i = 0; i < stripes_; i++) {
+            int candidate = (nextQp_ + i) % stripes_;
+            if (credits_[candidate] > 0) {
+                qp = candidate;
+                break;
+            }
+        }
+        if (qp < 0)
+            return;
+        uint64_t id = sent_ + posting_;
+        size_t offset = (size_t)message.posted * message.chunkSize;
+        struct ibv_sge sge;
+        sge.addr = message.localAddr + offset;
+        sge.length = (uint32_t)std::min(message.chunkSize, message.length - offset);
+        sge.lkey = message.lkey;
+        struct ibv_send_wr send_wr, *bad_wr = nullptr;
+        std::memset(&send_wr, 0, sizeof(send_wr));
+        send_wr.wr_id = id;
+        send_wr.sg_list = &sge;
+        send_wr.num_sge = message.length > 0 ? 1 : 0;
+        send_wr.opcode = IBV_WR_RDMA_WRITE_WITH_IMM;
+        send_wr.send_flags = IBV_SEND_SIGNALED;
+        if (sge.length <= qps_[qp]->maxInlineData())
+            send_wr.send_flags |= IBV_SEND_INLINE;
+        send_wr.imm_data = htonl((uint32_t)((id % STRIPED_ID_SPACE) << 16 | message.chunks));
+        send_wr.wr.rdma.remote_addr = message.remoteAddr + offset;
+        send_wr.wr.rdma.rkey = message.rkey;
+        int ret = ibv_post_send(qps_[qp]->qp(), &send_wr, &bad_wr);
+        CHECK(ret == 0) << "Failed to post chunk " << message.posted << " of message " << id
+                        << " on QP " << qps_[qp]->qpNum() << ", ret = " << ret;
+        credits_[qp]--;
+        nextQp_ = (qp + 1) % stripes_;
+        if (++message.posted == message.chunks)
+            posting_++;
+    }
+}
+
+void StripedChannel::onSendCompletion(const ibv_wc &wc) {
+    credits_[qpIndex_.at(wc.qp_num)]++;
+    messages_[wc.wr_id - sent_].completed++;
+}
+
+void StripedChannel::onRecvCompletion(const ibv_wc &wc) {
+    postReceive(qpIndex_.at(wc.qp_num));
+    uint32_t imm = ntohl(wc.imm_data);
+    uint32_t slot = imm >> 16;
+    arrived_[slot]++;
+    expected_[slot] = imm & 0xFFFF;
+}
+
+/**
+ * @brief 推进通道：轮询所有 CQ，投递新的分块，按序回收已完成的消息。
+ *
+ * @return 本次调用中发送完成和接收完成的消息总数，0 表示没有进展。
+ */
+int StripedChannel::progress() {
+    struct ibv_wc wcs[kPollBatch];
+    for (ibv_cq *cq : cqs_) {
+        int n = ibv_poll_cq(cq, kPollBatch, wcs);
+        CHECK(n >= 0) << "Failed to poll CQ";
+        for (int i = 0; i < n; i++) {
+            CHECK_EQ(wcs[i].status, IBV_WC_SUCCESS)
+                << "Striped chunk failed on QP " << wcs[i].qp_num << ": "
+                << ibv_wc_status_str(wcs[i].status);
+            if (wcs[i].opcode == IBV_WC_RECV_RDMA_WITH_IMM)
+                onRecvCompletion(wcs[i]);
+            else
+                onSendCompletion(wcs[i]);
+        }
+    }
+    postChunks();
+    int finished = 0;
+    while (!messages_.empty() && messages_.front().completed == messages_.front().chunks) {
+        messages_.pop_front();
+        posting_--;
+        sent_++;
+        finished++;
+    }
+    for (;;) {
+        uint32_t slot = received_ % STRIPED_ID_SPACE;
+        if (expected_[slot] == 0 || arrived_[slot] < expected_[slot])
+            break;
+        arrived_[slot] = 0;
+        expected_[slot] = 0;
+        received_++;
+        finished++;
+    }
+    return finished;
+}
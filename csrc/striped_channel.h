@@ -0,0 +1,80 @@
+#pragma once
+#include "rdma_context.h"
+#include <cstdint>
+#include <deque>
+#include <unordered_map>
+#include <vector>
+
+/* 立即数高 16 位为消息序号，低 16 位为该消息的分块数，接收端据此重组，
+ * 不需要知道发送端当前的条带数和分块大小 */
+#define STRIPED_MAX_CHUNKS 0xFFFF
+#define STRIPED_ID_SPACE (1 << 16)
+/* 在途消息上限，保证接收端按 16 位序号区分的消息不会重叠 */
+#define STRIPED_MAX_INFLIGHT (STRIPED_ID_SPACE / 2)
+
+/* 条带化通道：把一条消息切成若干块，以 RDMA WRITE_WITH_IMM 轮流投递到前 K 个 QP 上，
+ * 再从（可能多个）CQ 收回完成并按消息重组。单个 QP 打不满链路时用多个 QP 并行。
+ * 条带数和分块大小可以随时修改，只影响之后开始投递的分块。
+ * 只支持 RC：发送额度在本地发送完成时归还，RC 的发送完成说明对端已收下这一块，
+ * 对端来不及补回接收请求时由 RNR 重试兜底；UC 的发送完成与对端无关，发送端会越过
+ * 对端预投递的接收请求，多出的写入被静默丢弃，接收端永远等不齐分块。
+ * 不是线程安全的，应只由一个线程（通常是代理线程）调用 progress。 */
+class StripedChannel
+{
+public:
+    StripedChannel(std::vector<QueuePair> &qps, int sendQueueDepth);
+    StripedChannel(const StripedChannel &) = delete;
+    StripedChannel &operator=(const StripedChannel &) = delete;
+
+    void setStripes(int stripes);
+    void setChunkSize(size_t chunkSize);
+    int stripes() const { return stripes_; }
+    size_t chunkSize() const { return chunkSize_; }
+
+    void postReceives(int depth);
+    uint64_t send(const MemoryRegion &local, size_t offset, size_t length, uint64_t remoteAddr,
+                  uint32_t rkey);
+    int progress();
+
+    bool done(uint64_t id) const { return id < sent_; }
+    uint64_t sent() const { return sent_; }
+    uint64_t received() const { return received_; }
+    bool idle() const { return messages_.empty(); }
+
+private:
+    struct Message
+    {
+        uint64_t localAddr;
+        uint64_t remoteAddr;
+        uint32_t lkey;
+        uint32_t rkey;
+        size_t length;
+        size_t chunkSize;
+        uint32_t chunks;
+        uint32_t posted;
+        uint32_t completed;
+    };
+
+    void postChunks();
+    void postReceive(int qp);
+    void onSendCompletion(const ibv_wc &wc);
+    void onRecvCompletion(const ibv_wc &wc);
+
+    std::vector<QueuePair *> qps_;
+    std::vector<ibv_cq *> cqs_;
+    std::unordered_map<uint32_t, int> qpIndex_;
+    std::vector<int> credits_;
+    int stripes_;
+    size_t chunkSize_;
+    int nextQp_;
+
+    /* 发送端：messages_ 按序号排列，队首序号为 sent_，posting_ 是第一条未投递完的消息 */
+    std::deque<Message> messages_;
+    size_t posting_;
+    uint64_t sent_;
+
+    /* 接收端：按 16 位序号统计已到达的分块数 */
+    std::vector<uint16_t> arrived_;
+    std::vector<uint16_t> expected_;
+    uint64_t received_;
+};
@@ -0,0 +1,744 @@
+#include "switch_emulator.h"
+#include <arpa/inet.h>
+#include <algorithm>
+#include <cerrno>
+#include <climits>
+#include <cstring>
+#include <fcntl.h>
+#include <netdb.h>
+#include <new>
+#include <pthread.h>
+#include <poll.h>
+#include <random>
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+using flashreduce::shadow_index;
+using flashreduce::slot_imm_op;
+using flashreduce::slot_imm_seq;
+using flashreduce::slot_imm_slot;
+using flashreduce::slot_imm_version;
+
+const int kPollBatch = 32;
+const int kSocketBuffer = 8 << 20;
+const uint32_t kShmMagic = 0x46525357; // "FRSW"
+
+/**
+ * @brief 创建聚合流水线。
+ *
+ * @param numWorkers worker 数，不超过 SWITCH_MAX_WORKERS。
+ * @param window 槽数，须与 worker 的 AllReduceConfig::window 一致。
+ * @param slotElems 每个槽的 int32 元素数，须与 worker 一致。
+ */
+SwitchPipeline::SwitchPipeline(int numWorkers, int window, int slotElems)
+    : numWorkers_(numWorkers), window_(window), slotElems_(slotElems),
+      fullBitmap_(numWorkers == SWITCH_MAX_WORKERS ? ~0ull : (1ull << numWorkers) - 1),
+      slots_(new Slot[window]), accumulators_(2 * (size_t)window * slotElems),
+      results_(2 * (size_t)window * slotElems) {
+    CHECK(numWorkers > 0 && numWorkers <= SWITCH_MAX_WORKERS)
+        << "Number of workers must be in [1, " << SWITCH_MAX_WORKERS << "], got " << numWorkers;
+    CHECK(window > 0 && window <= ALLREDUCE_MAX_SLOTS)
+        << "Window must be in [1, " << ALLREDUCE_MAX_SLOTS << "], got " << window;
+    CHECK(slotElems > 0) << "Slot must hold at least one element";
+    // worker 的序号从 0 开始，两份副本的初始序号各比它们的第一轮早一轮
+    for (int i = 0; i < window; i++)
+        for (uint32_t v = 0; v < 2; v++)
+            slots_[i].rounds[v] = {0, 0, (uint16_t)(v - 2), false};
+}
+
+/**
+ * @brief 把一个 worker 对某个槽的写入并入累加器。
+ *
+ * @param worker 写入者。
+ * @param imm 立即数，携带归约操作、槽号和序号，同一轮所有写入须相同。
+ * @param payload 一个槽的 int32 载荷。
+ * @param counters 调用线程的计数器。
+ * @return 该写入凑齐了这一轮时返回结果并要求组播；是已完成一轮的重复写入时
+ *         返回结果并只发给写入者；否则 data 为空。
+ */
+SwitchResult SwitchPipeline::aggregate(int worker, uint32_t imm, const int32_t *payload,
+                                       SwitchCounters *counters) {
+    counters->packets.fetch_add(1, std::memory_order_relaxed);
+    uint32_t index = slot_imm_slot(imm);
+    SwitchResult result;
+    if (worker < 0 || worker >= numWorkers_ || index >= (uint32_t)window_) {
+        counters->dropped.fetch_add(1, std::memory_order_relaxed);
+        return result;
+    }
+    Slot &slot = slots_[index];
+    Round &round = slot.rounds[slot_imm_version(imm)];
+    uint16_t seq = slot_imm_seq(imm);
+    uint64_t bit = 1ull << worker;
+    size_t offset = shadow_index(index, slot_imm_version(imm)) * slotElems_;
+    int32_t *acc = accumulators_.data() + offset;
+    while (slot.lock.test_and_set(std::memory_order_acquire))
+        ;
+    // 16 位序号按回绕比较，同一副本相邻两轮相差 2
+    int16_t age = (int16_t)(uint16_t)(seq - round.seq);
+    if (age < 0) {
+        counters->dropped.fetch_add(1, std::memory_order_relaxed);
+        slot.lock.clear(std::memory_order_release);
+        return result;
+    }
+    if (age > 0)
+        round = {0, 0, seq, false};
+    if (round.bitmap & bit) {
+        counters->duplicates.fetch_add(1, std::memory_order_relaxed);
+        if (round.complete) {
+            result.data = results_.data() + offset;
+            counters->resent.fetch_add(1, std::memory_order_relaxed);
+        }
+    } else if (round.bitmap == 0) {
+        std::memcpy(acc, payload, slotBytes());
+        round.imm = imm;
+        round.bitmap = bit;
+    } else if (imm != round.imm) {
+        counters->dropped.fetch_add(1, std::memory_order_relaxed);
+    } else {
+        if (slot_imm_op(imm) == flashreduce::Max) {
+            for (int i = 0; i < slotElems_; i++)
+                acc[i] = std::max(acc[i], payload[i]);
+        } else {
+            // 与交换机的 32 位加法器一致，溢出按补码回绕
+            for (int i = 0; i < slotElems_; i++)
+                acc[i] = (int32_t)((uint32_t)acc[i] + (uint32_t)payload[i]);
+        }
+        round.bitmap |= bit;
+    }
+    if (!round.complete && round.bitmap == fullBitmap_) {
+        int32_t *out = results_.data() + offset;
+        std::memcpy(out, acc, slotBytes());
+        round.complete = true;
+        result.data = out;
+        result.multicast = true;
+        counters->results.fetch_add(1, std::memory_order_relaxed);
+    }
+    slot.lock.clear(std::memory_order_release);
+    return result;
+}
+
+SwitchTransport::SwitchTransport(SwitchPipeline &pipeline, int numThreads)
+    : pipeline_(&pipeline), numThreads_(numThreads), counters_(new SwitchCounters[numThreads]),
+      running_(false), lossThreshold_(0) {
+    CHECK(numThreads > 0) << "Switch needs at least one forwarding thread";
+}
+
+SwitchTransport::~SwitchTransport() {
+    stop();
+}
+
+void SwitchTransport::launch(const std::function<void(int)> &run) {
+    CHECK(!running_.load()) << "Switch is already running";
+    running_.store(true);
+    for (int t = 0; t < numThreads_; t++) {
+        threads_.emplace_back(run, t);
+        char name[16];
+        snprintf(name, sizeof(name), "switch-%d", t);
+        pthread_setname_np(threads_.back().native_handle(), name);
+    }
+}
+
+void SwitchTransport::stop() {
+    running_.store(false);
+    for (auto &thread : threads_)
+        thread.join();
+    threads_.clear();
+}
+
+SwitchStats SwitchTransport::stats() const {
+    SwitchStats stats;
+    for (int t = 0; t < numThreads_; t++) {
+        stats.packets += counters_[t].packets.load(std::memory_order_relaxed);
+        stats.results += counters_[t].results.load(std::memory_order_relaxed);
+        stats.duplicates += counters_[t].duplicates.load(std::memory_order_relaxed);
+        stats.resent += counters_[t].resent.load(std::memory_order_relaxed);
+        stats.dropped += counters_[t].dropped.load(std::memory_order_relaxed);
+        stats.lost += counters_[t].lost.load(std::memory_order_relaxed);
+    }
+    return stats;
+}
+
+void SwitchTransport::setLossRate(double rate) {
+    CHECK(rate >= 0 && rate < 1) << "Loss rate must be in [0, 1), got " << rate;
+    lossThreshold_.store((uint32_t)(rate * std::minstd_rand::max()), std::memory_order_relaxed);
+}
+
+/* 转发线程各用一个随机数发生器，返回真时调用者丢弃这个写入或结果 */
+bool SwitchTransport::injectLoss(SwitchCounters *counters) {
+    uint32_t threshold = lossThreshold_.load(std::memory_order_relaxed);
+    if (threshold == 0)
+        return false;
+    thread_local std::minstd_rand random(std::random_device{}());
+    if (random() >= threshold)
+        return false;
+    counters->lost.fetch_add(1, std::memory_order_relaxed);
+    return true;
+}
+
+static QueuePairConfig switch_qp_config(const SwitchPipeline &pipeline) {
+    QueuePairConfig qpConfig;
+    qpConfig.type = IBV_QPT_UC;
+    // 发往同一 worker 的结果每个槽至多一个在途，再留出尚未轮询到的完成和重发的余量
+    qpConfig.maxSendWr = 3 * pipeline.window();
+    // 每个槽一个首发写入，再加上 worker 的重传
+    qpConfig.maxRecvWr = 2 * pipeline.window();
+    return qpConfig;
+}
+
+/**
+ * @brief 为每个 worker 创建 UC QP 并注册接收区和结果区，之后逐个 connect 再 start。
+ *
+ * @param context 设备上下文，可以是 rxe 等软件 RoCE 设备。
+ * @param pipeline 聚合流水线，须比本对象活得久。
+ * @param numThreads 转发线程数，超过 worker 数的线程空转。
+ */
+RdmaSwitch::RdmaSwitch(RdmaContext &context, SwitchPipeline &pipeline, int numThreads)
+    : SwitchTransport(pipeline, numThreads),
+      recvBuffer_(2 * (size_t)pipeline.numWorkers() * pipeline.window() * pipeline.slotElems()),
+      recvRegion_(context, recvBuffer_.data(), recvBuffer_.size() * sizeof(int32_t)),
+      resultRegion_(context, pipeline.results(), pipeline.resultBytes(), IBV_ACCESS_LOCAL_WRITE),
+      sendCq_(context, pipeline.numWorkers() * 3 * pipeline.window()),
+      remotes_(pipeline.numWorkers()) {
+    int numWorkers = pipeline.numWorkers();
+    recvCqs_.reserve(numWorkers);
+    qps_.reserve(numWorkers);
+    for (int w = 0; w < numWorkers; w++) {
+        recvCqs_.emplace_back(context, 2 * pipeline.window());
+        qps_.emplace_back(context, switch_qp_config(pipeline), sendCq_, recvCqs_.back());
+    }
+}
+
+RdmaSwitch::~RdmaSwitch() {
+    stop();
+}
+
+/**
+ * @brief 第 worker 个 QP 的信息，raddr 指向该 worker 在接收区中的 window 个槽的两份副本。
+ */
+QpInfo RdmaSwitch::localInfo(int worker) const {
+    QpInfo info = qps_[worker].localInfo(&recvRegion_);
+    info.raddr = (char *)recvRegion_.addr() + 2 * (size_t)worker * pipeline_->window() * pipeline_->slotBytes();
+    return info;
+}
+
+/**
+ * @brief 连接第 worker 个 QP，并为每个槽的两份副本各预投递一个接收请求。
+ *
+ * @param worker worker 序号。
+ * @param remote worker 的 QP 信息，raddr/rkey 为其暂存区。
+ * @param mtu 路径 MTU，须不小于一个槽的载荷。
+ */
+void RdmaSwitch::connect(int worker, const QpInfo &remote, ibv_mtu mtu) {
+    CHECK(worker >= 0 && worker < pipeline_->numWorkers()) << "Invalid worker " << worker;
+    QueuePair &qp = qps_[worker];
+    qp.toInit();
+    struct ibv_recv_wr recv_wr, *bad_recv_wr = nullptr;
+    std::memset(&recv_wr, 0, sizeof(recv_wr));
+    for (int i = 0; i < 2 * pipeline_->window(); i++)
+        CHECK(ibv_post_recv(qp.qp(), &recv_wr, &bad_recv_wr) == 0) << "Failed to post receive WR";
+    qp.connect(remote, mtu);
+    CHECK(pipeline_->slotBytes() <= (size_t)(128 << qp.pathMtu()))
+        << "Slot of " << pipeline_->slotBytes() << " bytes does not fit the path MTU "
+        << (128 << qp.pathMtu());
+    remotes_[worker] = remote;
+}
+
+void RdmaSwitch::start() {
+    launch([this](int thread) { run(thread); });
+}
+
+void RdmaSwitch::run(int thread) {
+    SwitchCounters *counters = &counters_[thread];
+    int numWorkers = pipeline_->numWorkers();
+    int window = pipeline_->window();
+    size_t slotBytes = pipeline_->slotBytes();
+    struct ibv_recv_wr recv_wr, *bad_recv_wr = nullptr;
+    std::memset(&recv_wr, 0, sizeof(recv_wr));
+    struct ibv_send_wr wr, *bad_wr = nullptr;
+    struct ibv_sge sge;
+    struct ibv_wc wcs[kPollBatch];
+    while (running()) {
+        int events = 0;
+        for (int w = thread; w < numWorkers; w += numThreads_) {
+            int n = ibv_poll_cq(recvCqs_[w].cq(), kPollBatch, wcs);
+            CHECK(n >= 0) << "Failed to poll receive CQ of worker " << w;
+            events += n;
+            for (int k = 0; k < n; k++) {
+                CHECK_EQ(wcs[k].status, IBV_WC_SUCCESS)
+                    << "Worker " << w << " write failed: " << ibv_wc_status_str(wcs[k].status);
+                uint32_t imm = ntohl(wcs[k].imm_data);
+                uint32_t slot = std::min<uint32_t>(slot_imm_slot(imm), window - 1);
+                size_t shadow = shadow_index(slot, slot_imm_version(imm));
+                const int32_t *payload =
+                    recvBuffer_.data() + (2 * (size_t)w * window + shadow) * pipeline_->slotElems();
+                CHECK(ibv_post_recv(qps_[w].qp(), &recv_wr, &bad_recv_wr) == 0)
+                    << "Failed to post receive WR";
+                // worker 收到结果前不会往这份副本写入新数据，重传的内容相同，先补投接收请求不影响载荷
+                if (injectLoss(counters))
+                    continue;
+                SwitchResult result = pipeline_->aggregate(w, imm, payload, counters);
+                if (!result.data)
+                    continue;
+                sge.addr = (uintptr_t)result.data;
+                sge.length = slotBytes;
+                sge.lkey = resultRegion_.lkey();
+                std::memset(&wr, 0, sizeof(wr));
+                wr.sg_list = &sge;
+                wr.num_sge = 1;
+                wr.opcode = IBV_WR_RDMA_WRITE_WITH_IMM;
+                wr.send_flags = IBV_SEND_SIGNALED;
+                wr.imm_data = htonl(imm);
+                int first = result.multicast ? 0 : w, last = result.multicast ? numWorkers : w + 1;
+                for (int v = first; v < last; v++) {
+                    if (injectLoss(counters))
+                        continue;
+                    wr.wr.rdma.remote_addr = (uint64_t)remotes_[v].raddr + shadow * slotBytes;
+                    wr.wr.rdma.rkey = remotes_[v].rkey;
+                    int rc = ibv_post_send(qps_[v].qp(), &wr, &bad_wr);
+                    // 发送队列被重发占满时和交换机一样丢弃，worker 会再次重传
+                    if (rc == ENOMEM) {
+                        counters->lost.fetch_add(1, std::memory_order_relaxed);
+                        continue;
+                    }
+                    CHECK(rc == 0) << "Failed to write result of slot " << slot << " to worker " << v;
+                }
+            }
+        }
+        int n = ibv_poll_cq(sendCq_.cq(), kPollBatch, wcs);
+        CHECK(n >= 0) << "Failed to poll send CQ";
+        for (int k = 0; k < n; k++)
+            CHECK_EQ(wcs[k].status, IBV_WC_SUCCESS)
+                << "Result write failed: " << ibv_wc_status_str(wcs[k].status);
+        if (events + n == 0)
+            sched_yield();
+    }
+}
+
+/**
+ * @brief 在 port 上为每个转发线程绑定一个 SO_REUSEPORT 的 UDP 套接字。
+ *
+ * @param pipeline 聚合流水线，槽载荷加包头须放得进一个数据报。
+ * @param port UDP 端口。
+ * @param numThreads 转发线程数。
+ */
+UdpSwitch::UdpSwitch(SwitchPipeline &pipeline, int port, int numThreads)
+    : SwitchTransport(pipeline, numThreads), learned_(new std::atomic<int>[pipeline.numWorkers()]),
+      workerAddrs_(pipeline.numWorkers()) {
+    CHECK(sizeof(SwitchPacketHeader) + pipeline.slotBytes() <= 65507)
+        << "Slot of " << pipeline.slotBytes() << " bytes does not fit a UDP datagram";
+    for (int w = 0; w < pipeline.numWorkers(); w++)
+        learned_[w].store(0);
+    struct sockaddr_in addr;
+    std::memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    addr.sin_port = htons(port);
+    // 接收超时让转发线程能及时看到 stop
+    struct timeval timeout = {0, 100 * 1000};
+    int one = 1, bufferBytes = kSocketBuffer;
+    for (int t = 0; t < numThreads; t++) {
+        int fd = socket(AF_INET, SOCK_DGRAM, 0);
+        CHECK(fd >= 0) << "Failed to create UDP socket: " << strerror(errno);
+        setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one));
+        setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &bufferBytes, sizeof(bufferBytes));
+        setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &bufferBytes, sizeof(bufferBytes));
+        setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+        CHECK(bind(fd, (struct sockaddr *)&addr, sizeof(addr)) == 0)
+            << "Failed to bind UDP port " << port << ": " << strerror(errno);
+        sockets_.push_back(fd);
+    }
+    // 接收缓冲区受 net.core.rmem_max 限制，装不下所有在途槽时溢出的数据报会被内核丢弃
+    socklen_t optlen = sizeof(bufferBytes);
+    getsockopt(sockets_[0], SOL_SOCKET, SO_RCVBUF, &bufferBytes, &optlen);
+    size_t inflight = (size_t)pipeline.numWorkers() * pipeline.window() *
+                      (sizeof(SwitchPacketHeader) + pipeline.slotBytes());
+    LOG_IF(WARNING, inflight > (size_t)bufferBytes / 2)
+        << inflight << " bytes can be in flight but the socket buffer is only " << bufferBytes
+        << " bytes; raise net.core.rmem_max or shrink the window to avoid drops";
+}
+
+UdpSwitch::~UdpSwitch() {
+    stop();
+    for (int fd : sockets_)
+        close(fd);
+}
+
+void UdpSwitch::start() {
+    launch([this](int thread) { run(thread); });
+}
+
+void UdpSwitch::run(int thread) {
+    SwitchCounters *counters = &counters_[thread];
+    int fd = sockets_[thread];
+    int numWorkers = pipeline_->numWorkers();
+    size_t slotBytes = pipeline_->slotBytes();
+    size_t packetBytes = sizeof(SwitchPacketHeader) + slotBytes;
+    std::vector<char> rxBuffer(kPollBatch * packetBytes);
+    struct mmsghdr rxMsgs[kPollBatch];
+    struct iovec rxIovs[kPollBatch];
+    struct sockaddr_in rxAddrs[kPollBatch];
+    std::memset(rxMsgs, 0, sizeof(rxMsgs));
+    for (int i = 0; i < kPollBatch; i++) {
+        rxIovs[i].iov_base = rxBuffer.data() + i * packetBytes;
+        rxIovs[i].iov_len = packetBytes;
+        rxMsgs[i].msg_hdr.msg_iov = &rxIovs[i];
+        rxMsgs[i].msg_hdr.msg_iovlen = 1;
+        rxMsgs[i].msg_hdr.msg_name = &rxAddrs[i];
+    }
+    // 一批数据报最多凑齐 kPollBatch 个槽，每个槽向每个 worker 发一个结果
+    size_t txCapacity = (size_t)kPollBatch * numWorkers;
+    std::vector<struct mmsghdr> txMsgs(txCapacity);
+    std::vector<struct iovec> txIovs(2 * txCapacity);
+    std::vector<SwitchPacketHeader> txHeaders(txCapacity);
+    while (running()) {
+        for (int i = 0; i < kPollBatch; i++)
+            rxMsgs[i].msg_hdr.msg_namelen = sizeof(rxAddrs[i]);
+        int n = recvmmsg(fd, rxMsgs, kPollBatch, MSG_WAITFORONE, nullptr);
+        if (n < 0) {
+            CHECK(errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+                << "recvmmsg failed: " << strerror(errno);
+            continue;
+        }
+        size_t tx = 0;
+        for (int i = 0; i < n; i++) {
+            const SwitchPacketHeader *header = (const SwitchPacketHeader *)rxIovs[i].iov_base;
+            if (rxMsgs[i].msg_len != packetBytes || header->worker >= (uint32_t)numWorkers) {
+                counters->dropped.fetch_add(1, std::memory_order_relaxed);
+                continue;
+            }
+            int worker = header->worker;
+            int expected = 0;
+            if (learned_[worker].load(std::memory_order_acquire) != 2 &&
+                learned_[worker].compare_exchange_strong(expected, 1)) {
+                workerAddrs_[worker] = rxAddrs[i];
+                learned_[worker].store(2, std::memory_order_release);
+            }
+            if (injectLoss(counters))
+                continue;
+            SwitchResult result =
+                pipeline_->aggregate(worker, header->imm, (const int32_t *)(header + 1), counters);
+            if (!result.data)
+                continue;
+            int first = result.multicast ? 0 : worker, last = result.multicast ? numWorkers : worker + 1;
+            for (int v = first; v < last; v++) {
+                if (injectLoss(counters))
+                    continue;
+                // 凑齐槽意味着每个 worker 都已发来过数据报，地址必然已学到
+                CHECK_EQ(learned_[v].load(std::memory_order_acquire), 2);
+                txHeaders[tx].imm = header->imm;
+                txHeaders[tx].worker = v;
+                txIovs[2 * tx].iov_base = &txHeaders[tx];
+                txIovs[2 * tx].iov_len = sizeof(SwitchPacketHeader);
+                txIovs[2 * tx + 1].iov_base = (void *)result.data;
+                txIovs[2 * tx + 1].iov_len = slotBytes;
+                std::memset(&txMsgs[tx], 0, sizeof(txMsgs[tx]));
+                txMsgs[tx].msg_hdr.msg_name = &workerAddrs_[v];
+                txMsgs[tx].msg_hdr.msg_namelen = sizeof(workerAddrs_[v]);
+                txMsgs[tx].msg_hdr.msg_iov = &txIovs[2 * tx];
+                txMsgs[tx].msg_hdr.msg_iovlen = 2;
+                tx++;
+            }
+        }
+        for (size_t sent = 0; sent < tx;) {
+            int m = sendmmsg(fd, txMsgs.data() + sent, tx - sent, 0);
+            if (m < 0) {
+                CHECK(errno == EAGAIN || errno == ENOBUFS || errno == EINTR)
+                    << "sendmmsg failed: " << strerror(errno);
+                sched_yield();
+                continue;
+            }
+            sent += m;
+        }
+    }
+}
+
+/* 共享内存段开头的描述，client 据此算出各个环的位置 */
+struct ShmSwitchSegment
+{
+    uint32_t magic;
+    int numWorkers;
+    int numThreads;
+    int window;
+    int slotElems;
+    uint32_t ringEntries;
+    size_t entryBytes;
+    size_t ringBytes;
+};
+
+static size_t round_up(size_t value, size_t alignment) {
+    return (value + alignment - 1) / alignment * alignment;
+}
+
+/* 段布局：描述占一条缓存行，随后是 numWorkers 个上行环和 numWorkers * numThreads 个下行环 */
+static void shm_layout(ShmSwitchSegment *segment, int numWorkers, int numThreads, int window,
+                       int slotElems) {
+    segment->numWorkers = numWorkers;
+    segment->numThreads = numThreads;
+    segment->window = window;
+    segment->slotElems = slotElems;
+    // 每个方向首发的槽不超过 window，再为重传和重发留出同样多的余量
+    segment->ringEntries = 1;
+    while (segment->ringEntries < 2 * (uint32_t)window)
+        segment->ringEntries <<= 1;
+    segment->entryBytes = round_up(sizeof(SwitchPacketHeader) + slotElems * sizeof(int32_t), 64);
+    segment->ringBytes = sizeof(ShmSwitchRing) + segment->ringEntries * segment->entryBytes;
+}
+
+static size_t shm_bytes(const ShmSwitchSegment *segment) {
+    size_t rings = (size_t)segment->numWorkers * (1 + segment->numThreads);
+    return 64 + rings * segment->ringBytes;
+}
+
+static ShmSwitchRing *shm_ring(void *base, int index) {
+    const ShmSwitchSegment *segment = (const ShmSwitchSegment *)base;
+    return (ShmSwitchRing *)((char *)base + 64 + index * segment->ringBytes);
+}
+
+static ShmSwitchRing *shm_up_ring(void *base, int worker) {
+    return shm_ring(base, worker);
+}
+
+static ShmSwitchRing *shm_down_ring(void *base, int worker, int thread) {
+    const ShmSwitchSegment *segment = (const ShmSwitchSegment *)base;
+    return shm_ring(base, segment->numWorkers + worker * segment->numThreads + thread);
+}
+
+static SwitchPacketHeader *ring_entry(const ShmSwitchSegment *segment, ShmSwitchRing *ring,
+                                      uint64_t index) {
+    char *entries = (char *)ring + sizeof(ShmSwitchRing);
+    return (SwitchPacketHeader *)(entries + (index & (segment->ringEntries - 1)) * segment->entryBytes);
+}
+
+/* 环满时返回 false，由调用者决定等待还是丢弃 */
+static bool ring_try_push(const ShmSwitchSegment *segment, ShmSwitchRing *ring, uint32_t imm,
+                          uint32_t worker, const int32_t *payload) {
+    uint64_t tail = ring->tail.load(std::memory_order_relaxed);
+    if (tail - ring->head.load(std::memory_order_acquire) >= segment->ringEntries)
+        return false;
+    SwitchPacketHeader *entry = ring_entry(segment, ring, tail);
+    entry->imm = imm;
+    entry->worker = worker;
+    std::memcpy(entry + 1, payload, segment->slotElems * sizeof(int32_t));
+    ring->tail.store(tail + 1, std::memory_order_release);
+    return true;
+}
+
+/* 取出队首但不出队，处理完载荷后再调用 ring_release */
+static SwitchPacketHeader *ring_peek(const ShmSwitchSegment *segment, ShmSwitchRing *ring) {
+    uint64_t head = ring->head.load(std::memory_order_relaxed);
+    if (head == ring->tail.load(std::memory_order_acquire))
+        return nullptr;
+    return ring_entry(segment, ring, head);
+}
+
+static void ring_release(ShmSwitchRing *ring) {
+    ring->head.store(ring->head.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+}
+
+static void *map_segment(int fd, size_t length) {
+    void *addr = mmap(nullptr, length, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    CHECK(addr != MAP_FAILED) << "Failed to map " << length << " bytes of shared memory";
+    return addr;
+}
+
+/**
+ * @brief 创建（或覆盖同名的）共享内存段并初始化所有环。
+ *
+ * @param pipeline 聚合流水线。
+ * @param name POSIX 共享内存名，以 / 开头。
+ * @param numThreads 转发线程数。
+ */
+ShmSwitch::ShmSwitch(SwitchPipeline &pipeline, const std::string &name, int numThreads)
+    : SwitchTransport(pipeline, numThreads), name_(name), segment_(nullptr), segmentBytes_(0) {
+    ShmSwitchSegment layout;
+    shm_layout(&layout, pipeline.numWorkers(), numThreads, pipeline.window(), pipeline.slotElems());
+    segmentBytes_ = shm_bytes(&layout);
+    int fd = shm_open(name.c_str(), O_CREAT | O_RDWR | O_TRUNC, 0600);
+    CHECK(fd >= 0) << "Failed to create shared memory " << name << ": " << strerror(errno);
+    CHECK(ftruncate(fd, segmentBytes_) == 0) << "Failed to size shared memory " << name;
+    segment_ = map_segment(fd, segmentBytes_);
+    close(fd);
+    ShmSwitchSegment *segment = (ShmSwitchSegment *)segment_;
+    *segment = layout;
+    int rings = pipeline.numWorkers() * (1 + numThreads);
+    for (int i = 0; i < rings; i++) {
+        ShmSwitchRing *ring = new (shm_ring(segment_, i)) ShmSwitchRing;
+        ring->head.store(0);
+        ring->tail.store(0);
+    }
+    // 最后写入魔数，client 看到它即说明环已就绪
+    std::atomic_thread_fence(std::memory_order_release);
+    segment->magic = kShmMagic;
+}
+
+ShmSwitch::~ShmSwitch() {
+    stop();
+    munmap(segment_, segmentBytes_);
+    shm_unlink(name_.c_str());
+}
+
+void ShmSwitch::start() {
+    launch([this](int thread) { run(thread); });
+}
+
+void ShmSwitch::run(int thread) {
+    SwitchCounters *counters = &counters_[thread];
+    const ShmSwitchSegment *segment = (const ShmSwitchSegment *)segment_;
+    int numWorkers = pipeline_->numWorkers();
+    while (running()) {
+        int events = 0;
+        for (int w = thread; w < numWorkers; w += numThreads_) {
+            ShmSwitchRing *ring = shm_up_ring(segment_, w);
+            for (int k = 0; k < kPollBatch; k++) {
+                SwitchPacketHeader *entry = ring_peek(segment, ring);
+                if (!entry)
+                    break;
+                events++;
+                uint32_t imm = entry->imm;
+                SwitchResult result;
+                if (!injectLoss(counters))
+                    result = pipeline_->aggregate(w, imm, (const int32_t *)(entry + 1), counters);
+                ring_release(ring);
+                if (!result.data)
+                    continue;
+                int first = result.multicast ? 0 : w, last = result.multicast ? numWorkers : w + 1;
+                for (int v = first; v < last; v++) {
+                    // 转发线程从不阻塞，下行环满时和交换机一样丢弃结果，由 worker 重传
+                    if (!injectLoss(counters) &&
+                        !ring_try_push(segment, shm_down_ring(segment_, v, thread), imm, v, result.data))
+                        counters->lost.fetch_add(1, std::memory_order_relaxed);
+                }
+            }
+        }
+        if (events == 0)
+            sched_yield();
+    }
+}
+
+/**
+ * @brief 创建连到 UDP 聚合器的 worker 套接字。
+ *
+ * @param host 聚合器地址。
+ * @param port 聚合器端口。
+ * @param worker 本 worker 的序号，随每个数据报发送。
+ * @param slotElems 每个槽的元素数，须与聚合器一致。
+ */
+UdpSwitchClient::UdpSwitchClient(const std::string &host, int port, int worker, int slotElems)
+    : sockfd_(-1), worker_(worker), slotElems_(slotElems),
+      packet_(sizeof(SwitchPacketHeader) + slotElems * sizeof(int32_t)) {
+    struct addrinfo hints, *res = nullptr;
+    std::memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_DGRAM;
+    std::string service = std::to_string(port);
+    int rc = getaddrinfo(host.c_str(), service.c_str(), &hints, &res);
+    CHECK(rc == 0) << "Failed to resolve " << host << ": " << gai_strerror(rc);
+    sockfd_ = socket(AF_INET, SOCK_DGRAM, 0);
+    CHECK(sockfd_ >= 0) << "Failed to create UDP socket: " << strerror(errno);
+    int bufferBytes = kSocketBuffer;
+    setsockopt(sockfd_, SOL_SOCKET, SO_RCVBUF, &bufferBytes, sizeof(bufferBytes));
+    setsockopt(sockfd_, SOL_SOCKET, SO_SNDBUF, &bufferBytes, sizeof(bufferBytes));
+    // connect 固定四元组，聚合器的 SO_REUSEPORT 散列因此总把本 worker 交给同一线程
+    CHECK(::connect(sockfd_, res->ai_addr, res->ai_addrlen) == 0)
+        << "Failed to connect to " << host << ":" << port << ": " << strerror(errno);
+    freeaddrinfo(res);
+}
+
+UdpSwitchClient::~UdpSwitchClient() {
+    close(sockfd_);
+}
+
+void UdpSwitchClient::send(uint32_t imm, const int32_t *payload) {
+    SwitchPacketHeader *header = (SwitchPacketHeader *)packet_.data();
+    header->imm = imm;
+    header->worker = worker_;
+    std::memcpy(header + 1, payload, slotElems_ * sizeof(int32_t));
+    while (::send(sockfd_, packet_.data(), packet_.size(), 0) < 0)
+        CHECK(errno == EAGAIN || errno == ENOBUFS || errno == EINTR)
+            << "Failed to send slot: " << strerror(errno);
+}
+
+/**
+ * @brief 接收一个槽的聚合结果。
+ *
+ * @param imm 输出结果的立即数。
+ * @param payload 输出一个槽的结果。
+ * @param timeoutMs 等待上限，UDP 丢包时由调用者决定重传或放弃。
+ * @return 超时返回 false。
+ */
+bool UdpSwitchClient::poll(uint32_t *imm, int32_t *payload, int timeoutMs) {
+    struct pollfd pfd = {sockfd_, POLLIN, 0};
+    while (true) {
+        int rc = ::poll(&pfd, 1, timeoutMs);
+        if (rc == 0)
+            return false;
+        if (rc < 0) {
+            CHECK(errno == EINTR) << "poll failed: " << strerror(errno);
+            continue;
+        }
+        ssize_t n = recv(sockfd_, packet_.data(), packet_.size(), 0);
+        if (n < 0 && (errno == EAGAIN || errno == EINTR))
+            continue;
+        CHECK(n == (ssize_t)packet_.size()) << "Unexpected datagram of " << n << " bytes";
+        const SwitchPacketHeader *header = (const SwitchPacketHeader *)packet_.data();
+        *imm = header->imm;
+        std::memcpy(payload, header + 1, slotElems_ * sizeof(int32_t));
+        return true;
+    }
+}
+
+/**
+ * @brief 打开 ShmSwitch 创建的共享内存段。
+ *
+ * @param name 共享内存名。
+ * @param worker 本 worker 的序号。
+ */
+ShmSwitchClient::ShmSwitchClient(const std::string &name, int worker)
+    : segment_(nullptr), segmentBytes_(0), worker_(worker), nextRing_(0) {
+    int fd = shm_open(name.c_str(), O_RDWR, 0);
+    CHECK(fd >= 0) << "Failed to open shared memory " << name << ": " << strerror(errno);
+    ShmSwitchSegment *segment = (ShmSwitchSegment *)map_segment(fd, sizeof(ShmSwitchSegment));
+    CHECK(segment->magic == kShmMagic) << "Shared memory " << name << " is not a switch segment";
+    std::atomic_thread_fence(std::memory_order_acquire);
+    segmentBytes_ = shm_bytes(segment);
+    numThreads_ = segment->numThreads;
+    slotElems_ = segment->slotElems;
+    CHECK(worker >= 0 && worker < segment->numWorkers)
+        << "Worker " << worker << " out of range, switch has " << segment->numWorkers;
+    munmap(segment, sizeof(ShmSwitchSegment));
+    segment_ = map_segment(fd, segmentBytes_);
+    close(fd);
+}
+
+ShmSwitchClient::~ShmSwitchClient() {
+    munmap(segment_, segmentBytes_);
+}
+
+void ShmSwitchClient::send(uint32_t imm, const int32_t *payload) {
+    const ShmSwitchSegment *segment = (const ShmSwitchSegment *)segment_;
+    while (!ring_try_push(segment, shm_up_ring(segment_, worker_), imm, worker_, payload))
+        sched_yield();
+}
+
+/**
+ * @brief 非阻塞地取一个槽的聚合结果，轮流检查各转发线程的下行环。
+ *
+ * @return 没有结果时返回 false。
+ */
+bool ShmSwitchClient::poll(uint32_t *imm, int32_t *payload) {
+    const ShmSwitchSegment *segment = (const ShmSwitchSegment *)segment_;
+    for (int i = 0; i < numThreads_; i++) {
+        ShmSwitchRing *ring = shm_down_ring(segment_, worker_, nextRing_);
+        nextRing_ = (nextRing_ + 1) % numThreads_;
+        SwitchPacketHeader *entry = ring_peek(segment, ring);
+        if (!entry)
+            continue;
+        *imm = entry->imm;
+        std::memcpy(payload, entry + 1, slotElems_ * sizeof(int32_t));
+        ring_release(ring);
+        return true;
+    }
+    return false;
+}
@@ -0,0 +1,251 @@
+#pragma once
+#include "allreduce.h"
+#include "rdma_context.h"
+#include <atomic>
+#include <functional>
+#include <memory>
+#include <netinet/in.h>
+#include <string>
+#include <thread>
+#include <vector>
+
+/* 槽位图用一个 uint64_t 记录已到达的 worker */
+#define SWITCH_MAX_WORKERS 64
+/* RDMA 模式下第 r 个 worker 通过 TCP 端口 SWITCH_BASE_PORT + r 与模拟器交换 QpInfo */
+#define SWITCH_BASE_PORT 12400
+#define SWITCH_UDP_PORT 48864
+#define SWITCH_SHM_NAME "/flashreduce_switch"
+
+/* UDP 数据报和共享内存环中每个槽前面的包头；RDMA 下 imm 即立即数，worker 由 QP 区分 */
+struct SwitchPacketHeader
+{
+    uint32_t imm;    // 编码见 flashreduce::slot_imm
+    uint32_t worker; // 上行为发送者，下行为接收者
+};
+
+struct SwitchStats
+{
+    uint64_t packets = 0;    // 收到的 worker 写入
+    uint64_t results = 0;    // 聚合完成的槽，每个槽向所有 worker 各发一次结果
+    uint64_t duplicates = 0; // 同一轮中同一 worker 对同一槽的重复写入（重传），不再累加
+    uint64_t resent = 0;     // 重复写入所在的一轮已完成时，单独重发给该 worker 的结果
+    uint64_t dropped = 0;    // 槽号或 worker 越界、过期一轮的重传、与本轮操作不一致的写入，丢弃
+    uint64_t lost = 0;       // 按 setLossRate 注入丢弃的写入和结果，以及下行队列满时丢弃的结果
+};
+
+/* 每个转发线程独占一条缓存行的计数器，读取方只做 relaxed 读 */
+struct alignas(64) SwitchCounters
+{
+    std::atomic<uint64_t> packets{0};
+    std::atomic<uint64_t> results{0};
+    std::atomic<uint64_t> duplicates{0};
+    std::atomic<uint64_t> resent{0};
+    std::atomic<uint64_t> dropped{0};
+    std::atomic<uint64_t> lost{0};
+};
+
+/* aggregate 的结果：data 为空时无需发送；multicast 为真时发给所有 worker，否则只重发给写入者 */
+struct SwitchResult
+{
+    const int32_t *data = nullptr;
+    bool multicast = false;
+};
+
+/* 交换机聚合流水线，对应 controller_.py 建模的 SwitchML 式槽池：window 个槽，
+ * 每个槽按立即数中序号的最低位分成两份影子副本，每份有 slotElems 个 int32 累加器、
+ * 一个 worker 位图和当前的序号。序号比副本记录的新，说明所有 worker 都已收到该副本
+ * 上一轮的结果，副本开始新的一轮；比记录的旧则是迟到的重传，丢弃。一轮中某个 worker
+ * 的第一份写入直接拷入累加器并记下立即数，之后的写入按立即数中的操作求和（按补码回绕）
+ * 或取最大值；位图凑齐全部 worker 后把累加器拷到该副本的结果区，这一轮完成。
+ *
+ * 位图在一轮完成后保留，同一 worker 的重复写入据此识别：未完成时忽略，已完成时说明
+ * 该 worker 没收到结果，只向它重发。结果区在该副本的下一轮完成之前保持不变，
+ * 所以传输层可以直接从结果区异步发送。aggregate 可被多个线程并发调用，
+ * 每个槽由自旋锁保护。 */
+class SwitchPipeline
+{
+public:
+    SwitchPipeline(int numWorkers, int window, int slotElems);
+    SwitchPipeline(const SwitchPipeline &) = delete;
+    SwitchPipeline &operator=(const SwitchPipeline &) = delete;
+
+    SwitchResult aggregate(int worker, uint32_t imm, const int32_t *payload, SwitchCounters *counters);
+
+    int numWorkers() const { return numWorkers_; }
+    int window() const { return window_; }
+    int slotElems() const { return slotElems_; }
+    size_t slotBytes() const { return (size_t)slotElems_ * sizeof(int32_t); }
+    int32_t *results() { return results_.data(); }
+    size_t resultBytes() const { return results_.size() * sizeof(int32_t); }
+
+private:
+    struct Round
+    {
+        uint64_t bitmap;
+        uint32_t imm;
+        uint16_t seq;
+        bool complete;
+    };
+
+    struct alignas(64) Slot
+    {
+        std::atomic_flag lock = ATOMIC_FLAG_INIT;
+        Round rounds[2];
+    };
+
+    int numWorkers_;
+    int window_;
+    int slotElems_;
+    uint64_t fullBitmap_;
+    std::unique_ptr<Slot[]> slots_;
+    std::vector<int32_t> accumulators_;
+    std::vector<int32_t> results_;
+};
+
+/* 各传输层共用的转发线程管理：start 之后由 numThreads 个线程忙轮询，stop 或析构时回收。
+ * 可经由基类指针持有和析构，但派生类析构时必须先 stop，线程可能还在访问派生类的成员。 */
+class SwitchTransport
+{
+public:
+    virtual ~SwitchTransport();
+    SwitchTransport(const SwitchTransport &) = delete;
+    SwitchTransport &operator=(const SwitchTransport &) = delete;
+
+    void stop();
+    SwitchStats stats() const;
+    SwitchPipeline &pipeline() const { return *pipeline_; }
+    /* 以概率 rate 独立地丢弃收到的每个写入和发往每个 worker 的每个结果，模拟有损链路 */
+    void setLossRate(double rate);
+
+protected:
+    SwitchTransport(SwitchPipeline &pipeline, int numThreads);
+    void launch(const std::function<void(int)> &run);
+    bool running() const { return running_.load(std::memory_order_relaxed); }
+    bool injectLoss(SwitchCounters *counters);
+
+    SwitchPipeline *pipeline_;
+    int numThreads_;
+    std::unique_ptr<SwitchCounters[]> counters_;
+
+private:
+    std::atomic<bool> running_;
+    std::atomic<uint32_t> lossThreshold_;
+    std::vector<std::thread> threads_;
+};
+
+/* 经由 RDMA（网卡或 soft-RoCE rxe）的聚合器：每个 worker 一个 UC QP，
+ * 在接收区中独占 window 个槽、每槽两份副本的区域。worker 的 WRITE_WITH_IMM 消耗一个
+ * 接收请求，完成后按立即数聚合并立即补投；槽聚合完成时从结果区向每个 worker 的
+ * raddr + shadow_index(slot, version) * slotBytes 写回结果，立即数不变，与 AllReduceSession
+ * 的协议一致。
+ * worker 按 w % numThreads 分给转发线程，发送 CQ 由所有线程共享。 */
+class RdmaSwitch : public SwitchTransport
+{
+public:
+    RdmaSwitch(RdmaContext &context, SwitchPipeline &pipeline, int numThreads = 1);
+    ~RdmaSwitch();
+
+    QpInfo localInfo(int worker) const;
+    void connect(int worker, const QpInfo &remote, ibv_mtu mtu = RDMA_MTU_AUTO);
+    void start();
+
+private:
+    void run(int thread);
+
+    std::vector<int32_t> recvBuffer_;
+    MemoryRegion recvRegion_;
+    MemoryRegion resultRegion_;
+    CompletionQueue sendCq_;
+    std::vector<CompletionQueue> recvCqs_;
+    std::vector<QueuePair> qps_;
+    std::vector<QpInfo> remotes_;
+};
+
+/* 经由 UDP 的聚合器：每个转发线程一个 SO_REUSEPORT 套接字，内核按四元组把同一 worker
+ * 的数据报散列到固定线程。数据报为 SwitchPacketHeader 加一个槽的载荷；worker 的地址
+ * 从它的第一个数据报中学习，结果用 sendmmsg 批量发给每个 worker。 */
+class UdpSwitch : public SwitchTransport
+{
+public:
+    UdpSwitch(SwitchPipeline &pipeline, int port = SWITCH_UDP_PORT, int numThreads = 1);
+    ~UdpSwitch();
+
+    void start();
+
+private:
+    void run(int thread);
+
+    std::vector<int> sockets_;
+    /* 0 未知，1 正在写入，2 已学到 */
+    std::unique_ptr<std::atomic<int>[]> learned_;
+    std::vector<sockaddr_in> workerAddrs_;
+};
+
+/* 共享内存段中的单生产者单消费者环，head 由消费者推进，tail 由生产者推进 */
+struct alignas(64) ShmSwitchRing
+{
+    std::atomic<uint64_t> head;
+    char pad[64 - sizeof(std::atomic<uint64_t>)];
+    std::atomic<uint64_t> tail;
+};
+
+/* 经由 POSIX 共享内存的聚合器：段内每个 worker 一个上行环，每个 (worker, 转发线程)
+ * 一个下行环，所有环都是单生产者单消费者。worker 按 w % numThreads 分给转发线程，
+ * 哪个线程凑齐了槽就由它向各 worker 的下行环写结果。 */
+class ShmSwitch : public SwitchTransport
+{
+public:
+    ShmSwitch(SwitchPipeline &pipeline, const std::string &name = SWITCH_SHM_NAME,
+              int numThreads = 1);
+    ~ShmSwitch();
+
+    void start();
+
+private:
+    void run(int thread);
+
+    std::string name_;
+    void *segment_;
+    size_t segmentBytes_;
+};
+
+/* UDP 聚合器的 worker 端，供测试和基准程序使用 */
+class UdpSwitchClient
+{
+public:
+    UdpSwitchClient(const std::string &host, int port, int worker, int slotElems);
+    ~UdpSwitchClient();
+    UdpSwitchClient(const UdpSwitchClient &) = delete;
+    UdpSwitchClient &operator=(const UdpSwitchClient &) = delete;
+
+    void send(uint32_t imm, const int32_t *payload);
+    bool poll(uint32_t *imm, int32_t *payload, int timeoutMs);
+
+private:
+    int sockfd_;
+    int worker_;
+    int slotElems_;
+    std::vector<char> packet_;
+};
+
+/* 共享内存聚合器的 worker 端，段须已由 ShmSwitch 创建 */
+class ShmSwitchClient
+{
+public:
+    ShmSwitchClient(const std::string &name, int worker);
+    ~ShmSwitchClient();
+    ShmSwitchClient(const ShmSwitchClient &) = delete;
+    ShmSwitchClient &operator=(const ShmSwitchClient &) = delete;
+
+    int slotElems() const { return slotElems_; }
+    void send(uint32_t imm, const int32_t *payload);
+    bool poll(uint32_t *imm, int32_t *payload);
+
+private:
+    void *segment_;
+    size_t segmentBytes_;
+    int worker_;
+    int numThreads_;
+    int slotElems_;
+    int nextRing_;
+};
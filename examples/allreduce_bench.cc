@@ -0,0 +1,99 @@
+/*
+经由交换机聚合的 AllReduce 正确性与吞吐测试
+LD_LIBRARY_PATH=/usr/local/grpc/lib ./allreduce_bench <rank> <num_workers> [controller_ip] [max_count] [window] [device] [dtype]
+先启动 controller/controller.py 和聚合器（可编程交换机，以 root 身份注册会话），
+每个 worker 以自己的 rank 启动。controller_ip 写成 emu:<host> 时不经控制器，直接经 TCP 连到
+host 上的 switch_emulator，此时各次 AllReduce 之间没有 Barrier，由聚合本身同步。第 r 个 worker 的张量元素为 r + 1，归约结果应为
+1 + 2 + ... + num_workers。元素数从 1K 依次乘 4 到 max_count，每个规模各跑若干次取平均。
+dtype 为 f32（默认）、f16 或 bf16，半精度在打包时直接转换，带宽按各自的元素大小计算。
+*/
+#include "allreduce.h"
+#include "grpc_client.h"
+#include "quantize.h"
+#include "rdma_context.h"
+#include "socket_endpoint.h"
+#include "switch_emulator.h"
+#include <glog/logging.h>
+#include <algorithm>
+#include <memory>
+#include <cmath>
+#include <vector>
+#include "get_clock.h"
+
+const int kRepeats = 10;
+const uint32_t kSessionId = 1;
+
+int main(int argc, char **argv)
+{
+    FLAGS_alsologtostderr = 1;
+    google::InitGoogleLogging(argv[0]);
+    uint32_t rank = atoi(argv[1]);
+    uint32_t num_workers = atoi(argv[2]);
+    std::string ip = argc > 3 ? argv[3] : "localhost";
+    size_t max_count = argc > 4 ? atol(argv[4]) : (16 << 20);
+    flashreduce::AllReduceConfig config;
+    config.window = argc > 5 ? atoi(argv[5]) : ALLREDUCE_DEFAULT_WINDOW;
+    std::string device = argc > 6 ? argv[6] : "mlx5_0";
+    std::string dtype_name = argc > 7 ? argv[7] : "f32";
+    flashreduce::DataType dtype = dtype_name == "f16"    ? flashreduce::Float16
+                                  : dtype_name == "bf16" ? flashreduce::BFloat16
+                                                         : flashreduce::Float32;
+    CHECK(dtype != flashreduce::Float32 || dtype_name == "f32") << "Unknown dtype " << dtype_name;
+
+    RdmaContext rdma(device);
+    flashreduce::AllReduceSession session(rdma, config);
+    std::unique_ptr<gRPCClient> client;
+    if (ip.rfind("emu:", 0) == 0)
+    {
+        QpInfo local = session.localInfo(), aggregator;
+        SocketEndpoint sock(ip.substr(4), SWITCH_BASE_PORT + rank);
+        CHECK(sock.syncData(sizeof(QpInfo), &local, &aggregator) == 0) << "Failed to exchange QpInfo";
+        session.connect(aggregator);
+    }
+    else
+    {
+        client = std::make_unique<gRPCClient>(ip, "8934");
+        session.connect(*client, kSessionId, rank, num_workers);
+        client->Barrier(num_workers);
+    }
+
+    float expected = num_workers * (num_workers + 1) / 2.0f;
+    double mhz = get_cpu_mhz(0);
+    std::vector<float> tensor(max_count);
+    std::vector<uint16_t> half(max_count);
+    bool f16 = dtype == flashreduce::Float16;
+    uint16_t (*narrow)(float) = f16 ? flashreduce::float_to_half : flashreduce::float_to_bfloat16;
+    float (*widen)(uint16_t) = f16 ? flashreduce::half_to_float : flashreduce::bfloat16_to_float;
+    // 和超出半精度能精确表示的整数范围时，结果只能精确到其尾数位数
+    float tolerance = dtype == flashreduce::Float32 ? 1e-3f : std::max(1e-3f, expected / (f16 ? 1024 : 128));
+    void *data = dtype == flashreduce::Float32 ? (void *)tensor.data() : (void *)half.data();
+    for (size_t count = 1024; count <= max_count; count *= 4)
+    {
+        cycles_t total = 0;
+        for (int r = 0; r < kRepeats; r++)
+        {
+            if (dtype == flashreduce::Float32)
+                std::fill(tensor.begin(), tensor.begin() + count, (float)(rank + 1));
+            else
+                std::fill(half.begin(), half.begin() + count, narrow((float)(rank + 1)));
+            if (client)
+                client->Barrier(num_workers);
+            cycles_t start = get_cycles();
+            flashreduce::AllReduce(data, count, dtype, flashreduce::Sum, session);
+            total += get_cycles() - start;
+            for (size_t i = 0; i < count; i++)
+            {
+                float value = dtype == flashreduce::Float32 ? tensor[i] : widen(half[i]);
+                CHECK(std::fabs(value - expected) < tolerance)
+                    << "Element " << i << " is " << value << ", expected " << expected;
+            }
+        }
+        double usec = total / mhz / kRepeats;
+        LOG(INFO) << count << " " << dtype_name << ": " << usec << " us, "
+                  << count * flashreduce::dtype_size(dtype) * 8 / (usec * 1e3) << " Gbps per worker";
+    }
+    LOG(INFO) << session.slotsSent() << " slots sent, " << session.retransmits() << " retransmits, "
+              << session.staleResults() << " stale results, retransmit timeout "
+              << session.retransmitTimeoutUs() << " us";
+    return 0;
+}
@@ -0,0 +1,139 @@
+/*
+测量门铃批量提交与选择性置信号对小消息发送速率的影响
+server: ./doorbell_batch_bench 1
+client: ./doorbell_batch_bench 0 [signal_interval] [msg_size] [iterations]
+client 的代理线程用 RDMA 写向 server 连续发送 iterations 条小消息，批大小从 1 依次
+翻倍到 64，每批只敲一次门铃；signal_interval 为 0 时每批只有最后一个 WR 带信号，
+否则每 signal_interval 个 WR 带一次信号。批大小 1、每个都带信号即原来的发送方式。
+*/
+#include "proxy.h"
+#include "rdma_context.h"
+#include "socket_endpoint.h"
+#include <infiniband/verbs.h>
+#include <glog/logging.h>
+#include <algorithm>
+#include <cstring>
+#include <vector>
+#include "get_clock.h"
+
+const int kCompletionQueueDepth = 1024;
+const int kSendQueueDepth = 256;
+
+static int batch_size = 1;
+/* 任务结束后 ProxyArgs 即被回收，计时结果放在这里 */
+static cycles_t run_start, run_end;
+
+void batch_send_progress(ProxyArgs *args)
+{
+    if (args->state == ProxyOpReady)
+    {
+        args->state = ProxyOpProgress;
+        args->count = 0;
+        run_start = get_cycles();
+    }
+    args->idle = 1;
+    struct ibv_wc wcs[32];
+    int num_completions = ProxyPollCq(args, 32, wcs);
+    for (int k = 0; k < num_completions; ++k)
+    {
+        CHECK_EQ(wcs[k].status, IBV_WC_SUCCESS) << ibv_wc_status_str(wcs[k].status);
+        ProxySendCompleted(args, &wcs[k]);
+        args->idle = 0;
+    }
+    int left = args->iterations - args->count;
+    int n = std::min(batch_size, left);
+    // 额度不足一整批时等待，保证每次门铃都提交满批（数据流末尾除外）
+    if (n > 0 && args->endpoint.available_wqes >= n)
+    {
+        struct ibv_send_wr wrs[PROXY_MAX_SEND_BATCH];
+        for (int i = 0; i < n; i++)
+            wrs[i] = args->endpoint.send_wr;
+        CHECK(ProxyPostSendBatch(args, wrs, n, n == left) == 0) << "Failed to post send batch";
+        args->count += n;
+        args->idle = 0;
+    }
+    if (args->count == args->iterations && args->endpoint.available_wqes == kSendQueueDepth)
+    {
+        run_end = get_cycles();
+        args->state = ProxyOpNone;
+    }
+}
+
+int main(int argc, char **argv)
+{
+    FLAGS_alsologtostderr = 1;
+    google::InitGoogleLogging(argv[0]);
+    int server = atoi(argv[1]);
+    int signal_interval = argc > 2 ? atoi(argv[2]) : 0;
+    int msg_size = argc > 3 ? atoi(argv[3]) : 64;
+    int iterations = argc > 4 ? atoi(argv[4]) : 1000000;
+    // 等待整批额度时，末尾不带信号的 WR 加上一整批不能超过发送队列深度，否则会互相等待
+    CHECK(signal_interval + PROXY_MAX_SEND_BATCH <= kSendQueueDepth)
+        << "signal_interval must not exceed " << kSendQueueDepth - PROXY_MAX_SEND_BATCH;
+
+    RdmaContext rdma("mlx5_0");
+    std::vector<char> buffer(msg_size);
+    MemoryRegion mr(rdma, buffer.data(), msg_size);
+    CompletionQueue cq(rdma, kCompletionQueueDepth);
+    QueuePairConfig qp_config;
+    qp_config.type = IBV_QPT_RC;
+    qp_config.maxSendWr = kSendQueueDepth;
+    qp_config.maxRecvWr = 1;
+    QueuePair qp(rdma, qp_config, cq);
+    qp.toInit();
+    QpInfo qp_info = qp.localInfo(&mr), neighbor_qp_info;
+    SocketEndpoint *sock = server ? new SocketEndpoint(12345) : new SocketEndpoint("localhost", 12345);
+    CHECK(sock->syncData(sizeof(QpInfo), &qp_info, &neighbor_qp_info) == 0) << "Failed to exchange QP info";
+    qp.connect(neighbor_qp_info);
+    sock->syncReady();
+
+    if (!server)
+    {
+        ProxyHandler handler = {};
+        uint32_t abort = 0;
+        handler.abortFlag = &abort;
+        ProxyThreadConfig proxyConfig = {};
+        proxyConfig.numaNode = rdma.numaNode();
+        proxyConfig.name = "proxy-doorbell";
+        ProxyCreate(&handler, &proxyConfig);
+        ProxyArgs *channelProxyTail = nullptr;
+        double mhz = get_cpu_mhz(0);
+        for (batch_size = 1; batch_size <= PROXY_MAX_SEND_BATCH; batch_size *= 2)
+        {
+            ProxyArgs *args = allocateArgs(&handler);
+            args->state = ProxyOpReady;
+            args->proxyTail = &channelProxyTail;
+            args->progress = batch_send_progress;
+            args->iterations = iterations;
+            args->endpoint.cq = cq.cq();
+            args->endpoint.qp = qp.qp();
+            args->endpoint.max_inline = qp.maxInlineData();
+            args->endpoint.sge.addr = (uintptr_t)buffer.data();
+            args->endpoint.sge.length = msg_size;
+            args->endpoint.sge.lkey = mr.lkey();
+            std::memset(&args->endpoint.send_wr, 0, sizeof(args->endpoint.send_wr));
+            args->endpoint.send_wr.sg_list = &args->endpoint.sge;
+            args->endpoint.send_wr.num_sge = 1;
+            args->endpoint.send_wr.opcode = IBV_WR_RDMA_WRITE;
+            args->endpoint.send_wr.wr.rdma.remote_addr = (uint64_t)neighbor_qp_info.raddr;
+            args->endpoint.send_wr.wr.rdma.rkey = neighbor_qp_info.rkey;
+            args->endpoint.available_wqes = kSendQueueDepth;
+            args->endpoint.signal_interval = signal_interval > 0 ? signal_interval : batch_size;
+            int interval = args->endpoint.signal_interval;
+            ProxyRequest request;
+            ProxyRequestInit(&request);
+            ProxyArgsAppend(&handler, args, &request);
+            ProxyStart(&handler);
+            ProxyRequestWait(&request);
+            double nanosec = 1e3 * (run_end - run_start) / mhz;
+            LOG(INFO) << "batch " << batch_size << ", signal every " << interval
+                      << ", message " << msg_size << " B"
+                      << (msg_size <= (int)qp.maxInlineData() ? " inline: " : ": ")
+                      << iterations / (nanosec / 1e3) << " Mmsg/s";
+        }
+        ProxyDestroy(&handler);
+    }
+    sock->syncReady();
+    delete sock;
+    return 0;
+}
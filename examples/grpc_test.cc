@@ -24,9 +24,9 @@ int main(int argc, char** argv) {
     init_ibv_device(&device, &context, "mlx5_7");
     struct ibv_port_attr port_attr;
     std::memset(&port_attr, 0, sizeof(port_attr));
-    CHECK(ibv_query_port(context, IB_PORT, &port_attr) == 0) << "Failed to query port attributes";
-    ibv_gid gid;
-    CHECK(ibv_query_gid(context, IB_PORT, GID_INDEX, &gid) == 0) << "Failed to query GID";
+    const GidSelection &local_gid = resolve_gid(context);
+    CHECK(ibv_query_port(context, local_gid.port, &port_attr) == 0) << "Failed to query port attributes";
+    ibv_gid gid = local_gid.gid;
     std::vector<QpInfo> local_qp_infos, remote_qp_infos;
     struct QpInfo qp_info;
     qp_info.rkey = 102 + rank;
@@ -0,0 +1,123 @@
+/*
+对比普通页与大页内存池上的注册耗时和随机小写吞吐
+server: ./hugepage_arena_bench 1 <0:malloc|1:arena> [buffer_mb] [msg_size] [iterations]
+client: ./hugepage_arena_bench 0 <0:malloc|1:arena> [buffer_mb] [msg_size] [iterations]
+两端各分配 buffer_mb 的缓冲区并注册，client 用 RDMA 写把 msg_size 的小消息写到
+对端缓冲区的随机偏移，本端源地址也随机选取。缓冲区远大于网卡地址翻译缓存时，
+4K 页每次写都可能缺失，大页则一项翻译覆盖 2MB 或 1GB。
+*/
+#include "hugepage_arena.h"
+#include "rdma_context.h"
+#include "socket_endpoint.h"
+#include <infiniband/verbs.h>
+#include <glog/logging.h>
+#include <cstring>
+#include <memory>
+#include <random>
+#include "get_clock.h"
+
+const int kCompletionQueueDepth = 1024;
+const int kSendQueueDepth = 256;
+
+int main(int argc, char **argv)
+{
+    FLAGS_alsologtostderr = 1;
+    google::InitGoogleLogging(argv[0]);
+    int server = atoi(argv[1]);
+    int use_arena = argc > 2 ? atoi(argv[2]) : 1;
+    size_t buffer_size = (size_t)(argc > 3 ? atoi(argv[3]) : 4096) << 20;
+    int msg_size = argc > 4 ? atoi(argv[4]) : 64;
+    int iterations = argc > 5 ? atoi(argv[5]) : 1000000;
+    double mhz = get_cpu_mhz(0);
+
+    RdmaContext rdma("mlx5_0");
+    std::unique_ptr<HugepageArena> arena;
+    std::unique_ptr<MemoryRegion> region;
+    RegisteredBuffer arena_buffer = {};
+    void *base;
+    uint32_t lkey, rkey;
+    cycles_t c0 = get_cycles();
+    if (use_arena)
+    {
+        // 整个缓冲区放在一块中，块大小为 1GB 整数倍时优先用 1GB 页
+        arena = std::make_unique<HugepageArena>(rdma, buffer_size);
+        arena_buffer = arena->allocate(buffer_size);
+        base = arena_buffer.addr;
+        lkey = arena_buffer.lkey;
+        rkey = arena_buffer.rkey;
+    }
+    else
+    {
+        base = malloc(buffer_size);
+        CHECK(base) << "Cannot allocate " << buffer_size << "B.";
+        region = std::make_unique<MemoryRegion>(rdma, base, buffer_size);
+        lkey = region->lkey();
+        rkey = region->rkey();
+    }
+    cycles_t c1 = get_cycles();
+    LOG(INFO) << (use_arena ? "arena" : "malloc") << ": allocating and registering "
+              << (buffer_size >> 20) << " MB took " << (c1 - c0) / mhz / 1e3 << " ms";
+
+    CompletionQueue cq(rdma, kCompletionQueueDepth);
+    QueuePairConfig qp_config;
+    qp_config.type = IBV_QPT_RC;
+    qp_config.maxSendWr = kSendQueueDepth;
+    qp_config.maxRecvWr = 1;
+    QueuePair qp(rdma, qp_config, cq);
+    qp.toInit();
+    QpInfo qp_info = qp.localInfo(), neighbor_qp_info;
+    qp_info.raddr = base;
+    qp_info.rkey = rkey;
+    SocketEndpoint *sock = server ? new SocketEndpoint(12345) : new SocketEndpoint("localhost", 12345);
+    CHECK(sock->syncData(sizeof(QpInfo), &qp_info, &neighbor_qp_info) == 0) << "Failed to exchange QP info";
+    qp.connect(neighbor_qp_info);
+    sock->syncReady();
+
+    if (!server)
+    {
+        std::mt19937_64 rng(1);
+        size_t slots = buffer_size / msg_size;
+        struct ibv_sge sge;
+        sge.length = msg_size;
+        sge.lkey = lkey;
+        struct ibv_send_wr send_wr, *bad_wr = nullptr;
+        std::memset(&send_wr, 0, sizeof(send_wr));
+        send_wr.sg_list = &sge;
+        send_wr.num_sge = 1;
+        send_wr.opcode = IBV_WR_RDMA_WRITE;
+        send_wr.send_flags = IBV_SEND_SIGNALED;
+        send_wr.wr.rdma.rkey = neighbor_qp_info.rkey;
+        int posted = 0, completed = 0;
+        struct ibv_wc wcs[32];
+        cycles_t start = get_cycles();
+        while (completed < iterations)
+        {
+            while (posted < iterations && posted - completed < kSendQueueDepth)
+            {
+                sge.addr = (uintptr_t)base + rng() % slots * msg_size;
+                send_wr.wr.rdma.remote_addr = (uint64_t)neighbor_qp_info.raddr + rng() % slots * msg_size;
+                CHECK(ibv_post_send(qp.qp(), &send_wr, &bad_wr) == 0) << "Failed to post send WR";
+                posted++;
+            }
+            int n = ibv_poll_cq(cq.cq(), 32, wcs);
+            for (int k = 0; k < n; k++)
+                CHECK_EQ(wcs[k].status, IBV_WC_SUCCESS) << ibv_wc_status_str(wcs[k].status);
+            completed += n;
+        }
+        double nanosec = 1e3 * (get_cycles() - start) / mhz;
+        LOG(INFO) << (use_arena ? "arena" : "malloc") << ", " << (buffer_size >> 20) << " MB, "
+                  << msg_size << " B random writes: " << iterations / (nanosec / 1e3) << " Mmsg/s";
+    }
+    sock->syncReady();
+    delete sock;
+    if (use_arena)
+    {
+        arena->free(arena_buffer);
+    }
+    else
+    {
+        region.reset();
+        free(base);
+    }
+    return 0;
+}
@@ -0,0 +1,83 @@
+/*
+测量 MR 缓存命中与未命中时取得 MR 的耗时
+./mr_cache_bench [budget_mb] [rounds] [leave_pinned]
+1. 对 4KB 到 64MB 的缓冲区分别测量直接 ibv_reg_mr/ibv_dereg_mr 与缓存命中的耗时
+2. 模拟反复对同一组张量做 allreduce：每轮对 16 个缓冲区各取一次 MR，统计命中率
+3. munmap 之后重新 mmap 同一大小的缓冲区，确认旧的 MR 已失效并重新注册
+leave_pinned 非 0 时让 free 不再把内存归还系统，见 MrCache 的说明
+*/
+#include "mr_cache.h"
+#include "rdma_context.h"
+#include <infiniband/verbs.h>
+#include <glog/logging.h>
+#include <sys/mman.h>
+#include <vector>
+#include "get_clock.h"
+
+const int kTensors = 16;
+const size_t kTensorSize = 4 << 20;
+
+int main(int argc, char **argv)
+{
+    FLAGS_alsologtostderr = 1;
+    google::InitGoogleLogging(argv[0]);
+    size_t budget = (size_t)(argc > 1 ? atoi(argv[1]) : 1024) << 20;
+    int rounds = argc > 2 ? atoi(argv[2]) : 1000;
+    bool leavePinned = argc > 3 && atoi(argv[3]) != 0;
+    double mhz = get_cpu_mhz(0);
+
+    RdmaContext rdma("mlx5_0");
+    MrCache cache(rdma, budget, RDMA_DEFAULT_ACCESS, leavePinned);
+    for (size_t size = 4096; size <= (64 << 20); size *= 4)
+    {
+        std::vector<char> buffer(size);
+        cycles_t c0 = get_cycles();
+        ibv_mr *mr = ibv_reg_mr(rdma.pd(), buffer.data(), size, RDMA_DEFAULT_ACCESS);
+        CHECK(mr) << "Failed to register " << size << " bytes";
+        ibv_dereg_mr(mr);
+        cycles_t c1 = get_cycles();
+        cache.release(cache.acquire(buffer.data(), size));
+        cycles_t c2 = get_cycles();
+        const int kHits = 1000;
+        for (int i = 0; i < kHits; i++)
+            cache.release(cache.acquire(buffer.data(), size));
+        cycles_t c3 = get_cycles();
+        LOG(INFO) << size << " B: reg+dereg " << (c1 - c0) / mhz << " us, miss "
+                  << (c2 - c1) / mhz << " us, hit " << (c3 - c2) / mhz / kHits * 1e3 << " ns";
+        cache.invalidate(buffer.data(), size);
+    }
+
+    std::vector<std::vector<char>> tensors(kTensors, std::vector<char>(kTensorSize));
+    uint64_t hits = cache.hits(), misses = cache.misses();
+    cycles_t c0 = get_cycles();
+    for (int round = 0; round < rounds; round++)
+    {
+        ibv_mr *mrs[kTensors];
+        for (int i = 0; i < kTensors; i++)
+            mrs[i] = cache.acquire(tensors[i].data(), kTensorSize);
+        for (int i = 0; i < kTensors; i++)
+            cache.release(mrs[i]);
+    }
+    cycles_t c1 = get_cycles();
+    hits = cache.hits() - hits;
+    misses = cache.misses() - misses;
+    LOG(INFO) << rounds << " rounds over " << kTensors << " tensors of " << kTensorSize << " B: "
+              << "hit rate " << 100.0 * hits / (hits + misses) << "%, "
+              << (c1 - c0) / mhz / rounds << " us per round, " << cache.pinnedBytes() << " B pinned, "
+              << cache.evictions() << " evictions";
+
+    void *region = mmap(nullptr, kTensorSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    CHECK(region != MAP_FAILED) << "Failed to mmap";
+    cache.release(cache.acquire(region, kTensorSize));
+    uint64_t invalidations = cache.invalidations();
+    munmap(region, kTensorSize);
+    CHECK(cache.invalidations() > invalidations) << "munmap did not invalidate the cached MR";
+    misses = cache.misses();
+    region = mmap(nullptr, kTensorSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    CHECK(region != MAP_FAILED) << "Failed to mmap";
+    cache.release(cache.acquire(region, kTensorSize));
+    CHECK(cache.misses() == misses + 1) << "Remapped buffer hit a stale MR";
+    munmap(region, kTensorSize);
+    LOG(INFO) << "munmap invalidation ok, " << cache.invalidations() << " invalidations in total";
+    return 0;
+}
@@ -0,0 +1,98 @@
+/*
+测量不同路径 MTU 下 RDMA 写的带宽
+server: ./mtu_bench 1 [max_msg_size] [iterations]
+client: ./mtu_bench 0 [max_msg_size] [iterations]
+两端先按 active_mtu 自动协商出上限，再对 256 到上限之间的每个 MTU 各建一个 RC QP，
+client 在每个 QP 上对 4KB 到 max_msg_size 的消息各发送 iterations 次 RDMA 写。
+小 MTU 下每条消息拆成更多的包，包头和每包处理开销限制了带宽。
+*/
+#include "rdma_context.h"
+#include "socket_endpoint.h"
+#include <infiniband/verbs.h>
+#include <glog/logging.h>
+#include <cstring>
+#include <vector>
+#include "get_clock.h"
+
+const int kCompletionQueueDepth = 1024;
+const int kSendQueueDepth = 128;
+
+static double write_bandwidth(QueuePair &qp, CompletionQueue &cq, const MemoryRegion &mr,
+                              const QpInfo &remote, size_t msg_size, int iterations)
+{
+    struct ibv_sge sge;
+    sge.addr = (uintptr_t)mr.addr();
+    sge.length = msg_size;
+    sge.lkey = mr.lkey();
+    struct ibv_send_wr send_wr, *bad_wr = nullptr;
+    std::memset(&send_wr, 0, sizeof(send_wr));
+    send_wr.sg_list = &sge;
+    send_wr.num_sge = 1;
+    send_wr.opcode = IBV_WR_RDMA_WRITE;
+    send_wr.send_flags = IBV_SEND_SIGNALED;
+    send_wr.wr.rdma.remote_addr = (uint64_t)remote.raddr;
+    send_wr.wr.rdma.rkey = remote.rkey;
+    int posted = 0, completed = 0;
+    struct ibv_wc wcs[32];
+    cycles_t start = get_cycles();
+    while (completed < iterations)
+    {
+        while (posted < iterations && posted - completed < kSendQueueDepth)
+        {
+            CHECK(ibv_post_send(qp.qp(), &send_wr, &bad_wr) == 0) << "Failed to post send WR";
+            posted++;
+        }
+        int n = ibv_poll_cq(cq.cq(), 32, wcs);
+        for (int k = 0; k < n; k++)
+            CHECK_EQ(wcs[k].status, IBV_WC_SUCCESS) << ibv_wc_status_str(wcs[k].status);
+        completed += n;
+    }
+    double nanosec = 1e3 * (get_cycles() - start) / get_cpu_mhz(0);
+    return (double)iterations * msg_size * 8 / nanosec;
+}
+
+int main(int argc, char **argv)
+{
+    FLAGS_alsologtostderr = 1;
+    google::InitGoogleLogging(argv[0]);
+    int server = atoi(argv[1]);
+    size_t max_msg_size = argc > 2 ? atol(argv[2]) : (1 << 20);
+    int iterations = argc > 3 ? atoi(argv[3]) : 10000;
+
+    RdmaContext rdma("mlx5_0");
+    std::vector<char> buffer(max_msg_size);
+    MemoryRegion mr(rdma, buffer.data(), max_msg_size);
+    CompletionQueue cq(rdma, kCompletionQueueDepth);
+    SocketEndpoint *sock = server ? new SocketEndpoint(12345) : new SocketEndpoint("localhost", 12345);
+    QueuePairConfig qp_config;
+    qp_config.type = IBV_QPT_RC;
+    qp_config.maxSendWr = kSendQueueDepth;
+    qp_config.maxRecvWr = 1;
+
+    // 先用自动协商得到两端都支持的上限，之后逐个 MTU 显式覆盖
+    ibv_mtu max_mtu = RDMA_MTU_AUTO;
+    for (int mtu = IBV_MTU_256; max_mtu == RDMA_MTU_AUTO || mtu <= max_mtu; mtu++)
+    {
+        QueuePair qp(rdma, qp_config, cq);
+        qp.toInit();
+        QpInfo qp_info = qp.localInfo(&mr), neighbor_qp_info;
+        CHECK(sock->syncData(sizeof(QpInfo), &qp_info, &neighbor_qp_info) == 0) << "Failed to exchange QP info";
+        if (max_mtu == RDMA_MTU_AUTO)
+        {
+            max_mtu = negotiate_mtu(rdma.activeMtu(), neighbor_qp_info, RDMA_MTU_AUTO);
+            LOG(INFO) << "local active MTU " << (128 << rdma.activeMtu()) << ", negotiated up to "
+                      << (128 << max_mtu);
+        }
+        qp.connect(neighbor_qp_info, (ibv_mtu)mtu);
+        sock->syncReady();
+        if (!server)
+        {
+            for (size_t msg_size = 4096; msg_size <= max_msg_size; msg_size *= 4)
+                LOG(INFO) << "MTU " << (128 << qp.pathMtu()) << ", message " << msg_size << " B: "
+                          << write_bandwidth(qp, cq, mr, neighbor_qp_info, msg_size, iterations) << " Gbps";
+        }
+        sock->syncReady();
+    }
+    delete sock;
+    return 0;
+}
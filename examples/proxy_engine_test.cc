@@ -0,0 +1,83 @@
+#include "proxy.h"
+#include <stdio.h>
+#include <unistd.h>
+#include <glog/logging.h>
+// 示例任务执行函数：每个任务推进若干步后完成
+void exampleTask(ProxyArgs *args)
+{
+    if (args->state == ProxyOpReady)
+    {
+        args->state = ProxyOpProgress;
+        args->iterations = 0;
+    }
+    args->idle = 0;
+    if (++args->iterations == args->count)
+    {
+        args->state = ProxyOpNone;
+    }
+}
+
+int main(int argc, char **argv)
+{
+    FLAGS_alsologtostderr = 1;
+    google::InitGoogleLogging(argv[0]);
+    int nThreads = argc > 1 ? atoi(argv[1]) : 4;
+    const int kChannels = 16;
+    const int kOpsPerChannel = 64;
+
+    ProxyEngine engine = {};
+    uint32_t abort = 0;
+    engine.abortFlag = &abort;
+    // 空闲的代理线程从繁忙的线程窃取 channel
+    engine.workStealing = true;
+    // 每个代理线程绑定到一个 CPU
+    int *cores = new int[nThreads];
+    ProxyThreadConfig *configs = new ProxyThreadConfig[nThreads]();
+    long nCpus = sysconf(_SC_NPROCESSORS_ONLN);
+    for (int i = 0; i < nThreads; i++)
+    {
+        cores[i] = i % nCpus;
+        configs[i].cores = &cores[i];
+        configs[i].nCores = 1;
+        configs[i].numaNode = -1;
+    }
+    ProxyEngineCreate(&engine, nThreads, configs);
+    delete[] configs;
+    delete[] cores;
+
+    ProxyArgs *channelProxyTails[kChannels] = {};
+    for (int c = 0; c < kChannels; c++)
+    {
+        LOG(INFO) << "Channel " << c << " -> shard "
+                  << ProxyEngineShard(&engine, &channelProxyTails[c]);
+    }
+    cycles_t start = get_cycles();
+    for (int i = 0; i < kOpsPerChannel; i++)
+    {
+        for (int c = 0; c < kChannels; c++)
+        {
+            ProxyArgs *args = ProxyEngineAllocateArgs(&engine, &channelProxyTails[c]);
+            args->state = ProxyOpReady;
+            args->progress = exampleTask;
+            // 前两个 channel 的任务远大于其它 channel，制造负载不均
+            args->count = c < 2 ? 10000 : 100;
+            ProxyEngineArgsAppend(&engine, args);
+        }
+        ProxyEngineStart(&engine);
+    }
+    ProxyEngineWaitAllOpFinished(&engine);
+    cycles_t end = get_cycles();
+    LOG(INFO) << kChannels * kOpsPerChannel << " ops finished on " << nThreads
+              << " proxy threads in " << (end - start) / get_cpu_mhz(0) << " us";
+    for (int i = 0; i < nThreads; i++)
+    {
+        ProxyStealStats stats;
+        ProxyEngineGetStealStats(&engine, i, &stats);
+        LOG(INFO) << "Shard " << i << ": steals=" << stats.steals
+                  << ", donations=" << stats.donations
+                  << ", avg migration=" << stats.avgMigrationUs << " us";
+    }
+
+    ProxyEngineDestroy(&engine);
+    return 0;
+}
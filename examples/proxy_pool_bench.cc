@@ -0,0 +1,161 @@
+/*
+对比 ProxyArgs 分配延迟：旧的 mutex + 32 个一组 CALLOC 对象池 vs. slab/magazine 对象池
+用法: ./proxy_pool_bench [producers] [ops_per_producer] [huge_pages]
+每个生产者线程分配 ProxyArgs 并经由单生产者/单消费者环交给回收线程，
+回收线程模拟代理线程归还对象，统计生产者侧每次分配的周期数。
+*/
+#include "proxy_pool.h"
+#include "common.h"
+#include <stdio.h>
+#include <string.h>
+#include <algorithm>
+#include <atomic>
+#include <thread>
+#include <vector>
+#include "get_clock.h"
+
+const int kRingSize = 1024;
+const int kLegacyChunk = 32;
+
+// 旧实现：生产者在 mutex 下分配，回收者压入无锁栈，池空时整体取回或新建一组
+struct LegacyChunk
+{
+    LegacyChunk *next;
+    ProxyArgs elems[kLegacyChunk];
+};
+
+struct LegacyPool
+{
+    pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+    std::atomic<ProxyArgs *> freeHead{nullptr};
+    ProxyArgs *pool = nullptr;
+    LegacyChunk *chunks = nullptr;
+
+    ProxyArgs *alloc()
+    {
+        pthread_mutex_lock(&mutex);
+        if (pool == nullptr)
+            pool = freeHead.exchange(nullptr, std::memory_order_acquire);
+        if (pool == nullptr)
+        {
+            LegacyChunk *chunk;
+            ALLOC_ALIGNED(chunk, LegacyChunk, 1, PROXY_CACHE_LINE_SIZE);
+            memset((void *)chunk, 0, sizeof(LegacyChunk));
+            for (int i = 0; i + 1 < kLegacyChunk; i++)
+                chunk->elems[i].next = &chunk->elems[i + 1];
+            pool = chunk->elems;
+            chunk->next = chunks;
+            chunks = chunk;
+        }
+        ProxyArgs *elem = pool;
+        pool = pool->next;
+        pthread_mutex_unlock(&mutex);
+        return elem;
+    }
+
+    void free(ProxyArgs *args)
+    {
+        ProxyArgs *head = freeHead.load(std::memory_order_relaxed);
+        do
+        {
+            args->next = head;
+        } while (!freeHead.compare_exchange_weak(head, args, std::memory_order_release,
+                                                 std::memory_order_relaxed));
+    }
+
+    ~LegacyPool()
+    {
+        while (chunks != nullptr)
+        {
+            LegacyChunk *next = chunks->next;
+            _mm_free(chunks);
+            chunks = next;
+        }
+    }
+};
+
+struct Ring
+{
+    alignas(64) std::atomic<uint64_t> head{0};
+    alignas(64) std::atomic<uint64_t> tail{0};
+    ProxyArgs *slots[kRingSize];
+};
+
+template <typename Alloc, typename Free>
+static void run(const char *name, int producers, int ops, Alloc alloc_fn, Free free_fn)
+{
+    std::vector<Ring> rings(producers);
+    std::vector<std::vector<cycles_t>> samples(producers);
+    std::atomic<int> done{0};
+    std::thread reclaimer([&]
+                          {
+        while (done.load(std::memory_order_acquire) < producers ||
+               std::any_of(rings.begin(), rings.end(), [](Ring &r)
+                           { return r.head.load() != r.tail.load(); }))
+        {
+            for (Ring &ring : rings)
+            {
+                uint64_t head = ring.head.load(std::memory_order_relaxed);
+                uint64_t tail = ring.tail.load(std::memory_order_acquire);
+                for (; head != tail; head++)
+                    free_fn(ring.slots[head % kRingSize]);
+                ring.head.store(head, std::memory_order_release);
+            }
+        } });
+    std::vector<std::thread> threads;
+    for (int p = 0; p < producers; p++)
+        threads.emplace_back([&, p]
+                             {
+            Ring &ring = rings[p];
+            samples[p].reserve(ops);
+            for (int i = 0; i < ops; i++)
+            {
+                cycles_t start = get_cycles();
+                ProxyArgs *args = alloc_fn();
+                samples[p].push_back(get_cycles() - start);
+                args->state = ProxyOpReady;
+                uint64_t tail = ring.tail.load(std::memory_order_relaxed);
+                while (tail - ring.head.load(std::memory_order_acquire) == kRingSize)
+                    ;
+                ring.slots[tail % kRingSize] = args;
+                ring.tail.store(tail + 1, std::memory_order_release);
+            }
+            done.fetch_add(1, std::memory_order_release); });
+    for (std::thread &t : threads)
+        t.join();
+    reclaimer.join();
+
+    std::vector<cycles_t> all;
+    for (auto &s : samples)
+        all.insert(all.end(), s.begin(), s.end());
+    std::sort(all.begin(), all.end());
+    double sum = 0;
+    for (cycles_t c : all)
+        sum += c;
+    double mhz = get_cpu_mhz(0);
+    printf("%-8s producers %d: alloc avg %.1f ns, p50 %.1f ns, p99 %.1f ns, max %.1f us\n", name,
+           producers, 1000.0 * sum / all.size() / mhz, 1000.0 * all[all.size() / 2] / mhz,
+           1000.0 * all[all.size() * 99 / 100] / mhz, all.back() / mhz);
+}
+
+int main(int argc, char **argv)
+{
+    int producers = argc > 1 ? atoi(argv[1]) : 4;
+    int ops = argc > 2 ? atoi(argv[2]) : 1000000;
+    bool huge_pages = argc > 3 && atoi(argv[3]) != 0;
+    printf("sizeof(ProxyArgs) = %zu, alignof(ProxyArgs) = %zu\n", sizeof(ProxyArgs),
+           alignof(ProxyArgs));
+
+    LegacyPool legacy;
+    run("legacy", producers, ops, [&]
+        { return legacy.alloc(); }, [&](ProxyArgs *args)
+        { legacy.free(args); });
+
+    ProxyArgsPool *pool = ProxyPoolCreate(huge_pages);
+    ProxyPoolReserve(pool, (size_t)producers * kRingSize * 2);
+    run("slab", producers, ops, [&]
+        { return ProxyPoolAlloc(pool); }, [&](ProxyArgs *args)
+        { ProxyPoolFree(pool, args); });
+    ProxyPoolDestroy(pool);
+    return 0;
+}
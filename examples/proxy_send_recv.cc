@@ -1,13 +1,17 @@
 #include "proxy.h"
+#include "proxy_coro.h"
 #include <stdio.h>
 #include <unistd.h>
-#include "rdma_utils.h"
+#include "rdma_context.h"
 #include "socket_endpoint.h"
 #include <infiniband/verbs.h>
 #include <ostream>
 #include <cstring>
+#include <vector>
 #include "get_clock.h"
 
+const int kSendQueueDepth = 256;
+
 void send_benchmark(ProxyArgs *args)
 {
     if (args->state == ProxyOpReady)
@@ -22,13 +26,12 @@ void send_benchmark(ProxyArgs *args)
         if (args->endpoint.available_wqes == 0)
         {
             struct ibv_wc wcs[32];
-            int num_completions = ibv_poll_cq(args->endpoint.cq, 32, wcs);
+            int num_completions = ProxyPollCq(args, 32, wcs);
             args->endpoint.available_wqes += num_completions;
             return;
         }
-        struct ibv_send_wr *bad_wr = nullptr;
         args->endpoint.send_wr.wr_id = args->iterations;
-        int ret = ibv_post_send(args->endpoint.qp, &args->endpoint.send_wr, &bad_wr);
+        int ret = ProxyPostSend(args, &args->endpoint.send_wr);
         args->endpoint.available_wqes--;
     }
     if (args->iterations == 10) {
@@ -50,14 +53,13 @@ void recv_benchmark(ProxyArgs *args)
     {
         args->idle = 0;
         struct ibv_wc wcs[32];
-        int num_completions = ibv_poll_cq(args->endpoint.cq, 32, wcs);
+        int num_completions = ProxyPollCq(args, 32, wcs);
         if (num_completions) args->iterations += 1;
         args->count += num_completions;
         for (int k = 0; k < num_completions; ++k)
         {
             args->endpoint.recv_wr.wr_id = wcs[k].wr_id;
-            struct ibv_recv_wr *bad_recv_wr = nullptr;
-            ibv_post_recv(args->endpoint.qp, &args->endpoint.recv_wr, &bad_recv_wr);
+            ProxyPostRecv(args, &args->endpoint.recv_wr);
         }
         if (args->count > 0 && args->first_completion)
         {
@@ -76,88 +78,172 @@ void recv_benchmark(ProxyArgs *args)
     }    
 }
 
+// CQ 集中轮询模式：progress 只负责发送，完成事件由代理线程按 wr_id 分发到 complete
+void send_sweep_progress(ProxyArgs *args)
+{
+    if (args->state == ProxyOpReady)
+    {
+        args->state = ProxyOpProgress;
+        args->count = 0;
+    }
+    if (args->count == 10)
+    {
+        args->state = ProxyOpNone;
+        return;
+    }
+    if (args->iterations == 10 || args->endpoint.available_wqes == 0)
+    {
+        args->idle = 1;
+        return;
+    }
+    args->endpoint.send_wr.wr_id = ProxyWrId(args, args->iterations);
+    CHECK(ProxyPostSend(args, &args->endpoint.send_wr) == 0) << "Failed to post send WR";
+    args->endpoint.available_wqes--;
+    args->iterations++;
+}
+
+void send_sweep_complete(ProxyArgs *args, struct ibv_wc *wc)
+{
+    CHECK_EQ(wc->status, IBV_WC_SUCCESS) << ibv_wc_status_str(wc->status);
+    args->endpoint.available_wqes++;
+    args->count++;
+}
+
+void recv_sweep_progress(ProxyArgs *args)
+{
+    if (args->state == ProxyOpReady)
+    {
+        args->state = ProxyOpProgress;
+        args->first_completion = 1;
+        args->count = 0;
+    }
+    args->idle = 1;
+    if (args->count == 10)
+    {
+        args->state = ProxyOpNone;
+        args->endTick = get_cycles();
+        double mhz = get_cpu_mhz(0);
+        double nanosec = 1e3 * (args->endTick - args->startTick) / mhz;
+        LOG(INFO) << ", Rx (Gbps): " << ((args->count - 1) * 65536 * 8) / nanosec << " Gbps";
+    }
+}
+
+void recv_sweep_complete(ProxyArgs *args, struct ibv_wc *wc)
+{
+    CHECK_EQ(wc->status, IBV_WC_SUCCESS) << ibv_wc_status_str(wc->status);
+    if (args->first_completion)
+    {
+        args->startTick = get_cycles();
+        args->first_completion = 0;
+    }
+    args->count++;
+    args->endpoint.recv_wr.wr_id = wc->wr_id;
+    ProxyPostRecv(args, &args->endpoint.recv_wr);
+}
+
+// 协程模式：同样的收发逻辑写成顺序代码，等待 CQ 完成和发送额度时挂起
+ProxyTask send_coroutine(ProxyArgs *args)
+{
+    struct ibv_wc wcs[32];
+    for (int i = 0; i < 10; i++)
+    {
+        if (args->endpoint.available_wqes == 0)
+            args->endpoint.available_wqes += co_await ProxyCqCompletion(args->endpoint.cq, wcs, 32);
+        args->endpoint.send_wr.wr_id = i;
+        CHECK(ProxyPostSend(args, &args->endpoint.send_wr) == 0) << "Failed to post send WR";
+        args->endpoint.available_wqes--;
+    }
+    // 等待全部发送完成后结束
+    while (args->endpoint.available_wqes < kSendQueueDepth)
+        args->endpoint.available_wqes += co_await ProxyCqCompletion(args->endpoint.cq, wcs, 32);
+}
+
+ProxyTask recv_coroutine(ProxyArgs *args)
+{
+    struct ibv_wc wcs[32];
+    int count = 0;
+    while (count < 10)
+    {
+        int n = co_await ProxyCqCompletion(args->endpoint.cq, wcs, 32);
+        if (count == 0)
+            args->startTick = get_cycles();
+        count += n;
+        for (int k = 0; k < n; ++k)
+        {
+            CHECK_EQ(wcs[k].status, IBV_WC_SUCCESS) << ibv_wc_status_str(wcs[k].status);
+            args->endpoint.recv_wr.wr_id = wcs[k].wr_id;
+            ProxyPostRecv(args, &args->endpoint.recv_wr);
+        }
+    }
+    args->endTick = get_cycles();
+    double mhz = get_cpu_mhz(0);
+    double nanosec = 1e3 * (args->endTick - args->startTick) / mhz;
+    LOG(INFO) << ", Rx (Gbps): " << ((count - 1) * 65536 * 8) / nanosec << " Gbps";
+}
+
 int main(int argc, char **argv)
 {
     FLAGS_alsologtostderr = 1;
     google::InitGoogleLogging(argv[0]);
     int server = atoi(argv[1]);
+    // 0: 状态机，1: CQ 集中轮询，2: 协程
+    int mode = argc > 2 ? atoi(argv[2]) : 0;
+    int sweep = mode == 1;
     int msg_numel = 16384;
-    ibv_mtu mtu = IBV_MTU_256; // Use 1024 MTU for this example
+    ibv_mtu mtu = RDMA_MTU_AUTO; // 取两端 active_mtu 的较小值
     const int kCompletionQueueDepth = 1024;
-    const int kSendQueueDepth = 256;
     const int kReceiveQueueDepth = 512;
     const int kScatterGatherElementCount = 1;
-    const int kMaxInlineData = 16;
-    ProxyHandler handler;
+    RdmaContext rdma("mlx5_0");
+    ProxyHandler handler = {};
     uint32_t abort = 0;
     handler.abortFlag = &abort;
-    ProxyCreate(&handler);
+    // 代理线程放在网卡所在的 NUMA 节点上
+    ProxyThreadConfig proxyConfig = {};
+    proxyConfig.numaNode = rdma.numaNode();
+    proxyConfig.name = "proxy-send-recv";
+    ProxyCreate(&handler, &proxyConfig);
     ProxyArgs *args = allocateArgs(&handler);
     args->state = ProxyOpReady;
     ProxyArgs *channelProxyTail = nullptr;
      args->proxyTail = &channelProxyTail;
-    ibv_device *device = nullptr;
-    ibv_context *context = nullptr;
-    init_ibv_device(&device, &context, "mlx5_0");
-    struct ibv_port_attr port_attr;
-    std::memset(&port_attr, 0, sizeof(port_attr));
-    CHECK(ibv_query_port(context, IB_PORT, &port_attr) == 0) << "Failed to query port attributes";
-    ibv_gid gid;
-    CHECK(ibv_query_gid(context, IB_PORT, GID_INDEX, &gid) == 0) << "Failed to query GID";
-    LOG(INFO) << "Step 1: Initialize RDMA device " << ibv_get_device_name(device)
-              << ", open device context, query port attributes such as GID: "
+    const ibv_gid &gid = rdma.gid();
+    LOG(INFO) << "Step 1: Initialize RDMA device " << ibv_get_device_name(rdma.device())
+              << ", open device context, allocate protection domain, query port attributes such as GID: "
               << std::hex << gid.global.subnet_prefix << gid.global.interface_id << std::dec;
 
-    struct ibv_pd *pd = ibv_alloc_pd(context);
-    CHECK(pd) << "Failed to allocate protection domain";
-    LOG(INFO) << "Step 2: Allocate protection domain";
-
     int buffer_size = msg_numel * sizeof(float);
-    void *buffer = malloc(buffer_size);
-    CHECK(buffer) << "Failed to allocate buffer of size " << buffer_size;
-    struct ibv_mr *mr = ibv_reg_mr(pd, buffer, buffer_size, (IBV_ACCESS_LOCAL_WRITE | IBV_ACCESS_REMOTE_WRITE | IBV_ACCESS_ZERO_BASED));
-    CHECK(mr) << "Failed to register memory region";
-    LOG(INFO) << "Step 3: Allocate and register memory region of size " << buffer_size
+    std::vector<float> buffer(msg_numel);
+    MemoryRegion mr(rdma, buffer.data(), buffer_size, RDMA_DEFAULT_ACCESS | IBV_ACCESS_ZERO_BASED);
+    LOG(INFO) << "Step 2: Allocate and register memory region of size " << buffer_size
               << " with local write and remote write access";
 
-    struct ibv_cq *cq = ibv_create_cq(context, kCompletionQueueDepth, nullptr, nullptr, 0);
-    CHECK(cq) << "Failed to create completion queue";
-    LOG(INFO) << "Step 4: Create completion queue with depth " << kCompletionQueueDepth;
+    CompletionQueue cq(rdma, kCompletionQueueDepth);
+    LOG(INFO) << "Step 3: Create completion queue with depth " << kCompletionQueueDepth;
 
-    struct ibv_qp_init_attr init_attributes;
-    std::memset(&init_attributes, 0, sizeof(init_attributes));
-    init_attributes.send_cq = cq;
-    init_attributes.recv_cq = cq;
-    init_attributes.qp_type = IBV_QPT_UC;
-    init_attributes.cap.max_send_wr = kSendQueueDepth;
-    init_attributes.cap.max_recv_wr = kReceiveQueueDepth;
-    init_attributes.cap.max_send_sge = kScatterGatherElementCount;
-    init_attributes.cap.max_recv_sge = kScatterGatherElementCount;
-    init_attributes.cap.max_inline_data = kMaxInlineData;
-    struct ibv_qp *qp = ibv_create_qp(pd, &init_attributes);
-    CHECK(qp) << "Failed to create queue pair";
-    LOG(INFO) << "Step 5: Create queue pair with send/receive CQ, type UC, and specified capabilities";
+    QueuePairConfig qp_config;
+    qp_config.type = IBV_QPT_UC;
+    qp_config.maxSendWr = kSendQueueDepth;
+    qp_config.maxRecvWr = kReceiveQueueDepth;
+    qp_config.maxSendSge = kScatterGatherElementCount;
+    qp_config.maxRecvSge = kScatterGatherElementCount;
+    QueuePair qp(rdma, qp_config, cq);
+    LOG(INFO) << "Step 4: Create queue pair with send/receive CQ, type UC, and specified capabilities";
 
-    args->endpoint.cq = cq;
-    args->endpoint.qp = qp;
+    args->endpoint.cq = cq.cq();
+    args->endpoint.qp = qp.qp();
+    args->endpoint.max_inline = qp.maxInlineData();
     args->iterations = 0;
 
-    int ret = modify_qp_to_init(qp);
-    CHECK(ret == 0) << "Failed to modify QP to INIT state";
-    LOG(INFO) << "Step 6: Modify QP to INIT state with port number, PKey index, and access flags";
+    qp.toInit();
+    LOG(INFO) << "Step 5: Modify QP to INIT state with port number, PKey index, and access flags";
     // 交换gid, rkey, qp_num, psn
-    struct QpInfo qp_info, neighbor_qp_info;
-    qp_info.rkey = mr->rkey;
-    qp_info.raddr = buffer;
-    qp_info.qp_num = qp->qp_num;
-    qp_info.psn = 0;
-    qp_info.gid = gid;
-    qp_info.lid = port_attr.lid;
+    struct QpInfo qp_info = qp.localInfo(&mr), neighbor_qp_info;
     if (server)
     {
         SocketEndpoint sock(12345);
         sock.syncData(sizeof(QpInfo), &qp_info, &neighbor_qp_info);
-        LOG(INFO) << "Step 7: Server side, exchange QP info with client";
+        LOG(INFO) << "Step 6: Server side, exchange QP info with client";
         LOG(INFO) << "        Server QP Info: rkey=" << qp_info.rkey
                   << ", qp_num=" << qp_info.qp_num
                   << ", psn=" << qp_info.psn
@@ -170,9 +256,8 @@ int main(int argc, char **argv)
                   << ", gid=" << std::hex << neighbor_qp_info.gid.global.subnet_prefix
                   << neighbor_qp_info.gid.global.interface_id << std::dec
                   << ", lid=" << neighbor_qp_info.lid;
-        ret = modify_qp_to_rts(qp, neighbor_qp_info, mtu, 0);
-        CHECK(ret >= 0) << "Failed to modify QP to RTS state";
-        LOG(INFO) << "Step 8: Modify QP to RTS state with initial PSN and other parameters";
+        qp.connect(neighbor_qp_info, mtu);
+        LOG(INFO) << "Step 7: Modify QP to RTS state with initial PSN and other parameters";
         std::memset(&args->endpoint.recv_wr, 0, sizeof(args->endpoint.recv_wr));
         struct ibv_recv_wr &recv_wr = args->endpoint.recv_wr;
         recv_wr.wr_id = 0;
@@ -181,12 +266,15 @@ int main(int argc, char **argv)
         recv_wr.num_sge = 0;
         for (int i = 0; i < kSendQueueDepth; i++)
         {
-            recv_wr.wr_id = i;
+            recv_wr.wr_id = sweep ? ProxyWrId(args, i) : i;
             struct ibv_recv_wr *bad_recv_wr = nullptr;
-            ret = ibv_post_recv(qp, &recv_wr, &bad_recv_wr);
+            CHECK(ibv_post_recv(qp.qp(), &recv_wr, &bad_recv_wr) == 0) << "Failed to post receive WR";
         }
         args->endpoint.available_wqes = kReceiveQueueDepth;
-        args->progress = recv_benchmark;
+        args->progress = sweep ? recv_sweep_progress : recv_benchmark;
+        args->complete = sweep ? recv_sweep_complete : nullptr;
+        if (mode == 2)
+            ProxyCoroBind(args, recv_coroutine);
         sock.syncReady();
         ProxyArgsAppend(&handler, args);
     }
@@ -194,7 +282,7 @@ int main(int argc, char **argv)
     {
         SocketEndpoint sock("localhost", 12345);
         sock.syncData(sizeof(QpInfo), &qp_info, &neighbor_qp_info);
-        LOG(INFO) << "Step 7: Client side, exchange QP info with server";
+        LOG(INFO) << "Step 6: Client side, exchange QP info with server";
         LOG(INFO) << "        Client QP Info: rkey=" << qp_info.rkey
                   << ", qp_num=" << qp_info.qp_num
                   << ", psn=" << qp_info.psn
@@ -207,17 +295,16 @@ int main(int argc, char **argv)
                   << ", gid=" << std::hex << neighbor_qp_info.gid.global.subnet_prefix
                   << neighbor_qp_info.gid.global.interface_id << std::dec
                   << ", lid=" << neighbor_qp_info.lid;
-        ret = modify_qp_to_rts(qp, neighbor_qp_info, mtu, 0);
-        CHECK(ret >= 0) << "Failed to modify QP to RTS state";
-        LOG(INFO) << "Step 8: Modify QP to RTS state with initial PSN and other parameters";
+        qp.connect(neighbor_qp_info, mtu);
+        LOG(INFO) << "Step 7: Modify QP to RTS state with initial PSN and other parameters";
         sock.syncReady();
         std::memset(&args->endpoint.send_wr, 0, sizeof(args->endpoint.send_wr));
         struct ibv_send_wr &send_wr = args->endpoint.send_wr;
         struct ibv_sge &sge = args->endpoint.sge;
         std::memset(&sge, 0, sizeof(sge));
-        sge.addr = (uintptr_t)buffer;
+        sge.addr = (uintptr_t)buffer.data();
         sge.length = buffer_size;
-        sge.lkey = mr->lkey;
+        sge.lkey = mr.lkey();
         send_wr.wr_id = 0;
         send_wr.next = nullptr;
         send_wr.sg_list = &sge;
@@ -228,18 +315,15 @@ int main(int argc, char **argv)
         send_wr.wr.rdma.rkey = neighbor_qp_info.rkey;                   // Remote key for the memory region
         send_wr.imm_data = 0;
         args->endpoint.available_wqes = kSendQueueDepth;
-        args->progress = send_benchmark;
+        args->progress = sweep ? send_sweep_progress : send_benchmark;
+        args->complete = sweep ? send_sweep_complete : nullptr;
+        if (mode == 2)
+            ProxyCoroBind(args, send_coroutine);
         sock.syncReady();
         ProxyArgsAppend(&handler, args);
     }
     ProxyStart(&handler);
     ProxyWaitAllOpFinished(&handler);
-    ibv_destroy_qp(qp);
-    ibv_destroy_cq(cq);
-    ibv_dereg_mr(mr);
-    free(buffer);
-    ibv_dealloc_pd(pd);
-    ibv_close_device(context);
     ProxyDestroy(&handler);
     return 0;
 }
\ No newline at end of file
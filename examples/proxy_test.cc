@@ -15,7 +15,7 @@ int main(int argc, char **argv)
 {
     FLAGS_alsologtostderr = 1;
     google::InitGoogleLogging(argv[0]);
-    ProxyHandler handler;
+    ProxyHandler handler = {};
     // 初始化 abortFlag
     uint32_t abort = 0;
     handler.abortFlag = &abort;
@@ -32,15 +32,16 @@ int main(int argc, char **argv)
     ProxyArgs *channelProxyTail = nullptr;
     args->proxyTail = &channelProxyTail;
 
-    // 将任务添加到任务队列
-    ProxyArgsAppend(&handler, args);
+    // 将任务添加到任务队列，并关联完成句柄
+    ProxyRequest request;
+    ProxyRequestInit(&request);
+    ProxyArgsAppend(&handler, args, &request);
 
     // 唤醒代理执行线程
     ProxyStart(&handler);
 
-    // 等待一段时间，让任务有机会执行
-    // 这里可以使用更合适的同步机制
-    sleep(2);
+    // 阻塞等待任务完成
+    ProxyRequestWait(&request);
 
     ProxyDestroy(&handler);
 
@@ -0,0 +1,209 @@
+/*
+对比代理线程空闲等待方式的延迟与 CPU 开销
+server: ./proxy_wait_bench 1 <0:yield|1:adaptive> [gap_us] [iterations]
+client: ./proxy_wait_bench 0 <mode 无意义> [gap_us] [iterations]
+client 每隔 gap_us 发送一个 ping，server 的代理线程收到后立即回 pong，
+client 统计往返延迟，server 统计进程 CPU 占用率。
+*/
+#include "proxy.h"
+#include <stdio.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/time.h>
+#include "rdma_context.h"
+#include "socket_endpoint.h"
+#include <infiniband/verbs.h>
+#include <algorithm>
+#include <cstring>
+#include <vector>
+#include "get_clock.h"
+
+const int kCompletionQueueDepth = 1024;
+const int kSendQueueDepth = 256;
+const int kReceiveQueueDepth = 256;
+const int kMessageSize = 64;
+
+static void post_recvs(struct ibv_qp *qp, int n)
+{
+    struct ibv_recv_wr recv_wr;
+    std::memset(&recv_wr, 0, sizeof(recv_wr));
+    for (int i = 0; i < n; i++)
+    {
+        struct ibv_recv_wr *bad_recv_wr = nullptr;
+        recv_wr.wr_id = i;
+        CHECK(ibv_post_recv(qp, &recv_wr, &bad_recv_wr) == 0) << "Failed to post receive WR";
+    }
+}
+
+// server 端进度函数：收到 ping 立即回 pong，没有完成时报告空闲
+void pong_progress(ProxyArgs *args)
+{
+    if (args->state == ProxyOpReady)
+    {
+        args->state = ProxyOpProgress;
+        args->count = 0;
+    }
+    struct ibv_wc wcs[32];
+    int num_completions = ProxyPollCq(args, 32, wcs);
+    if (num_completions == 0)
+    {
+        args->idle = 1;
+        return;
+    }
+    args->idle = 0;
+    for (int k = 0; k < num_completions; ++k)
+    {
+        CHECK_EQ(wcs[k].status, IBV_WC_SUCCESS) << ibv_wc_status_str(wcs[k].status);
+        if (wcs[k].opcode != IBV_WC_RECV_RDMA_WITH_IMM)
+        {
+            args->endpoint.available_wqes++;
+            continue;
+        }
+        args->endpoint.recv_wr.wr_id = wcs[k].wr_id;
+        ProxyPostRecv(args, &args->endpoint.recv_wr);
+        args->endpoint.send_wr.imm_data = wcs[k].imm_data;
+        ProxyPostSend(args, &args->endpoint.send_wr);
+        args->endpoint.available_wqes--;
+        args->count++;
+    }
+    if (args->count == args->iterations)
+    {
+        args->state = ProxyOpNone;
+    }
+}
+
+static double cpu_seconds()
+{
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return usage.ru_utime.tv_sec + usage.ru_stime.tv_sec +
+           1e-6 * (usage.ru_utime.tv_usec + usage.ru_stime.tv_usec);
+}
+
+static double wall_seconds()
+{
+    struct timeval tv;
+    gettimeofday(&tv, nullptr);
+    return tv.tv_sec + 1e-6 * tv.tv_usec;
+}
+
+int main(int argc, char **argv)
+{
+    FLAGS_alsologtostderr = 1;
+    google::InitGoogleLogging(argv[0]);
+    int server = atoi(argv[1]);
+    int adaptive = argc > 2 ? atoi(argv[2]) : 1;
+    int gap_us = argc > 3 ? atoi(argv[3]) : 1000;
+    int iterations = argc > 4 ? atoi(argv[4]) : 1000;
+
+    RdmaContext rdma("mlx5_0");
+    std::vector<char> buffer(kMessageSize);
+    MemoryRegion mr(rdma, buffer.data(), kMessageSize);
+    // CQ 绑定完成通道，代理线程可在其上阻塞
+    CompletionQueue cq(rdma, kCompletionQueueDepth, true);
+    QueuePairConfig qp_config;
+    qp_config.type = IBV_QPT_UC;
+    qp_config.maxSendWr = kSendQueueDepth;
+    qp_config.maxRecvWr = kReceiveQueueDepth;
+    QueuePair qp(rdma, qp_config, cq);
+    qp.toInit();
+
+    struct QpInfo qp_info = qp.localInfo(&mr), neighbor_qp_info;
+    SocketEndpoint *sock = server ? new SocketEndpoint(12345) : new SocketEndpoint("localhost", 12345);
+    sock->syncData(sizeof(QpInfo), &qp_info, &neighbor_qp_info);
+    qp.connect(neighbor_qp_info);
+    post_recvs(qp.qp(), kReceiveQueueDepth);
+
+    struct ibv_sge sge;
+    sge.addr = (uintptr_t)buffer.data();
+    sge.length = kMessageSize;
+    sge.lkey = mr.lkey();
+    struct ibv_send_wr send_wr;
+    std::memset(&send_wr, 0, sizeof(send_wr));
+    send_wr.sg_list = &sge;
+    send_wr.num_sge = 1;
+    send_wr.opcode = IBV_WR_RDMA_WRITE_WITH_IMM;
+    send_wr.send_flags = IBV_SEND_SIGNALED;
+    // ping 足够小时内联发送，省去网卡读取负载的一次 DMA
+    if (kMessageSize <= qp.maxInlineData())
+        send_wr.send_flags |= IBV_SEND_INLINE;
+    send_wr.wr.rdma.remote_addr = (uint64_t)neighbor_qp_info.raddr;
+    send_wr.wr.rdma.rkey = neighbor_qp_info.rkey;
+
+    if (server)
+    {
+        ProxyHandler handler = {};
+        uint32_t abort = 0;
+        handler.abortFlag = &abort;
+        ProxyThreadConfig proxyConfig = {};
+        proxyConfig.numaNode = rdma.numaNode();
+        proxyConfig.waitMode = adaptive ? ProxyWaitAdaptive : ProxyWaitYield;
+        ProxyCreate(&handler, &proxyConfig);
+        ProxyArgs *channelProxyTail = nullptr;
+        ProxyArgs *args = allocateArgs(&handler);
+        args->state = ProxyOpReady;
+        args->proxyTail = &channelProxyTail;
+        args->progress = pong_progress;
+        args->iterations = iterations;
+        args->endpoint.cq = cq.cq();
+        args->endpoint.qp = qp.qp();
+        args->endpoint.max_inline = qp.maxInlineData();
+        args->endpoint.sge = sge;
+        args->endpoint.send_wr = send_wr;
+        args->endpoint.send_wr.sg_list = &args->endpoint.sge;
+        std::memset(&args->endpoint.recv_wr, 0, sizeof(args->endpoint.recv_wr));
+        args->endpoint.available_wqes = kSendQueueDepth;
+        ProxyArgsAppend(&handler, args);
+        ProxyStart(&handler);
+        sock->syncReady();
+        double cpu_start = cpu_seconds();
+        double wall_start = wall_seconds();
+        // 主线程在 futex 上阻塞，不计入 CPU 占用
+        ProxyWaitAllOpFinished(&handler);
+        double cpu = cpu_seconds() - cpu_start;
+        double wall = wall_seconds() - wall_start;
+        LOG(INFO) << (adaptive ? "adaptive" : "yield") << " wait, gap " << gap_us
+                  << " us: server CPU " << 100.0 * cpu / wall << "% of one core";
+        ProxyDestroy(&handler);
+    }
+    else
+    {
+        sock->syncReady();
+        double mhz = get_cpu_mhz(0);
+        std::vector<double> rtts;
+        struct ibv_wc wc;
+        for (int i = 0; i < iterations; i++)
+        {
+            usleep(gap_us);
+            struct ibv_send_wr *bad_wr = nullptr;
+            send_wr.imm_data = i;
+            cycles_t start = get_cycles();
+            CHECK(ibv_post_send(qp.qp(), &send_wr, &bad_wr) == 0) << "Failed to post send WR";
+            bool pong = false;
+            while (!pong)
+            {
+                if (ibv_poll_cq(cq.cq(), 1, &wc) == 0)
+                    continue;
+                CHECK_EQ(wc.status, IBV_WC_SUCCESS) << ibv_wc_status_str(wc.status);
+                if (wc.opcode == IBV_WC_RECV_RDMA_WITH_IMM)
+                {
+                    struct ibv_recv_wr recv_wr, *bad_recv_wr = nullptr;
+                    std::memset(&recv_wr, 0, sizeof(recv_wr));
+                    recv_wr.wr_id = wc.wr_id;
+                    ibv_post_recv(qp.qp(), &recv_wr, &bad_recv_wr);
+                    pong = true;
+                }
+            }
+            rtts.push_back((get_cycles() - start) / mhz);
+        }
+        std::sort(rtts.begin(), rtts.end());
+        double sum = 0;
+        for (double rtt : rtts)
+            sum += rtt;
+        LOG(INFO) << "gap " << gap_us << " us: RTT avg " << sum / rtts.size()
+                  << " us, p50 " << rtts[rtts.size() / 2]
+                  << " us, p99 " << rtts[rtts.size() * 99 / 100] << " us";
+    }
+    delete sock;
+    return 0;
+}
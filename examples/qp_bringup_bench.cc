@@ -0,0 +1,111 @@
+/*
+测量 1 到 max_qps 个 QP 的建链耗时
+server: ./qp_bringup_bench 1 [max_qps] [threads]
+client: ./qp_bringup_bench 0 [max_qps] [threads]
+每个规模依次测三种方式：
+1. serial: 逐个 QP 迁移到 INIT、交换 QpInfo、迁移到 RTS，每个 QP 一次往返
+2. bulk:   一次往返交换全部 QpInfo，单线程完成状态迁移
+3. bulk-N: 一次往返交换全部 QpInfo，N 个线程并行完成状态迁移
+*/
+#include "rdma_context.h"
+#include "socket_endpoint.h"
+#include <infiniband/verbs.h>
+#include <glog/logging.h>
+#include <algorithm>
+#include <thread>
+#include <vector>
+#include "get_clock.h"
+
+const int kCompletionQueueDepth = 4096;
+const int kMaxCompletionQueues = 16;
+const ibv_mtu kMtu = RDMA_MTU_AUTO;
+
+struct BringupTime
+{
+    double create;
+    double init;
+    double exchange;
+    double connect;
+};
+
+static BringupTime bringup(RdmaContext &rdma, SocketEndpoint &sock, int count, int threads, bool serial)
+{
+    double mhz = get_cpu_mhz(0);
+    BringupTime time = {};
+    QueuePairConfig config;
+    config.type = IBV_QPT_RC;
+    config.maxSendWr = 64;
+    config.maxRecvWr = 64;
+    sock.syncReady();
+    cycles_t c0 = get_cycles();
+    std::vector<CompletionQueue> cqs;
+    for (int i = 0; i < std::min(count, kMaxCompletionQueues); i++)
+        cqs.emplace_back(rdma, kCompletionQueueDepth);
+    std::vector<QueuePair> qps = create_queue_pairs(rdma, config, cqs, count);
+    cycles_t c1 = get_cycles();
+    time.create = (c1 - c0) / mhz;
+    if (serial)
+    {
+        for (QueuePair &qp : qps)
+        {
+            cycles_t t0 = get_cycles();
+            qp.toInit();
+            QpInfo local = qp.localInfo(), remote;
+            cycles_t t1 = get_cycles();
+            CHECK(sock.syncData(sizeof(QpInfo), &local, &remote) == 0) << "Failed to exchange QP info";
+            cycles_t t2 = get_cycles();
+            qp.toRtr(remote, kMtu);
+            qp.toRts();
+            cycles_t t3 = get_cycles();
+            time.init += (t1 - t0) / mhz;
+            time.exchange += (t2 - t1) / mhz;
+            time.connect += (t3 - t2) / mhz;
+        }
+        return time;
+    }
+    init_queue_pairs(qps, threads);
+    cycles_t c2 = get_cycles();
+    std::vector<QpInfo> local;
+    local.reserve(count);
+    for (const QueuePair &qp : qps)
+        local.push_back(qp.localInfo());
+    std::vector<QpInfo> remote = exchange_qp_infos(sock, local);
+    cycles_t c3 = get_cycles();
+    connect_queue_pairs(qps, remote, kMtu, threads);
+    cycles_t c4 = get_cycles();
+    time.init = (c2 - c1) / mhz;
+    time.exchange = (c3 - c2) / mhz;
+    time.connect = (c4 - c3) / mhz;
+    return time;
+}
+
+static void report(const char *mode, int count, const BringupTime &time)
+{
+    double total = time.create + time.init + time.exchange + time.connect;
+    LOG(INFO) << mode << " qps " << count
+              << ": total " << total / 1000 << " ms (create " << time.create / 1000
+              << ", init " << time.init / 1000
+              << ", exchange " << time.exchange / 1000
+              << ", connect " << time.connect / 1000 << ")";
+}
+
+int main(int argc, char **argv)
+{
+    FLAGS_alsologtostderr = 1;
+    google::InitGoogleLogging(argv[0]);
+    int server = atoi(argv[1]);
+    int max_qps = argc > 2 ? atoi(argv[2]) : 1024;
+    int threads = argc > 3 ? atoi(argv[3]) : std::thread::hardware_concurrency();
+
+    RdmaContext rdma("mlx5_0");
+    SocketEndpoint *sock = server ? new SocketEndpoint(12345) : new SocketEndpoint("localhost", 12345);
+    std::string parallel = "bulk-" + std::to_string(threads);
+    for (int count = 1; count <= max_qps; count *= 2)
+    {
+        report("serial", count, bringup(rdma, *sock, count, 1, true));
+        report("bulk", count, bringup(rdma, *sock, count, 1, false));
+        report(parallel.c_str(), count, bringup(rdma, *sock, count, threads, false));
+    }
+    delete sock;
+    return 0;
+}
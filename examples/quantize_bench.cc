@@ -0,0 +1,104 @@
+/*
+float32、float16、bfloat16 与定点 int32 转换核的单核吞吐测试
+./quantize_bench [count] [iterations]
+对 count 个元素分别用 scalar、avx2、avx512 实现（CPU 不支持的跳过）做量化、反量化和最大绝对值扫描，
+与标量实现逐位比对结果，并以同样大小的 memcpy 作为内存带宽的参照。带宽按读写的总字节数计算。
+半精度的展开和收窄与定点转换在同一遍中完成，读写的字节数比 float32 少四分之一。
+*/
+#include "quantize.h"
+#include <glog/logging.h>
+#include <cstring>
+#include <random>
+#include <string>
+#include <vector>
+#include "get_clock.h"
+
+using namespace flashreduce;
+
+template <typename T>
+struct Kernels
+{
+    const char *name;
+    float (*quantize)(const T *, int32_t *, size_t, float);
+    void (*dequantize)(const int32_t *, T *, size_t, float);
+    float (*maxAbs)(const T *, size_t);
+};
+
+/* 逐个指令集测一种元素类型，结果与标量实现逐位比对 */
+template <typename T>
+static void bench(const Kernels<T> &kernels, const std::vector<T> &src, int iterations, float scale, double mhz)
+{
+    size_t count = src.size();
+    std::vector<T> restored(count), expectedRestored(count);
+    std::vector<int32_t> quantized(count), reference(count);
+    auto gbps = [&](cycles_t cycles, size_t bytes) {
+        return bytes * iterations / (cycles / mhz) / 1e3;
+    };
+
+    set_quantize_isa(QuantizeScalar);
+    float expectedMax = kernels.quantize(src.data(), reference.data(), count, scale);
+    kernels.dequantize(reference.data(), expectedRestored.data(), count, 1.0f / scale);
+    for (QuantizeIsa isa : {QuantizeScalar, QuantizeAvx2, QuantizeAvx512})
+    {
+        if (set_quantize_isa(isa) != isa)
+        {
+            LOG(INFO) << kernels.name << " " << quantize_isa_name(isa) << ": not supported";
+            continue;
+        }
+        float maxAbs = 0.0f;
+        cycles_t start = get_cycles();
+        for (int i = 0; i < iterations; i++)
+            maxAbs = kernels.quantize(src.data(), quantized.data(), count, scale);
+        cycles_t quantizeCycles = get_cycles() - start;
+        start = get_cycles();
+        for (int i = 0; i < iterations; i++)
+            kernels.dequantize(quantized.data(), restored.data(), count, 1.0f / scale);
+        cycles_t dequantizeCycles = get_cycles() - start;
+        start = get_cycles();
+        for (int i = 0; i < iterations; i++)
+            maxAbs = kernels.maxAbs(src.data(), count);
+        cycles_t scanCycles = get_cycles() - start;
+
+        CHECK(maxAbs == expectedMax && std::memcmp(quantized.data(), reference.data(), count * sizeof(int32_t)) == 0 &&
+              std::memcmp(restored.data(), expectedRestored.data(), count * sizeof(T)) == 0)
+            << kernels.name << " " << quantize_isa_name(isa) << " differs from the scalar kernel";
+        size_t bytes = count * (sizeof(T) + sizeof(int32_t));
+        LOG(INFO) << kernels.name << " " << quantize_isa_name(isa) << ": quantize " << gbps(quantizeCycles, bytes)
+                  << " GB/s, dequantize " << gbps(dequantizeCycles, bytes) << " GB/s, max_abs "
+                  << gbps(scanCycles, count * sizeof(T)) << " GB/s";
+    }
+}
+
+int main(int argc, char **argv)
+{
+    FLAGS_alsologtostderr = 1;
+    google::InitGoogleLogging(argv[0]);
+    size_t count = argc > 1 ? atol(argv[1]) : (64 << 20);
+    int iterations = argc > 2 ? atoi(argv[2]) : 10;
+
+    std::vector<float> src(count);
+    std::vector<uint16_t> half(count), bfloat(count);
+    std::vector<int32_t> reference(count);
+    std::mt19937 rng(42);
+    std::normal_distribution<float> dist(0.0f, 1.0f);
+    for (size_t i = 0; i < count; i++)
+    {
+        src[i] = dist(rng);
+        half[i] = float_to_half(src[i]);
+        bfloat[i] = float_to_bfloat16(src[i]);
+    }
+    float scale = block_scale(block_exponent(4.0f), 8);
+    double mhz = get_cpu_mhz(0);
+
+    cycles_t start = get_cycles();
+    for (int i = 0; i < iterations; i++)
+        std::memcpy(reference.data(), src.data(), count * sizeof(float));
+    LOG(INFO) << "memcpy: " << 2 * count * sizeof(float) * iterations / ((get_cycles() - start) / mhz) / 1e3
+              << " GB/s";
+
+    bench(Kernels<float>{"float32", quantize, dequantize, max_abs}, src, iterations, scale, mhz);
+    bench(Kernels<uint16_t>{"float16", quantize_f16, dequantize_f16, max_abs_f16}, half, iterations, scale, mhz);
+    bench(Kernels<uint16_t>{"bfloat16", quantize_bf16, dequantize_bf16, max_abs_bf16}, bfloat, iterations, scale,
+          mhz);
+    return 0;
+}
@@ -3,12 +3,13 @@
 1. UC情况下的消息切分方式以及报文内容
 2. UC情况下丢包对端侧接收报文的影响，例如重复发送报文
 */
-#include "rdma_utils.h"
+#include "rdma_context.h"
 #include "socket_endpoint.h"
 #include <infiniband/verbs.h>
 #include <glog/logging.h>
 #include <ostream>
 #include <cstring>
+#include <vector>
 #include "get_clock.h"
 
 void send_benchmark(struct ibv_send_wr *send_wr, struct ibv_qp *qp, struct ibv_cq *cq, int iterations, int available_wqes)
@@ -71,71 +72,48 @@ int main(int argc, char **argv)
     google::InitGoogleLogging(argv[0]);
     int server = atoi(argv[1]);
     int msg_numel = 16384;
-    ibv_mtu mtu = IBV_MTU_256; // Use 1024 MTU for this example
+    ibv_mtu mtu = RDMA_MTU_AUTO; // 取两端 active_mtu 的较小值
     const int kCompletionQueueDepth = 1024;
     const int kSendQueueDepth = 256;
     const int kReceiveQueueDepth = 512;
     const int kScatterGatherElementCount = 1;
     const int kMaxInlineData = 16;
     
-    ibv_device *device = nullptr;
-    ibv_context *context = nullptr;
-    init_ibv_device(&device, &context, "mlx5_0");
-    struct ibv_port_attr port_attr;
-    std::memset(&port_attr, 0, sizeof(port_attr));
-    CHECK(ibv_query_port(context, IB_PORT, &port_attr) == 0) << "Failed to query port attributes";
-    ibv_gid gid;
-    CHECK(ibv_query_gid(context, IB_PORT, GID_INDEX, &gid) == 0) << "Failed to query GID";
-    LOG(INFO) << "Step 1: Initialize RDMA device " << ibv_get_device_name(device)
-              << ", open device context, query port attributes such as GID: "
+    RdmaContext rdma("mlx5_0");
+    const ibv_gid &gid = rdma.gid();
+    LOG(INFO) << "Step 1: Initialize RDMA device " << ibv_get_device_name(rdma.device())
+              << ", open device context, allocate protection domain, query port attributes such as GID: "
               << std::hex << gid.global.subnet_prefix << gid.global.interface_id << std::dec;
 
-    struct ibv_pd *pd = ibv_alloc_pd(context);
-    CHECK(pd) << "Failed to allocate protection domain";
-    LOG(INFO) << "Step 2: Allocate protection domain";
-
     int buffer_size = msg_numel * sizeof(float);
-    void *buffer = malloc(buffer_size);
-    CHECK(buffer) << "Failed to allocate buffer of size " << buffer_size;
-    struct ibv_mr *mr = ibv_reg_mr(pd, buffer, buffer_size, (IBV_ACCESS_LOCAL_WRITE | IBV_ACCESS_REMOTE_WRITE | IBV_ACCESS_ZERO_BASED));
-    CHECK(mr) << "Failed to register memory region";
-    LOG(INFO) << "Step 3: Allocate and register memory region of size " << buffer_size
+    std::vector<float> buffer(msg_numel);
+    MemoryRegion mr(rdma, buffer.data(), buffer_size, RDMA_DEFAULT_ACCESS | IBV_ACCESS_ZERO_BASED);
+    LOG(INFO) << "Step 2: Allocate and register memory region of size " << buffer_size
               << " with local write and remote write access";
 
-    struct ibv_cq *cq = ibv_create_cq(context, kCompletionQueueDepth, nullptr, nullptr, 0);
-    CHECK(cq) << "Failed to create completion queue";
-    LOG(INFO) << "Step 4: Create completion queue with depth " << kCompletionQueueDepth;
+    CompletionQueue cq(rdma, kCompletionQueueDepth);
+    LOG(INFO) << "Step 3: Create completion queue with depth " << kCompletionQueueDepth;
 
-    struct ibv_qp_init_attr init_attributes;
-    std::memset(&init_attributes, 0, sizeof(init_attributes));
-    init_attributes.send_cq = cq;
-    init_attributes.recv_cq = cq;
-    init_attributes.qp_type = IBV_QPT_UC;
-    init_attributes.cap.max_send_wr = kSendQueueDepth;
-    init_attributes.cap.max_recv_wr = kReceiveQueueDepth;
-    init_attributes.cap.max_send_sge = kScatterGatherElementCount;
-    init_attributes.cap.max_recv_sge = kScatterGatherElementCount;
-    init_attributes.cap.max_inline_data = kMaxInlineData;
-    struct ibv_qp *qp = ibv_create_qp(pd, &init_attributes);
-    CHECK(qp) << "Failed to create queue pair";
-    LOG(INFO) << "Step 5: Create queue pair with send/receive CQ, type UC, and specified capabilities";
+    QueuePairConfig qp_config;
+    qp_config.type = IBV_QPT_UC;
+    qp_config.maxSendWr = kSendQueueDepth;
+    qp_config.maxRecvWr = kReceiveQueueDepth;
+    qp_config.maxSendSge = kScatterGatherElementCount;
+    qp_config.maxRecvSge = kScatterGatherElementCount;
+    qp_config.maxInlineData = kMaxInlineData;
+    QueuePair qp(rdma, qp_config, cq);
+    LOG(INFO) << "Step 4: Create queue pair with send/receive CQ, type UC, and specified capabilities";
 
-    int ret = modify_qp_to_init(qp);
-    CHECK(ret == 0) << "Failed to modify QP to INIT state";
-    LOG(INFO) << "Step 6: Modify QP to INIT state with port number, PKey index, and access flags";
+    qp.toInit();
+    LOG(INFO) << "Step 5: Modify QP to INIT state with port number, PKey index, and access flags";
+    int ret = 0;
     // 交换gid, rkey, qp_num, psn
-    struct QpInfo qp_info, neighbor_qp_info;
-    qp_info.rkey = mr->rkey;
-    qp_info.raddr = buffer;
-    qp_info.qp_num = qp->qp_num;
-    qp_info.psn = 0;
-    qp_info.gid = gid;
-    qp_info.lid = port_attr.lid;
+    struct QpInfo qp_info = qp.localInfo(&mr), neighbor_qp_info;
     if (server)
     {
         SocketEndpoint sock(12345);
         sock.syncData(sizeof(QpInfo), &qp_info, &neighbor_qp_info);
-        LOG(INFO) << "Step 7: Server side, exchange QP info with client";
+        LOG(INFO) << "Step 6: Server side, exchange QP info with client";
         LOG(INFO) << "        Server QP Info: rkey=" << qp_info.rkey
                   << ", qp_num=" << qp_info.qp_num
                   << ", psn=" << qp_info.psn
@@ -148,9 +126,8 @@ int main(int argc, char **argv)
                   << ", gid=" << std::hex << neighbor_qp_info.gid.global.subnet_prefix
                   << neighbor_qp_info.gid.global.interface_id << std::dec
                   << ", lid=" << neighbor_qp_info.lid;
-        ret = modify_qp_to_rts(qp, neighbor_qp_info, mtu, 0);
-        CHECK(ret >= 0) << "Failed to modify QP to RTS state";
-        LOG(INFO) << "Step 8: Modify QP to RTS state with initial PSN and other parameters";
+        qp.connect(neighbor_qp_info, mtu);
+        LOG(INFO) << "Step 7: Modify QP to RTS state with initial PSN and other parameters";
         struct ibv_recv_wr recv_wr;
         std::memset(&recv_wr, 0, sizeof(recv_wr));
         recv_wr.wr_id = 0;
@@ -158,16 +135,16 @@ int main(int argc, char **argv)
         recv_wr.sg_list = nullptr;
         recv_wr.num_sge = 0;
         struct ibv_recv_wr *bad_recv_wr;
-        ret = ibv_post_recv(qp, &recv_wr, &bad_recv_wr);
+        ret = ibv_post_recv(qp.qp(), &recv_wr, &bad_recv_wr);
         CHECK(ret == 0) << "Failed to post receive WR";
         sock.syncReady();
-        LOG(INFO) << "Step 9: Post receive WR to queue pair and then wait for completion";
+        LOG(INFO) << "Step 8: Post receive WR to queue pair and then wait for completion";
         struct ibv_wc wc;
-        while (ret = ibv_poll_cq(cq, 1, &wc) == 0)
+        while (ret = ibv_poll_cq(cq.cq(), 1, &wc) == 0)
         {
         };
         CHECK_EQ(wc.status, IBV_WC_SUCCESS) << "Failed to poll CQ for receive completion";
-        LOG(INFO) << "Step 10: Receive completion received, status: " << ibv_wc_status_str(wc.status)
+        LOG(INFO) << "Step 9: Receive completion received, status: " << ibv_wc_status_str(wc.status)
                   << ", QP number: " << wc.qp_num
                   << ", WR ID: " << wc.wr_id
                   << ", byte length: " << wc.byte_len;
@@ -175,16 +152,16 @@ int main(int argc, char **argv)
         {
             recv_wr.wr_id = i;
             struct ibv_recv_wr *bad_recv_wr = nullptr;
-            ret = ibv_post_recv(qp, &recv_wr, &bad_recv_wr);
+            ret = ibv_post_recv(qp.qp(), &recv_wr, &bad_recv_wr);
         }
         sock.syncReady();
-        recv_benchmark(&recv_wr, qp, cq, 10);
+        recv_benchmark(&recv_wr, qp.qp(), cq.cq(), 10);
     }
     else
     {
         SocketEndpoint sock("localhost", 12345);
         sock.syncData(sizeof(QpInfo), &qp_info, &neighbor_qp_info);
-        LOG(INFO) << "Step 7: Client side, exchange QP info with server";
+        LOG(INFO) << "Step 6: Client side, exchange QP info with server";
         LOG(INFO) << "        Client QP Info: rkey=" << qp_info.rkey
                   << ", qp_num=" << qp_info.qp_num
                   << ", psn=" << qp_info.psn
@@ -197,16 +174,15 @@ int main(int argc, char **argv)
                   << ", gid=" << std::hex << neighbor_qp_info.gid.global.subnet_prefix
                   << neighbor_qp_info.gid.global.interface_id << std::dec
                   << ", lid=" << neighbor_qp_info.lid;
-        ret = modify_qp_to_rts(qp, neighbor_qp_info, mtu, 0);
-        CHECK(ret >= 0) << "Failed to modify QP to RTS state";
-        LOG(INFO) << "Step 8: Modify QP to RTS state with initial PSN and other parameters";
+        qp.connect(neighbor_qp_info, mtu);
+        LOG(INFO) << "Step 7: Modify QP to RTS state with initial PSN and other parameters";
         sock.syncReady();
         struct ibv_send_wr send_wr;
         std::memset(&send_wr, 0, sizeof(send_wr));
         struct ibv_sge sge;
-        sge.addr = (uintptr_t)buffer;
+        sge.addr = (uintptr_t)buffer.data();
         sge.length = buffer_size;
-        sge.lkey = mr->lkey;
+        sge.lkey = mr.lkey();
         send_wr.wr_id = 0;
         send_wr.next = nullptr;
         send_wr.sg_list = &sge;
@@ -217,33 +193,27 @@ int main(int argc, char **argv)
         send_wr.wr.rdma.rkey = neighbor_qp_info.rkey;                   // Remote key for the memory region
         send_wr.imm_data = 0;
         struct ibv_send_wr *bad_wr = nullptr;
-        ret = ibv_post_send(qp, &send_wr, &bad_wr);
+        ret = ibv_post_send(qp.qp(), &send_wr, &bad_wr);
         if (ret > 0)
         {
             perror("ibv_post_send failed with error: ");
         }
         CHECK(!bad_wr) << "Error posting send WR at WR " << bad_wr << " id 0x"
-                       << std::hex << bad_wr->wr_id << " QP 0x" << qp->qp_num
+                       << std::hex << bad_wr->wr_id << " QP 0x" << qp.qpNum()
                        << std::dec << ", opcode: " << send_wr.opcode;
-        LOG(INFO) << "Step 9: Post send WR to queue pair with RDMA write operation";
+        LOG(INFO) << "Step 8: Post send WR to queue pair with RDMA write operation";
         struct ibv_wc wc;
-        while (ret = ibv_poll_cq(cq, 1, &wc) == 0)
+        while (ret = ibv_poll_cq(cq.cq(), 1, &wc) == 0)
         {
         };
         CHECK_EQ(wc.status, IBV_WC_SUCCESS) << "Failed to poll CQ for send completion";
-        LOG(INFO) << "Step 10: Send completion received, status: " << ibv_wc_status_str(wc.status)
+        LOG(INFO) << "Step 9: Send completion received, status: " << ibv_wc_status_str(wc.status)
                   << ", QP number: " << wc.qp_num
                   << ", WR ID: " << wc.wr_id
                   << ", byte length: " << wc.byte_len;
         sock.syncReady();
-        send_benchmark(&send_wr, qp, cq, 10, kSendQueueDepth);
+        send_benchmark(&send_wr, qp.qp(), cq.cq(), 10, kSendQueueDepth);
     }
 
-    ibv_destroy_qp(qp);
-    ibv_destroy_cq(cq);
-    ibv_dereg_mr(mr);
-    free(buffer);
-    ibv_dealloc_pd(pd);
-    ibv_close_device(context);
     return 0;
 }
\ No newline at end of file
@@ -0,0 +1,192 @@
+/*
+对比多对端接收时每 QP 接收队列与共享接收队列（SRQ）的吞吐和接收请求占用
+server: ./srq_recv_bench 1 <0:per-QP|1:SRQ> [num_peers] [iterations] [srq_depth]
+client: ./srq_recv_bench 0 <mode 无意义> [num_peers] [iterations]
+client 在 num_peers 个 RC QP 上轮流发送带立即数的 RDMA 写，server 的代理线程
+从共享 CQ 收回完成：per-QP 模式每个完成在原 QP 上补一个接收请求，
+SRQ 模式只记账，已投递数低于低水位时按批串联补充。
+*/
+#include "proxy.h"
+#include "rdma_context.h"
+#include "socket_endpoint.h"
+#include <infiniband/verbs.h>
+#include <glog/logging.h>
+#include <cstring>
+#include <unordered_map>
+#include <vector>
+#include "get_clock.h"
+
+const int kCompletionQueueDepth = 8192;
+const int kQueueDepth = 128;
+const int kMessageSize = 4096;
+/* client 所有 QP 合计的在途写请求上限 */
+const int kWindow = 512;
+
+static std::unordered_map<uint32_t, ibv_qp *> qp_by_num;
+
+void recv_progress(ProxyArgs *args)
+{
+    if (args->state == ProxyOpReady)
+    {
+        args->state = ProxyOpProgress;
+        args->count = 0;
+        args->startTick = get_cycles();
+    }
+    SharedReceiveQueue *srq = args->endpoint.srq;
+    struct ibv_wc wcs[32];
+    int num_completions = ProxyPollCq(args, 32, wcs);
+    if (num_completions == 0)
+    {
+        args->idle = 1;
+        return;
+    }
+    args->idle = 0;
+    for (int k = 0; k < num_completions; ++k)
+    {
+        CHECK_EQ(wcs[k].status, IBV_WC_SUCCESS) << ibv_wc_status_str(wcs[k].status);
+        if (srq)
+        {
+            srq->consumed(wcs[k]);
+            continue;
+        }
+        args->endpoint.recv_wr.wr_id = wcs[k].wr_id;
+        struct ibv_recv_wr *bad_recv_wr = nullptr;
+        CHECK(ibv_post_recv(qp_by_num[wcs[k].qp_num], &args->endpoint.recv_wr, &bad_recv_wr) == 0)
+            << "Failed to post receive WR";
+    }
+    if (srq)
+        srq->refill();
+    args->count += num_completions;
+    if (args->count >= args->iterations)
+    {
+        args->endTick = get_cycles();
+        args->state = ProxyOpNone;
+    }
+}
+
+int main(int argc, char **argv)
+{
+    FLAGS_alsologtostderr = 1;
+    google::InitGoogleLogging(argv[0]);
+    int server = atoi(argv[1]);
+    int use_srq = argc > 2 ? atoi(argv[2]) : 1;
+    int num_peers = argc > 3 ? atoi(argv[3]) : 64;
+    int iterations = argc > 4 ? atoi(argv[4]) : 1000000;
+    int srq_depth = argc > 5 ? atoi(argv[5]) : 1024;
+
+    RdmaContext rdma("mlx5_0");
+    std::vector<char> buffer(kMessageSize);
+    MemoryRegion mr(rdma, buffer.data(), kMessageSize);
+    std::vector<CompletionQueue> cqs;
+    cqs.emplace_back(rdma, kCompletionQueueDepth);
+    // 低水位取深度的四分之一，每批串联 32 个接收请求
+    SharedReceiveQueue *srq = nullptr;
+    if (server && use_srq)
+        srq = new SharedReceiveQueue(rdma, srq_depth, srq_depth / 4, 32);
+    QueuePairConfig qp_config;
+    qp_config.type = IBV_QPT_RC;
+    qp_config.maxSendWr = kQueueDepth;
+    qp_config.maxRecvWr = kQueueDepth;
+    qp_config.srq = srq ? srq->srq() : nullptr;
+    std::vector<QueuePair> qps = create_queue_pairs(rdma, qp_config, cqs, num_peers);
+    init_queue_pairs(qps);
+    if (server)
+    {
+        if (srq)
+        {
+            srq->refill();
+        }
+        else
+        {
+            struct ibv_recv_wr recv_wr, *bad_recv_wr = nullptr;
+            std::memset(&recv_wr, 0, sizeof(recv_wr));
+            for (QueuePair &qp : qps)
+            {
+                qp_by_num[qp.qpNum()] = qp.qp();
+                for (int i = 0; i < kQueueDepth; i++)
+                    CHECK(ibv_post_recv(qp.qp(), &recv_wr, &bad_recv_wr) == 0) << "Failed to post receive WR";
+            }
+        }
+    }
+
+    std::vector<QpInfo> local;
+    for (const QueuePair &qp : qps)
+        local.push_back(qp.localInfo(&mr));
+    SocketEndpoint *sock = server ? new SocketEndpoint(12345) : new SocketEndpoint("localhost", 12345);
+    std::vector<QpInfo> remote = exchange_qp_infos(*sock, local);
+    connect_queue_pairs(qps, remote);
+
+    if (server)
+    {
+        ProxyHandler handler = {};
+        uint32_t abort = 0;
+        handler.abortFlag = &abort;
+        ProxyThreadConfig proxyConfig = {};
+        proxyConfig.numaNode = rdma.numaNode();
+        proxyConfig.name = "proxy-srq-recv";
+        ProxyCreate(&handler, &proxyConfig);
+        ProxyArgs *channelProxyTail = nullptr;
+        ProxyArgs *args = allocateArgs(&handler);
+        args->state = ProxyOpReady;
+        args->proxyTail = &channelProxyTail;
+        args->progress = recv_progress;
+        args->iterations = iterations;
+        args->endpoint.cq = cqs[0].cq();
+        args->endpoint.srq = srq;
+        std::memset(&args->endpoint.recv_wr, 0, sizeof(args->endpoint.recv_wr));
+        ProxyArgsAppend(&handler, args);
+        ProxyStart(&handler);
+        sock->syncReady();
+        ProxyWaitAllOpFinished(&handler);
+        double nanosec = 1e3 * (args->endTick - args->startTick) / get_cpu_mhz(0);
+        long wqes = srq ? srq_depth : (long)num_peers * kQueueDepth;
+        LOG(INFO) << (srq ? "SRQ" : "per-QP") << " receive, " << num_peers << " peers: "
+                  << iterations / (nanosec / 1e3) << " Mmsg/s, "
+                  << (double)iterations * kMessageSize * 8 / nanosec << " Gbps, "
+                  << wqes << " receive WQEs posted";
+        ProxyDestroy(&handler);
+    }
+    else
+    {
+        sock->syncReady();
+        struct ibv_sge sge;
+        sge.addr = (uintptr_t)buffer.data();
+        sge.length = kMessageSize;
+        sge.lkey = mr.lkey();
+        struct ibv_send_wr send_wr, *bad_wr = nullptr;
+        std::memset(&send_wr, 0, sizeof(send_wr));
+        send_wr.sg_list = &sge;
+        send_wr.num_sge = 1;
+        send_wr.opcode = IBV_WR_RDMA_WRITE_WITH_IMM;
+        send_wr.send_flags = IBV_SEND_SIGNALED;
+        std::vector<int> credits(num_peers, kQueueDepth);
+        std::unordered_map<uint32_t, int> peer_by_num;
+        for (int i = 0; i < num_peers; i++)
+            peer_by_num[qps[i].qpNum()] = i;
+        int posted = 0, completed = 0, peer = 0;
+        struct ibv_wc wcs[32];
+        while (completed < iterations)
+        {
+            while (posted < iterations && posted - completed < kWindow && credits[peer] > 0)
+            {
+                send_wr.wr.rdma.remote_addr = (uint64_t)remote[peer].raddr;
+                send_wr.wr.rdma.rkey = remote[peer].rkey;
+                CHECK(ibv_post_send(qps[peer].qp(), &send_wr, &bad_wr) == 0) << "Failed to post send WR";
+                credits[peer]--;
+                posted++;
+                peer = (peer + 1) % num_peers;
+            }
+            int n = ibv_poll_cq(cqs[0].cq(), 32, wcs);
+            for (int k = 0; k < n; k++)
+            {
+                CHECK_EQ(wcs[k].status, IBV_WC_SUCCESS) << ibv_wc_status_str(wcs[k].status);
+                credits[peer_by_num[wcs[k].qp_num]]++;
+            }
+            completed += n;
+        }
+    }
+    delete sock;
+    qps.clear();
+    delete srq;
+    return 0;
+}
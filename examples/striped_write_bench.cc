@@ -0,0 +1,91 @@
+/*
+测量一条消息条带化到多个 QP 上的带宽
+server: ./striped_write_bench 1 [max_stripes] [msg_size] [chunk_size] [num_cqs] [iterations]
+client: ./striped_write_bench 0 [max_stripes] [msg_size] [chunk_size] [num_cqs] [iterations]
+两端创建 max_stripes 个 RC QP 并分摊到 num_cqs 个 CQ 上。client 在运行时把条带数从 1 依次
+翻倍到 max_stripes，每种条带数连续写 iterations 条消息，server 只按立即数重组，
+不需要知道 client 当前的条带数和分块大小。
+*/
+#include "striped_channel.h"
+#include "socket_endpoint.h"
+#include <infiniband/verbs.h>
+#include <glog/logging.h>
+#include <vector>
+#include "get_clock.h"
+
+const int kCompletionQueueDepth = 4096;
+const int kQueueDepth = 256;
+/* 同时在途的消息数，消息都写往对端同一块缓冲区 */
+const int kWindow = 8;
+
+int main(int argc, char **argv)
+{
+    FLAGS_alsologtostderr = 1;
+    google::InitGoogleLogging(argv[0]);
+    int server = atoi(argv[1]);
+    int max_stripes = argc > 2 ? atoi(argv[2]) : 8;
+    size_t msg_size = argc > 3 ? atol(argv[3]) : (4 << 20);
+    size_t chunk_size = argc > 4 ? atol(argv[4]) : (64 << 10);
+    int num_cqs = argc > 5 ? atoi(argv[5]) : 1;
+    int iterations = argc > 6 ? atoi(argv[6]) : 1000;
+    ibv_mtu mtu = RDMA_MTU_AUTO;
+
+    RdmaContext rdma("mlx5_0");
+    std::vector<char> buffer(msg_size);
+    MemoryRegion mr(rdma, buffer.data(), msg_size);
+    std::vector<CompletionQueue> cqs;
+    for (int i = 0; i < num_cqs; i++)
+        cqs.emplace_back(rdma, kCompletionQueueDepth);
+    QueuePairConfig qp_config;
+    qp_config.maxSendWr = kQueueDepth;
+    qp_config.maxRecvWr = kQueueDepth;
+    std::vector<QueuePair> qps = create_queue_pairs(rdma, qp_config, cqs, max_stripes);
+    init_queue_pairs(qps);
+    StripedChannel channel(qps, kQueueDepth);
+    channel.setChunkSize(chunk_size);
+    if (server)
+        channel.postReceives(kQueueDepth);
+
+    std::vector<QpInfo> local;
+    for (const QueuePair &qp : qps)
+        local.push_back(qp.localInfo(&mr));
+    SocketEndpoint *sock = server ? new SocketEndpoint(12345) : new SocketEndpoint("localhost", 12345);
+    std::vector<QpInfo> remote = exchange_qp_infos(*sock, local);
+    connect_queue_pairs(qps, remote, mtu);
+    sock->syncReady();
+
+    double mhz = get_cpu_mhz(0);
+    uint64_t total = 0;
+    for (int stripes = 1; stripes <= max_stripes; stripes *= 2)
+    {
+        total += iterations;
+        sock->syncReady();
+        cycles_t start = get_cycles();
+        if (server)
+        {
+            while (channel.received() < total)
+                channel.progress();
+        }
+        else
+        {
+            channel.setStripes(stripes);
+            uint64_t submitted = channel.sent();
+            while (channel.sent() < total)
+            {
+                while (submitted < total && submitted - channel.sent() < kWindow)
+                {
+                    channel.send(mr, 0, msg_size, (uint64_t)remote[0].raddr, remote[0].rkey);
+                    submitted++;
+                }
+                channel.progress();
+            }
+        }
+        double nanosec = 1e3 * (get_cycles() - start) / mhz;
+        LOG(INFO) << (server ? "Rx" : "Tx") << " stripes " << stripes << ", chunk " << chunk_size
+                  << " B, message " << msg_size << " B: "
+                  << (double)iterations * msg_size * 8 / nanosec << " Gbps";
+    }
+    sock->syncReady();
+    delete sock;
+    return 0;
+}
@@ -0,0 +1,103 @@
+/*
+交换机聚合模拟器，代替可编程交换机做聚合器
+./switch_emulator <rdma|udp|shm> <num_workers> [threads] [window] [slot_elems] [device] [loss]
+rdma：在 device（默认 rxe0）上为每个 worker 建一个 UC QP，第 r 个 worker 经 TCP 端口
+SWITCH_BASE_PORT + r 交换 QpInfo，例如 ./allreduce_bench <r> <num_workers> emu:<host> ... <device>；
+udp：监听 SWITCH_UDP_PORT；shm：创建共享内存 SWITCH_SHM_NAME。
+window 和 slot_elems 须与 worker 一致。loss 为注入的丢包率（默认 0），用于测试 worker 的重传。
+运行到 Ctrl-C 为止，每秒输出一次包速率和带宽。
+*/
+#include "rdma_context.h"
+#include "socket_endpoint.h"
+#include "switch_emulator.h"
+#include <glog/logging.h>
+#include <csignal>
+#include <memory>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+static volatile sig_atomic_t stopping = 0;
+
+static void on_signal(int)
+{
+    stopping = 1;
+}
+
+int main(int argc, char **argv)
+{
+    FLAGS_alsologtostderr = 1;
+    google::InitGoogleLogging(argv[0]);
+    std::string transport = argv[1];
+    int num_workers = atoi(argv[2]);
+    int threads = argc > 3 ? atoi(argv[3]) : 1;
+    int window = argc > 4 ? atoi(argv[4]) : ALLREDUCE_DEFAULT_WINDOW;
+    int slot_elems = argc > 5 ? atoi(argv[5]) : ALLREDUCE_SLOT_ELEMS;
+    std::string device = argc > 6 ? argv[6] : "rxe0";
+    double loss = argc > 7 ? atof(argv[7]) : 0.0;
+
+    SwitchPipeline pipeline(num_workers, window, slot_elems);
+    std::unique_ptr<RdmaContext> rdma;
+    std::unique_ptr<SwitchTransport> emulator;
+    if (transport == "udp")
+    {
+        auto udp = std::make_unique<UdpSwitch>(pipeline, SWITCH_UDP_PORT, threads);
+        udp->start();
+        emulator = std::move(udp);
+        LOG(INFO) << "Listening on UDP port " << SWITCH_UDP_PORT;
+    }
+    else if (transport == "shm")
+    {
+        auto shm = std::make_unique<ShmSwitch>(pipeline, SWITCH_SHM_NAME, threads);
+        shm->start();
+        emulator = std::move(shm);
+        LOG(INFO) << "Serving shared memory " << SWITCH_SHM_NAME;
+    }
+    else
+    {
+        CHECK(transport == "rdma") << "Unknown transport " << transport;
+        rdma = std::make_unique<RdmaContext>(device);
+        auto sw = std::make_unique<RdmaSwitch>(*rdma, pipeline, threads);
+        // 每个 worker 一个监听端口，worker 可以按任意顺序连入
+        std::vector<QpInfo> remotes(num_workers);
+        std::vector<std::thread> exchanges;
+        for (int w = 0; w < num_workers; w++)
+        {
+            exchanges.emplace_back([&, w]() {
+                QpInfo local = sw->localInfo(w);
+                SocketEndpoint sock(SWITCH_BASE_PORT + w);
+                CHECK(sock.syncData(sizeof(QpInfo), &local, &remotes[w]) == 0)
+                    << "Failed to exchange QpInfo with worker " << w;
+            });
+        }
+        LOG(INFO) << "Waiting for " << num_workers << " workers on TCP ports " << SWITCH_BASE_PORT
+                  << " - " << SWITCH_BASE_PORT + num_workers - 1;
+        for (auto &exchange : exchanges)
+            exchange.join();
+        for (int w = 0; w < num_workers; w++)
+            sw->connect(w, remotes[w]);
+        sw->start();
+        emulator = std::move(sw);
+        LOG(INFO) << "All workers connected on " << device;
+    }
+
+    emulator->setLossRate(loss);
+
+    signal(SIGINT, on_signal);
+    signal(SIGTERM, on_signal);
+    SwitchStats last;
+    while (!stopping)
+    {
+        sleep(1);
+        SwitchStats stats = emulator->stats();
+        uint64_t packets = stats.packets - last.packets;
+        LOG(INFO) << packets << " packets/s, " << stats.results - last.results << " results/s, "
+                  << packets * pipeline.slotBytes() * 8 / 1e9 << " Gbps in, "
+                  << (stats.results - last.results) * num_workers * pipeline.slotBytes() * 8 / 1e9
+                  << " Gbps out, " << stats.duplicates << " duplicates, " << stats.resent << " resent, "
+                  << stats.dropped << " dropped, " << stats.lost << " lost in total";
+        last = stats;
+    }
+    emulator->stop();
+    return 0;
+}
@@ -0,0 +1,198 @@
+/*
+交换机聚合模拟器的进程内吞吐测试，不需要可编程交换机
+./switch_emulator_bench <udp|shm|rdma> <num_workers> [threads] [window] [slot_elems] [count] [device] [loss]
+在本进程中启动聚合器和 num_workers 个 worker 线程，每个 worker 对 count 个 int32 做 kRepeats 次
+求和 AllReduce 并校验结果。udp 经回环地址，shm 经 POSIX 共享内存，rdma 的 worker 是连到同一设备
+（例如 rxe0）上的 AllReduceSession。loss 为聚合器注入的丢包率（默认 0），上下行各自独立丢弃，
+worker 靠超时重传恢复。输出每个 worker 的有效带宽（goodput）、聚合器收到的总带宽和重传统计。
+*/
+#include "allreduce.h"
+#include "rdma_context.h"
+#include "switch_emulator.h"
+#include <glog/logging.h>
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <memory>
+#include <sched.h>
+#include <thread>
+#include <vector>
+#include "get_clock.h"
+
+using namespace flashreduce;
+
+const int kRepeats = 10;
+
+static int32_t worker_value(int worker, size_t i) {
+    return (worker + 1) * (int32_t)(i % 1000 + 1);
+}
+
+static bool receive(UdpSwitchClient &client, uint32_t *imm, int32_t *payload) {
+    return client.poll(imm, payload, 1);
+}
+
+static bool receive(ShmSwitchClient &client, uint32_t *imm, int32_t *payload) {
+    if (client.poll(imm, payload))
+        return true;
+    sched_yield();
+    return false;
+}
+
+static uint64_t now_ns() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+               std::chrono::steady_clock::now().time_since_epoch())
+        .count();
+}
+
+/* UDP 和共享内存 worker 的滑动窗口和重传由 SlotWindow 完成，与 AllReduceSession 相同。
+ * 载荷在发送时已拷进数据报或环，张量本身就是重传的来源，不需要影子副本。 */
+template <typename Client>
+static void reduce_slots(Client &client, std::vector<int32_t> &tensor, int slotElems, SlotWindow &window) {
+    uint32_t chunks = tensor.size() / slotElems;
+    std::vector<int32_t> result(slotElems);
+    auto send = [&](int slot) {
+        window.sent(slot, now_ns());
+        client.send(slot_imm(Sum, slot, window.seq(slot)), tensor.data() + (size_t)window.chunk(slot) * slotElems);
+    };
+    window.begin(chunks);
+    for (int slot = 0; slot < window.window() && (uint32_t)slot < chunks; slot++) {
+        window.fill(slot);
+        send(slot);
+    }
+    while (!window.done()) {
+        uint32_t imm;
+        bool received = receive(client, &imm, result.data());
+        uint64_t now = now_ns();
+        if (received) {
+            int slot = window.receive(imm, now);
+            if (slot >= 0) {
+                std::copy(result.begin(), result.end(), tensor.begin() + (size_t)window.chunk(slot) * slotElems);
+                if (window.advance(slot)) {
+                    window.fill(slot);
+                    send(slot);
+                }
+            }
+        }
+        // 先收完已到达的结果再判定丢失
+        if (received || !window.due(now))
+            continue;
+        for (int slot : window.retransmitExpired(now))
+            send(slot);
+    }
+}
+
+int main(int argc, char **argv)
+{
+    FLAGS_alsologtostderr = 1;
+    google::InitGoogleLogging(argv[0]);
+    std::string transport = argv[1];
+    int num_workers = atoi(argv[2]);
+    int threads = argc > 3 ? atoi(argv[3]) : 1;
+    int window = argc > 4 ? atoi(argv[4]) : ALLREDUCE_DEFAULT_WINDOW;
+    int slot_elems = argc > 5 ? atoi(argv[5]) : ALLREDUCE_SLOT_ELEMS;
+    size_t count = argc > 6 ? atol(argv[6]) : (4 << 20);
+    std::string device = argc > 7 ? argv[7] : "rxe0";
+    double loss = argc > 8 ? atof(argv[8]) : 0.0;
+    count = std::max<size_t>(count / slot_elems, 1) * slot_elems;
+
+    SwitchPipeline pipeline(num_workers, window, slot_elems);
+    std::unique_ptr<RdmaContext> rdma;
+    std::unique_ptr<SwitchTransport> emulator;
+    std::vector<std::unique_ptr<AllReduceSession>> sessions;
+    if (transport == "udp")
+    {
+        auto udp = std::make_unique<UdpSwitch>(pipeline, SWITCH_UDP_PORT, threads);
+        udp->start();
+        emulator = std::move(udp);
+    }
+    else if (transport == "shm")
+    {
+        auto shm = std::make_unique<ShmSwitch>(pipeline, SWITCH_SHM_NAME, threads);
+        shm->start();
+        emulator = std::move(shm);
+    }
+    else
+    {
+        CHECK(transport == "rdma") << "Unknown transport " << transport;
+        rdma = std::make_unique<RdmaContext>(device);
+        auto sw = std::make_unique<RdmaSwitch>(*rdma, pipeline, threads);
+        AllReduceConfig config;
+        config.window = window;
+        config.slotElems = slot_elems;
+        for (int w = 0; w < num_workers; w++)
+        {
+            sessions.push_back(std::make_unique<AllReduceSession>(*rdma, config));
+            sessions[w]->connect(sw->localInfo(w));
+            sw->connect(w, sessions[w]->localInfo());
+        }
+        sw->start();
+        emulator = std::move(sw);
+    }
+    emulator->setLossRate(loss);
+
+    double mhz = get_cpu_mhz(0);
+    std::vector<std::vector<int32_t>> tensors(num_workers, std::vector<int32_t>(count));
+    // 时钟刻度为纳秒
+    std::vector<SlotWindow> slotWindows(
+        num_workers, SlotWindow(window, RetransmitTimer(ALLREDUCE_DEFAULT_RTO_US, ALLREDUCE_MIN_RTO_US, ALLREDUCE_MAX_RTO_US, window),
+                                1000.0, AllReduceConfig().maxRetransmits));
+    std::vector<std::thread> workers;
+    cycles_t start = get_cycles();
+    for (int w = 0; w < num_workers; w++)
+    {
+        workers.emplace_back([&, w]() {
+            std::unique_ptr<UdpSwitchClient> udp;
+            std::unique_ptr<ShmSwitchClient> shm;
+            if (transport == "udp")
+                udp = std::make_unique<UdpSwitchClient>("127.0.0.1", SWITCH_UDP_PORT, w, slot_elems);
+            else if (transport == "shm")
+                shm = std::make_unique<ShmSwitchClient>(SWITCH_SHM_NAME, w);
+            std::vector<int32_t> &tensor = tensors[w];
+            for (int r = 0; r < kRepeats; r++)
+            {
+                for (size_t i = 0; i < count; i++)
+                    tensor[i] = worker_value(w, i);
+                if (udp)
+                    reduce_slots(*udp, tensor, slot_elems, slotWindows[w]);
+                else if (shm)
+                    reduce_slots(*shm, tensor, slot_elems, slotWindows[w]);
+                else
+                    AllReduce(tensor.data(), count, Int32, Sum, *sessions[w]);
+            }
+        });
+    }
+    for (auto &worker : workers)
+        worker.join();
+    double usec = (get_cycles() - start) / mhz / kRepeats;
+
+    int32_t factor = num_workers * (num_workers + 1) / 2;
+    for (int w = 0; w < num_workers; w++)
+        for (size_t i = 0; i < count; i++)
+            CHECK_EQ(tensors[w][i], factor * (int32_t)(i % 1000 + 1)) << "Worker " << w << " element " << i;
+
+    SwitchStats stats = emulator->stats();
+    uint64_t retransmits = 0, stale = 0;
+    double rttUs = 0, timeoutUs = 0;
+    for (int w = 0; w < num_workers; w++)
+    {
+        const RetransmitTimer &timer = slotWindows[w].timer();
+        // 会话的计时器在代理线程上，读它发布的快照
+        retransmits += sessions.empty() ? slotWindows[w].retransmits() : sessions[w]->retransmits();
+        stale += sessions.empty() ? slotWindows[w].staleResults() : sessions[w]->staleResults();
+        rttUs += (sessions.empty() ? timer.smoothedRttUs() : sessions[w]->smoothedRttUs()) / num_workers;
+        timeoutUs += (sessions.empty() ? timer.timeoutUs() : sessions[w]->retransmitTimeoutUs()) / num_workers;
+    }
+    double gbps = count * sizeof(int32_t) * 8 / (usec * 1e3);
+    LOG(INFO) << transport << ", " << num_workers << " workers, " << threads << " threads, window "
+              << window << ", " << slot_elems << " elements per slot, loss " << loss << ": " << usec
+              << " us per AllReduce of " << count << " int32, " << gbps << " Gbps goodput per worker, "
+              << stats.packets * pipeline.slotBytes() * 8 / (usec * kRepeats * 1e3)
+              << " Gbps into the switch";
+    LOG(INFO) << stats.packets << " packets, " << stats.results << " results, " << stats.duplicates
+              << " duplicates, " << stats.resent << " resent, " << stats.dropped << " dropped, "
+              << stats.lost << " lost";
+    LOG(INFO) << retransmits << " retransmits, " << stale << " stale results, smoothed RTT " << rttUs
+              << " us, retransmit timeout " << timeoutUs << " us";
+    emulator->stop();
+    return 0;
+}